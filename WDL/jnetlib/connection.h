@@ -83,6 +83,7 @@ class JNL_Connection
 
     void run(int max_send_bytes=-1, int max_recv_bytes=-1, int *bytes_sent=NULL, int *bytes_rcvd=NULL);
     int  get_state() { return m_state; }
+    int  get_socket() { return m_socket; } // for poll()/select(), -1 if none
     char *get_errstr() { return m_errorstr; }
 
     void close(int quick=0);
@@ -51,6 +51,7 @@
 #ifndef _PCMFMTCVT_H_
 #define _PCMFMTCVT_H_
 
+#include "pcmmix.h"
 
 static inline int float2int(double d)
 {
@@ -345,6 +346,19 @@ static void mixFloatsNIOutput(float *src, int src_srate, int src_nch,  // length
   }
   
 
+  if (src_srate == dest_srate && (src_nch == 1 || dest_nch > 1))
+  {
+    // no resampling, use the vectorized kernels
+    const WDL_PCMMix_Funcs *mix=WDL_PCMMix_Get();
+    if (src_nch == 2) mix->mix_deint2(src,dest1,dest2,dest_len,(float)vol1,(float)vol2);
+    else
+    {
+      mix->mix_peak(src,dest1,dest_len,(float)vol1,0.0f);
+      if (dest2) mix->mix_peak(src,dest2,dest_len,(float)vol2,0.0f);
+    }
+    return;
+  }
+
   double rspos=*state;
   double drspos = 1.0;
   if (src_srate != dest_srate) drspos=(double)src_srate/(double)dest_srate;
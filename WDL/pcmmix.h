@@ -0,0 +1,529 @@
+/*
+    WDL - pcmmix.h
+    Copyright (C) 2005 Cockos Incorporated
+
+    WDL is dual-licensed. You may modify and/or distribute WDL under either of
+    the following  licenses:
+
+      This software is provided 'as-is', without any express or implied
+      warranty.  In no event will the authors be held liable for any damages
+      arising from the use of this software.
+
+      Permission is granted to anyone to use this software for any purpose,
+      including commercial applications, and to alter it and redistribute it
+      freely, subject to the following restrictions:
+
+      1. The origin of this software must not be misrepresented; you must not
+         claim that you wrote the original software. If you use this software
+         in a product, an acknowledgment in the product documentation would be
+         appreciated but is not required.
+      2. Altered source versions must be plainly marked as such, and must not be
+         misrepresented as being the original software.
+      3. This notice may not be removed or altered from any source distribution.
+
+
+    or:
+
+      WDL is free software; you can redistribute it and/or modify
+      it under the terms of the GNU General Public License as published by
+      the Free Software Foundation; either version 2 of the License, or
+      (at your option) any later version.
+
+      WDL is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+      GNU General Public License for more details.
+
+      You should have received a copy of the GNU General Public License
+      along with WDL; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  This file provides vectorized kernels for the inner loops of a float mixer:
+    + peak detection
+    + gain with peak detection (in place)
+    + gain, clip to [-1,1] and accumulate, with peak detection of the unclipped signal
+    + the same, deinterleaving a stereo source into two outputs
+    + plain accumulate
+    + FIR dot product with linearly interpolated coefficients (for resampling)
+
+  Each kernel has a scalar reference version, plus SSE2/AVX2 (x86, selected
+  at runtime by CPUID) and NEON (ARM, selected at compile time) versions.
+  WDL_PCMMix_Get() returns the table for the best level the CPU supports,
+  WDL_PCMMix_SetLevel() can cap it (WDL_PCMMIX_SCALAR forces the reference
+  code). Define WDL_PCMMIX_NO_SIMD to build only the scalar versions.
+  There's one table per program. The first WDL_PCMMix_Get() probes the CPU,
+  so call it once at startup rather than leaving that to an audio thread.
+
+  Peak values are absolute values; pass the previous (decayed) peak in and
+  get the new one back. Buffers need not be aligned.
+
+*/
+
+#ifndef _WDL_PCMMIX_H_
+#define _WDL_PCMMIX_H_
+
+#ifndef WDL_PCMMIX_NO_SIMD
+  #if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define WDL_PCMMIX_X86
+    #include <emmintrin.h>
+    #if defined(_MSC_VER) || defined(__AVX2__) || defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+      #define WDL_PCMMIX_HAVE_AVX2
+      #include <immintrin.h>
+    #endif
+    #ifdef _MSC_VER
+      #include <intrin.h>
+      #define WDL_PCMMIX_TARGET_SSE2
+      #define WDL_PCMMIX_TARGET_AVX2
+    #else
+      #define WDL_PCMMIX_TARGET_SSE2 __attribute__((target("sse2")))
+      #define WDL_PCMMIX_TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+  #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define WDL_PCMMIX_NEON_ENABLED
+    #include <arm_neon.h>
+  #endif
+#endif
+
+enum
+{
+  WDL_PCMMIX_SCALAR=0,
+  WDL_PCMMIX_SSE2,
+  WDL_PCMMIX_AVX2,
+  WDL_PCMMIX_NEON,
+  WDL_PCMMIX_BEST=0x7fff
+};
+
+typedef struct
+{
+  int level;
+  // returns max(maxf,|src[i]|)
+  float (*peak)(const float *src, int n, float maxf);
+  // buf[i]*=vol, returns max(maxf,|buf[i]|)
+  float (*scale_peak)(float *buf, int n, float vol, float maxf);
+  // dest[i]+=clip(src[i]*vol), returns max(maxf,|src[i]*vol|)
+  float (*mix_peak)(const float *src, float *dest, int n, float vol, float maxf);
+  // src is interleaved stereo: dest1[i]+=clip(src[2i]*vol1), dest2[i]+=clip(src[2i+1]*vol2)
+  void (*mix_deint2)(const float *src, float *dest1, float *dest2, int n, float vol1, float vol2);
+  // dest[i]+=src[i]
+  void (*add)(const float *src, float *dest, int n);
+  // returns sum of x[i]*(h[i]+dh[i]*frac)
+  float (*fir_lerp)(const float *x, const float *h, const float *dh, int n, float frac);
+} WDL_PCMMix_Funcs;
+
+
+inline float WDL_PCMMix_peak_c(const float *src, int n, float maxf)
+{
+  while (n-- > 0)
+  {
+    float f=*src++;
+    if (f > maxf) maxf=f;
+    else if (f < -maxf) maxf=-f;
+  }
+  return maxf;
+}
+
+inline float WDL_PCMMix_scale_peak_c(float *buf, int n, float vol, float maxf)
+{
+  while (n-- > 0)
+  {
+    float f = *buf++ *= vol;
+    if (f > maxf) maxf=f;
+    else if (f < -maxf) maxf=-f;
+  }
+  return maxf;
+}
+
+inline float WDL_PCMMix_mix_peak_c(const float *src, float *dest, int n, float vol, float maxf)
+{
+  while (n-- > 0)
+  {
+    float f=*src++ * vol;
+    if (f > maxf) maxf=f;
+    else if (f < -maxf) maxf=-f;
+
+    if (f > 1.0f) f=1.0f;
+    else if (f < -1.0f) f=-1.0f;
+
+    *dest++ += f;
+  }
+  return maxf;
+}
+
+inline void WDL_PCMMix_mix_deint2_c(const float *src, float *dest1, float *dest2, int n, float vol1, float vol2)
+{
+  while (n-- > 0)
+  {
+    float f=src[0]*vol1;
+    if (f > 1.0f) f=1.0f;
+    else if (f < -1.0f) f=-1.0f;
+    *dest1++ += f;
+
+    f=src[1]*vol2;
+    if (f > 1.0f) f=1.0f;
+    else if (f < -1.0f) f=-1.0f;
+    *dest2++ += f;
+
+    src+=2;
+  }
+}
+
+inline void WDL_PCMMix_add_c(const float *src, float *dest, int n)
+{
+  while (n-- > 0) *dest++ += *src++;
+}
+
+inline float WDL_PCMMix_fir_lerp_c(const float *x, const float *h, const float *dh, int n, float frac)
+{
+  float a=0.0f;
+  while (n-- > 0) a += *x++ * (*h++ + *dh++ * frac);
+  return a;
+}
+
+
+#ifdef WDL_PCMMIX_X86
+
+WDL_PCMMIX_TARGET_SSE2 inline __m128 WDL_PCMMix_abs_sse(__m128 v)
+{
+  return _mm_and_ps(v,_mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+}
+
+WDL_PCMMIX_TARGET_SSE2 inline float WDL_PCMMix_hmax_sse(__m128 m)
+{
+  m=_mm_max_ps(m,_mm_movehl_ps(m,m));
+  m=_mm_max_ps(m,_mm_shuffle_ps(m,m,1));
+  return _mm_cvtss_f32(m);
+}
+
+WDL_PCMMIX_TARGET_SSE2 inline float WDL_PCMMix_peak_sse2(const float *src, int n, float maxf)
+{
+  __m128 m=_mm_set1_ps(maxf);
+  int x=0;
+  for (; x <= n-4; x+=4) m=_mm_max_ps(m,WDL_PCMMix_abs_sse(_mm_loadu_ps(src+x)));
+  return WDL_PCMMix_peak_c(src+x,n-x,WDL_PCMMix_hmax_sse(m));
+}
+
+WDL_PCMMIX_TARGET_SSE2 inline float WDL_PCMMix_scale_peak_sse2(float *buf, int n, float vol, float maxf)
+{
+  const __m128 v=_mm_set1_ps(vol);
+  __m128 m=_mm_set1_ps(maxf);
+  int x=0;
+  for (; x <= n-4; x+=4)
+  {
+    __m128 f=_mm_mul_ps(_mm_loadu_ps(buf+x),v);
+    _mm_storeu_ps(buf+x,f);
+    m=_mm_max_ps(m,WDL_PCMMix_abs_sse(f));
+  }
+  return WDL_PCMMix_scale_peak_c(buf+x,n-x,vol,WDL_PCMMix_hmax_sse(m));
+}
+
+WDL_PCMMIX_TARGET_SSE2 inline float WDL_PCMMix_mix_peak_sse2(const float *src, float *dest, int n, float vol, float maxf)
+{
+  const __m128 v=_mm_set1_ps(vol), one=_mm_set1_ps(1.0f), mone=_mm_set1_ps(-1.0f);
+  __m128 m=_mm_set1_ps(maxf);
+  int x=0;
+  for (; x <= n-4; x+=4)
+  {
+    __m128 f=_mm_mul_ps(_mm_loadu_ps(src+x),v);
+    m=_mm_max_ps(m,WDL_PCMMix_abs_sse(f));
+    f=_mm_min_ps(_mm_max_ps(f,mone),one);
+    _mm_storeu_ps(dest+x,_mm_add_ps(_mm_loadu_ps(dest+x),f));
+  }
+  return WDL_PCMMix_mix_peak_c(src+x,dest+x,n-x,vol,WDL_PCMMix_hmax_sse(m));
+}
+
+WDL_PCMMIX_TARGET_SSE2 inline void WDL_PCMMix_mix_deint2_sse2(const float *src, float *dest1, float *dest2, int n, float vol1, float vol2)
+{
+  const __m128 v1=_mm_set1_ps(vol1), v2=_mm_set1_ps(vol2), one=_mm_set1_ps(1.0f), mone=_mm_set1_ps(-1.0f);
+  int x=0;
+  for (; x <= n-4; x+=4)
+  {
+    __m128 a=_mm_loadu_ps(src+x*2), b=_mm_loadu_ps(src+x*2+4);
+    __m128 l=_mm_mul_ps(_mm_shuffle_ps(a,b,_MM_SHUFFLE(2,0,2,0)),v1);
+    __m128 r=_mm_mul_ps(_mm_shuffle_ps(a,b,_MM_SHUFFLE(3,1,3,1)),v2);
+    l=_mm_min_ps(_mm_max_ps(l,mone),one);
+    r=_mm_min_ps(_mm_max_ps(r,mone),one);
+    _mm_storeu_ps(dest1+x,_mm_add_ps(_mm_loadu_ps(dest1+x),l));
+    _mm_storeu_ps(dest2+x,_mm_add_ps(_mm_loadu_ps(dest2+x),r));
+  }
+  WDL_PCMMix_mix_deint2_c(src+x*2,dest1+x,dest2+x,n-x,vol1,vol2);
+}
+
+WDL_PCMMIX_TARGET_SSE2 inline void WDL_PCMMix_add_sse2(const float *src, float *dest, int n)
+{
+  int x=0;
+  for (; x <= n-4; x+=4) _mm_storeu_ps(dest+x,_mm_add_ps(_mm_loadu_ps(dest+x),_mm_loadu_ps(src+x)));
+  WDL_PCMMix_add_c(src+x,dest+x,n-x);
+}
+
+WDL_PCMMIX_TARGET_SSE2 inline float WDL_PCMMix_fir_lerp_sse2(const float *x, const float *h, const float *dh, int n, float frac)
+{
+  const __m128 fr=_mm_set1_ps(frac);
+  __m128 a=_mm_setzero_ps();
+  int i=0;
+  for (; i <= n-4; i+=4)
+    a=_mm_add_ps(a,_mm_mul_ps(_mm_loadu_ps(x+i),_mm_add_ps(_mm_loadu_ps(h+i),_mm_mul_ps(_mm_loadu_ps(dh+i),fr))));
+  a=_mm_add_ps(a,_mm_movehl_ps(a,a));
+  a=_mm_add_ss(a,_mm_shuffle_ps(a,a,1));
+  return _mm_cvtss_f32(a)+WDL_PCMMix_fir_lerp_c(x+i,h+i,dh+i,n-i,frac);
+}
+
+#ifdef WDL_PCMMIX_HAVE_AVX2
+
+WDL_PCMMIX_TARGET_AVX2 inline __m256 WDL_PCMMix_abs_avx(__m256 v)
+{
+  return _mm256_and_ps(v,_mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+}
+
+WDL_PCMMIX_TARGET_AVX2 inline float WDL_PCMMix_hmax_avx(__m256 m)
+{
+  __m128 h=_mm_max_ps(_mm256_castps256_ps128(m),_mm256_extractf128_ps(m,1));
+  h=_mm_max_ps(h,_mm_movehl_ps(h,h));
+  h=_mm_max_ps(h,_mm_shuffle_ps(h,h,1));
+  return _mm_cvtss_f32(h);
+}
+
+WDL_PCMMIX_TARGET_AVX2 inline float WDL_PCMMix_peak_avx2(const float *src, int n, float maxf)
+{
+  __m256 m=_mm256_set1_ps(maxf);
+  int x=0;
+  for (; x <= n-8; x+=8) m=_mm256_max_ps(m,WDL_PCMMix_abs_avx(_mm256_loadu_ps(src+x)));
+  return WDL_PCMMix_peak_c(src+x,n-x,WDL_PCMMix_hmax_avx(m));
+}
+
+WDL_PCMMIX_TARGET_AVX2 inline float WDL_PCMMix_scale_peak_avx2(float *buf, int n, float vol, float maxf)
+{
+  const __m256 v=_mm256_set1_ps(vol);
+  __m256 m=_mm256_set1_ps(maxf);
+  int x=0;
+  for (; x <= n-8; x+=8)
+  {
+    __m256 f=_mm256_mul_ps(_mm256_loadu_ps(buf+x),v);
+    _mm256_storeu_ps(buf+x,f);
+    m=_mm256_max_ps(m,WDL_PCMMix_abs_avx(f));
+  }
+  return WDL_PCMMix_scale_peak_c(buf+x,n-x,vol,WDL_PCMMix_hmax_avx(m));
+}
+
+WDL_PCMMIX_TARGET_AVX2 inline float WDL_PCMMix_mix_peak_avx2(const float *src, float *dest, int n, float vol, float maxf)
+{
+  const __m256 v=_mm256_set1_ps(vol), one=_mm256_set1_ps(1.0f), mone=_mm256_set1_ps(-1.0f);
+  __m256 m=_mm256_set1_ps(maxf);
+  int x=0;
+  for (; x <= n-8; x+=8)
+  {
+    __m256 f=_mm256_mul_ps(_mm256_loadu_ps(src+x),v);
+    m=_mm256_max_ps(m,WDL_PCMMix_abs_avx(f));
+    f=_mm256_min_ps(_mm256_max_ps(f,mone),one);
+    _mm256_storeu_ps(dest+x,_mm256_add_ps(_mm256_loadu_ps(dest+x),f));
+  }
+  return WDL_PCMMix_mix_peak_c(src+x,dest+x,n-x,vol,WDL_PCMMix_hmax_avx(m));
+}
+
+WDL_PCMMIX_TARGET_AVX2 inline void WDL_PCMMix_add_avx2(const float *src, float *dest, int n)
+{
+  int x=0;
+  for (; x <= n-8; x+=8) _mm256_storeu_ps(dest+x,_mm256_add_ps(_mm256_loadu_ps(dest+x),_mm256_loadu_ps(src+x)));
+  WDL_PCMMix_add_c(src+x,dest+x,n-x);
+}
+
+WDL_PCMMIX_TARGET_AVX2 inline float WDL_PCMMix_fir_lerp_avx2(const float *x, const float *h, const float *dh, int n, float frac)
+{
+  const __m256 fr=_mm256_set1_ps(frac);
+  __m256 a=_mm256_setzero_ps();
+  int i=0;
+  for (; i <= n-8; i+=8)
+    a=_mm256_add_ps(a,_mm256_mul_ps(_mm256_loadu_ps(x+i),_mm256_add_ps(_mm256_loadu_ps(h+i),_mm256_mul_ps(_mm256_loadu_ps(dh+i),fr))));
+  __m128 s=_mm_add_ps(_mm256_castps256_ps128(a),_mm256_extractf128_ps(a,1));
+  s=_mm_add_ps(s,_mm_movehl_ps(s,s));
+  s=_mm_add_ss(s,_mm_shuffle_ps(s,s,1));
+  return _mm_cvtss_f32(s)+WDL_PCMMix_fir_lerp_c(x+i,h+i,dh+i,n-i,frac);
+}
+
+#endif // WDL_PCMMIX_HAVE_AVX2
+
+inline int WDL_PCMMix_DetectLevel()
+{
+  int level=WDL_PCMMIX_SCALAR;
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info,0);
+  int maxid=info[0];
+  __cpuid(info,1);
+  if (info[3]&(1<<26)) level=WDL_PCMMIX_SSE2;
+#ifdef WDL_PCMMIX_HAVE_AVX2
+  // need OS support for the AVX register state as well as the instructions
+  if (level && maxid >= 7 && (info[2]&(1<<27)) && (info[2]&(1<<28)) && (_xgetbv(0)&6)==6)
+  {
+    __cpuidex(info,7,0);
+    if (info[1]&(1<<5)) level=WDL_PCMMIX_AVX2;
+  }
+#endif
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) level=WDL_PCMMIX_SSE2;
+#ifdef WDL_PCMMIX_HAVE_AVX2
+  if (level && __builtin_cpu_supports("avx2")) level=WDL_PCMMIX_AVX2;
+#endif
+#endif
+  return level;
+}
+
+#elif defined(WDL_PCMMIX_NEON_ENABLED)
+
+inline float WDL_PCMMix_hmax_neon(float32x4_t m)
+{
+  float32x2_t h=vpmax_f32(vget_low_f32(m),vget_high_f32(m));
+  h=vpmax_f32(h,h);
+  return vget_lane_f32(h,0);
+}
+
+inline float WDL_PCMMix_peak_neon(const float *src, int n, float maxf)
+{
+  float32x4_t m=vdupq_n_f32(maxf);
+  int x=0;
+  for (; x <= n-4; x+=4) m=vmaxq_f32(m,vabsq_f32(vld1q_f32(src+x)));
+  return WDL_PCMMix_peak_c(src+x,n-x,WDL_PCMMix_hmax_neon(m));
+}
+
+inline float WDL_PCMMix_scale_peak_neon(float *buf, int n, float vol, float maxf)
+{
+  float32x4_t m=vdupq_n_f32(maxf);
+  int x=0;
+  for (; x <= n-4; x+=4)
+  {
+    float32x4_t f=vmulq_n_f32(vld1q_f32(buf+x),vol);
+    vst1q_f32(buf+x,f);
+    m=vmaxq_f32(m,vabsq_f32(f));
+  }
+  return WDL_PCMMix_scale_peak_c(buf+x,n-x,vol,WDL_PCMMix_hmax_neon(m));
+}
+
+inline float WDL_PCMMix_mix_peak_neon(const float *src, float *dest, int n, float vol, float maxf)
+{
+  const float32x4_t one=vdupq_n_f32(1.0f), mone=vdupq_n_f32(-1.0f);
+  float32x4_t m=vdupq_n_f32(maxf);
+  int x=0;
+  for (; x <= n-4; x+=4)
+  {
+    float32x4_t f=vmulq_n_f32(vld1q_f32(src+x),vol);
+    m=vmaxq_f32(m,vabsq_f32(f));
+    f=vminq_f32(vmaxq_f32(f,mone),one);
+    vst1q_f32(dest+x,vaddq_f32(vld1q_f32(dest+x),f));
+  }
+  return WDL_PCMMix_mix_peak_c(src+x,dest+x,n-x,vol,WDL_PCMMix_hmax_neon(m));
+}
+
+inline void WDL_PCMMix_mix_deint2_neon(const float *src, float *dest1, float *dest2, int n, float vol1, float vol2)
+{
+  const float32x4_t one=vdupq_n_f32(1.0f), mone=vdupq_n_f32(-1.0f);
+  int x=0;
+  for (; x <= n-4; x+=4)
+  {
+    float32x4x2_t lr=vld2q_f32(src+x*2);
+    float32x4_t l=vminq_f32(vmaxq_f32(vmulq_n_f32(lr.val[0],vol1),mone),one);
+    float32x4_t r=vminq_f32(vmaxq_f32(vmulq_n_f32(lr.val[1],vol2),mone),one);
+    vst1q_f32(dest1+x,vaddq_f32(vld1q_f32(dest1+x),l));
+    vst1q_f32(dest2+x,vaddq_f32(vld1q_f32(dest2+x),r));
+  }
+  WDL_PCMMix_mix_deint2_c(src+x*2,dest1+x,dest2+x,n-x,vol1,vol2);
+}
+
+inline void WDL_PCMMix_add_neon(const float *src, float *dest, int n)
+{
+  int x=0;
+  for (; x <= n-4; x+=4) vst1q_f32(dest+x,vaddq_f32(vld1q_f32(dest+x),vld1q_f32(src+x)));
+  WDL_PCMMix_add_c(src+x,dest+x,n-x);
+}
+
+inline float WDL_PCMMix_fir_lerp_neon(const float *x, const float *h, const float *dh, int n, float frac)
+{
+  float32x4_t a=vdupq_n_f32(0.0f);
+  int i=0;
+  for (; i <= n-4; i+=4)
+    a=vmlaq_f32(a,vld1q_f32(x+i),vmlaq_n_f32(vld1q_f32(h+i),vld1q_f32(dh+i),frac));
+  float32x2_t s=vadd_f32(vget_low_f32(a),vget_high_f32(a));
+  s=vpadd_f32(s,s);
+  return vget_lane_f32(s,0)+WDL_PCMMix_fir_lerp_c(x+i,h+i,dh+i,n-i,frac);
+}
+
+inline int WDL_PCMMix_DetectLevel() { return WDL_PCMMIX_NEON; }
+
+#else
+
+inline int WDL_PCMMix_DetectLevel() { return WDL_PCMMIX_SCALAR; }
+
+#endif
+
+
+inline WDL_PCMMix_Funcs *WDL_PCMMix_Table()
+{
+  static WDL_PCMMix_Funcs funcs;
+  return &funcs;
+}
+
+// selects the best kernels available, not exceeding maxlevel. returns the level used.
+// every pointer is valid at all times, so this is safe to call while another thread mixes.
+inline int WDL_PCMMix_SetLevel(int maxlevel)
+{
+  static const int detected=WDL_PCMMix_DetectLevel(); // probed once, thread-safe
+  int level=detected < maxlevel ? detected : maxlevel;
+
+  WDL_PCMMix_Funcs *f=WDL_PCMMix_Table();
+  f->peak=WDL_PCMMix_peak_c;
+  f->scale_peak=WDL_PCMMix_scale_peak_c;
+  f->mix_peak=WDL_PCMMix_mix_peak_c;
+  f->mix_deint2=WDL_PCMMix_mix_deint2_c;
+  f->add=WDL_PCMMix_add_c;
+  f->fir_lerp=WDL_PCMMix_fir_lerp_c;
+  f->level=WDL_PCMMIX_SCALAR;
+
+#ifdef WDL_PCMMIX_X86
+  if (level >= WDL_PCMMIX_SSE2)
+  {
+    f->peak=WDL_PCMMix_peak_sse2;
+    f->scale_peak=WDL_PCMMix_scale_peak_sse2;
+    f->mix_peak=WDL_PCMMix_mix_peak_sse2;
+    f->mix_deint2=WDL_PCMMix_mix_deint2_sse2;
+    f->add=WDL_PCMMix_add_sse2;
+    f->fir_lerp=WDL_PCMMix_fir_lerp_sse2;
+    f->level=WDL_PCMMIX_SSE2;
+  }
+#ifdef WDL_PCMMIX_HAVE_AVX2
+  if (level >= WDL_PCMMIX_AVX2)
+  {
+    f->peak=WDL_PCMMix_peak_avx2;
+    f->scale_peak=WDL_PCMMix_scale_peak_avx2;
+    f->mix_peak=WDL_PCMMix_mix_peak_avx2;
+    // the 256-bit deinterleave measured slower than SSE2 at callback sizes, so keep that one
+    f->add=WDL_PCMMix_add_avx2;
+    f->fir_lerp=WDL_PCMMix_fir_lerp_avx2;
+    f->level=WDL_PCMMIX_AVX2;
+  }
+#endif
+#elif defined(WDL_PCMMIX_NEON_ENABLED)
+  if (level >= WDL_PCMMIX_NEON)
+  {
+    f->peak=WDL_PCMMix_peak_neon;
+    f->scale_peak=WDL_PCMMix_scale_peak_neon;
+    f->mix_peak=WDL_PCMMix_mix_peak_neon;
+    f->mix_deint2=WDL_PCMMix_mix_deint2_neon;
+    f->add=WDL_PCMMix_add_neon;
+    f->fir_lerp=WDL_PCMMix_fir_lerp_neon;
+    f->level=WDL_PCMMIX_NEON;
+  }
+#endif
+  return f->level;
+}
+
+inline const WDL_PCMMix_Funcs *WDL_PCMMix_Get()
+{
+  // filled in by whichever thread gets here first, the others wait for it
+  static const int level=WDL_PCMMix_SetLevel(WDL_PCMMIX_BEST);
+  (void)level;
+  return WDL_PCMMix_Table();
+}
+
+#endif
@@ -0,0 +1,322 @@
+/*
+    WDL - resample.h
+    Copyright (C) 2005 Cockos Incorporated
+
+    WDL is dual-licensed. You may modify and/or distribute WDL under either of
+    the following  licenses:
+
+      This software is provided 'as-is', without any express or implied
+      warranty.  In no event will the authors be held liable for any damages
+      arising from the use of this software.
+
+      Permission is granted to anyone to use this software for any purpose,
+      including commercial applications, and to alter it and redistribute it
+      freely, subject to the following restrictions:
+
+      1. The origin of this software must not be misrepresented; you must not
+         claim that you wrote the original software. If you use this software
+         in a product, an acknowledgment in the product documentation would be
+         appreciated but is not required.
+      2. Altered source versions must be plainly marked as such, and must not be
+         misrepresented as being the original software.
+      3. This notice may not be removed or altered from any source distribution.
+
+
+    or:
+
+      WDL is free software; you can redistribute it and/or modify
+      it under the terms of the GNU General Public License as published by
+      the Free Software Foundation; either version 2 of the License, or
+      (at your option) any later version.
+
+      WDL is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+      GNU General Public License for more details.
+
+      You should have received a copy of the GNU General Public License
+      along with WDL; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  This file provides a polyphase windowed-sinc sample rate converter, for
+  planar float audio.
+
+  The filter is a Kaiser-windowed sinc, tabulated at WDL_RESAMPLE_PHASES
+  fractional offsets and linearly interpolated between them. The cutoff
+  follows the lower of the two rates, so downsampling is anti-aliased.
+  Quality levels:
+    0: linear interpolation (cheap, aliases)
+    1: 16 taps, ~60dB stopband
+    2: 32 taps, ~80dB stopband
+    3: 64 taps, ~100dB stopband
+  (tap counts grow proportionally when downsampling.)
+
+  Usage (pull model, one block of output at a time):
+
+    WDL_Resampler rs;
+    rs.Init(44100.0,48000.0,2,2);               // allocates, do this off the audio thread
+    rs.Prepare(maxoutlen);                      // likewise. outlen <= maxoutlen then never allocates
+
+    int n=rs.GetInputNeeded(outlen);            // in frames
+    for (ch...) memcpy(rs.GetInputBuffer(ch,n),src[ch],n*sizeof(float));
+    rs.AddInput(n);
+    rs.Process(outptrs,outlen);                 // writes (not mixes) outlen frames per channel
+
+  Output is aligned with input: the first output sample corresponds to the
+  first input sample, the filter's group delay is hidden by zero history.
+
+*/
+
+#ifndef _WDL_RESAMPLE_H_
+#define _WDL_RESAMPLE_H_
+
+#include <math.h>
+#include <string.h>
+#include "heapbuf.h"
+#include "pcmmix.h"
+
+#define WDL_RESAMPLE_PHASES 256
+#define WDL_RESAMPLE_MAXQUALITY 3
+
+class WDL_Resampler
+{
+public:
+  WDL_Resampler() : m_srcrate(0.0), m_dstrate(0.0), m_nch(0), m_quality(0), m_halfw(1), m_taps(2),
+                    m_step(1.0), m_pos(0.0), m_filled(0), m_cap(0)
+  {
+  }
+  ~WDL_Resampler() { }
+
+  void Init(double srcrate, double dstrate, int nch, int quality)
+  {
+    if (quality < 0) quality=0;
+    else if (quality > WDL_RESAMPLE_MAXQUALITY) quality=WDL_RESAMPLE_MAXQUALITY;
+    if (nch < 1) nch=1;
+
+    m_srcrate=srcrate;
+    m_dstrate=dstrate;
+    m_nch=nch;
+    m_quality=quality;
+    m_step=srcrate/dstrate;
+
+    if (!quality)
+    {
+      m_taps=2;
+      m_halfw=1;
+      m_filter.Resize(0);
+    }
+    else
+    {
+      static const double betas[WDL_RESAMPLE_MAXQUALITY]={5.65, 7.86, 10.06};
+      double beta=betas[quality-1];
+      double ratio=dstrate < srcrate ? dstrate/srcrate : 1.0;
+
+      // widen the filter when downsampling so the transition band keeps its (relative) width
+      int taps=(int)ceil((8<<quality)/ratio);
+      taps=(taps+7)&~7;
+      if (taps > 512) taps=512;
+      m_taps=taps;
+      m_halfw=taps/2;
+
+      // Kaiser's estimate of the transition width, centered just under the output nyquist
+      double atten=beta/0.1102 + 8.7;
+      double tw=(atten-7.95)/(14.36*taps);
+      double fc=ratio*(1.0-tw);
+      if (fc < ratio*0.5) fc=ratio*0.5;
+
+      BuildFilter(fc,beta);
+    }
+
+    m_filled=m_cap=0; // channel layout may have changed
+    Reset();
+  }
+
+  void Reset()
+  {
+    // keep halfw-1 frames of zero history in front of the first input sample
+    m_filled=m_halfw-1;
+    m_pos=(double)(m_halfw-1);
+    Reserve(m_filled + 1024);
+    int c;
+    for (c = 0; c < m_nch; c ++) memset(m_buf.Get()+c*m_cap,0,m_filled*sizeof(float));
+  }
+
+  // sizes the input buffer so that adding GetInputNeeded(n) frames and calling Process(n)
+  // never allocates, for any n <= maxoutlen. call after Init(), off the audio thread.
+  void Prepare(int maxoutlen)
+  {
+    Reserve(2*m_halfw + (int)ceil(maxoutlen*m_step) + 2);
+  }
+
+  double GetSrcRate() const { return m_srcrate; }
+  double GetDstRate() const { return m_dstrate; }
+  int GetNumChannels() const { return m_nch; }
+  int GetQuality() const { return m_quality; }
+
+  // frames past the last output position that the filter reads. at the end of a stream
+  // it's fine to pad up to this many frames of silence.
+  int GetLookahead() const { return m_halfw; }
+
+  // frames of input that must be added before Process(outlen) can complete
+  int GetInputNeeded(int outlen)
+  {
+    if (outlen < 1) return 0;
+    int need=(int)(m_pos + (outlen-1)*m_step) + m_halfw + 1;
+    return need > m_filled ? need-m_filled : 0;
+  }
+
+  // returns space for frames of input on channel ch. grows the buffer if needed,
+  // so size it via GetInputNeeded() beforehand if calling from a realtime thread.
+  float *GetInputBuffer(int ch, int frames)
+  {
+    Reserve(m_filled+frames);
+    return m_buf.Get()+ch*m_cap+m_filled;
+  }
+
+  void AddInput(int frames)
+  {
+    if (frames > 0 && m_filled+frames <= m_cap) m_filled+=frames;
+  }
+
+  // writes up to outlen frames to each of out[0..nch-1], returns the number of frames written
+  int Process(float **out, int outlen)
+  {
+    const WDL_PCMMix_Funcs *mix=WDL_PCMMix_Get();
+    const int taps=m_taps, halfw=m_halfw;
+    int x;
+    for (x = 0; x < outlen; x ++)
+    {
+      double p=m_pos + x*m_step;
+      int ipos=(int)p;
+      if (ipos+halfw >= m_filled) break;
+
+      float frac=(float)(p-ipos);
+      int c;
+      if (!m_quality)
+      {
+        for (c = 0; c < m_nch; c ++)
+        {
+          const float *in=m_buf.Get()+c*m_cap+ipos;
+          out[c][x]=in[0] + (in[1]-in[0])*frac;
+        }
+      }
+      else
+      {
+        float pf=frac*WDL_RESAMPLE_PHASES;
+        int ph=(int)pf;
+        if (ph >= WDL_RESAMPLE_PHASES) ph=WDL_RESAMPLE_PHASES-1; // frac rounded up to 1.0
+        const float *h=m_filter.Get()+ph*taps*2;
+        for (c = 0; c < m_nch; c ++)
+          out[c][x]=mix->fir_lerp(m_buf.Get()+c*m_cap+ipos-halfw+1,h,h+taps,taps,pf-ph);
+      }
+    }
+
+    Advance(x);
+    return x;
+  }
+
+  // like Process(), but only moves along as if it had written the frames. returns the number skipped.
+  int Skip(int outlen)
+  {
+    int x;
+    for (x = 0; x < outlen && (int)(m_pos + x*m_step)+m_halfw < m_filled; x ++);
+    Advance(x);
+    return x;
+  }
+
+private:
+
+  void Advance(int outframes)
+  {
+    // drop input that no later output can reach
+    m_pos += outframes*m_step;
+    int drop=(int)m_pos - m_halfw + 1;
+    if (drop > m_filled) drop=m_filled;
+    if (drop > 0)
+    {
+      int c;
+      for (c = 0; c < m_nch; c ++)
+      {
+        float *b=m_buf.Get()+c*m_cap;
+        memmove(b,b+drop,(m_filled-drop)*sizeof(float));
+      }
+      m_filled-=drop;
+      m_pos-=drop;
+    }
+  }
+
+  static double besselI0(double x)
+  {
+    double sum=1.0, term=1.0, hx=x*0.5;
+    int k;
+    for (k = 1; k < 64; k ++)
+    {
+      term *= (hx/k)*(hx/k);
+      sum += term;
+      if (term < sum*1e-12) break;
+    }
+    return sum;
+  }
+
+  // rows of taps coefficients for each phase, each followed by its delta to the next phase
+  void BuildFilter(double fc, double beta)
+  {
+    const int taps=m_taps, halfw=m_halfw;
+    WDL_TypedBuf<double> rows;
+    double *r=rows.Resize((WDL_RESAMPLE_PHASES+1)*taps);
+    double i0b=besselI0(beta);
+    int ph,k;
+    for (ph = 0; ph <= WDL_RESAMPLE_PHASES; ph ++)
+    {
+      double frac=ph/(double)WDL_RESAMPLE_PHASES;
+      double sum=0.0;
+      for (k = 0; k < taps; k ++)
+      {
+        double d=(k-halfw+1)-frac;
+        double t=d/halfw;
+        double w=t*t < 1.0 ? besselI0(beta*sqrt(1.0-t*t))/i0b : 0.0;
+        double sx=fc*d;
+        double sinc=fabs(sx) < 1e-9 ? 1.0 : sin(3.14159265358979323846*sx)/(3.14159265358979323846*sx);
+        sum += r[ph*taps+k]=fc*sinc*w;
+      }
+      if (sum > 0.0) for (k = 0; k < taps; k ++) r[ph*taps+k] /= sum;
+    }
+
+    float *f=m_filter.Resize(WDL_RESAMPLE_PHASES*taps*2);
+    for (ph = 0; ph < WDL_RESAMPLE_PHASES; ph ++)
+    {
+      for (k = 0; k < taps; k ++)
+      {
+        f[ph*taps*2+k]=(float)r[ph*taps+k];
+        f[ph*taps*2+taps+k]=(float)(r[(ph+1)*taps+k]-r[ph*taps+k]);
+      }
+    }
+  }
+
+  void Reserve(int frames)
+  {
+    if (frames <= m_cap) return;
+    int newcap=frames*2;
+    m_buf.Resize(newcap*m_nch);
+    // move channels to their new offsets, last first since they only move up
+    int c;
+    for (c = m_nch-1; c > 0; c --)
+      memmove(m_buf.Get()+c*newcap,m_buf.Get()+c*m_cap,m_filled*sizeof(float));
+    m_cap=newcap;
+  }
+
+  double m_srcrate, m_dstrate;
+  int m_nch, m_quality;
+  int m_halfw, m_taps;
+
+  double m_step, m_pos;
+  int m_filled, m_cap;
+
+  WDL_TypedBuf<float> m_filter;
+  WDL_TypedBuf<float> m_buf;
+};
+
+#endif
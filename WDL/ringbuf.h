@@ -0,0 +1,171 @@
+/*
+    WDL - ringbuf.h
+    Copyright (C) 2005 Cockos Incorporated
+
+    WDL is dual-licensed. You may modify and/or distribute WDL under either of
+    the following  licenses:
+
+      This software is provided 'as-is', without any express or implied
+      warranty.  In no event will the authors be held liable for any damages
+      arising from the use of this software.
+
+      Permission is granted to anyone to use this software for any purpose,
+      including commercial applications, and to alter it and redistribute it
+      freely, subject to the following restrictions:
+
+      1. The origin of this software must not be misrepresented; you must not
+         claim that you wrote the original software. If you use this software
+         in a product, an acknowledgment in the product documentation would be
+         appreciated but is not required.
+      2. Altered source versions must be plainly marked as such, and must not be
+         misrepresented as being the original software.
+      3. This notice may not be removed or altered from any source distribution.
+
+
+    or:
+
+      WDL is free software; you can redistribute it and/or modify
+      it under the terms of the GNU General Public License as published by
+      the Free Software Foundation; either version 2 of the License, or
+      (at your option) any later version.
+
+      WDL is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+      GNU General Public License for more details.
+
+      You should have received a copy of the GNU General Public License
+      along with WDL; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  This file provides WDL_PlanarRingBuf, a ring buffer of float audio kept as
+  one contiguous ring per channel. Writers append whole frames, readers look
+  at the data in place (at most two segments per channel) and then Advance().
+  Nothing is ever compacted; the buffer only grows if a write doesn't fit.
+
+  Not thread safe, the reader and writer are expected to be the same thread
+  (or to be serialized by the caller).
+
+*/
+
+#ifndef _WDL_RINGBUF_H_
+#define _WDL_RINGBUF_H_
+
+#include <string.h>
+#include "heapbuf.h"
+
+class WDL_PlanarRingBuf
+{
+public:
+  WDL_PlanarRingBuf() : m_nch(0), m_cap(0), m_rd(0), m_avail(0) { }
+  ~WDL_PlanarRingBuf() { }
+
+  // discards contents
+  void Init(int nch, int capacity)
+  {
+    if (nch < 1) nch=1;
+    if (capacity < 1) capacity=1;
+    m_nch=nch;
+    m_cap=capacity;
+    m_rd=m_avail=0;
+    m_buf.Resize(m_nch*m_cap);
+  }
+  void Clear() { m_rd=m_avail=0; }
+
+  int GetNumChannels() const { return m_nch; }
+  int GetCapacity() const { return m_cap; }
+  int Available() const { return m_avail; } // frames
+
+  // make room for at least frames more frames. only allocates if it has to.
+  void Reserve(int frames)
+  {
+    if (m_avail+frames > m_cap) Grow(m_avail+frames);
+  }
+
+  // src[c][srcoffs..srcoffs+frames-1] for each channel
+  void Write(float **src, int frames, int srcoffs=0)
+  {
+    if (frames < 1 || !m_nch) return;
+    Reserve(frames);
+
+    int wr=m_rd+m_avail;
+    if (wr >= m_cap) wr-=m_cap;
+    int l1=m_cap-wr;
+    if (l1 > frames) l1=frames;
+    int c;
+    for (c = 0; c < m_nch; c ++)
+    {
+      float *b=m_buf.Get()+c*m_cap;
+      memcpy(b+wr,src[c]+srcoffs,l1*sizeof(float));
+      if (frames > l1) memcpy(b,src[c]+srcoffs+l1,(frames-l1)*sizeof(float));
+    }
+    m_avail+=frames;
+  }
+
+  // pointer to channel ch, offs frames past the read position. *contig gets how many
+  // frames can be read from there before wrapping (or running out).
+  float *Peek(int ch, int offs, int *contig)
+  {
+    int p=m_rd+offs;
+    if (p >= m_cap) p-=m_cap;
+    int l=m_cap-p;
+    if (l > m_avail-offs) l=m_avail-offs;
+    *contig=l > 0 ? l : 0;
+    return m_buf.Get()+ch*m_cap+p;
+  }
+
+  // copies frames of channel ch (starting offs past the read position) to dest
+  int Read(int ch, float *dest, int frames, int offs=0)
+  {
+    if (frames > m_avail-offs) frames=m_avail-offs;
+    int done=0;
+    while (done < frames)
+    {
+      int l;
+      float *p=Peek(ch,offs+done,&l);
+      if (l > frames-done) l=frames-done;
+      memcpy(dest+done,p,l*sizeof(float));
+      done+=l;
+    }
+    return frames > 0 ? frames : 0;
+  }
+
+  void Advance(int frames)
+  {
+    if (frames > m_avail) frames=m_avail;
+    if (frames < 1) return;
+    m_avail-=frames;
+    m_rd+=frames;
+    if (m_rd >= m_cap) m_rd-=m_cap;
+    if (!m_avail) m_rd=0;
+  }
+
+private:
+
+  void Grow(int minframes)
+  {
+    int newcap=m_cap*2;
+    if (newcap < minframes) newcap=minframes;
+    newcap=(newcap+4095)&~4095;
+
+    // unwrap into the new layout
+    WDL_TypedBuf<float> nb;
+    float *n=nb.Resize(m_nch*newcap);
+    int c;
+    for (c = 0; c < m_nch; c ++) Read(c,n+c*newcap,m_avail);
+
+    m_buf.Resize(m_nch*newcap);
+    for (c = 0; c < m_nch; c ++) memcpy(m_buf.Get()+c*newcap,n+c*newcap,m_avail*sizeof(float));
+    m_cap=newcap;
+    m_rd=0;
+  }
+
+  int m_nch, m_cap;
+  int m_rd, m_avail;
+  WDL_TypedBuf<float> m_buf;
+};
+
+#endif
@@ -54,6 +54,10 @@
 #include "vorbis/vorbisenc.h"
 #include "vorbis/codec.h"
 #include "../WDL/queue.h"
+#include "../WDL/ringbuf.h"
+
+#define VORBISDEC_PLANAR_MAXCH 8
+#define VORBISDEC_PLANAR_FRAMES 65536 // ring sizes, set up with the stream headers: more than a page decodes to
 
 class VorbisDecoder
 {
@@ -61,6 +65,12 @@ class VorbisDecoder
     VorbisDecoder()
     {
       m_samples_used=0;
+      m_planar=false;
+      m_setup=false;
+      m_stream_active=false;
+      m_skip=m_resync=false;
+      m_skipped=0;
+      m_pos=0;
     	packets=0;
 	    memset(&oy,0,sizeof(oy));
 	    memset(&os,0,sizeof(os));
@@ -77,11 +87,8 @@ class VorbisDecoder
     }
     ~VorbisDecoder()
     {
-      ogg_stream_clear(&os);
-      vorbis_block_clear(&vb);
-      vorbis_dsp_clear(&vd);
-	    vorbis_comment_clear(&vc);
-      vorbis_info_clear(&vi);
+      if (m_stream_active) ogg_stream_clear(&os);
+      ClearSetup();
 
   	  ogg_sync_clear(&oy);
     }
@@ -92,6 +99,41 @@ class VorbisDecoder
     WDL_HeapBuf m_samples; // we let the size get as big as it needs to, so we don't worry about tons of mallocs/etc
     int m_samples_used;
 
+    // if enabled (before decoding anything), output goes to m_ring instead of m_samples/m_samples_used
+    void SetPlanarOutput(bool planar) { m_planar=planar; }
+    WDL_PlanarRingBuf m_ring;
+
+    // planar output only. with skip on, audio packets aren't decoded, the frames they cover (from the
+    // pages' granule positions) are counted instead, ahead of anything in m_ring. when skip goes off,
+    // decoding restarts, and what comes out is held back (and counted as skipped too) until the end of
+    // a page says where it belongs. then m_ring gets it, after silence for whatever couldn't be decoded,
+    // so the stream position comes out the same as if everything had been.
+    void SetSkip(bool skip)
+    {
+      if (!m_planar || skip == m_skip) return;
+      m_skip=skip;
+      if (skip)
+      {
+        m_skipped+=m_ring.Available();
+        m_ring.Clear();
+        m_resync_ring.Clear();
+        m_resync=false;
+      }
+      else
+      {
+        if (m_setup) vorbis_synthesis_restart(&vd);
+        m_resync=true;
+        m_resync_ring.Clear();
+      }
+    }
+    int GetSkipped()
+    {
+      int n=m_skipped;
+      if (m_resync) n+=m_resync_ring.Available();
+      return n > 0 ? n : 0;
+    }
+    void ConsumeSkipped(int frames) { m_skipped-=frames; } // goes negative if resyncing, PageDone() sorts it out
+
     void *DecodeGetSrcBuffer(int srclen)
     {
 		  return ogg_sync_buffer(&oy,srclen);
@@ -104,83 +146,218 @@ class VorbisDecoder
 		  while(ogg_sync_pageout(&oy,&og)>0)
 		  {
 			  int serial=ogg_page_serialno(&og);
-			  if (!packets) ogg_stream_init(&os,serial);
-			  else if (serial!=os.serialno)
+			  if (!m_stream_active || serial!=os.serialno)
 			  {
-				  vorbis_block_clear(&vb);
-				  vorbis_dsp_clear(&vd);
-				  vorbis_comment_clear(&vc);
-				  vorbis_info_clear(&vi);
-
-				  ogg_stream_clear(&os);
+				  if (m_stream_active) ogg_stream_clear(&os);
 				  ogg_stream_init(&os,serial);
+				  m_stream_active=true;
 				  packets=0;
-			  }
-			  if (!packets)
-			  {
-				  vorbis_info_init(&vi);
-				  vorbis_comment_init(&vc);
+				  m_pos=0;
+				  m_newhdr.Advance(m_newhdr.Available());
+				  m_newhdr.Compact();
 			  }
 			  ogg_stream_pagein(&os,&og);
 			  while(ogg_stream_packetout(&os,&op)>0)
 			  {
 				  if (packets<3)
 				  {
-					  if(vorbis_synthesis_headerin(&vi,&vc,&op)<0) return;
+					  // collect the headers, the setup is only redone if they differ from the last stream's
+					  int l=op.bytes;
+					  m_newhdr.Add(&l,sizeof(l));
+					  m_newhdr.Add(op.packet,l);
+					  if (++packets==3) SetupFromHeaders();
+					  continue;
 				  }
-				  else
+				  if (!m_setup || m_skip) continue;
+
+				  float ** pcm;
+				  int samples;
+				  if(vorbis_synthesis(&vb,&op)==0) vorbis_synthesis_blockin(&vd,&vb);
+				  while((samples=vorbis_synthesis_pcmout(&vd,&pcm))>0)
 				  {
-					  float ** pcm;
-					  int samples;
-					  if(vorbis_synthesis(&vb,&op)==0) vorbis_synthesis_blockin(&vd,&vb);
-					  while((samples=vorbis_synthesis_pcmout(&vd,&pcm))>0)
-					  {
-						  int n,c;
+					  int n,c;
 
-              int newsize=(m_samples_used+(samples+4096)*vi.channels)*sizeof(float);
+            if (m_planar)
+            {
+              WDL_PlanarRingBuf *ring=m_resync ? &m_resync_ring : &m_ring;
+              ring->Write(pcm,samples); // sized by PreparePlanar()
+              vorbis_synthesis_read(&vd,samples);
+              if (!m_resync) m_pos+=samples;
+              continue;
+            }
 
-              if (m_samples.GetSize() < newsize) m_samples.Resize(newsize+32768);
+            int newsize=(m_samples_used+(samples+4096)*vi.channels)*sizeof(float);
 
-              float *bufmem = (float *)m_samples.Get();
+            if (m_samples.GetSize() < newsize) m_samples.Resize(newsize+32768);
 
-						  for(n=0;n<samples;n++)
+            float *bufmem = (float *)m_samples.Get();
+
+					  for(n=0;n<samples;n++)
+					  {
+						  for(c=0;c<vi.channels;c++)
 						  {
-							  for(c=0;c<vi.channels;c++)
-							  {
-								  bufmem[m_samples_used++]=pcm[c][n];
-							  }							
-						  }
-						  vorbis_synthesis_read(&vd,samples);
+							  bufmem[m_samples_used++]=pcm[c][n];
+						  }							
 					  }
-				  }
-				  packets++;
-				  if (packets==3)
-				  {
-					  vorbis_synthesis_init(&vd,&vi);
-					  vorbis_block_init(&vd,&vb);
+					  vorbis_synthesis_read(&vd,samples);
 				  }
 			  }
+
+			  ogg_int64_t gp=ogg_page_granulepos(&og);
+			  if (packets>=3 && m_setup && gp>=0 && (m_skip || m_resync)) PageDone((int)gp);
 		  }
     }
 
+    // ready for a new stream. the codec setup is kept, and reused if the next stream has the same headers.
     void Reset()
     {
       m_samples_used=0;
+      m_ring.Clear();
+      m_resync_ring.Clear();
 
-			vorbis_block_clear(&vb);
-			vorbis_dsp_clear(&vd);
-			vorbis_comment_clear(&vc);
-			vorbis_info_clear(&vi);
-
-			ogg_stream_clear(&os);
+      ogg_sync_reset(&oy);
+      if (m_stream_active) ogg_stream_clear(&os);
+      m_stream_active=false;
 			packets=0;
+      m_skip=m_resync=false;
+      m_skipped=0;
+      m_pos=0;
     }
 
   private:
 
+    // skipping or resyncing, at the end of a page that ends at frame gp
+    void PageDone(int gp)
+    {
+      if (m_skip)
+      {
+        if (gp > m_pos) m_skipped+=gp-m_pos;
+        m_pos=gp;
+        return;
+      }
+
+      // m_resync_ring has what was decoded since we restarted, which ends at gp. play it from wherever
+      // the skipped frames (real or assumed) have got us to.
+      int from=m_pos-m_skipped, n=m_resync_ring.Available(), start=gp-n;
+      m_pos=gp;
+      if (from >= gp)
+      {
+        // already played past all of it, keep going in silence until the next page
+        m_skipped=gp-from;
+        m_resync_ring.Clear();
+        return;
+      }
+
+      if (from > start)
+      {
+        m_resync_ring.Advance(from-start);
+        n-=from-start;
+      }
+
+      // silence for what couldn't be decoded, then the resynced audio, straight from ring to ring
+      static float zero[4096];
+      float *bufs[VORBISDEC_PLANAR_MAXCH];
+      int nch=m_ring.GetNumChannels(), c;
+      m_ring.Clear();
+      for (c = 0; c < nch; c ++) bufs[c]=zero;
+      int gap=start-from;
+      while (gap > 0)
+      {
+        int l=gap < 4096 ? gap : 4096;
+        m_ring.Write(bufs,l);
+        gap-=l;
+      }
+      while (n > 0)
+      {
+        int l=0;
+        for (c = 0; c < nch; c ++) bufs[c]=m_resync_ring.Peek(c,0,&l);
+        if (l <= 0) break;
+        m_ring.Write(bufs,l);
+        m_resync_ring.Advance(l);
+        n-=l;
+      }
+      m_resync_ring.Clear();
+      m_skipped=0;
+      m_resync=false;
+    }
+
+    void ClearSetup()
+    {
+      if (m_setup)
+      {
+        vorbis_block_clear(&vb);
+        vorbis_dsp_clear(&vd);
+      }
+      vorbis_comment_clear(&vc);
+      vorbis_info_clear(&vi);
+      m_setup=false;
+      m_hdr.Resize(0);
+    }
+
+    void SetupFromHeaders()
+    {
+      int len=m_newhdr.Available();
+      if (m_setup && len == m_hdr.GetSize() && !memcmp(m_hdr.Get(),m_newhdr.Get(),len))
+      {
+        vorbis_synthesis_restart(&vd);
+        PreparePlanar(); // in case planar output was switched on since
+        return;
+      }
+
+      ClearSetup();
+      vorbis_info_init(&vi);
+      vorbis_comment_init(&vc);
+
+      unsigned char *p=(unsigned char *)m_newhdr.Get();
+      int n;
+      for (n = 0; n < 3; n ++)
+      {
+        ogg_packet hp;
+        memset(&hp,0,sizeof(hp));
+        int l;
+        memcpy(&l,p,sizeof(l));
+        hp.bytes=l;
+        hp.packet=p+sizeof(l);
+        hp.b_o_s=!n;
+        hp.packetno=n;
+        p+=sizeof(l)+l;
+        if (vorbis_synthesis_headerin(&vi,&vc,&hp)<0)
+        {
+          ClearSetup();
+          return;
+        }
+      }
+      vorbis_synthesis_init(&vd,&vi);
+      vorbis_block_init(&vd,&vb);
+      m_setup=true;
+      m_hdr.Resize(len);
+      memcpy(m_hdr.Get(),m_newhdr.Get(),len);
+      PreparePlanar();
+    }
+
+    // allocates everything planar decoding and resyncing use, so it's done with the headers (which
+    // the caller decodes before it starts playing) rather than when skip goes off mid-stream
+    void PreparePlanar()
+    {
+      if (!m_planar) return;
+      int nch=vi.channels < 1 ? 1 : vi.channels > VORBISDEC_PLANAR_MAXCH ? VORBISDEC_PLANAR_MAXCH : vi.channels;
+      if (m_ring.GetNumChannels() != nch || m_ring.GetCapacity() < VORBISDEC_PLANAR_FRAMES)
+        m_ring.Init(nch,VORBISDEC_PLANAR_FRAMES);
+      if (m_resync_ring.GetNumChannels() != nch || m_resync_ring.GetCapacity() < VORBISDEC_PLANAR_FRAMES)
+        m_resync_ring.Init(nch,VORBISDEC_PLANAR_FRAMES);
+    }
 
     int m_err;
     int packets;
+    bool m_planar;
+    bool m_setup; // vi/vc/vd/vb are set up from the headers in m_hdr
+    bool m_stream_active;
+    bool m_skip, m_resync;
+    int m_skipped;
+    int m_pos; // frame position of the end of what's been decoded or skipped
+    WDL_PlanarRingBuf m_resync_ring; // decoded after skipping, not yet placed
+    WDL_HeapBuf m_hdr;
+    WDL_Queue m_newhdr; // this stream's headers so far, each prefixed with its length
 
     ogg_sync_state   oy; /* sync and verify incoming physical bitstream */
     ogg_stream_state os; /* take physical pages, weld into a logical
@@ -47,6 +47,7 @@ class audioStreamer
 		virtual ~audioStreamer() { }
 
     virtual const char *GetChannelName(int idx)=0;
+    virtual int IsRunning() { return 1; } // 0 once the device has gone away under us (callbacks have stopped)
 
 		int m_srate, m_innch, m_outnch, m_bps;
 };
@@ -57,6 +58,9 @@ typedef void (*SPLPROC)(float **inbuf, int innch, float **outbuf, int outnch, in
 audioStreamer *create_audioStreamer_PortAudio(const char *hostAPI,
     const char *inputDevice, const char *outputDevice, SPLPROC proc);
 
+// no hardware: input from a .wav file or generator, optional .wav output (see audiostream_null.cpp)
+audioStreamer *create_audioStreamer_Null(char *cfg, SPLPROC proc);
+
 #ifdef _WIN32
 audioStreamer *create_audioStreamer_KS(int srate, int bps, int *nbufs, int *bufsize, SPLPROC proc);
 
@@ -69,6 +73,9 @@ audioStreamer *create_audioStreamer_DS(int srate, int bps, GUID devs[2], int *nb
 audioStreamer *create_audioStreamer_CoreAudio(char **dev, int srate, int nch, int bps, SPLPROC proc);
 #else
 audioStreamer *create_audioStreamer_ALSA(char *cfg, SPLPROC proc);
+
+// callback driven, on JACK's own thread (audiostream_jack.cpp, needs libjack)
+audioStreamer *create_audioStreamer_JACK(char *cfg, SPLPROC proc);
 #endif
 
 #endif
@@ -33,6 +33,16 @@
       bsize  - block size (bytes) i.e. 2048
       nblock - number of blocks i.e. 16
 
+    with "mmap 1", capture and playback run from one thread, mmap'ed and linked, in
+    float or 32 bit when the hardware has it (bps and bsize don't apply). then:
+      period - frames per period i.e. 128
+      nblock - periods in the buffer, default 2
+      nch    - channels, any number the device has
+      rt     - SCHED_FIFO priority for the audio thread, 0 (default) for none
+      mlock  - 1 to lock the process in memory
+    xruns restart both streams together, and the count and measured round trip
+    latency are printed to stderr.
+
 
   (everything else in this file is used internally)
 
@@ -46,6 +56,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include <alsa/asoundlib.h>
 #include <sys/ioctl.h>
@@ -367,6 +379,353 @@ void audioStreamer_asiosim::tp()
   }
 }
 
+
+
+
+//============== mmap duplex
+//
+// one thread, one period at a time: wait for capture, convert straight out of the mmap'ed
+// buffer, call the SPLPROC, convert straight into playback's. the two PCMs are linked so
+// they start (and stop) together and stay a fixed distance apart.
+class audioStreamer_ALSA_mmap : public audioStreamer
+{
+  public:
+    audioStreamer_ALSA_mmap(SPLPROC proc);
+    ~audioStreamer_ALSA_mmap();
+
+    int Open(char *indev, char *outdev, int srate, int nch, int period, int nperiods, int rtprio, int domlock);
+
+    const char *GetChannelName(int idx)
+    {
+      if (idx < 0 || idx >= m_innch) return NULL;
+      sprintf(m_chnames[idx],"Channel %d",idx+1);
+      return m_chnames[idx];
+    }
+
+  private:
+    int SetupPCM(snd_pcm_t *pcm, int is_write, int srate, int nch, int period, int nperiods, snd_pcm_format_t *fmt);
+    int Start(); // prepares, primes playback with silence and starts both
+    int Transfer(snd_pcm_t *pcm, snd_pcm_format_t fmt, int is_write, float **bufs, int frames);
+
+    void tp();
+    static void *threadProc(void *p)
+    {
+      ((audioStreamer_ALSA_mmap *)p)->tp();
+      return 0;
+    }
+
+    SPLPROC m_splproc;
+    snd_pcm_t *m_cap, *m_play;
+    snd_pcm_format_t m_capfmt, m_playfmt;
+    int m_period, m_nperiods, m_linked;
+    float *m_procbuf;
+    float *m_inptrs[32], *m_outptrs[32];
+    char m_chnames[32][16]; // per channel, callers hold on to more than one
+
+    pthread_t hThread;
+    int m_hasthread;
+    volatile int m_done;
+
+    int m_xruns;
+    double m_latsum; // frames, over m_latcnt periods
+    int m_latcnt;
+};
+
+audioStreamer_ALSA_mmap::audioStreamer_ALSA_mmap(SPLPROC proc) : m_splproc(proc), m_cap(0), m_play(0),
+  m_capfmt(SND_PCM_FORMAT_UNKNOWN), m_playfmt(SND_PCM_FORMAT_UNKNOWN), m_period(0), m_nperiods(0), m_linked(0),
+  m_procbuf(0), m_hasthread(0), m_done(0), m_xruns(0), m_latsum(0.0), m_latcnt(0)
+{
+}
+
+audioStreamer_ALSA_mmap::~audioStreamer_ALSA_mmap()
+{
+  m_done=1;
+  if (m_hasthread) pthread_join(hThread,NULL);
+
+  if (m_latcnt) fprintf(stderr,"ALSA: %d xruns, round trip %.1fms (%d frames)\n",
+                       m_xruns,m_latsum/m_latcnt*1000.0/m_srate,(int)(m_latsum/m_latcnt+0.5));
+
+  if (m_linked) snd_pcm_unlink(m_cap);
+  if (m_cap) { snd_pcm_drop(m_cap); snd_pcm_close(m_cap); }
+  if (m_play) { snd_pcm_drop(m_play); snd_pcm_close(m_play); }
+  free(m_procbuf);
+}
+
+int audioStreamer_ALSA_mmap::SetupPCM(snd_pcm_t *pcm, int is_write, int srate, int nch, int period, int nperiods, snd_pcm_format_t *fmt)
+{
+  const char *what=is_write?"playback":"capture";
+  snd_pcm_hw_params_t *hwparams;
+  snd_pcm_hw_params_alloca(&hwparams);
+  if (snd_pcm_hw_params_any(pcm,hwparams) < 0)
+  {
+    fprintf(stderr,"Can not configure %s device.\n",what);
+    return -1;
+  }
+  if (snd_pcm_hw_params_set_access(pcm,hwparams,SND_PCM_ACCESS_MMAP_NONINTERLEAVED) < 0 &&
+      snd_pcm_hw_params_set_access(pcm,hwparams,SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0)
+  {
+    fprintf(stderr,"Error setting mmap access on %s device (try without mmap).\n",what);
+    return -1;
+  }
+
+  // the best the hardware does natively, so there's nothing lost (or converted by plug layers)
+  static const snd_pcm_format_t fmts[]={ SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S16_LE };
+  int x;
+  for (x = 0; x < (int)(sizeof(fmts)/sizeof(fmts[0])); x ++)
+    if (!snd_pcm_hw_params_set_format(pcm,hwparams,fmts[x])) break;
+  if (x == (int)(sizeof(fmts)/sizeof(fmts[0])))
+  {
+    fprintf(stderr,"No usable sample format on %s device.\n",what);
+    return -1;
+  }
+  *fmt=fmts[x];
+
+  unsigned int rate=srate;
+  if (snd_pcm_hw_params_set_rate_near(pcm,hwparams,&rate,0) < 0 || (int)rate != srate)
+  {
+    fprintf(stderr,"The rate %d Hz is not supported by the %s device.\n",srate,what);
+    return -1;
+  }
+  if (snd_pcm_hw_params_set_channels(pcm,hwparams,nch) < 0)
+  {
+    fprintf(stderr,"Error setting %d channels on %s device.\n",nch,what);
+    return -1;
+  }
+  snd_pcm_uframes_t ps=period;
+  if (snd_pcm_hw_params_set_period_size(pcm,hwparams,ps,0) < 0)
+  {
+    fprintf(stderr,"Error setting period of %d frames on %s device.\n",period,what);
+    return -1;
+  }
+  if (snd_pcm_hw_params_set_periods(pcm,hwparams,nperiods,0) < 0)
+  {
+    fprintf(stderr,"Error setting %d periods on %s device.\n",nperiods,what);
+    return -1;
+  }
+  if (snd_pcm_hw_params(pcm,hwparams) < 0)
+  {
+    fprintf(stderr,"Error setting HW params on %s device.\n",what);
+    return -1;
+  }
+
+  // wake up once per period, start/stop by hand
+  snd_pcm_sw_params_t *swparams;
+  snd_pcm_sw_params_alloca(&swparams);
+  snd_pcm_sw_params_current(pcm,swparams);
+  snd_pcm_sw_params_set_avail_min(pcm,swparams,period);
+  snd_pcm_sw_params_set_start_threshold(pcm,swparams,0x7fffffff);
+  if (snd_pcm_sw_params(pcm,swparams) < 0)
+  {
+    fprintf(stderr,"Error setting SW params on %s device.\n",what);
+    return -1;
+  }
+  return 0;
+}
+
+int audioStreamer_ALSA_mmap::Open(char *indev, char *outdev, int srate, int nch, int period, int nperiods, int rtprio, int domlock)
+{
+  if (nch < 1) nch=1;
+  else if (nch > 32) nch=32;
+  m_srate=srate;
+  m_innch=m_outnch=nch;
+  m_period=period;
+  m_nperiods=nperiods;
+
+  if (snd_pcm_open(&m_cap,indev,SND_PCM_STREAM_CAPTURE,0) < 0)
+  {
+    m_cap=0;
+    fprintf(stderr,"Error opening PCM device %s\n",indev);
+    return -1;
+  }
+  if (snd_pcm_open(&m_play,outdev,SND_PCM_STREAM_PLAYBACK,0) < 0)
+  {
+    m_play=0;
+    fprintf(stderr,"Error opening PCM device %s\n",outdev);
+    return -1;
+  }
+  if (SetupPCM(m_cap,0,srate,nch,period,nperiods,&m_capfmt) ||
+      SetupPCM(m_play,1,srate,nch,period,nperiods,&m_playfmt)) return -1;
+
+  m_linked=!snd_pcm_link(m_cap,m_play);
+  if (!m_linked) fprintf(stderr,"Warning: couldn't link capture and playback, starting them separately.\n");
+
+  m_bps=snd_pcm_format_physical_width(m_capfmt);
+
+  m_procbuf=(float *)malloc(sizeof(float)*period*nch*2);
+  int c;
+  for (c = 0; c < nch; c ++)
+  {
+    m_inptrs[c]=m_procbuf+period*c;
+    m_outptrs[c]=m_procbuf+period*(nch+c);
+  }
+
+  if (domlock && mlockall(MCL_CURRENT|MCL_FUTURE))
+    fprintf(stderr,"Warning: mlockall failed (%s), memory may get paged out.\n",strerror(errno));
+
+  if (Start()) return -1;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (rtprio > 0)
+  {
+    struct sched_param sp;
+    memset(&sp,0,sizeof(sp));
+    sp.sched_priority=rtprio;
+    pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr,SCHED_FIFO);
+    pthread_attr_setschedparam(&attr,&sp);
+  }
+  int err=pthread_create(&hThread,&attr,threadProc,(void *)this);
+  if (err && rtprio > 0)
+  {
+    fprintf(stderr,"Warning: can't run SCHED_FIFO at priority %d (%s), using normal scheduling.\n",rtprio,strerror(err));
+    pthread_attr_destroy(&attr);
+    pthread_attr_init(&attr);
+    err=pthread_create(&hThread,&attr,threadProc,(void *)this);
+  }
+  pthread_attr_destroy(&attr);
+  if (err) return -1;
+  m_hasthread=1;
+
+  fprintf(stderr,"ALSA mmap duplex: %d frames x %d periods, %s in, %s out, buffering %.1fms\n",
+    period,nperiods,snd_pcm_format_name(m_capfmt),snd_pcm_format_name(m_playfmt),
+    period*(nperiods+1)*1000.0/srate);
+  return 0;
+}
+
+int audioStreamer_ALSA_mmap::Start()
+{
+  if (m_linked) snd_pcm_drop(m_cap); // drops both
+  else
+  {
+    snd_pcm_drop(m_cap);
+    snd_pcm_drop(m_play);
+  }
+  if (snd_pcm_prepare(m_cap) < 0 || (!m_linked && snd_pcm_prepare(m_play) < 0)) return -1;
+
+  // playback runs nperiods-1 periods ahead of capture, leaving one for us to work in
+  int c;
+  memset(m_outptrs[0],0,sizeof(float)*m_period*m_outnch);
+  for (c = 0; c < m_nperiods-1; c ++)
+    if (Transfer(m_play,m_playfmt,1,m_outptrs,m_period) < 0) return -1;
+
+  if (m_linked) return snd_pcm_start(m_cap) < 0 ? -1 : 0;
+  if (snd_pcm_start(m_play) < 0) return -1;
+  return snd_pcm_start(m_cap) < 0 ? -1 : 0;
+}
+
+// copies frames between bufs and the mmap area, converting. returns <0 on xrun
+int audioStreamer_ALSA_mmap::Transfer(snd_pcm_t *pcm, snd_pcm_format_t fmt, int is_write, float **bufs, int frames)
+{
+  int done=0;
+  while (done < frames)
+  {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offs, n=frames-done;
+    int err=snd_pcm_mmap_begin(pcm,&areas,&offs,&n);
+    if (err < 0) return err;
+    if (!n) return -EPIPE;
+
+    int c;
+    int nch=is_write?m_outnch:m_innch;
+    for (c = 0; c < nch; c ++)
+    {
+      char *p=(char *)areas[c].addr + (areas[c].first + offs*areas[c].step)/8;
+      int step=areas[c].step/8;
+      float *f=bufs[c]+done;
+      snd_pcm_uframes_t i;
+      switch (fmt)
+      {
+        case SND_PCM_FORMAT_FLOAT_LE:
+          if (is_write) for (i = 0; i < n; i ++, p+=step) *(float *)p=f[i];
+          else for (i = 0; i < n; i ++, p+=step) f[i]=*(float *)p;
+        break;
+        case SND_PCM_FORMAT_S32_LE:
+          if (is_write) for (i = 0; i < n; i ++, p+=step)
+          {
+            double v=f[i]*2147483648.0;
+            *(int *)p=v >= 2147483647.0 ? 2147483647 : v <= -2147483648.0 ? (-2147483647-1) : (int)v;
+          }
+          else for (i = 0; i < n; i ++, p+=step) f[i]=(float)(*(int *)p * (1.0/2147483648.0));
+        break;
+        case SND_PCM_FORMAT_S24_LE: // low 24 bits of 32
+          if (is_write) for (i = 0; i < n; i ++, p+=step)
+          {
+            float v=f[i]*8388608.0f;
+            *(int *)p=v >= 8388607.0f ? 8388607 : v <= -8388608.0f ? -8388608 : (int)v;
+          }
+          else for (i = 0; i < n; i ++, p+=step) f[i]=(float)(((*(int *)p)<<8)>>8) * (1.0f/8388608.0f);
+        break;
+        default: // S16_LE
+          if (is_write) for (i = 0; i < n; i ++, p+=step)
+          {
+            float v=f[i]*32768.0f;
+            *(short *)p=v >= 32767.0f ? 32767 : v <= -32768.0f ? -32768 : (short)v;
+          }
+          else for (i = 0; i < n; i ++, p+=step) f[i]=(float)*(short *)p * (1.0f/32768.0f);
+        break;
+      }
+    }
+
+    snd_pcm_sframes_t r=snd_pcm_mmap_commit(pcm,offs,n);
+    if (r < 0) return (int)r;
+    if ((snd_pcm_uframes_t)r != n) return -EPIPE;
+    done+=n;
+  }
+  return done;
+}
+
+void audioStreamer_ALSA_mmap::tp()
+{
+  while (!m_done)
+  {
+    int err=snd_pcm_wait(m_cap,100);
+    snd_pcm_sframes_t avail=snd_pcm_avail_update(m_cap);
+    if (err < 0 || avail < 0)
+    {
+      m_xruns++;
+      audiostream_onover();
+      if (Start() < 0)
+      {
+        struct timespec s={0,10*1000*1000}; // device gone, don't spin
+        nanosleep(&s,NULL);
+      }
+      continue;
+    }
+    if (avail < m_period) continue;
+
+    snd_pcm_sframes_t capdel=0;
+    snd_pcm_delay(m_cap,&capdel);
+
+    if (Transfer(m_cap,m_capfmt,0,m_inptrs,m_period) < 0)
+    {
+      m_xruns++;
+      audiostream_onover();
+      Start();
+      continue;
+    }
+
+    if (m_splproc) m_splproc(m_inptrs,m_innch,m_outptrs,m_outnch,m_period,m_srate);
+    else memset(m_outptrs[0],0,sizeof(float)*m_period*m_outnch);
+
+    if (snd_pcm_avail_update(m_play) < m_period || Transfer(m_play,m_playfmt,1,m_outptrs,m_period) < 0)
+    {
+      m_xruns++;
+      audiostream_onunder();
+      Start();
+      continue;
+    }
+
+    // what was just captured comes back out after everything queued ahead of it
+    snd_pcm_sframes_t playdel=0;
+    if (!snd_pcm_delay(m_play,&playdel))
+    {
+      m_latsum+=capdel+playdel; // reported when we close, not from here
+      m_latcnt++;
+    }
+  }
+}
+
 audioStreamer *create_audioStreamer_ALSA(char *cfg, SPLPROC proc)
 {
   // todo: parse from cfg
@@ -376,7 +735,8 @@ audioStreamer *create_audioStreamer_ALSA(char *cfg, SPLPROC proc)
   int nch=2;
   int bps=16;
   int fs=1024;
-  int nf=16;
+  int nf=-1;
+  int usemmap=0, period=128, rtprio=0, domlock=0;
 
   while (cfg && *cfg)
   {
@@ -398,6 +758,10 @@ audioStreamer *create_audioStreamer_ALSA(char *cfg, SPLPROC proc)
     else if (!strcasecmp(cfg,"bps")) bps=atoi(p);
     else if (!strcasecmp(cfg,"bsize")) fs=atoi(p);
     else if (!strcasecmp(cfg,"nblock")) nf=atoi(p);
+    else if (!strcasecmp(cfg,"mmap")) usemmap=atoi(p);
+    else if (!strcasecmp(cfg,"period")) period=atoi(p);
+    else if (!strcasecmp(cfg,"rt")) rtprio=atoi(p);
+    else if (!strcasecmp(cfg,"mlock")) domlock=atoi(p);
     else 
     {
 	    printf("unknown config item '%s'\n",cfg);
@@ -411,6 +775,18 @@ audioStreamer *create_audioStreamer_ALSA(char *cfg, SPLPROC proc)
     cfg=p;
   }
 
+  if (usemmap)
+  {
+    audioStreamer_ALSA_mmap *s=new audioStreamer_ALSA_mmap(proc);
+    if (s->Open(indev,outdev,srate,nch,period,nf > 1 ? nf : 2,rtprio,domlock))
+    {
+      delete s;
+      return 0;
+    }
+    return s;
+  }
+  if (nf < 1) nf=16;
+
   audioStreamer_ALSA *in=new audioStreamer_ALSA();
   if (in->Open(indev,0,srate,nch,bps,fs,nf,-1))
   {
@@ -0,0 +1,259 @@
+/*
+    Copyright (C) 2005 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  This file implements an audioStreamer for JACK. The SPLPROC is called
+  straight from JACK's process callback, once per period, with the port
+  buffers themselves (JACK audio is already 32 bit float), so there's no
+  extra thread or copying in between.
+
+  The config string is "key value" pairs, like the ALSA one:
+
+    name <client name>     JACK client name (default wahjam)
+    server <name>          JACK server to use (default the default one)
+    in <n>                 input ports (default 2)
+    out <n>                output ports (default 2)
+    connect <0|1>          connect the ports to the physical ones, in order (default 1)
+    autostart <0|1>        start a JACK server if none is running (default 0)
+
+  The samplerate and block size are whatever the server runs at. To try it
+  without sound hardware, run a server with the dummy driver, e.g.:
+
+    jackd --no-realtime -n test -d dummy -r 48000 -p 256
+
+  and use "server test".
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <jack/jack.h>
+
+#include "audiostream.h"
+
+#define JACK_MAX_PORTS 64
+
+
+class audioStreamer_JACK : public audioStreamer
+{
+  public:
+    audioStreamer_JACK(SPLPROC proc);
+    ~audioStreamer_JACK();
+
+    int Open(const char *name, const char *server, int innch, int outnch, int autoconnect, int autostart);
+
+    const char *GetChannelName(int idx);
+    int IsRunning() { return !m_shutdown; }
+
+  private:
+    static int ProcessCallback(jack_nframes_t nframes, void *arg);
+    static int SampleRateCallback(jack_nframes_t nframes, void *arg);
+    static void ShutdownCallback(void *arg);
+
+    void ConnectPhysical();
+
+    SPLPROC m_proc;
+    jack_client_t *m_client;
+    int m_active;
+    volatile int m_shutdown; // the server went away, or kicked us out
+
+    jack_port_t *m_inports[JACK_MAX_PORTS], *m_outports[JACK_MAX_PORTS];
+    float *m_inbufs[JACK_MAX_PORTS], *m_outbufs[JACK_MAX_PORTS]; // only touched by the process callback
+};
+
+
+audioStreamer_JACK::audioStreamer_JACK(SPLPROC proc) : m_proc(proc), m_client(0), m_active(0), m_shutdown(0)
+{
+  m_innch=m_outnch=0;
+  m_bps=32;
+  memset(m_inports,0,sizeof(m_inports));
+  memset(m_outports,0,sizeof(m_outports));
+  memset(m_inbufs,0,sizeof(m_inbufs));
+  memset(m_outbufs,0,sizeof(m_outbufs));
+}
+
+audioStreamer_JACK::~audioStreamer_JACK()
+{
+  if (m_client)
+  {
+    if (m_active && !m_shutdown) jack_deactivate(m_client);
+    jack_client_close(m_client);
+    m_client=0;
+  }
+}
+
+int audioStreamer_JACK::Open(const char *name, const char *server, int innch, int outnch, int autoconnect, int autostart)
+{
+  if (innch < 0) innch=0;
+  else if (innch > JACK_MAX_PORTS) innch=JACK_MAX_PORTS;
+  if (outnch < 0) outnch=0;
+  else if (outnch > JACK_MAX_PORTS) outnch=JACK_MAX_PORTS;
+
+  int opts=autostart ? JackNullOption : JackNoStartServer;
+  jack_status_t status;
+  if (server && *server) m_client=jack_client_open(name,(jack_options_t)(opts|JackServerName),&status,server);
+  else m_client=jack_client_open(name,(jack_options_t)opts,&status);
+  if (!m_client)
+  {
+    printf("error connecting to JACK server (status 0x%x)\n",(int)status);
+    return -1;
+  }
+
+  m_srate=jack_get_sample_rate(m_client);
+
+  int x;
+  for (x = 0; x < innch; x ++)
+  {
+    char buf[32];
+    sprintf(buf,"in_%d",x+1);
+    if (!(m_inports[x]=jack_port_register(m_client,buf,JACK_DEFAULT_AUDIO_TYPE,JackPortIsInput,0)))
+    {
+      printf("error registering JACK port %s\n",buf);
+      return -1;
+    }
+  }
+  for (x = 0; x < outnch; x ++)
+  {
+    char buf[32];
+    sprintf(buf,"out_%d",x+1);
+    if (!(m_outports[x]=jack_port_register(m_client,buf,JACK_DEFAULT_AUDIO_TYPE,JackPortIsOutput,0)))
+    {
+      printf("error registering JACK port %s\n",buf);
+      return -1;
+    }
+  }
+  m_innch=innch;
+  m_outnch=outnch;
+
+  jack_set_process_callback(m_client,ProcessCallback,this);
+  jack_set_sample_rate_callback(m_client,SampleRateCallback,this);
+  jack_on_shutdown(m_client,ShutdownCallback,this);
+
+  if (jack_activate(m_client))
+  {
+    printf("error activating JACK client\n");
+    return -1;
+  }
+  m_active=1;
+
+  if (autoconnect) ConnectPhysical();
+  return 0;
+}
+
+void audioStreamer_JACK::ConnectPhysical()
+{
+  // physical capture ports are outputs as far as JACK is concerned, and playback ports inputs
+  const char **ports=jack_get_ports(m_client,NULL,JACK_DEFAULT_AUDIO_TYPE,JackPortIsPhysical|JackPortIsOutput);
+  int x;
+  if (ports)
+  {
+    for (x = 0; x < m_innch && ports[x]; x ++)
+      jack_connect(m_client,ports[x],jack_port_name(m_inports[x]));
+    jack_free(ports);
+  }
+
+  ports=jack_get_ports(m_client,NULL,JACK_DEFAULT_AUDIO_TYPE,JackPortIsPhysical|JackPortIsInput);
+  if (ports)
+  {
+    for (x = 0; x < m_outnch && ports[x]; x ++)
+      jack_connect(m_client,jack_port_name(m_outports[x]),ports[x]);
+    jack_free(ports);
+  }
+}
+
+const char *audioStreamer_JACK::GetChannelName(int idx)
+{
+  if (idx < 0 || idx >= m_innch) return NULL;
+  return jack_port_short_name(m_inports[idx]);
+}
+
+int audioStreamer_JACK::ProcessCallback(jack_nframes_t nframes, void *arg)
+{
+  audioStreamer_JACK *_this=(audioStreamer_JACK *)arg;
+  int x;
+  for (x = 0; x < _this->m_innch; x ++)
+    _this->m_inbufs[x]=(float *)jack_port_get_buffer(_this->m_inports[x],nframes);
+  for (x = 0; x < _this->m_outnch; x ++)
+    _this->m_outbufs[x]=(float *)jack_port_get_buffer(_this->m_outports[x],nframes);
+
+  _this->m_proc(_this->m_inbufs,_this->m_innch,_this->m_outbufs,_this->m_outnch,nframes,_this->m_srate);
+  return 0;
+}
+
+int audioStreamer_JACK::SampleRateCallback(jack_nframes_t nframes, void *arg)
+{
+  ((audioStreamer_JACK *)arg)->m_srate=nframes; // NJClient follows along, as it would with a reopened device
+  return 0;
+}
+
+void audioStreamer_JACK::ShutdownCallback(void *arg)
+{
+  audioStreamer_JACK *_this=(audioStreamer_JACK *)arg;
+  _this->m_shutdown=1; // may be on the process thread and must be signal safe, so the host reports it
+}
+
+
+audioStreamer *create_audioStreamer_JACK(char *cfg, SPLPROC proc)
+{
+  char *name="wahjam";
+  char *server=NULL;
+  int innch=2, outnch=2, autoconnect=1, autostart=0;
+
+  while (cfg && *cfg)
+  {
+    char *p=cfg;
+    while (*p && *p != ' ') p++;
+    if (*p) *p++=0;
+    while (*p == ' ') p++;
+    if (!*p)
+    {
+      printf("config item '%s' has no parameter\n",cfg);
+      return 0;
+    }
+
+    if (!strcasecmp(cfg,"name")) name=p;
+    else if (!strcasecmp(cfg,"server")) server=p;
+    else if (!strcasecmp(cfg,"in")) innch=atoi(p);
+    else if (!strcasecmp(cfg,"out")) outnch=atoi(p);
+    else if (!strcasecmp(cfg,"connect")) autoconnect=atoi(p);
+    else if (!strcasecmp(cfg,"autostart")) autostart=atoi(p);
+    else
+    {
+      printf("unknown config item '%s'\n",cfg);
+      return 0;
+    }
+
+    while (*p && *p != ' ') p++;
+    if (!*p) break;
+    *p++=0;
+    while (*p == ' ') p++;
+    cfg=p;
+  }
+
+  audioStreamer_JACK *s=new audioStreamer_JACK(proc);
+  if (s->Open(name,server,innch,outnch,autoconnect,autostart))
+  {
+    delete s;
+    return 0;
+  }
+  return s;
+}
@@ -0,0 +1,412 @@
+/*
+    Copyright (C) 2005 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  This file implements a "null" audioStreamer, which needs no sound hardware.
+  A thread calls the SPLPROC with input taken from a .wav file or a generator,
+  and can write the output to a .wav file. It either runs as fast as it can
+  or paces itself to real time.
+
+  The config string is "key value" pairs, like the ALSA one:
+
+    in <file.wav|sine|sine:freq|noise|silence>   input source (default sine:440)
+    out <file.wav>                                output file, every channel (default none)
+    srate <n>                                     samplerate (default 48000)
+    nch <n>                                       input and output channels (default 2)
+    bsize <n>                                     frames per callback (default 256)
+    realtime <0|1>                                pace to the wall clock (default 1)
+    loop <0|1>                                    loop the input file (default 1)
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#define strcasecmp stricmp
+#define strncasecmp strnicmp
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "../WDL/pcmfmtcvt.h"
+#include "../WDL/wavwrite.h"
+#include "../WDL/heapbuf.h"
+
+#include "audiostream.h"
+
+
+static double null_now() // seconds, monotonic
+{
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER c;
+  if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&c);
+  return (double)c.QuadPart/(double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*0.000000001;
+#endif
+}
+
+static void null_sleep(double sec)
+{
+  if (sec <= 0.0) return;
+#ifdef _WIN32
+  Sleep((DWORD)(sec*1000.0));
+#else
+  struct timespec s;
+  s.tv_sec=(time_t)sec;
+  s.tv_nsec=(long)((sec-s.tv_sec)*1000000000.0);
+  nanosleep(&s,NULL);
+#endif
+}
+
+
+// minimal .wav reader: PCM 16/24/32 bit or 32 bit float
+class nullWaveReader
+{
+  public:
+    nullWaveReader() : m_fp(0), m_nch(0), m_srate(0), m_bps(0), m_isfloat(0), m_datastart(0), m_datalen(0), m_left(0) { }
+    ~nullWaveReader() { if (m_fp) fclose(m_fp); }
+
+    int Open(const char *fn)
+    {
+      m_fp=fopen(fn,"rb");
+      if (!m_fp) return 0;
+
+      unsigned char hdr[12];
+      if (fread(hdr,1,12,m_fp) != 12 || memcmp(hdr,"RIFF",4) || memcmp(hdr+8,"WAVE",4)) return 0;
+
+      while (!m_datastart)
+      {
+        unsigned char ck[8];
+        if (fread(ck,1,8,m_fp) != 8) return 0;
+        int len=ck[4] | (ck[5]<<8) | (ck[6]<<16) | (ck[7]<<24);
+        if (!memcmp(ck,"fmt ",4) && len >= 16)
+        {
+          unsigned char f[16];
+          if (fread(f,1,16,m_fp) != 16) return 0;
+          int fmt=f[0] | (f[1]<<8);
+          m_nch=f[2] | (f[3]<<8);
+          m_srate=f[4] | (f[5]<<8) | (f[6]<<16) | (f[7]<<24);
+          m_bps=f[14] | (f[15]<<8);
+          m_isfloat = fmt == 3;
+          if ((fmt != 1 && fmt != 3 && fmt != 0xfffe) || m_nch < 1 || (m_isfloat && m_bps != 32) ||
+              (m_bps != 16 && m_bps != 24 && m_bps != 32)) return 0;
+          fseek(m_fp,len-16+(len&1),SEEK_CUR);
+        }
+        else if (!memcmp(ck,"data",4) && m_nch)
+        {
+          m_datastart=ftell(m_fp);
+          m_datalen=m_left=len;
+        }
+        else fseek(m_fp,len+(len&1),SEEK_CUR);
+      }
+      return 1;
+    }
+
+    // reads up to frames interleaved frames, returns frames read
+    int Read(float *dest, int frames, int loop)
+    {
+      int blockalign=m_nch*(m_bps/8);
+      int done=0;
+      while (done < frames)
+      {
+        if (m_left < blockalign)
+        {
+          if (!loop || m_datalen < blockalign) break;
+          fseek(m_fp,m_datastart,SEEK_SET);
+          m_left=m_datalen;
+        }
+        int n=frames-done;
+        if (n > m_left/blockalign) n=m_left/blockalign;
+        if (n > 4096) n=4096;
+        char *p=(char *)m_raw.Resize(n*blockalign);
+        n=fread(p,1,n*blockalign,m_fp)/blockalign;
+        if (n < 1) { m_left=0; continue; }
+        m_left-=n*blockalign;
+
+        if (m_isfloat) memcpy(dest+done*m_nch,p,n*m_nch*sizeof(float));
+        else pcmToFloats(p,n*m_nch,m_bps,1,dest+done*m_nch,1);
+        done+=n;
+      }
+      return done;
+    }
+
+    FILE *m_fp;
+    int m_nch, m_srate, m_bps, m_isfloat;
+    int m_datastart, m_datalen, m_left;
+    WDL_HeapBuf m_raw;
+};
+
+
+class audioStreamer_Null : public audioStreamer
+{
+  public:
+    audioStreamer_Null(int srate, int nch, int bsize, int realtime, int loop, int gen, double freq,
+                       nullWaveReader *in, WaveWriter *out, SPLPROC proc)
+    {
+      m_srate=srate;
+      m_innch=m_outnch=nch;
+      m_bps=32;
+      m_bsize=bsize;
+      m_realtime=realtime;
+      m_loop=loop;
+      m_gen=gen;
+      m_freq=freq;
+      m_phase=0.0;
+      m_rng=12345;
+      m_in=in;
+      m_out=out;
+      m_splproc=proc;
+      m_done=0;
+
+      m_procbuf.Resize(bsize*nch*2);
+      m_filebuf.Resize(bsize*(in ? in->m_nch : 1));
+      m_pcmbuf.Resize(bsize*nch*2);
+
+#ifdef _WIN32
+      DWORD id;
+      hThread=CreateThread(NULL,0,threadProc,this,0,&id);
+#else
+      pthread_create(&hThread,NULL,threadProc,(void *)this);
+#endif
+    }
+    ~audioStreamer_Null()
+    {
+      m_done=1;
+#ifdef _WIN32
+      WaitForSingleObject(hThread,INFINITE);
+      CloseHandle(hThread);
+#else
+      pthread_join(hThread,NULL);
+#endif
+      delete m_in;
+      delete m_out;
+    }
+
+    const char *GetChannelName(int idx)
+    {
+      static char buf[32];
+      if (idx < 0 || idx >= m_innch) return NULL;
+      sprintf(buf,"Null %d",idx+1);
+      return buf;
+    }
+
+  private:
+    void tp();
+    void fillInput(float **inptrs);
+#ifdef _WIN32
+    static DWORD WINAPI threadProc(LPVOID p)
+#else
+    static void *threadProc(void *p)
+#endif
+    {
+      audioStreamer_Null *t=(audioStreamer_Null*)p;
+      t->tp();
+      return 0;
+    }
+
+    enum { GEN_SINE=0, GEN_NOISE, GEN_SILENCE };
+
+#ifdef _WIN32
+    HANDLE hThread;
+#else
+    pthread_t hThread;
+#endif
+    volatile int m_done;
+    int m_bsize, m_realtime, m_loop, m_gen;
+    double m_freq, m_phase;
+    unsigned int m_rng;
+
+    nullWaveReader *m_in;
+    WaveWriter *m_out;
+    WDL_TypedBuf<float> m_procbuf, m_filebuf;
+    WDL_HeapBuf m_pcmbuf;
+
+    SPLPROC m_splproc;
+};
+
+void audioStreamer_Null::fillInput(float **inptrs)
+{
+  int x,c;
+  if (m_in)
+  {
+    int fnch=m_in->m_nch;
+    float *fb=m_filebuf.Get();
+    int got=m_in->Read(fb,m_bsize,m_loop);
+    for (c = 0; c < m_innch; c ++)
+    {
+      const float *s=fb+(c%fnch);
+      for (x = 0; x < got; x ++) inptrs[c][x]=s[x*fnch];
+      for (; x < m_bsize; x ++) inptrs[c][x]=0.0f;
+    }
+    return;
+  }
+
+  if (m_gen == GEN_SINE)
+  {
+    double dp=2.0*3.14159265358979323846*m_freq/m_srate;
+    for (x = 0; x < m_bsize; x ++)
+    {
+      inptrs[0][x]=(float)(sin(m_phase)*0.25);
+      m_phase+=dp;
+    }
+    if (m_phase > 1000.0) m_phase=fmod(m_phase,2.0*3.14159265358979323846);
+  }
+  else if (m_gen == GEN_NOISE)
+  {
+    for (x = 0; x < m_bsize; x ++)
+    {
+      m_rng=m_rng*1664525+1013904223;
+      inptrs[0][x]=((int)(m_rng>>8)-0x800000)*(0.25f/0x800000);
+    }
+  }
+  else memset(inptrs[0],0,m_bsize*sizeof(float));
+
+  for (c = 1; c < m_innch; c ++) memcpy(inptrs[c],inptrs[0],m_bsize*sizeof(float));
+}
+
+void audioStreamer_Null::tp()
+{
+  float *inptrs[64], *outptrs[64];
+  int nch=m_innch > 64 ? 64 : m_innch;
+  int c;
+  for (c = 0; c < nch; c ++)
+  {
+    inptrs[c]=m_procbuf.Get()+c*m_bsize;
+    outptrs[c]=m_procbuf.Get()+(nch+c)*m_bsize;
+  }
+
+  double blocklen=(double)m_bsize/m_srate;
+  double next=null_now();
+  while (!m_done)
+  {
+    fillInput(inptrs);
+    for (c = 0; c < nch; c ++) memset(outptrs[c],0,m_bsize*sizeof(float));
+
+    if (m_splproc) m_splproc(inptrs,nch,outptrs,nch,m_bsize,m_srate);
+
+    if (m_out)
+    {
+      for (c = 0; c < nch; c ++)
+        floatsToPcm(outptrs[c],1,m_bsize,(char *)m_pcmbuf.Get()+c*2,16,nch);
+      m_out->WriteRaw(m_pcmbuf.Get(),m_bsize*nch*2);
+    }
+
+    if (m_realtime)
+    {
+      next+=blocklen;
+      double now=null_now();
+      if (next > now) null_sleep(next-now);
+      else if (now-next > blocklen*4) next=now; // fell way behind, don't try to catch up
+    }
+  }
+}
+
+
+audioStreamer *create_audioStreamer_Null(char *cfg, SPLPROC proc)
+{
+  char *infn=NULL, *outfn=NULL;
+  int srate=48000, nch=2, bsize=256, realtime=1, loop=1;
+  int gen=0;
+  double freq=440.0;
+
+  while (cfg && *cfg)
+  {
+    char *p=cfg;
+    while (*p && *p != ' ') p++;
+    if (*p) *p++=0;
+    while (*p == ' ') p++;
+    if (!*p)
+    {
+      printf("config item '%s' has no parameter\n",cfg);
+      return 0;
+    }
+    char *v=p;
+    while (*p && *p != ' ') p++;
+    if (*p) *p++=0;
+    while (*p == ' ') p++;
+
+    if (!strcasecmp(cfg,"in"))
+    {
+      if (!strncasecmp(v,"sine",4))
+      {
+        gen=0;
+        if (v[4] == ':') freq=atof(v+5);
+      }
+      else if (!strcasecmp(v,"noise")) gen=1;
+      else if (!strcasecmp(v,"silence")) gen=2;
+      else infn=v;
+    }
+    else if (!strcasecmp(cfg,"out")) outfn=v;
+    else if (!strcasecmp(cfg,"srate")) srate=atoi(v);
+    else if (!strcasecmp(cfg,"nch")) nch=atoi(v);
+    else if (!strcasecmp(cfg,"bsize")) bsize=atoi(v);
+    else if (!strcasecmp(cfg,"realtime")) realtime=atoi(v);
+    else if (!strcasecmp(cfg,"loop")) loop=atoi(v);
+    else
+    {
+      printf("unknown config item '%s'\n",cfg);
+      return 0;
+    }
+    cfg=p;
+  }
+
+  if (srate < 8000) srate=8000;
+  if (nch < 1) nch=1;
+  else if (nch > 64) nch=64;
+  if (bsize < 16) bsize=16;
+  if (freq <= 0.0) freq=440.0;
+
+  nullWaveReader *in=NULL;
+  if (infn)
+  {
+    in=new nullWaveReader;
+    if (!in->Open(infn))
+    {
+      printf("error opening input '%s' (need PCM or float .wav)\n",infn);
+      delete in;
+      return 0;
+    }
+    if (in->m_srate != srate) printf("warning: '%s' is %dHz, running at %dHz\n",infn,in->m_srate,srate);
+  }
+
+  WaveWriter *out=NULL;
+  if (outfn)
+  {
+    out=new WaveWriter(outfn,16,nch,srate,0);
+    if (!out->Status())
+    {
+      printf("error opening output '%s'\n",outfn);
+      delete out;
+      delete in;
+      return 0;
+    }
+  }
+
+  return new audioStreamer_Null(srate,nch,bsize,realtime,loop,gen,freq,in,out,proc);
+}
@@ -0,0 +1,550 @@
+/*
+    Copyright (C) 2005 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Headless benchmark client. Starts a server in-process, connects a number of
+  peer clients that each broadcast a channel of generated audio, then connects
+  the measured client (with N local channels, subscribed to every peer) to a
+  null audio streamer and times each audio callback.
+
+  At the end it prints the distribution of audio callback CPU time, how many
+  callbacks missed their deadline (took longer than the audio they produced),
+  and how many times remote playback underran. With -master it also records
+  the master mix, then checks the file came out at the engine rate and as
+  long as the audio that went through (exit status 3 if not).
+
+  -latcal skips all of that and checks round trip calibration instead, on a
+  simulated loopback of a known delay (exit status 4 if it's measured wrong,
+  a dead input is trusted, or it waits forever with no audio running).
+
+  The peers are driven from the main thread at real-time rate. With -fast the
+  measured client's streamer runs unpaced, which is good for profiling the
+  mixer, but remote audio then arrives slower than it is consumed.
+
+  Built with RTCHECK=1 (see rtcheck.h), it also reports anything that isn't
+  real-time safe in the measured client's audio callback, and exits with
+  status 2 if there was any. "make RTCHECK=1 check" runs a short session.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../audiostream.h"
+#include "../njclient.h"
+#include "../njcodec.h"
+#include "../../WDL/jnetlib/jnetlib.h"
+#include "../server/usercon.h"
+#include "../rtcheck.h"
+
+
+// permissive login for the in-process server
+class benchUserLookup : public IUserInfoLookup
+{
+public:
+  benchUserLookup(char *name)
+  {
+    username.Set(name);
+    user_valid=1;
+    reqpass=0;
+    privs=PRIV_ALLOWMULTI|PRIV_CHATSEND|PRIV_BPM|PRIV_TOPIC;
+    max_channels=32;
+  }
+  ~benchUserLookup() { }
+  int Run() { return 1; }
+};
+
+static IUserInfoLookup *bench_CreateUserLookup(char *username)
+{
+  return new benchUserLookup(username);
+}
+
+int g_verbose;
+
+void logText(char *s, ...)
+{
+  if (!g_verbose) return;
+  va_list ap;
+  va_start(ap,s);
+  vprintf(s,ap);
+  va_end(ap);
+}
+
+static int license_cb(int user32, char *licensetext) { return 1; }
+
+
+static double now_wall()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*0.000000001;
+}
+
+static double now_threadcpu()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+  return ts.tv_sec + ts.tv_nsec*0.000000001;
+}
+
+
+// measured client callback timing, written only by the audio thread
+NJClient *g_client;
+volatile int g_audio_enable;
+float *g_cpu_us;        // per callback cpu time, preallocated
+int g_cpu_cap;
+volatile int g_ncallbacks;
+int g_deadline_misses;
+double g_audio_seconds;
+int g_blocklen;
+
+void audiostream_onsamples(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate)
+{
+  if (!g_audio_enable)
+  {
+    int x;
+    for (x = 0; x < outnch; x ++) memset(outbuf[x],0,sizeof(float)*len);
+    return;
+  }
+
+  double w0=now_wall(), c0=now_threadcpu();
+  g_client->AudioProc(inbuf,innch,outbuf,outnch,len,srate);
+  double c1=now_threadcpu(), w1=now_wall();
+
+  double budget=(double)len/srate;
+  if (w1-w0 > budget) g_deadline_misses++;
+  g_audio_seconds+=budget;
+  g_blocklen=len;
+
+  int n=g_ncallbacks;
+  if (n < g_cpu_cap)
+  {
+    g_cpu_us[n]=(float)((c1-c0)*1000000.0);
+    g_ncallbacks=n+1;
+  }
+}
+
+
+// reads back a master .wav: its rate must be erate, and its length what the engine produced
+// (give or take the blocks still queued at the end)
+static int check_master(const char *fn, int erate, double seconds)
+{
+  FILE *fp=fopen(fn,"rb");
+  unsigned char hdr[44];
+  int ok=fp && fread(hdr,1,44,fp) == 44 && !memcmp(hdr,"RIFF",4) && !memcmp(hdr+36,"data",4);
+  if (fp) fclose(fp);
+  if (!ok)
+  {
+    printf("master: can't read %s\n",fn);
+    return 0;
+  }
+  int rate=hdr[24] | (hdr[25]<<8) | (hdr[26]<<16) | (hdr[27]<<24);
+  int align=hdr[32] | (hdr[33]<<8);
+  int bytes=hdr[40] | (hdr[41]<<8) | (hdr[42]<<16) | (hdr[43]<<24);
+  double len=align > 0 && rate > 0 ? (double)bytes/align/rate : 0.0;
+  ok=rate == erate && fabs(len-seconds) < 0.1+seconds*0.01;
+  printf("master: %dHz, %.2fs (expected %dHz, %.2fs)%s\n",rate,len,erate,seconds,ok ? "" : "  FAIL");
+  return ok;
+}
+
+// feeds a calibration through AudioProc() directly. output 0 comes back on input 0 delay frames later
+// (delay >= bsize, as on any real device), or not at all if !loop, with a little noise on every input
+static int latcal_run(NJClient *c, int srate, int bsize, int delay, int loop, double *rt)
+{
+  float *ring=(float *)calloc(delay,sizeof(float)); // the last delay frames of output 0
+  float *in[2], *out[2];
+  int x, i;
+  for (x = 0; x < 2; x ++)
+  {
+    in[x]=(float *)calloc(bsize,sizeof(float));
+    out[x]=(float *)calloc(bsize,sizeof(float));
+  }
+
+  int r=c->StartLatencyCalibration() ? -1 : 1, pos=0, n;
+  for (n = 0; r == 1 && n < srate*10; n+=bsize) // takes 4.5 seconds of audio
+  {
+    for (i = 0; i < bsize; i ++)
+    {
+      in[0][i]=(loop ? ring[(pos+i)%delay] : 0.0f) + (float)(rand()/(double)RAND_MAX-0.5)*0.002f;
+      in[1][i]=(float)(rand()/(double)RAND_MAX-0.5)*0.002f;
+    }
+    c->AudioProc(in,2,out,2,bsize,srate);
+    for (i = 0; i < bsize; i ++) ring[(pos+i)%delay]=out[0][i];
+    pos=(pos+bsize)%delay;
+
+    r=c->GetLatencyCalibration(rt);
+  }
+  if (r == 1) c->StopLatencyCalibration();
+
+  for (x = 0; x < 2; x ++) { free(in[x]); free(out[x]); }
+  free(ring);
+  return r;
+}
+
+// -latcal: the round trip over a simulated loopback must come out at the delay, to the frame (the median of
+// clicks that agree), a dead input must be refused rather than trusted, and with no audio running at all
+// GetLatencyCalibration() must give up rather than wait forever
+static int latcal_test(int srate, int bsize, int delay)
+{
+  if (delay < bsize) delay=bsize;
+  NJClient *c=new NJClient;
+  c->config_engine_srate=0; // measure at the device rate
+  int ok=1;
+
+  double rt=0.0;
+  int r=latcal_run(c,srate,bsize,delay,1,&rt);
+  int got=(int)(rt*srate+0.5);
+  printf("latcal: loopback of %d frames measured %s%d frames%s\n",delay,r ? "nothing, " : "",r ? 0 : got,
+         !r && got == delay ? "" : "  FAIL");
+  if (r || got != delay) ok=0;
+
+  r=latcal_run(c,srate,bsize,delay,0,&rt);
+  printf("latcal: no loopback %s%s\n",r ? "refused" : "accepted",r ? "" : "  FAIL");
+  if (!r) ok=0;
+
+  // nothing calls AudioProc() this time
+  double t0=now_wall();
+  r=c->StartLatencyCalibration() ? -1 : 1;
+  while (r == 1 && (r=c->GetLatencyCalibration(&rt)) == 1 && now_wall() < t0+10.0)
+  {
+    struct timespec ts={0,50*1000*1000};
+    nanosleep(&ts,NULL);
+  }
+  printf("latcal: no audio %s after %.1fs%s\n",r == -1 ? "failed" : "still waiting",now_wall()-t0,r == -1 ? "" : "  FAIL");
+  if (r != -1)
+  {
+    c->StopLatencyCalibration();
+    ok=0;
+  }
+
+  delete c;
+  return ok;
+}
+
+static int sortfloat(const void *a, const void *b)
+{
+  float fa=*(const float *)a, fb=*(const float *)b;
+  return fa < fb ? -1 : fa > fb ? 1 : 0;
+}
+
+static void usage()
+{
+  printf("Usage: wjbench [options]\n"
+         "Options:\n"
+         "  -port <n>         port for the in-process server (default 2050)\n"
+         "  -peers <n>        number of remote peers (default 4)\n"
+         "  -channels <n>     local channels on the measured client (default 2)\n"
+         "  -seconds <n>      how long to measure, after everyone is connected (default 30)\n"
+         "  -bpm <n> -bpi <n> tempo (default 120/8)\n"
+         "  -srate <n>        samplerate of the measured client (default 48000)\n"
+         "  -peersrate <n>    samplerate of the peers (default same, differ to exercise the resampler)\n"
+         "  -bsize <n>        audio block size in frames (default 256)\n"
+         "  -in <file.wav>    input for the measured client (default a sine)\n"
+         "  -out <file.wav>   write the measured client's output\n"
+         "  -codec <name>     codec for every channel, peers included (default vorbish if the server has it)\n"
+         "  -fast             run the measured client's audio unpaced\n"
+         "  -stereo           make the measured client's channels stereo\n"
+         "  -mixthreads <n>   extra threads mixing remote channels (default 0)\n"
+         "  -upload <n>       stream uploads as they're encoded, at most n bytes/sec (0=no limit)\n"
+         "  -enginerate <n>   measured client's processing rate, when -srate is higher (default 48000)\n"
+         "  -master <file.wav> record the master mix, and check its rate and length at the end\n"
+         "  -latcal <frames>  just check latency calibration, on a simulated loopback with this delay\n"
+#ifdef NJCLIENT_JACK
+         "  -jack <cfg>       run the measured client on JACK (see audiostream_jack.cpp), -srate/-bsize/-in/-out/-fast don't apply\n"
+#endif
+         "  -v                verbose (server and client logging)\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int port=2050, npeers=4, nch=2, seconds=30, bpm=120, bpi=8;
+  int srate=48000, peersrate=0, bsize=256, fast=0, stereo=0, mixthreads=0, upload=-1, enginerate=-1;
+  char *infn=NULL, *outfn=NULL, *jackcfg=NULL, *masterfn=NULL;
+  int latcal=-1;
+  unsigned int codec=0;
+
+  int p;
+  for (p = 1; p < argc; p ++)
+  {
+    if (argv[p][0] != '-') usage();
+    if (!strcmp(argv[p],"-fast")) fast=1;
+    else if (!strcmp(argv[p],"-stereo")) stereo=1;
+    else if (!strcmp(argv[p],"-v")) g_verbose=1;
+    else if (++p >= argc) usage();
+    else if (!strcmp(argv[p-1],"-port")) port=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-peers")) npeers=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-channels")) nch=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-seconds")) seconds=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-bpm")) bpm=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-bpi")) bpi=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-srate")) srate=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-peersrate")) peersrate=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-bsize")) bsize=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-in")) infn=argv[p];
+    else if (!strcmp(argv[p-1],"-out")) outfn=argv[p];
+    else if (!strcmp(argv[p-1],"-mixthreads")) mixthreads=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-upload")) upload=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-enginerate")) enginerate=atoi(argv[p]);
+    else if (!strcmp(argv[p-1],"-master")) masterfn=argv[p];
+    else if (!strcmp(argv[p-1],"-latcal")) latcal=atoi(argv[p]);
+#ifdef NJCLIENT_JACK
+    else if (!strcmp(argv[p-1],"-jack")) jackcfg=argv[p];
+#endif
+    else if (!strcmp(argv[p-1],"-codec"))
+    {
+      const NJ_CodecInfo *c=NJ_FindCodecByName(argv[p]);
+      if (!c) usage();
+      codec=c->fourcc;
+    }
+    else usage();
+  }
+  if (npeers < 0) npeers=0;
+  if (nch < 1) nch=1;
+  if (seconds < 1) seconds=1;
+  if (bsize < 16) bsize=16;
+  if (!peersrate) peersrate=srate;
+
+  if (latcal >= 0) return latcal_test(srate,bsize,latcal) ? 0 : 4;
+
+  char workdir[]="/tmp/wjbenchXXXXXX";
+  if (!mkdtemp(workdir))
+  {
+    printf("error creating work directory\n");
+    return 1;
+  }
+
+  JNL::open_socketlib();
+
+  JNL_Listen *listener=new JNL_Listen(port);
+  if (listener->is_error())
+  {
+    printf("error listening on port %d\n",port);
+    return 1;
+  }
+  User_Group *group=new User_Group;
+  group->CreateUserLookup=bench_CreateUserLookup;
+  group->SetConfig(bpi,bpm);
+
+  char host[64];
+  sprintf(host,"localhost:%d",port);
+
+  // peers: one broadcasting channel each, fed from the main loop
+  NJClient **peers=(NJClient **)calloc(npeers ? npeers : 1,sizeof(NJClient *));
+  int x;
+  for (x = 0; x < npeers; x ++)
+  {
+    char name[32];
+    sprintf(name,"peer%d",x);
+    peers[x]=new NJClient;
+    peers[x]->config_autosubscribe=0;
+    peers[x]->config_savelocalaudio=0;
+    peers[x]->config_debug_level=g_verbose;
+    peers[x]->LicenseAgreementCallback=license_cb;
+    peers[x]->SetWorkDir(workdir);
+    peers[x]->SetLocalChannelInfo(0,name,true,0,false,0,true,true);
+    peers[x]->SetLocalChannelCodec(0,codec);
+    peers[x]->Connect(host,name,"");
+  }
+
+  g_client=new NJClient;
+  g_client->config_autosubscribe=1;
+  g_client->config_savelocalaudio=-1;
+  g_client->config_debug_level=g_verbose;
+  g_client->config_mix_threads=mixthreads;
+  if (enginerate >= 0) g_client->config_engine_srate=enginerate;
+  if (upload >= 0)
+  {
+    g_client->config_upload_mode=1;
+    g_client->config_upload_budget=upload;
+  }
+  g_client->LicenseAgreementCallback=license_cb;
+  g_client->SetWorkDir(workdir);
+  for (x = 0; x < nch; x ++)
+  {
+    char name[32];
+    sprintf(name,"bench%d",x);
+    g_client->SetLocalChannelInfo(x,name,true,stereo ? LOCAL_CHANNEL_STEREO : x&1,false,0,true,true);
+    g_client->SetLocalChannelCodec(x,codec);
+  }
+  g_client->Connect(host,"bench","");
+
+  char cfg[1024];
+  audioStreamer *audio;
+#ifdef NJCLIENT_JACK
+  if (jackcfg)
+  {
+    snprintf(cfg,sizeof(cfg),"%s",jackcfg);
+    audio=create_audioStreamer_JACK(cfg,audiostream_onsamples);
+    if (audio) srate=audio->m_srate;
+    bsize=16; // the server picks, this is just the smallest it's likely to, for sizing g_cpu_us
+    fast=0;
+  }
+  else
+#endif
+  {
+    snprintf(cfg,sizeof(cfg),"in %s srate %d nch 2 bsize %d realtime %d%s%s",
+        infn?infn:"sine:330",srate,bsize,!fast,outfn?" out ":"",outfn?outfn:"");
+    audio=create_audioStreamer_Null(cfg,audiostream_onsamples);
+  }
+  if (!audio)
+  {
+    printf("error creating audio streamer\n");
+    return 1;
+  }
+
+  int erate=g_client->GetEngineSampleRate(srate);
+  if (masterfn)
+  {
+    unlink(masterfn); // WaveWriter appends to what's there
+    g_client->SetWaveOutFile(new WaveWriter(masterfn,16,2,erate));
+  }
+
+  g_cpu_cap=(int)((double)seconds*srate/bsize*(fast?64:2))+1024;
+  g_cpu_us=(float *)malloc(g_cpu_cap*sizeof(float));
+
+  if (jackcfg)
+    printf("wjbench: %d peers at %dHz, %d local channels, JACK at %dHz\n",npeers,peersrate,nch,srate);
+  else
+    printf("wjbench: %d peers at %dHz, %d local channels, %dHz/%d frames, %s\n",
+        npeers,peersrate,nch,srate,bsize,fast?"unpaced":"real time");
+
+  // peer audio, generated and pushed at real time from this thread
+  float *pbuf=(float *)calloc(bsize*4,sizeof(float));
+  float *pin[2]={pbuf,pbuf+bsize}, *pout[2]={pbuf+bsize*2,pbuf+bsize*3};
+  double phase=0.0;
+  double peer_t=now_wall();
+
+  double begin_t=peer_t, connected_t=0.0, start_t=0.0;
+  for (;;)
+  {
+    int sleepok=1;
+
+    JNL_Connection *con=listener->get_connect(2*65536,65536);
+    if (con) group->AddConnection(con);
+    if (!group->Run()) sleepok=0;
+
+    int connected=g_client->GetStatus() == NJClient::NJC_STATUS_OK;
+    if (g_client->GetStatus() < 0)
+    {
+      printf("measured client failed to connect: %s\n",g_client->GetErrorStr());
+      break;
+    }
+    while (!g_client->Run()) sleepok=0;
+
+    for (x = 0; x < npeers; x ++)
+    {
+      if (peers[x]->GetStatus() != NJClient::NJC_STATUS_OK) connected=0;
+      while (!peers[x]->Run()) sleepok=0;
+    }
+
+    double t=now_wall();
+    while (peer_t < t)
+    {
+      int i;
+      double dp=2.0*3.14159265358979323846*220.0/peersrate;
+      for (i = 0; i < bsize; i ++) pin[0][i]=pin[1][i]=(float)(sin(phase+=dp)*0.25);
+      if (phase > 1000.0) phase=fmod(phase,2.0*3.14159265358979323846);
+      for (x = 0; x < npeers; x ++) peers[x]->AudioProc(pin,2,pout,2,bsize,peersrate);
+      peer_t+=(double)bsize/peersrate;
+    }
+
+    if (!start_t)
+    {
+      if (connected)
+      {
+        // let one interval go by so the peers are streaming before we measure
+        double ilen=60.0*bpi/bpm;
+        if (!connected_t) connected_t=t;
+        if (t-connected_t > ilen)
+        {
+          start_t=t;
+          g_audio_enable=1;
+          printf("measuring for %d seconds...\n",seconds);
+        }
+      }
+      else if (t-begin_t > 30.0)
+      {
+        printf("timed out waiting for clients to connect\n");
+        break;
+      }
+    }
+    else if (t-start_t >= seconds) break;
+
+    if (sleepok) usleep(1000);
+  }
+
+  g_audio_enable=0;
+  delete audio;
+
+  int ncb=g_ncallbacks;
+  int underruns=0, nremote=0;
+  for (x = 0; x < g_client->GetNumUsers(); x ++)
+  {
+    int i=0, ch;
+    while ((ch=g_client->EnumUserChannels(x,i++)) >= 0)
+    {
+      underruns+=g_client->GetUserChannelUnderruns(x,ch);
+      nremote++;
+    }
+  }
+
+  if (!ncb)
+  {
+    printf("no audio callbacks measured (did everyone connect?)\n");
+  }
+  else
+  {
+    qsort(g_cpu_us,ncb,sizeof(float),sortfloat);
+    double sum=0.0;
+    for (x = 0; x < ncb; x ++) sum+=g_cpu_us[x];
+    double budget_us=1000000.0*g_blocklen/srate;
+
+    printf("callbacks: %d (%.1fs of audio), remote channels: %d\n",ncb,g_audio_seconds,nremote);
+    printf("cpu us/callback: mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f (budget %.1f)\n",
+        sum/ncb,g_cpu_us[ncb/2],g_cpu_us[(ncb*9)/10],g_cpu_us[(ncb*99)/100],g_cpu_us[ncb-1],budget_us);
+    printf("dsp load: %.2f%%\n",100.0*sum/ncb/budget_us);
+    printf("deadline misses: %d\n",g_deadline_misses);
+    printf("remote underruns: %d\n",underruns);
+  }
+
+  int rc=0;
+#ifdef NJCLIENT_RTCHECK
+  printf("real-time violations: %d (%d call sites)\n",rtcheck_get_violations(),rtcheck_get_sites());
+  if (rtcheck_get_violations()) rc=2;
+#endif
+
+  delete g_client; // finishes writing the master
+  if (masterfn && !check_master(masterfn,erate,g_audio_seconds)) rc=3;
+  for (x = 0; x < npeers; x ++) delete peers[x];
+  free(peers);
+  delete group;
+  delete listener;
+  free(pbuf);
+  free(g_cpu_us);
+
+  JNL::close_socketlib();
+  rmdir(workdir);
+  return rc;
+}
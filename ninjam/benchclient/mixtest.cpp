@@ -0,0 +1,168 @@
+/*
+    Copyright (C) 2005 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Checks every WDL_PCMMix kernel the CPU supports against the scalar reference,
+  for all lengths up to a few vectors (so every tail path runs), with signals
+  and gains that clip. Exits 1 on a mismatch.
+
+  With -bench it also times each kernel at a typical callback size.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../../WDL/pcmmix.h"
+
+#define MAXN 67 // covers 0..2 full AVX vectors plus every tail length
+
+static int g_errors;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*0.000000001;
+}
+
+static void fill(float *buf, int n)
+{
+  // mostly in range, some well past full scale so the clip paths run
+  for (int i = 0; i < n; i ++) buf[i]=(float) ((rand()/(double)RAND_MAX)*4.0-2.0);
+}
+
+static void check(const char *lvl, const char *what, int n, float a, float b, float tol)
+{
+  if (fabs(a-b) <= tol) return;
+  if (g_errors++ < 20) printf("%s %s n=%d: got %f, expected %f\n",lvl,what,n,a,b);
+}
+
+static void checkbuf(const char *lvl, const char *what, int n, const float *a, const float *b, int len)
+{
+  for (int i = 0; i < len; i ++) check(lvl,what,n,a[i],b[i],0.00001f);
+}
+
+static void test_level(const WDL_PCMMix_Funcs *f, const char *lvl)
+{
+  float src[MAXN*2+8], h[MAXN], dh[MAXN];
+  float d1[MAXN+8], d2[MAXN+8], r1[MAXN+8], r2[MAXN+8];
+
+  for (int pass = 0; pass < 20; pass ++)
+  {
+    for (int n = 0; n <= MAXN; n ++)
+    {
+      fill(src,n*2+8);
+      fill(h,MAXN);
+      fill(dh,MAXN);
+      const float vol=pass&1 ? 1.7f : 0.6f, vol2=pass&2 ? -1.3f : 0.9f;
+      const float maxf=pass&4 ? 3.0f : 0.0f; // an incoming peak above anything in the buffer
+
+      check(lvl,"peak",n,f->peak(src,n,maxf),WDL_PCMMix_peak_c(src,n,maxf),0.0f);
+
+      // extra elements past n catch kernels writing over the end
+      memcpy(d1,src,sizeof(d1));
+      memcpy(r1,src,sizeof(r1));
+      check(lvl,"scale_peak",n,f->scale_peak(d1,n,vol,maxf),WDL_PCMMix_scale_peak_c(r1,n,vol,maxf),0.00001f);
+      checkbuf(lvl,"scale_peak",n,d1,r1,n+8);
+
+      fill(d1,n+8);
+      memcpy(r1,d1,sizeof(r1));
+      check(lvl,"mix_peak",n,f->mix_peak(src,d1,n,vol,maxf),WDL_PCMMix_mix_peak_c(src,r1,n,vol,maxf),0.00001f);
+      checkbuf(lvl,"mix_peak",n,d1,r1,n+8);
+
+      fill(d1,n+8);
+      fill(d2,n+8);
+      memcpy(r1,d1,sizeof(r1));
+      memcpy(r2,d2,sizeof(r2));
+      f->mix_deint2(src,d1,d2,n,vol,vol2);
+      WDL_PCMMix_mix_deint2_c(src,r1,r2,n,vol,vol2);
+      checkbuf(lvl,"mix_deint2 L",n,d1,r1,n+8);
+      checkbuf(lvl,"mix_deint2 R",n,d2,r2,n+8);
+
+      fill(d1,n+8);
+      memcpy(r1,d1,sizeof(r1));
+      f->add(src,d1,n);
+      WDL_PCMMix_add_c(src,r1,n);
+      checkbuf(lvl,"add",n,d1,r1,n+8);
+
+      // summed in a different order, so allow for rounding that grows with n
+      check(lvl,"fir_lerp",n,f->fir_lerp(src,h,dh,n,0.37f),WDL_PCMMix_fir_lerp_c(src,h,dh,n,0.37f),0.00001f*(n+1)*8);
+    }
+  }
+}
+
+static void bench_level(const WDL_PCMMix_Funcs *f, const char *lvl)
+{
+  const int n=256, iter=200000;
+  static float src[n*2], dest[n], dest2[n], h[n], dh[n];
+  fill(src,n*2);
+  fill(h,n);
+  fill(dh,n);
+  memset(dest,0,sizeof(dest));
+  memset(dest2,0,sizeof(dest2));
+  float sink=0.0f;
+  double t[6];
+  int i;
+
+  t[0]=now(); for (i = 0; i < iter; i ++) sink+=f->peak(src,n,0.0f);
+  t[0]=now()-t[0];
+  t[1]=now(); for (i = 0; i < iter; i ++) sink+=f->scale_peak(dest,n,1.0f,0.0f);
+  t[1]=now()-t[1];
+  t[2]=now(); for (i = 0; i < iter; i ++) sink+=f->mix_peak(src,dest,n,0.5f,0.0f);
+  t[2]=now()-t[2];
+  t[3]=now(); for (i = 0; i < iter; i ++) f->mix_deint2(src,dest,dest2,n/2,0.5f,0.5f);
+  t[3]=now()-t[3];
+  t[4]=now(); for (i = 0; i < iter; i ++) f->add(src,dest,n);
+  t[4]=now()-t[4];
+  t[5]=now(); for (i = 0; i < iter; i ++) sink+=f->fir_lerp(src,h,dh,64,(i&255)/256.0f);
+  t[5]=now()-t[5];
+
+  printf("%-6s ns/call: peak %.1f scale_peak %.1f mix_peak %.1f mix_deint2 %.1f add %.1f fir_lerp(64) %.1f%s\n",lvl,
+    t[0]*1e9/iter,t[1]*1e9/iter,t[2]*1e9/iter,t[3]*1e9/iter,t[4]*1e9/iter,t[5]*1e9/iter,
+    sink == 12345.0f ? " " : ""); // keeps the results live
+}
+
+int main(int argc, char **argv)
+{
+  int bench=argc > 1 && !strcmp(argv[1],"-bench");
+  static const char *names[]={"scalar","sse2","avx2","neon"};
+  srand(1);
+
+  const int best=WDL_PCMMix_Get()->level;
+  for (int l = WDL_PCMMIX_SCALAR; l <= WDL_PCMMIX_NEON; l ++)
+  {
+    if (WDL_PCMMix_SetLevel(l) != l) continue; // not supported here
+    const WDL_PCMMix_Funcs *f=WDL_PCMMix_Get();
+    test_level(f,names[l]);
+    if (bench) bench_level(f,names[l]);
+  }
+  WDL_PCMMix_SetLevel(best);
+
+  if (g_errors)
+  {
+    printf("mixtest: %d mismatches (best level %s)\n",g_errors,names[best]);
+    return 1;
+  }
+  printf("mixtest: all kernels up to %s match the reference\n",names[best]);
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+    Copyright (C) 2005 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Quality and CPU cost of WDL_Resampler at each quality level, the way
+  mixInChannel drives it (stereo, 256-frame output blocks):
+    + passband: level of a 1kHz tone after 44.1k->48k, should be 0dB
+    + aliasing: what's left of a 23kHz tone after 48k->44.1k (above the output
+      nyquist, so all of it is alias)
+    + us per block for 44.1k->48k
+
+  Exits 1 if a level misses its passband or aliasing limit.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../../WDL/resample.h"
+
+#define BLOCK 256
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*0.000000001;
+}
+
+// resamples a full-scale sine for about a second, returns output rms relative to the input's in dB
+static double tone_db(int quality, double srcrate, double dstrate, double freq, double *us_per_block)
+{
+  WDL_Resampler rs;
+  rs.Init(srcrate,dstrate,2,quality);
+  rs.Prepare(BLOCK);
+
+  float l[BLOCK], r[BLOCK];
+  float *out[2]={l,r};
+  double ph=0.0, dph=2.0*3.14159265358979323846*freq/srcrate;
+  double sum=0.0, t=0.0;
+  int blocks=(int)(dstrate/BLOCK), n=0;
+  for (int b = 0; b < blocks; b ++)
+  {
+    int in=rs.GetInputNeeded(BLOCK);
+    float *p0=rs.GetInputBuffer(0,in), *p1=rs.GetInputBuffer(1,in);
+    for (int i = 0; i < in; i ++) { p0[i]=p1[i]=(float)sin(ph); ph+=dph; }
+    rs.AddInput(in);
+    double t0=now();
+    int got=rs.Process(out,BLOCK);
+    t+=now()-t0;
+
+    if (b < 8) continue; // let the filter settle
+    for (int i = 0; i < got; i ++) sum+=l[i]*(double)l[i];
+    n+=got;
+  }
+  if (us_per_block) *us_per_block=t*1000000.0/blocks;
+  double rms=n ? sqrt(sum/n) : 0.0;
+  return 20.0*log10(rms/sqrt(0.5)+1e-12);
+}
+
+int main(int argc, char **argv)
+{
+  // limits per quality level: passband flatness, then aliasing
+  static const double max_pass_err[WDL_RESAMPLE_MAXQUALITY+1]={0.1,0.05,0.05,0.05};
+  static const double max_alias[WDL_RESAMPLE_MAXQUALITY+1]={0.0,-55.0,-75.0,-95.0};
+  int fail=0;
+
+  for (int q = 0; q <= WDL_RESAMPLE_MAXQUALITY; q ++)
+  {
+    double us;
+    double pass=tone_db(q,44100.0,48000.0,1000.0,&us);
+    double alias=tone_db(q,48000.0,44100.0,23000.0,NULL);
+    bool ok=fabs(pass) <= max_pass_err[q] && alias <= max_alias[q];
+    printf("q%d: 1kHz %+.3fdB, 23kHz alias %.1fdB, %.2fus per %d-frame stereo block%s\n",
+           q,pass,alias,us,BLOCK,ok ? "" : "  FAIL");
+    if (!ok) fail=1;
+  }
+  return fail;
+}
@@ -633,7 +633,7 @@ if (needadd)
     WDL_String wf;
     wf.Set(g_client->GetWorkDir());
     wf.Append("output.wav");
-    g_client->waveWrite = new WaveWriter(wf.Get(),24,myAudio->m_outnch>1?2:1,myAudio->m_srate);
+    g_client->SetWaveOutFile(new WaveWriter(wf.Get(),24,myAudio->m_outnch>1?2:1,g_client->GetEngineSampleRate(myAudio->m_srate)));
   }
   
   if ([[NSUserDefaults standardUserDefaults] integerForKey:@"saveogg"])
@@ -641,7 +641,7 @@ if (needadd)
     WDL_String wf;
     wf.Set(g_client->GetWorkDir());
     wf.Append("output.ogg");
-    g_client->SetOggOutFile(fopen(wf.Get(),"ab"),myAudio->m_srate,myAudio->m_outnch>1?2:1,[[NSUserDefaults standardUserDefaults] integerForKey:@"saveoggbr"]);
+    g_client->SetOggOutFile(fopen(wf.Get(),"ab"),g_client->GetEngineSampleRate(myAudio->m_srate),myAudio->m_outnch>1?2:1,[[NSUserDefaults standardUserDefaults] integerForKey:@"saveoggbr"]);
   }
   
   if (g_client->config_savelocalaudio)
@@ -745,8 +745,7 @@ if (needadd)
   WDL_String sessiondir(g_client->GetWorkDir()); // save a copy of the work dir before we blow it away
   
   g_client->Disconnect();
-  delete g_client->waveWrite;
-  g_client->waveWrite=0;
+  g_client->SetWaveOutFile(NULL);
   g_client->SetWorkDir(NULL);
   g_client->SetOggOutFile(NULL,0,0,0);
   g_client->SetLogFile(NULL);
@@ -40,9 +40,11 @@
 #include <math.h>
 #include <signal.h>
 #include <float.h>
+#include <time.h>
 
 #include "../audiostream.h"
 #include "../njclient.h"
+#include "../njcodec.h"
 #include "../../WDL/dirscan.h"
 #include "../../WDL/lineparse.h"
 
@@ -194,6 +196,26 @@ void audiostream_onsamples(float **inbuf, int innch, float **outbuf, int outnch,
   g_client->AudioProc(inbuf,innch, outbuf, outnch, len,srate);
 }
 
+#define AUDIO_REOPEN_SEC 10 // how long to keep trying to get a stopped device back before giving up
+#define LATCAL_TIMEOUT_SEC 10 // -calibrate normally takes about 5
+
+#ifdef NJCLIENT_JACK
+WDL_String g_jackcfg; // kept to reopen with, the parser writes into the string it's given
+#endif
+
+// the device stopped (jackd quit, or kicked us out): try to open it again the same way
+static audioStreamer *reopen_audio()
+{
+#ifdef NJCLIENT_JACK
+  if (g_jackcfg.Get()[0])
+  {
+    WDL_String cfg(g_jackcfg.Get());
+    return create_audioStreamer_JACK(cfg.Get(),audiostream_onsamples);
+  }
+#endif
+  return NULL;
+}
+
 
 int g_sel_x, g_sel_ypos,g_sel_ycat;
 
@@ -284,6 +306,24 @@ void drawstatusbar()
   move(curs_ypos,curs_xpos); 
 }
 
+// order of sources when cycling: each input, silence, then each stereo pair
+static int srcch_to_pos(int sch)
+{
+  if (sch & LOCAL_CHANNEL_STEREO) return g_audio->m_innch+1+(sch&~LOCAL_CHANNEL_STEREO);
+  return sch;
+}
+static int pos_to_srcch(int pos)
+{
+  if (pos > g_audio->m_innch) return (pos-g_audio->m_innch-1)|LOCAL_CHANNEL_STEREO;
+  return pos;
+}
+static int srcch_maxpos()
+{
+  // the last pair starts at the second to last input. with fewer than two inputs there are no pairs
+  if (g_audio->m_innch < 2) return g_audio->m_innch > 0 ? g_audio->m_innch : 0;
+  return srcch_to_pos((g_audio->m_innch-2)|LOCAL_CHANNEL_STEREO);
+}
+
 void showmainview(bool action=false, int ymove=0)
 {
   int chat_lines=LINES/4;
@@ -437,8 +477,15 @@ void showmainview(bool action=false, int ymove=0)
 
     char volstr[256];
     mkvolpanstr(volstr,vol,pan);
-    const char *sname=g_audio->GetChannelName(sch);
+    char stereobuf[256];
+    const char *sname=g_audio->GetChannelName(sch&~LOCAL_CHANNEL_STEREO);
     if (!sname) sname="Silence";
+    else if (sch & LOCAL_CHANNEL_STEREO)
+    {
+      const char *sname2=g_audio->GetChannelName((sch&~LOCAL_CHANNEL_STEREO)+1);
+      snprintf(stereobuf,sizeof(stereobuf),"%s+%s",sname,sname2?sname2:"Silence");
+      sname=stereobuf;
+    }
 
     char snamebuf[32];
     if (strlen(sname)>16)
@@ -694,6 +741,11 @@ void showmainview(bool action=false, int ymove=0)
   ypos=LINES-1;
   sprintf(linebuf,"[QUIT Wahjam] : %s : %.1fBPM %dBPI : %dHz %dch->%dch %dbps%s",
     g_client->GetHostName(),g_client->GetActualBPM(),g_client->GetBPI(),g_audio->m_srate,g_audio->m_innch,g_audio->m_outnch,g_audio->m_bps&~7,g_audio->m_bps&1 ? "(f)":"");
+  {
+    double p99,budget=g_client->GetAudioCallbackBudget();
+    if (budget > 0.0 && g_client->GetAudioStageStats(NJClient::NJC_PROF_TOTAL,NULL,NULL,&p99))
+      sprintf(linebuf+strlen(linebuf)," : dsp %d%%",(int)(p99*100.0/budget));
+  }
   highlightoutline(ypos++,linebuf,COLORMAP(1),COLORMAP(1),COLORMAP(1),COLORMAP(1),COLORMAP(5),COLORMAP(5),(g_sel_ypos != selpos || g_sel_ycat != selcat) ? -1 : g_sel_x);
   attrset(COLORMAP(1));
   bkgdset(COLORMAP(1));
@@ -755,6 +807,16 @@ void usage(const char *progname, int noexit=0)
     "       bps 16       -- set bits/sample\n"
     "       bsize 2048   -- set blocksize (bytes)\n"
     "       nblock 16    -- set number of blocks\n"
+#ifdef NJCLIENT_JACK
+    "  -jack \"option value [option value ...]\"\n"
+    "     use JACK instead of ALSA, options are:\n"
+    "       name wahjam  -- client name\n"
+    "       server name  -- JACK server (default the default one)\n"
+    "       in 2         -- input ports\n"
+    "       out 2        -- output ports\n"
+    "       connect 1    -- connect to the physical ports\n"
+    "       autostart 0  -- start a JACK server if none is running\n"
+#endif
 #endif
 #endif
 
@@ -763,7 +825,11 @@ void usage(const char *progname, int noexit=0)
     "  -nosavesourcefiles   -- don't save source files for remixing\n"
 
     "  -writewav            -- writes a .wav of the jam in the session directory\n"
-    "  -writeogg <bitrate>  -- writes a .ogg of the jam (bitrate 64-256)..\n",
+    "  -writeogg <bitrate>  -- writes a .ogg of the jam (bitrate 64-256)..\n"
+    "  -streamupload <n>    -- send audio as soon as it's encoded, at most n bytes/sec (0=no limit)\n"
+    "  -enginerate <n>      -- process at most at this samplerate, converting to/from the device (default 48000, 0=device)\n"
+    "  -calibrate           -- measure the audio round trip first (loop an output back to an input), recording is\n"
+    "                          shifted by it to line up with the intervals. the result is saved in wahjam.config\n",
     progname);
 
   if (!noexit) exit(1);
@@ -894,10 +960,13 @@ int main(int argc, char **argv)
   char *parmpass=NULL;
   WDL_String sessiondir;
   int sessionspec=0;
-  int nolog=0,nowav=1,writeogg=0,g_nssf=0;
+  int nolog=0,nowav=1,writeogg=0,g_nssf=0,calibrate=0;
 
   printf("Wahjam 0.1 curses client, compiled " __DATE__ " at " __TIME__ "\n\n");
   char *audioconfigstr=NULL;
+#ifdef NJCLIENT_JACK
+  char *jackconfigstr=NULL;
+#endif
   g_client=new NJClient;
   g_client->config_savelocalaudio=1;
   g_client->LicenseAgreementCallback=licensecallback;
@@ -950,6 +1019,13 @@ int main(int argc, char **argv)
         if (++p >= argc) usage(argv[0]);
         audioconfigstr=argv[p];
       }
+#ifdef NJCLIENT_JACK
+      else if (!stricmp(argv[p],"-jack"))
+      {
+        if (++p >= argc) usage(argv[0]);
+        jackconfigstr=argv[p];
+      }
+#endif
       else if (!stricmp(argv[p],"-user"))
       {
         if (++p >= argc) usage(argv[0]);
@@ -983,6 +1059,21 @@ int main(int argc, char **argv)
         sessiondir.Set(argv[p]);
         sessionspec=1;
       }
+      else if (!stricmp(argv[p],"-streamupload"))
+      {
+        if (++p >= argc) usage(argv[0]);
+        g_client->config_upload_mode=1;
+        g_client->config_upload_budget=atoi(argv[p]);
+      }
+      else if (!stricmp(argv[p],"-enginerate"))
+      {
+        if (++p >= argc) usage(argv[0]);
+        g_client->config_engine_srate=atoi(argv[p]);
+      }
+      else if (!stricmp(argv[p],"-calibrate"))
+      {
+        calibrate=1;
+      }
       else usage(argv[0]);
     }
   }
@@ -1023,6 +1114,14 @@ int main(int argc, char **argv)
 #ifdef _MAC
     g_audio=create_audioStreamer_CoreAudio(&dev_name_in,48000,2,16,audiostream_onsamples);
 #else
+#ifdef NJCLIENT_JACK
+    if (jackconfigstr)
+    {
+      g_jackcfg.Set(jackconfigstr);
+      g_audio=create_audioStreamer_JACK(jackconfigstr,audiostream_onsamples);
+    }
+    else
+#endif
     g_audio=create_audioStreamer_ALSA(dev_name_in,audiostream_onsamples);
 #endif
   }
@@ -1107,7 +1206,7 @@ int main(int argc, char **argv)
               int n;
               for (n = 1; n < lp.getnumtokens()-1; n += 2)
               {
-                switch (lp.gettoken_enum(n,"mastervol\0masterpan\0metrovol\0metropan\0mastermute\0metromute\0"))
+                switch (lp.gettoken_enum(n,"mastervol\0masterpan\0metrovol\0metropan\0mastermute\0metromute\0latency\0"))
                 {
                   case 0: // mastervol
                     g_client->config_mastervolume = (float)lp.gettoken_float(n+1);
@@ -1127,6 +1226,9 @@ int main(int argc, char **argv)
                   case 5:
                     g_client->config_metronome_mute = !!lp.gettoken_int(n+1);
                   break;
+                  case 6: // round trip, ms
+                    g_client->config_latency_compensation = lp.gettoken_float(n+1)/1000.0;
+                  break;
                   default:
                   break;
                 }
@@ -1208,14 +1310,14 @@ int main(int argc, char **argv)
     WDL_String wf;
     wf.Set(sessiondir.Get());
     wf.Append("output.wav");
-    g_client->waveWrite = new WaveWriter(wf.Get(),24,g_audio->m_outnch>1?2:1,g_audio->m_srate);
+    g_client->SetWaveOutFile(new WaveWriter(wf.Get(),24,g_audio->m_outnch>1?2:1,g_client->GetEngineSampleRate(g_audio->m_srate)));
   }
   if (writeogg)
   {
     WDL_String wf;
     wf.Set(sessiondir.Get());
     wf.Append("output.ogg");
-    g_client->SetOggOutFile(fopen(wf.Get(),"ab"),g_audio->m_srate,g_audio->m_outnch>1?2:1,writeogg);
+    g_client->SetOggOutFile(fopen(wf.Get(),"ab"),g_client->GetEngineSampleRate(g_audio->m_srate),g_audio->m_outnch>1?2:1,writeogg);
   }
   if (!nolog)
   {
@@ -1225,6 +1327,34 @@ int main(int argc, char **argv)
     g_client->SetLogFile(lf.Get());
   }
  
+  if (calibrate)
+  {
+    printf("Measuring round trip latency, with an output looped back to an input...\n");
+    g_audio_enable=1;
+    double rt=0.0;
+    int r=g_client->StartLatencyCalibration() ? -1 : 1;
+    time_t deadline=time(NULL)+LATCAL_TIMEOUT_SEC;
+    while (r == 1 && (r=g_client->GetLatencyCalibration(&rt)) == 1)
+    {
+      if (time(NULL) >= deadline)
+      {
+        g_client->StopLatencyCalibration();
+        r=-1;
+        break;
+      }
+#ifdef _WIN32
+      Sleep(50);
+#else
+      struct timespec ts={0,50*1000*1000};
+      nanosleep(&ts,NULL);
+#endif
+    }
+    if (!r) printf("Round trip latency %.2fms (%d samples), local channels will be recorded that much later\n",
+                   rt*1000.0,(int)(rt*g_audio->m_srate+0.5));
+    else printf("Couldn't measure the round trip (no clicks heard, too noisy, or no audio running), keeping %.2fms\n",
+                g_client->config_latency_compensation*1000.0);
+  }
+
   printf("Connecting to %s...\n",hostname);
   g_client->Connect(hostname,parmuser,parmpass);
   g_audio_enable=1;
@@ -1310,6 +1440,8 @@ int main(int argc, char **argv)
 #else
   time_t nextupd=time(NULL)+1;
 #endif
+  time_t audio_lost=0, audio_retry=0;
+  int audio_stopped=0;
 
   while (g_client->GetStatus() >= 0 && !g_done
 #ifdef _WIN32
@@ -1318,6 +1450,37 @@ int main(int argc, char **argv)
     
     )
   {
+    if (!g_audio->IsRunning())
+    {
+      // the session carries on without audio while we try to get the device back
+      time_t now=time(NULL);
+      if (!audio_lost)
+      {
+        audio_lost=now;
+        addChatLine("","audio device stopped, trying to reopen it");
+        g_need_disp_update=1;
+      }
+      audioStreamer *a=NULL;
+      if (now >= audio_retry)
+      {
+        audio_retry=now+2;
+        a=reopen_audio();
+      }
+      if (a)
+      {
+        delete g_audio;
+        g_audio=a;
+        audio_lost=0;
+        addChatLine("","audio device reopened");
+        g_need_disp_update=1;
+      }
+      else if (now-audio_lost >= AUDIO_REOPEN_SEC)
+      {
+        audio_stopped=1;
+        break;
+      }
+    }
+
     if (g_client->Run()) 
     {
 #ifdef _WIN32
@@ -1449,6 +1612,107 @@ int main(int argc, char **argv)
                           addChatLine("","error: /msg requires a username and a message.");
                         }
                       }
+                      else if (!strncasecmp(m_chatinput_str,"/dsp",4) && (!m_chatinput_str[4] || m_chatinput_str[4]==' '))
+                      {
+                        char *p=m_chatinput_str+4;
+                        while (*p == ' ') p++;
+                        if (!strcasecmp(p,"reset"))
+                        {
+                          g_client->ResetAudioStats();
+                          addChatLine("","audio callback stats reset.");
+                        }
+                        else
+                        {
+                          char buf[256];
+                          sprintf(buf,"audio callback: budget %.0fus, %d deadline misses (times in us: mean/p50/p99/max)",
+                            g_client->GetAudioCallbackBudget(),g_client->GetAudioDeadlineMisses());
+                          addChatLine("",buf);
+                          int x;
+                          for (x = 0; x < NJClient::NJC_PROF_NUM; x ++)
+                          {
+                            double mean,p50,p99,mx;
+                            int n=g_client->GetAudioStageStats(x,&mean,&p50,&p99,&mx);
+                            if (!n) continue;
+                            sprintf(buf,"  %-10s %8.1f %8.1f %8.1f %8.1f  (%d)",g_client->GetAudioStageName(x),mean,p50,p99,mx,n);
+                            addChatLine("",buf);
+                          }
+                          int pending,dropped;
+                          double lag;
+                          g_client->GetRecordingStats(&pending,&lag,&dropped);
+                          sprintf(buf,"recording: %dkB queued, %.2fs behind, %dkB dropped",pending/1024,lag,dropped/1024);
+                          addChatLine("",buf);
+                        }
+                      }
+                      else if (!strncasecmp(m_chatinput_str,"/codec",6) && (!m_chatinput_str[6] || m_chatinput_str[6]==' '))
+                      {
+                        char *p=m_chatinput_str+6;
+                        while (*p == ' ') p++;
+                        const NJ_CodecInfo *codec=*p ? NJ_FindCodecByName(p) : NULL;
+                        char buf[256];
+                        if (*p && !codec)
+                        {
+                          WDL_String s("error: unknown codec, have:");
+                          int x;
+                          for (x = 0; (codec=NJ_EnumCodecs(x)); x ++) { s.Append(" "); s.Append(codec->name); }
+                          addChatLine("",s.Get());
+                        }
+                        else if (codec)
+                        {
+                          int x,ch;
+                          for (x = 0; (ch=g_client->EnumLocalChannels(x)) >= 0; x ++) g_client->SetLocalChannelCodec(ch,codec->fourcc);
+                          sprintf(buf,"local channels will use %s%s",codec->name,
+                                  g_client->IsCodecUsable(codec->fourcc)?"":" (once everybody here supports it, vorbis until then)");
+                          addChatLine("",buf);
+                        }
+                        else
+                        {
+                          int x,ch;
+                          for (x = 0; (ch=g_client->EnumLocalChannels(x)) >= 0; x ++)
+                          {
+                            unsigned int inuse=0, want=g_client->GetLocalChannelCodec(ch,&inuse);
+                            const NJ_CodecInfo *w=NJ_GetCodec(want), *u=NJ_GetCodec(inuse);
+                            int subs=g_client->GetLocalChannelSubscribers(ch);
+                            sprintf(buf,"channel %d: codec %s, sending %s",ch,!want?"default":w?w->name:"?",u?u->name:"nothing yet");
+                            if (subs >= 0) sprintf(buf+strlen(buf),", %d listening",subs);
+                            addChatLine("",buf);
+                          }
+                        }
+                      }
+                      else if (!strncasecmp(m_chatinput_str,"/simulcast",10) && (!m_chatinput_str[10] || m_chatinput_str[10]==' '))
+                      {
+                        char *p=m_chatinput_str+10;
+                        int b1=0,b2=0,x,ch;
+                        char buf[256];
+                        if (*p)
+                        {
+                          b1=strtol(p,&p,10);
+                          b2=strtol(p,&p,10);
+                          for (x = 0; (ch=g_client->EnumLocalChannels(x)) >= 0; x ++) g_client->SetLocalChannelTiers(ch,b1,b2);
+                        }
+                        else if ((ch=g_client->EnumLocalChannels(0)) >= 0) g_client->GetLocalChannelTiers(ch,&b1,&b2);
+                        if (b1 > 0 || b2 > 0) sprintf(buf,"local channels also send copies at %dkbps %dkbps, for those who ask",b1,b2);
+                        else sprintf(buf,"local channels send one bitrate (/simulcast <kbps> [kbps] to add lower ones)");
+                        addChatLine("",buf);
+                      }
+                      else if (!strncasecmp(m_chatinput_str,"/tier ",6))
+                      {
+                        char *p=m_chatinput_str+6;
+                        while (*p == ' ') p++;
+                        char *n=p;
+                        while (*p && *p != ' ') p++;
+                        if (*p == ' ') *p++=0;
+                        int x, tier=atoi(p);
+                        char *un=NULL;
+                        for (x = 0; (un=g_client->GetUserState(x)) && strcasecmp(un,n); x ++);
+                        char buf[256];
+                        if (un)
+                        {
+                          g_client->SetUserTier(x,tier);
+                          sprintf(buf,"getting %s at tier %d (0=normal, 2=lowest) from their next interval",un,g_client->GetUserTier(x));
+                        }
+                        else sprintf(buf,"error: no user %s",n);
+                        addChatLine("",buf);
+                      }
                       else
                       {
                         addChatLine("","error: unknown command.");
@@ -1566,9 +1830,10 @@ int main(int argc, char **argv)
               {
                 int ch=0;
                 g_client->GetLocalChannelInfo(g_ui_locrename_ch,&ch,NULL,NULL);
-                if (ch > 0) 
+                int pos=srcch_to_pos(ch);
+                if (pos > 0) 
                 {
-                  ch--;
+                  ch=pos_to_srcch(pos-1);
                   g_client->SetLocalChannelInfo(g_ui_locrename_ch,NULL,true,ch,false,0,false,false);
                   g_client->NotifyServerOfChannelChange();
                   showmainview();
@@ -1581,9 +1846,10 @@ int main(int argc, char **argv)
               {
                 int ch=0;
                 g_client->GetLocalChannelInfo(g_ui_locrename_ch,&ch,NULL,NULL);
-                if (ch < g_audio->m_innch) 
+                int pos=srcch_to_pos(ch);
+                if (pos < srcch_maxpos()) 
                 {
-                  ch++;
+                  ch=pos_to_srcch(pos+1);
                   g_client->SetLocalChannelInfo(g_ui_locrename_ch,NULL,true,ch,false,0,false,false);
                   g_client->NotifyServerOfChannelChange();
                   showmainview();
@@ -1672,6 +1938,8 @@ time(NULL) >= nextupd
 	// shut down curses
 	endwin();
 
+  if (audio_stopped) printf("ERROR: audio device stopped, and couldn't be reopened\n");
+
   switch (g_client->GetStatus())
   {
     case NJClient::NJC_STATUS_OK:
@@ -1704,8 +1972,7 @@ time(NULL) >= nextupd
   delete g_audio;
 
 
-  delete g_client->waveWrite;
-  g_client->waveWrite=0;
+  g_client->SetWaveOutFile(NULL);
 
 
   // save local channel state
@@ -1714,9 +1981,9 @@ time(NULL) >= nextupd
     int x=0;
     if (fp) 
     {
-      fprintf(fp,"master mastervol %f masterpan %f metrovol %f metropan %f mastermute %d metromute %d\n",
+      fprintf(fp,"master mastervol %f masterpan %f metrovol %f metropan %f mastermute %d metromute %d latency %f\n",
         g_client->config_mastervolume,g_client->config_masterpan,g_client->config_metronome,g_client->config_metronome_pan,
-        g_client->config_mastermute,g_client->config_metronome_mute);
+        g_client->config_mastermute,g_client->config_metronome_mute,g_client->config_latency_compensation*1000.0);
 
 
 
@@ -568,9 +568,9 @@ Net_Message *mpb_client_set_usermask::build()
 }
 
 
-void mpb_client_set_usermask::build_add_rec(char *username, unsigned int chflags)
+void mpb_client_set_usermask::build_add_rec(char *username, unsigned int chflags, int tier)
 {
-  int size=4+strlen(username?username:"")+1;
+  int size=4+strlen(username?username:"")+1+(tiered?1:0);
 
   if (!m_intmsg) 
   {
@@ -591,12 +591,13 @@ void mpb_client_set_usermask::build_add_rec(char *username, unsigned int chflags
     *p++=(chflags>>8)&0xff;
     *p++=(chflags>>16)&0xff;
     *p++=(chflags>>24)&0xff;
+    if (tiered) *p++=(unsigned char)tier;
   }
 }
 
 
 // returns offset of next item on success, or <= 0 if out of items
-int mpb_client_set_usermask::parse_get_rec(int offs, char **username, unsigned int *chflags)
+int mpb_client_set_usermask::parse_get_rec(int offs, char **username, unsigned int *chflags, int *tier)
 {
   if (!m_intmsg) return 0;
   unsigned char *p=(unsigned char *)m_intmsg->get_data();
@@ -613,12 +614,14 @@ int mpb_client_set_usermask::parse_get_rec(int offs, char **username, unsigned i
   p++;
   len--;
 
-  if (len<4) return -1;
+  if (len<4+(tiered?1:0)) return -1;
 
   *chflags = ((int)*p++); 
   *chflags |= ((int)*p++)<<8;
   *chflags |= ((int)*p++)<<16;
   *chflags |= ((int)*p++)<<24;
+  int t=tiered ? *p++ : 0;
+  if (tier) *tier=t;
 
   return p - (unsigned char *)m_intmsg->get_data();
 }
@@ -782,6 +785,67 @@ Net_Message *mpb_client_upload_interval_begin::build()
 }
 
 
+// MESSAGE_CLIENT_UPLOAD_TIER_BEGIN
+int mpb_client_upload_tier_begin::parse(Net_Message *msg) // return 0 on success
+{
+  if (msg->get_type() != MESSAGE_CLIENT_UPLOAD_TIER_BEGIN) return -1;
+  if (msg->get_size() < 42) return 1;
+  unsigned char *p=(unsigned char *)msg->get_data();
+  if (!p) return 2;
+
+  memcpy(guid,p,sizeof(guid));
+  p+=sizeof(guid);
+  estsize = (int)*p++;
+  estsize |= ((int)*p++)<<8;
+  estsize |= ((int)*p++)<<16;
+  estsize |= ((int)*p++)<<24;
+  fourcc = (unsigned int)*p++;
+  fourcc |= ((unsigned int)*p++)<<8;
+  fourcc |= ((unsigned int)*p++)<<16;
+  fourcc |= ((unsigned int)*p++)<<24;
+  chidx = (int)*p++;
+  memcpy(link_guid,p,sizeof(link_guid));
+  p+=sizeof(link_guid);
+  tier = (int)*p++;
+
+  return 0;
+}
+
+
+Net_Message *mpb_client_upload_tier_begin::build()
+{
+  Net_Message *nm=new Net_Message;
+  nm->set_type(MESSAGE_CLIENT_UPLOAD_TIER_BEGIN);
+  
+  nm->set_size(42);
+
+  unsigned char *p=(unsigned char *)nm->get_data();
+
+  if (!p)
+  {
+    delete nm;
+    return 0;
+  }
+
+  memcpy(p,guid,sizeof(guid));
+  p+=sizeof(guid);
+  *p++=(unsigned char)((estsize)&0xff);
+  *p++=(unsigned char)((estsize>>8)&0xff);
+  *p++=(unsigned char)((estsize>>16)&0xff);
+  *p++=(unsigned char)((estsize>>24)&0xff);
+  *p++=(unsigned char)((fourcc)&0xff);
+  *p++=(unsigned char)((fourcc>>8)&0xff);
+  *p++=(unsigned char)((fourcc>>16)&0xff);
+  *p++=(unsigned char)((fourcc>>24)&0xff);
+  *p++=(unsigned char)((chidx)&0xff);
+  memcpy(p,link_guid,sizeof(link_guid));
+  p+=sizeof(link_guid);
+  *p++=(unsigned char)((tier)&0xff);
+
+  return nm;
+}
+
+
 // MESSAGE_CLIENT_UPLOAD_INTERVAL_WRITE
 int mpb_client_upload_interval_write::parse(Net_Message *msg) // return 0 on success
 {
@@ -825,6 +889,116 @@ Net_Message *mpb_client_upload_interval_write::build()
 }
 
 
+
+// codec caps messages, both directions: a list of LE fourccs
+static int parse_codec_caps(Net_Message *msg, unsigned int *fourcc, int *num_fourcc)
+{
+  unsigned char *p=(unsigned char *)msg->get_data();
+  if (!p && msg->get_size()) return 2;
+  int n=msg->get_size()/4;
+  if (n > MPB_MAX_CODECS) n=MPB_MAX_CODECS;
+  int x;
+  for (x = 0; x < n; x ++)
+  {
+    fourcc[x] = ((unsigned int)*p++);
+    fourcc[x] |= ((unsigned int)*p++)<<8;
+    fourcc[x] |= ((unsigned int)*p++)<<16;
+    fourcc[x] |= ((unsigned int)*p++)<<24;
+  }
+  *num_fourcc=n;
+  return 0;
+}
+
+static Net_Message *build_codec_caps(int type, unsigned int *fourcc, int num_fourcc)
+{
+  Net_Message *nm=new Net_Message;
+  nm->set_type(type);
+
+  if (num_fourcc < 0) num_fourcc=0;
+  if (num_fourcc > MPB_MAX_CODECS) num_fourcc=MPB_MAX_CODECS;
+  nm->set_size(num_fourcc*4);
+
+  unsigned char *p=(unsigned char *)nm->get_data();
+  if (!p && num_fourcc)
+  {
+    delete nm;
+    return 0;
+  }
+  int x;
+  for (x = 0; x < num_fourcc; x ++)
+  {
+    *p++=(unsigned char)((fourcc[x])&0xff);
+    *p++=(unsigned char)((fourcc[x]>>8)&0xff);
+    *p++=(unsigned char)((fourcc[x]>>16)&0xff);
+    *p++=(unsigned char)((fourcc[x]>>24)&0xff);
+  }
+  return nm;
+}
+
+
+// MESSAGE_SERVER_CODEC_CAPS
+int mpb_server_codec_caps::parse(Net_Message *msg) // return 0 on success
+{
+  if (msg->get_type() != MESSAGE_SERVER_CODEC_CAPS) return -1;
+  return parse_codec_caps(msg,fourcc,&num_fourcc);
+}
+
+Net_Message *mpb_server_codec_caps::build()
+{
+  return build_codec_caps(MESSAGE_SERVER_CODEC_CAPS,fourcc,num_fourcc);
+}
+
+
+// MESSAGE_CLIENT_SET_CODEC_CAPS
+int mpb_client_set_codec_caps::parse(Net_Message *msg) // return 0 on success
+{
+  if (msg->get_type() != MESSAGE_CLIENT_SET_CODEC_CAPS) return -1;
+  return parse_codec_caps(msg,fourcc,&num_fourcc);
+}
+
+Net_Message *mpb_client_set_codec_caps::build()
+{
+  return build_codec_caps(MESSAGE_CLIENT_SET_CODEC_CAPS,fourcc,num_fourcc);
+}
+
+
+// MESSAGE_SERVER_CHANNEL_SUBSCRIBERS
+int mpb_server_channel_subscribers::parse(Net_Message *msg) // return 0 on success
+{
+  if (msg->get_type() != MESSAGE_SERVER_CHANNEL_SUBSCRIBERS) return -1;
+  unsigned char *p=(unsigned char *)msg->get_data();
+  if (!p && msg->get_size()) return 2;
+  int n=msg->get_size();
+  if (n > MPB_MAX_SUB_CHANNELS) n=MPB_MAX_SUB_CHANNELS;
+  int x;
+  for (x = 0; x < n; x ++) subscribers[x]=p[x];
+  for (; x < MPB_MAX_SUB_CHANNELS; x ++) subscribers[x]=0;
+  num_channels=n;
+  return 0;
+}
+
+Net_Message *mpb_server_channel_subscribers::build()
+{
+  Net_Message *nm=new Net_Message;
+  nm->set_type(MESSAGE_SERVER_CHANNEL_SUBSCRIBERS);
+
+  int n=num_channels;
+  if (n < 0) n=0;
+  if (n > MPB_MAX_SUB_CHANNELS) n=MPB_MAX_SUB_CHANNELS;
+  nm->set_size(n);
+
+  unsigned char *p=(unsigned char *)nm->get_data();
+  if (!p && n)
+  {
+    delete nm;
+    return 0;
+  }
+  int x;
+  for (x = 0; x < n; x ++) *p++=(unsigned char)(subscribers[x] < 0 ? 0 : subscribers[x] > 255 ? 255 : subscribers[x]);
+  return nm;
+}
+
+
 /////////////////////////////////////////////////////////////////////////
 //////////// bidirectional generic  messages
 /////////////////////////////////////////////////////////////////////////
@@ -35,9 +35,15 @@
 #define PROTO_VER_MAX 0x0002ffff
 #define PROTO_VER_CUR 0x00020000
 
+#ifndef MAKE_NJ_FOURCC
+#define MAKE_NJ_FOURCC(A,B,C,D) ((A) | ((B)<<8) | ((C)<<16) | ((D)<<24))
+#endif
+
 
 #define MESSAGE_SERVER_AUTH_CHALLENGE 0x00
 
+#define MPB_SERVER_CAP_TIERS 2 // takes MESSAGE_CLIENT_UPLOAD_TIER_BEGIN and tiered usermasks
+
 class mpb_server_auth_challenge 
 {
   public:
@@ -50,7 +56,7 @@ class mpb_server_auth_challenge
 
     // public data
     unsigned char challenge[8];
-    int server_caps; // low bit is license agreement, bits 8-16 are keepalive
+    int server_caps; // low bit is license agreement, MPB_SERVER_CAP_*, bits 8-16 are keepalive
     char *license_agreement;
     int protocol_version; // version should be 1 to start.
 };
@@ -156,9 +162,51 @@ class mpb_server_download_interval_write
 };
 
 
+#define MPB_MAX_CODECS 16
+
+// fourccs that every user in the session can decode. sent whenever that changes.
+// servers that don't send this mean only 'OGGv'.
+#define MESSAGE_SERVER_CODEC_CAPS 0x06
+class mpb_server_codec_caps
+{
+  public:
+    mpb_server_codec_caps() : num_fourcc(0) { }
+    ~mpb_server_codec_caps() { }
+
+    int parse(Net_Message *msg); // return 0 on success
+    Net_Message *build();
+
+    // public data
+    unsigned int fourcc[MPB_MAX_CODECS];
+    int num_fourcc;
+};
+
+
+#define MPB_MAX_SUB_CHANNELS 32
+
+// how many other users subscribe to each of the recipient's channels, one byte per channel
+// (capped at 255). sent whenever that changes. servers that don't send this mean everybody's listening.
+#define MESSAGE_SERVER_CHANNEL_SUBSCRIBERS 0x07
+class mpb_server_channel_subscribers
+{
+  public:
+    mpb_server_channel_subscribers() : num_channels(0) { memset(subscribers,0,sizeof(subscribers)); }
+    ~mpb_server_channel_subscribers() { }
+
+    int parse(Net_Message *msg); // return 0 on success
+    Net_Message *build();
+
+    // public data
+    int subscribers[MPB_MAX_SUB_CHANNELS];
+    int num_channels; // channels past this have nobody
+};
+
+
 
 
 #define MESSAGE_CLIENT_AUTH_USER 0x80
+
+#define MPB_CLIENT_CAP_TIERS 4 // our usermask records carry a tier. only set if the server has MPB_SERVER_CAP_TIERS
 class mpb_client_auth_user
 {
   public:
@@ -183,15 +231,19 @@ class mpb_client_auth_user
 class mpb_client_set_usermask
 {
   public:
-    mpb_client_set_usermask() : m_intmsg(0) { }
+    mpb_client_set_usermask() : tiered(0), m_intmsg(0) { }
     ~mpb_client_set_usermask() { }
 
     int parse(Net_Message *msg); // return 0 on success
     Net_Message *build();
 
 
-    void build_add_rec(char *username, unsigned int chflags);
-    int parse_get_rec(int offs, char **username, unsigned int *chflags); // returns offset of next item on success, or <0 if out of items
+    // tier picks which of the user's simulcast copies to get, 0 being the normal one. it's a byte after chflags,
+    // only there if tiered is set (the client said MPB_CLIENT_CAP_TIERS), set that before adding or parsing records.
+    void build_add_rec(char *username, unsigned int chflags, int tier=0);
+    int parse_get_rec(int offs, char **username, unsigned int *chflags, int *tier=0); // returns offset of next item on success, or <0 if out of items
+
+    int tiered;
 
    private:
 
@@ -242,6 +294,30 @@ class mpb_client_upload_interval_begin
 
 
 
+// a lower bitrate copy of an interval (simulcast), for subscribers that asked for tier. sent right before the
+// MESSAGE_CLIENT_UPLOAD_INTERVAL_BEGIN for link_guid, its data uses MESSAGE_CLIENT_UPLOAD_INTERVAL_WRITE as usual.
+// only for servers with MPB_SERVER_CAP_TIERS.
+#define MESSAGE_CLIENT_UPLOAD_TIER_BEGIN 0x86
+#define MPB_MAX_TIERS 3 // including tier 0, the interval itself
+class mpb_client_upload_tier_begin
+{
+  public:
+    mpb_client_upload_tier_begin() : estsize(0), fourcc(0), chidx(0), tier(0) { memset(guid,0,sizeof(guid)); memset(link_guid,0,sizeof(link_guid)); }
+    ~mpb_client_upload_tier_begin() { }
+
+    int parse(Net_Message *msg); // return 0 on success
+    Net_Message *build();
+
+    // public data
+    unsigned char guid[16];
+    int estsize;
+    unsigned int fourcc;
+    int chidx;       // only 1 byte
+    unsigned char link_guid[16]; // the interval this is a copy of
+    int tier;        // only 1 byte, 1..MPB_MAX_TIERS-1
+};
+
+
 // this uses the exact same message format as the server version
 #define MESSAGE_CLIENT_UPLOAD_INTERVAL_WRITE 0x84
 class mpb_client_upload_interval_write
@@ -262,6 +338,23 @@ class mpb_client_upload_interval_write
 };
 
 
+// fourccs this client can decode, sent after auth. clients that don't send this can only do 'OGGv'.
+#define MESSAGE_CLIENT_SET_CODEC_CAPS 0x85
+class mpb_client_set_codec_caps
+{
+  public:
+    mpb_client_set_codec_caps() : num_fourcc(0) { }
+    ~mpb_client_set_codec_caps() { }
+
+    int parse(Net_Message *msg); // return 0 on success
+    Net_Message *build();
+
+    // public data
+    unsigned int fourcc[MPB_MAX_CODECS];
+    int num_fourcc;
+};
+
+
 #define MESSAGE_CHAT_MESSAGE 0xC0
 class mpb_chat_message
 {
@@ -98,6 +98,7 @@ class Net_Connection
     int Send(Net_Message *msg); // -1 on error, i.e. queue full
     int GetStatus(); // returns <0 on error, 0 on normal, 1 on disconnect
     JNL_Connection *GetConnection() { return m_con; }
+    int HasPendingSend() { return m_sendq.Available()>0 || (m_con && m_con->send_bytes_in_queue()>0); }
 
     void SetKeepAlive(int interval)
     {
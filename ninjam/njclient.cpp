@@ -28,58 +28,1832 @@
 #include <stdint.h>
 #include "njclient.h"
 #include "mpb.h"
+#include "rtcheck.h"
 #include "../WDL/pcmfmtcvt.h"
+#include "../WDL/resample.h"
 #include "../WDL/wavwrite.h"
 
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+#endif
 
 
-// todo: make an interface base class for vorbis enc/dec
-#define VorbisEncoder I_NJEncoder 
-#define VorbisDecoder I_NJDecoder 
-#define NJ_ENCODER_FMT_TYPE MAKE_NJ_FOURCC('O','G','G','v')
+#include "njcodec.h"
 #include "../WDL/vorbisencdec.h"
-#undef VorbisEncoder
-#undef VorbisDecoder
 
+#ifdef _WIN32
+#define strcasecmp stricmp
+#endif
+
+#define NJ_ENCODER_FMT_TYPE NJ_CODEC_VORBIS // what we fall back to, and all that older clients understand
+
+
+class NJVorbisEncoder : public I_NJEncoder
+{
+  public:
+    NJVorbisEncoder(int srate, int nch, int bitrate, int serno) : m_enc(srate,nch,bitrate,serno) { }
+
+    void Encode(float *in, int inlen, int advance=1, int spacing=1) { m_enc.Encode(in,inlen,advance,spacing); }
+    int isError() { return m_enc.isError(); }
+    void reinit() { m_enc.reinit(); }
+    WDL_Queue *GetOutQueue() { return &m_enc.outqueue; }
+
+    static I_NJEncoder *Create(int srate, int nch, int bitrate, int serno) { return new NJVorbisEncoder(srate,nch,bitrate,serno); }
+
+  private:
+    VorbisEncoder m_enc;
+};
+
+class NJVorbisDecoder : public I_NJDecoder
+{
+  public:
+    NJVorbisDecoder() { m_dec.SetPlanarOutput(true); }
+
+    int GetSampleRate() { return m_dec.GetSampleRate(); }
+    int GetNumChannels() { return m_dec.GetNumChannels(); }
+    void *DecodeGetSrcBuffer(int srclen) { return m_dec.DecodeGetSrcBuffer(srclen); }
+    void DecodeWrote(int srclen) { m_dec.DecodeWrote(srclen); }
+    void Reset() { m_dec.Reset(); }
+    WDL_PlanarRingBuf *GetRing() { return &m_dec.m_ring; }
+    void SetSkip(bool skip) { m_dec.SetSkip(skip); }
+    int GetSkipped() { return m_dec.GetSkipped(); }
+    void ConsumeSkipped(int frames) { m_dec.ConsumeSkipped(frames); }
+
+    static I_NJDecoder *Create() { return new NJVorbisDecoder; }
+
+  private:
+    VorbisDecoder m_dec;
+};
+
+
+// 'PCMs' streams: a 12 byte header ("NJPC", samplerate as LE int32, nch, bits(16), 2 zero bytes),
+// then interleaved 16 bit LE samples. every interval starts with a header.
+#define PCM16_HDR_SIZE 12
+#define PCM16_MIN_SRATE 8000 // anything outside this came off the wire broken (or hostile): the resampler
+#define PCM16_MAX_SRATE 384000 // is sized from the rate ratio, so don't let it through
+#define PCM16_SRC_BYTES 4096 // input buffer, callers hand over 128 bytes at a time so this is plenty
+#define PCM16_CHUNK 256 // frames converted at a time, through a fixed scratch buffer
+#define PCM16_RING_FRAMES 16384 // set up with the header (in prime_decode), more than a block ever needs
+
+class NJPCM16Encoder : public I_NJEncoder
+{
+  public:
+    NJPCM16Encoder(int srate, int nch) : m_srate(srate), m_nch(nch>1?2:1) { reinit(); }
+
+    void Encode(float *in, int inlen, int advance=1, int spacing=1)
+    {
+      if (inlen <= 0 || !in) return;
+      unsigned char *p=(unsigned char *)outqueue.Add(NULL,inlen*m_nch*2);
+      if (!p) return;
+      int i,c;
+      for (i = 0; i < inlen; i ++)
+      {
+        for (c = 0; c < m_nch; c ++)
+        {
+          int v;
+          float_TO_INT16(v,in[c*spacing]);
+          *p++ = v&0xff;
+          *p++ = (v>>8)&0xff;
+        }
+        in+=advance;
+      }
+    }
+    int isError() { return 0; }
+    void reinit()
+    {
+      outqueue.Advance(outqueue.Available());
+      outqueue.Compact();
+      unsigned char *p=(unsigned char *)outqueue.Add(NULL,PCM16_HDR_SIZE);
+      memcpy(p,"NJPC",4);
+      p[4]=m_srate&0xff;
+      p[5]=(m_srate>>8)&0xff;
+      p[6]=(m_srate>>16)&0xff;
+      p[7]=(m_srate>>24)&0xff;
+      p[8]=m_nch;
+      p[9]=16;
+      p[10]=p[11]=0;
+    }
+    WDL_Queue *GetOutQueue() { return &outqueue; }
+
+    static I_NJEncoder *Create(int srate, int nch, int bitrate, int serno) { return new NJPCM16Encoder(srate,nch); }
+
+  private:
+    WDL_Queue outqueue;
+    int m_srate, m_nch;
+};
+
+class NJPCM16Decoder : public I_NJDecoder
+{
+  public:
+    NJPCM16Decoder() { m_in.Resize(PCM16_SRC_BYTES); Reset(); }
+
+    int GetSampleRate() { return m_srate; }
+    int GetNumChannels() { return m_nch; }
+
+    // everything but a few bytes of a frame is decoded as it arrives, so this only grows for a caller
+    // handing over more than PCM16_SRC_BYTES at once (none do)
+    void *DecodeGetSrcBuffer(int srclen)
+    {
+      if (m_in.GetSize() < m_inlen+srclen) m_in.Resize(m_inlen+srclen+PCM16_SRC_BYTES);
+      return (char *)m_in.Get()+m_inlen;
+    }
+
+    void DecodeWrote(int srclen)
+    {
+      if (srclen <= 0) return;
+      m_inlen+=srclen;
+      unsigned char *p=(unsigned char *)m_in.Get();
+      int pos=0;
+
+      if (!m_srate)
+      {
+        if (m_inlen < PCM16_HDR_SIZE) return;
+        const unsigned int srate=p[4] | (p[5]<<8) | (p[6]<<16) | ((unsigned int)p[7]<<24);
+        if (memcmp(p,"NJPC",4) || p[9] != 16 || p[8] < 1 || p[8] > 2 ||
+            srate < PCM16_MIN_SRATE || srate > PCM16_MAX_SRATE)
+        {
+          m_inlen=0; // not something we can play
+          return;
+        }
+        m_srate=(int)srate;
+        m_nch=p[8];
+        pos=PCM16_HDR_SIZE;
+        if (m_ring.GetNumChannels() != m_nch) m_ring.Init(m_nch,PCM16_RING_FRAMES);
+      }
+
+      int frames=(m_inlen-pos)/(2*m_nch);
+      float *bufs[2]={m_tmp,m_tmp+PCM16_CHUNK};
+      while (frames > 0)
+      {
+        int n=frames < PCM16_CHUNK ? frames : PCM16_CHUNK;
+        int i,c;
+        for (i = 0; i < n; i ++)
+        {
+          for (c = 0; c < m_nch; c ++)
+          {
+            short v=(short)(p[pos] | (p[pos+1]<<8));
+            INT16_TO_float(bufs[c][i],v);
+            pos+=2;
+          }
+        }
+        m_ring.Write(bufs,n);
+        frames-=n;
+      }
+
+      if (pos > 0)
+      {
+        m_inlen-=pos;
+        if (m_inlen > 0) memmove(p,p+pos,m_inlen);
+      }
+    }
+
+    void Reset()
+    {
+      m_srate=0;
+      m_nch=1;
+      m_inlen=0;
+      m_ring.Clear();
+    }
+
+    WDL_PlanarRingBuf *GetRing() { return &m_ring; }
+
+    static I_NJDecoder *Create() { return new NJPCM16Decoder; }
+
+  private:
+    WDL_HeapBuf m_in;
+    int m_inlen;
+    float m_tmp[2*PCM16_CHUNK];
+    WDL_PlanarRingBuf m_ring;
+    int m_srate, m_nch;
+};
+
+
+// 'OGHv' streams: Vorbis without the three setup header packets, which are several kB and the
+// same every interval. each interval starts with a 16 byte prefix: "NJVH", flags (1=the headers
+// are in the stream as usual), 3 zero bytes, then 8 bytes identifying the headers (the start of a
+// SHA-1 of the packets). the headers are sent in the first interval, the interval after the channel
+// gains a subscriber, and every OGHV_HEADER_REFRESH after that as a fallback (servers that don't
+// report subscribers). decoders rebuild the rest from a cache of every set they've seen. clients with the same settings produce the same headers, so a hit is likely.
+#define OGHV_PREFIX_SIZE 16
+#define OGHV_HEADER_REFRESH 8
+#define OGHV_MAX_CACHED 64
+
+class VorbisHeaderSet
+{
+  public:
+    unsigned char id[8];
+    WDL_HeapBuf pkt[3];
+};
+
+static WDL_Mutex s_vhdr_cs;
+static WDL_PtrList<VorbisHeaderSet> s_vhdr; // most recently added last
+
+// pulls the header packets out of the start of an ogg stream. returns NULL if there aren't 3 yet.
+static VorbisHeaderSet *vorbis_parse_headers(const void *buf, int len)
+{
+  ogg_sync_state oy;
+  ogg_stream_state os;
+  ogg_page og;
+  ogg_packet op;
+  ogg_sync_init(&oy);
+  memset(&os,0,sizeof(os));
+  memcpy(ogg_sync_buffer(&oy,len),buf,len);
+  ogg_sync_wrote(&oy,len);
+
+  VorbisHeaderSet *hs=new VorbisHeaderSet;
+  int n=0, init=0;
+  while (n < 3 && ogg_sync_pageout(&oy,&og) > 0)
+  {
+    if (!init) ogg_stream_init(&os,ogg_page_serialno(&og));
+    init=1;
+    ogg_stream_pagein(&os,&og);
+    while (n < 3 && ogg_stream_packetout(&os,&op) > 0)
+    {
+      hs->pkt[n].Resize(op.bytes);
+      memcpy(hs->pkt[n].Get(),op.packet,op.bytes);
+      n++;
+    }
+  }
+  if (init) ogg_stream_clear(&os);
+  ogg_sync_clear(&oy);
+
+  if (n < 3)
+  {
+    delete hs;
+    return NULL;
+  }
+
+  WDL_SHA1 sha;
+  unsigned char hash[WDL_SHA1SIZE];
+  for (n = 0; n < 3; n ++)
+  {
+    int l=hs->pkt[n].GetSize();
+    unsigned char lb[4]={(unsigned char)l,(unsigned char)(l>>8),(unsigned char)(l>>16),(unsigned char)(l>>24)};
+    sha.add(lb,4);
+    sha.add(hs->pkt[n].Get(),l);
+  }
+  sha.result(hash);
+  memcpy(hs->id,hash,sizeof(hs->id));
+  return hs;
+}
+
+static void vorbis_cache_headers(VorbisHeaderSet *hs) // takes ownership
+{
+  s_vhdr_cs.Enter();
+  int x;
+  for (x = 0; x < s_vhdr.GetSize() && memcmp(s_vhdr.Get(x)->id,hs->id,sizeof(hs->id)); x ++);
+  if (x < s_vhdr.GetSize())
+  {
+    delete hs;
+  }
+  else
+  {
+    if (s_vhdr.GetSize() >= OGHV_MAX_CACHED)
+    {
+      delete s_vhdr.Get(0);
+      s_vhdr.Delete(0);
+    }
+    s_vhdr.Add(hs);
+  }
+  s_vhdr_cs.Leave();
+}
+
+// writes the header pages for stream serno, as the encoder would have, to q. 0 if id isn't cached.
+static int vorbis_build_header_pages(const unsigned char *id, int serno, WDL_Queue *q)
+{
+  s_vhdr_cs.Enter();
+  int x;
+  for (x = 0; x < s_vhdr.GetSize() && memcmp(s_vhdr.Get(x)->id,id,8); x ++);
+  VorbisHeaderSet *hs=s_vhdr.Get(x);
+  if (hs)
+  {
+    ogg_stream_state os;
+    ogg_stream_init(&os,serno);
+    int n;
+    for (n = 0; n < 3; n ++)
+    {
+      ogg_packet op;
+      memset(&op,0,sizeof(op));
+      op.packet=(unsigned char *)hs->pkt[n].Get();
+      op.bytes=hs->pkt[n].GetSize();
+      op.b_o_s=!n;
+      op.packetno=n;
+      ogg_stream_packetin(&os,&op);
+    }
+    ogg_page og;
+    while (ogg_stream_flush(&os,&og))
+    {
+      q->Add(og.header,og.header_len);
+      q->Add(og.body,og.body_len);
+    }
+    ogg_stream_clear(&os);
+  }
+  s_vhdr_cs.Leave();
+  return !!hs;
+}
+
+class NJVorbisHEncoder : public I_NJEncoder
+{
+  public:
+    NJVorbisHEncoder(int srate, int nch, int bitrate, int serno) : m_enc(srate,nch,bitrate,serno), m_intervals(0), m_force(0)
+    {
+      memset(m_id,0,sizeof(m_id));
+      if (!m_enc.isError()) startInterval();
+    }
+
+    void Encode(float *in, int inlen, int advance=1, int spacing=1) { m_enc.Encode(in,inlen,advance,spacing); }
+    int isError() { return m_enc.isError(); }
+    void reinit()
+    {
+      m_enc.reinit();
+      startInterval();
+    }
+    WDL_Queue *GetOutQueue() { return &m_enc.outqueue; }
+    void SendHeadersNext() { m_force=1; }
+
+    static I_NJEncoder *Create(int srate, int nch, int bitrate, int serno) { return new NJVorbisHEncoder(srate,nch,bitrate,serno); }
+
+  private:
+    void startInterval()
+    {
+      // right after (re)init, all that's in the queue is the header pages
+      WDL_Queue *q=&m_enc.outqueue;
+      int hlen=q->Available();
+      if (m_hdrpages.GetSize() != hlen) m_hdrpages.Resize(hlen);
+      memcpy(m_hdrpages.Get(),q->Get(),hlen);
+      q->Advance(hlen);
+      q->Compact();
+
+      if (!m_intervals)
+      {
+        VorbisHeaderSet *hs=vorbis_parse_headers(m_hdrpages.Get(),hlen);
+        if (hs)
+        {
+          memcpy(m_id,hs->id,sizeof(m_id));
+          vorbis_cache_headers(hs); // so we can play back what we saved
+        }
+      }
+
+      int inband=m_force || !(m_intervals % OGHV_HEADER_REFRESH);
+      m_intervals++;
+      m_force=0;
+      unsigned char *p=(unsigned char *)q->Add(NULL,OGHV_PREFIX_SIZE);
+      memcpy(p,"NJVH",4);
+      p[4]=inband;
+      p[5]=p[6]=p[7]=0;
+      memcpy(p+8,m_id,8);
+      if (inband) q->Add(m_hdrpages.Get(),hlen);
+    }
+
+    VorbisEncoder m_enc;
+    WDL_HeapBuf m_hdrpages;
+    unsigned char m_id[8];
+    int m_intervals;
+    int m_force; // headers in the next interval regardless of the refresh count
+};
+
+class NJVorbisHDecoder : public I_NJDecoder
+{
+  public:
+    NJVorbisHDecoder() : m_state(0), m_prelen(0) { m_dec.SetPlanarOutput(true); }
+
+    int GetSampleRate() { return m_dec.GetSampleRate(); }
+    int GetNumChannels() { return m_dec.GetNumChannels(); }
+
+    void *DecodeGetSrcBuffer(int srclen)
+    {
+      if (m_state == 1) return m_dec.DecodeGetSrcBuffer(srclen);
+      if (m_state == 2) m_prelen=0;
+      if (m_pre.GetSize() < m_prelen+srclen) m_pre.Resize(m_prelen+srclen+4096);
+      return (char *)m_pre.Get()+m_prelen;
+    }
+
+    void DecodeWrote(int srclen)
+    {
+      if (m_state == 1)
+      {
+        m_dec.DecodeWrote(srclen);
+        return;
+      }
+      if (m_state == 2 || srclen <= 0) return;
+
+      m_prelen+=srclen;
+      if (m_prelen < OGHV_PREFIX_SIZE) return;
+
+      unsigned char *p=(unsigned char *)m_pre.Get();
+      if (memcmp(p,"NJVH",4))
+      {
+        m_state=2;
+        return;
+      }
+
+      WDL_Queue q;
+      if (p[4]&1)
+      {
+        // headers are in the stream, wait for all of them and remember them
+        VorbisHeaderSet *hs=vorbis_parse_headers(p+OGHV_PREFIX_SIZE,m_prelen-OGHV_PREFIX_SIZE);
+        if (!hs)
+        {
+          if (m_prelen > 256*1024) m_state=2;
+          return;
+        }
+        vorbis_cache_headers(hs);
+      }
+      else
+      {
+        // rebuild them for the stream's serial, which is in the first page header
+        if (m_prelen < OGHV_PREFIX_SIZE+27) return;
+        unsigned char *pg=p+OGHV_PREFIX_SIZE;
+        if (memcmp(pg,"OggS",4) ||
+            !vorbis_build_header_pages(p+8,pg[14] | (pg[15]<<8) | (pg[16]<<16) | (pg[17]<<24),&q))
+        {
+          m_state=2; // never saw its headers
+          return;
+        }
+      }
+
+      q.Add(p+OGHV_PREFIX_SIZE,m_prelen-OGHV_PREFIX_SIZE);
+      m_state=1;
+      m_prelen=0;
+      int l=q.Available();
+      memcpy(m_dec.DecodeGetSrcBuffer(l),q.Get(),l);
+      m_dec.DecodeWrote(l);
+    }
+
+    void Reset()
+    {
+      m_dec.Reset();
+      m_state=0;
+      m_prelen=0;
+    }
+    WDL_PlanarRingBuf *GetRing() { return &m_dec.m_ring; }
+    void SetSkip(bool skip) { m_dec.SetSkip(skip); }
+    int GetSkipped() { return m_dec.GetSkipped(); }
+    void ConsumeSkipped(int frames) { m_dec.ConsumeSkipped(frames); }
+
+    static I_NJDecoder *Create() { return new NJVorbisHDecoder; }
+
+  private:
+    VorbisDecoder m_dec;
+    int m_state; // 0=reading the prefix (and the headers, if they're there), 1=decoding, 2=can't play this
+    WDL_HeapBuf m_pre;
+    int m_prelen;
+};
+
+
+static const NJ_CodecInfo s_codec_vorbis={NJ_CODEC_VORBIS,"vorbis",NJVorbisEncoder::Create,NJVorbisDecoder::Create};
+static const NJ_CodecInfo s_codec_vorbis_h={NJ_CODEC_VORBIS_HDRLESS,"vorbish",NJVorbisHEncoder::Create,NJVorbisHDecoder::Create};
+static const NJ_CodecInfo s_codec_pcm16={NJ_CODEC_PCM16,"pcm",NJPCM16Encoder::Create,NJPCM16Decoder::Create};
+
+static WDL_PtrList<const NJ_CodecInfo> *nj_codecs()
+{
+  static WDL_PtrList<const NJ_CodecInfo> *list;
+  if (!list)
+  {
+    list=new WDL_PtrList<const NJ_CodecInfo>;
+    list->Add(&s_codec_vorbis);
+    list->Add(&s_codec_vorbis_h);
+    list->Add(&s_codec_pcm16);
+  }
+  return list;
+}
+
+void NJ_RegisterCodec(const NJ_CodecInfo *codec)
+{
+  if (!codec || !codec->fourcc) return;
+  WDL_PtrList<const NJ_CodecInfo> *list=nj_codecs();
+  int x;
+  for (x = 0; x < list->GetSize() && list->Get(x)->fourcc != codec->fourcc; x ++);
+  if (x < list->GetSize()) list->Set(x,codec);
+  else list->Add(codec);
+}
+
+const NJ_CodecInfo *NJ_GetCodec(unsigned int fourcc)
+{
+  WDL_PtrList<const NJ_CodecInfo> *list=nj_codecs();
+  int x;
+  for (x = 0; x < list->GetSize(); x ++)
+    if (list->Get(x)->fourcc == fourcc) return list->Get(x);
+  return NULL;
+}
+
+const NJ_CodecInfo *NJ_EnumCodecs(int idx)
+{
+  return nj_codecs()->Get(idx);
+}
+
+const NJ_CodecInfo *NJ_FindCodecByName(const char *name)
+{
+  WDL_PtrList<const NJ_CodecInfo> *list=nj_codecs();
+  int x;
+  for (x = 0; x < list->GetSize(); x ++)
+    if (list->Get(x)->name && !strcasecmp(list->Get(x)->name,name)) return list->Get(x);
+  return NULL;
+}
+
+
+// decoders that finished an interval, kept for the next one. Reset() leaves the codec setup
+// (Vorbis codebooks etc) in place and it gets reused if the next stream's headers are the same,
+// so each is tagged with the channel it last played and Get() prefers one from the same channel.
+#define DECODER_POOL_SIZE 64
+
+class PooledDecoder
+{
+  public:
+    I_NJDecoder *dec;
+    unsigned int fourcc, tag;
+};
+
+class DecoderPool
+{
+  public:
+    DecoderPool() { }
+    ~DecoderPool()
+    {
+      int x;
+      for (x = 0; x < m_list.GetSize(); x ++)
+      {
+        delete m_list.Get(x)->dec;
+        delete m_list.Get(x);
+      }
+      m_list.Empty();
+    }
+
+    I_NJDecoder *Get(unsigned int fourcc, unsigned int tag) // NULL if there isn't one
+    {
+      m_cs.Enter();
+      int x, best=-1;
+      for (x = m_list.GetSize()-1; x >= 0; x --)
+      {
+        PooledDecoder *p=m_list.Get(x);
+        if (p->fourcc != fourcc) continue;
+        if (p->tag == tag) { best=x; break; }
+        if (best < 0) best=x;
+      }
+      I_NJDecoder *dec=NULL;
+      if (best >= 0)
+      {
+        PooledDecoder *p=m_list.Get(best);
+        m_list.Delete(best);
+        dec=p->dec;
+        delete p;
+      }
+      m_cs.Leave();
+      return dec;
+    }
+
+    void Put(I_NJDecoder *dec, unsigned int fourcc, unsigned int tag)
+    {
+      if (!dec) return;
+      dec->Reset();
+      PooledDecoder *p=new PooledDecoder, *old=NULL;
+      p->dec=dec;
+      p->fourcc=fourcc;
+      p->tag=tag;
+      m_cs.Enter();
+      if (m_list.GetSize() >= DECODER_POOL_SIZE)
+      {
+        old=m_list.Get(0);
+        m_list.Delete(0);
+      }
+      m_list.Add(p);
+      m_cs.Leave();
+      if (old)
+      {
+        delete old->dec;
+        delete old;
+      }
+    }
+
+  private:
+    WDL_Mutex m_cs;
+    WDL_PtrList<PooledDecoder> m_list; // least recently returned first
+};
+
+static unsigned int decoder_tag(const char *username, int chidx)
+{
+  unsigned int h=2166136261u;
+  while (*username) h=(h ^ (unsigned char)*username++)*16777619u;
+  return (h ^ (unsigned int)chidx)*16777619u;
+}
+
+
+#ifdef _WIN32
+#define NJ_MEMBARRIER() MemoryBarrier()
+#define NJ_ATOMIC_ADD(x,n) InterlockedExchangeAdd((volatile LONG *)&(x),(n)) // returns the old value
+#define NJ_ATOMIC_CAS(x,o,n) (InterlockedCompareExchange((volatile LONG *)&(x),(n),(o)) == (o))
+#define NJ_ATOMIC_CASPTR(x,o,n) (InterlockedCompareExchangePointer((PVOID volatile *)&(x),(n),(o)) == (o))
+#else
+#define NJ_MEMBARRIER() __sync_synchronize()
+#define NJ_ATOMIC_ADD(x,n) __sync_fetch_and_add(&(x),(n))
+#define NJ_ATOMIC_CAS(x,o,n) __sync_bool_compare_and_swap(&(x),(o),(n))
+#define NJ_ATOMIC_CASPTR(x,o,n) __sync_bool_compare_and_swap(&(x),(o),(n))
+#endif
+
+// objects the audio thread is done with, deleted by Run() so that file, codec and heap
+// teardown happen outside of the audio callback. they link themselves into a lock-free
+// list, so adding never allocates and there's nothing to fill up. any number of
+// producers (the audio thread, mix workers), one consumer (Run()).
+class Retirable
+{
+  public:
+    Retirable() : retire_next(0) { }
+    virtual ~Retirable() { }
+
+    Retirable *retire_next;
+};
+
+// compressed interval data on its way to a decoder. the network thread appends what it
+// downloads (or a whole file read from disk), the decoder reads it back from memory, so
+// playback never touches the disk from the audio thread. one writer, one reader: the chunks
+// form a list that only ever grows at the tail, and m_size is published after the bytes it
+// covers. chunks are freed when the last reference (download, DecodeState) is released,
+// which never happens on the audio thread.
+#define STREAMBUF_CHUNK 16384
+
+class StreamBuf
+{
+  public:
+    StreamBuf() : m_refcnt(1), m_head(0), m_tail(0), m_tailused(0), m_size(0), m_rdchunk(0), m_rdoff(0), m_rdpos(0) { }
+
+    void AddRef() { NJ_ATOMIC_ADD(m_refcnt,1); }
+    void Release() { if (NJ_ATOMIC_ADD(m_refcnt,-1) == 1) delete this; }
+
+    void Write(const void *buf, int len) // writer only, allocates
+    {
+      while (len > 0)
+      {
+        if (!m_tail || m_tailused == STREAMBUF_CHUNK)
+        {
+          Chunk *c=new Chunk;
+          c->next=0;
+          if (m_tail) m_tail->next=c;
+          else m_head=c;
+          m_tail=c;
+          m_tailused=0;
+        }
+        int l=STREAMBUF_CHUNK-m_tailused;
+        if (l > len) l=len;
+        memcpy(m_tail->data+m_tailused,buf,l);
+        m_tailused+=l;
+        buf=(const char *)buf+l;
+        len-=l;
+        NJ_MEMBARRIER();
+        m_size+=l;
+      }
+    }
+
+    int Read(void *buf, int len) // reader only, returns bytes read (0 if it has caught up)
+    {
+      int avail=m_size;
+      NJ_MEMBARRIER();
+      int done=0;
+      while (done < len && m_rdpos < avail)
+      {
+        if (!m_rdchunk) m_rdchunk=m_head;
+        else if (m_rdoff == STREAMBUF_CHUNK)
+        {
+          m_rdchunk=m_rdchunk->next;
+          m_rdoff=0;
+        }
+        int l=STREAMBUF_CHUNK-m_rdoff;
+        if (l > len-done) l=len-done;
+        if (l > avail-m_rdpos) l=avail-m_rdpos;
+        memcpy((char *)buf+done,m_rdchunk->data+m_rdoff,l);
+        m_rdoff+=l;
+        m_rdpos+=l;
+        done+=l;
+      }
+      return done;
+    }
+
+    int GetSize() const { return m_size; }
+    int GetReadPos() const { return m_rdpos; }
+
+  private:
+    ~StreamBuf()
+    {
+      while (m_head)
+      {
+        Chunk *next=m_head->next;
+        delete m_head;
+        m_head=next;
+      }
+    }
+
+    struct Chunk
+    {
+      Chunk *next;
+      char data[STREAMBUF_CHUNK];
+    };
+
+    volatile int m_refcnt;
+    Chunk *m_head, *m_tail;
+    int m_tailused; // writer
+    volatile int m_size;
+    Chunk *m_rdchunk; // reader
+    int m_rdoff, m_rdpos;
+};
+
+class DecodeState : public Retirable
+{
+  public:
+    DecodeState() : decode_src(0), decode_codec(0), dump_samples(0),
+                                           decode_samplesout(0), resampler(0), decode_peak_vol(0.0),
+                                           pool(0), pool_fourcc(0), pool_tag(0)
+    { 
+      memset(guid,0,sizeof(guid));
+    }
+    ~DecodeState()
+    {
+      if (pool) pool->Put(decode_codec,pool_fourcc,pool_tag);
+      else delete decode_codec;
+      decode_codec=0;
+      delete resampler;
+      resampler=0;
+      if (decode_src) decode_src->Release();
+      decode_src=0;
+    }
+
+    unsigned char guid[16];
+    double decode_peak_vol;
+
+    StreamBuf *decode_src;
+    I_NJDecoder *decode_codec;
+    int decode_samplesout; // frames
+    int dump_samples; // frames
+    WDL_Resampler *resampler; // set up by start_decode if the stream's samplerate isn't ours
+
+    DecoderPool *pool; // decode_codec goes back here
+    unsigned int pool_fourcc, pool_tag;
+};
+
+
+
+// Retirables waiting for Run() to delete them
+class RetireQueue
+{
+  public:
+    RetireQueue() : m_head(0) { }
+    ~RetireQueue() { Drain(); }
+
+    void Add(Retirable *p)
+    {
+      if (!p) return;
+      Retirable *h;
+      do
+      {
+        h=m_head;
+        p->retire_next=h;
+      }
+      while (!NJ_ATOMIC_CASPTR(m_head,h,p));
+    }
+
+    int Drain() // returns number deleted
+    {
+      Retirable *p;
+      do p=m_head; while (p && !NJ_ATOMIC_CASPTR(m_head,p,(Retirable *)NULL));
+      int n=0;
+      while (p)
+      {
+        Retirable *next=p->retire_next;
+        delete p;
+        p=next;
+        n++;
+      }
+      return n;
+    }
+
+  private:
+    Retirable * volatile m_head;
+};
+
+
+// adaptive prebuffer for one remote channel. the main thread feeds it the download
+// messages, stamped with the session (interval) clock in ms, and it picks how many
+// compressed bytes to wait for so that underruns happen with roughly the target probability.
+class JitterEstimator
+{
+  public:
+    JitterEstimator() : underruns(0) { Reset(); }
+
+    void Reset()
+    {
+      gap_mean=gap_var=0.0;
+      rate_in=rate_out=0.0;
+      interval_ms=0.0;
+      ngaps=0;
+      margin=1.0;
+      underruns_seen=underruns;
+      depth=0;
+    }
+
+    void OnData(int gap); // ms since the previous message of the same download
+    void OnEnd(unsigned int now, unsigned int start, int bytes, double intms);
+    int Update(double target, int fallback);
+
+    double gap_mean, gap_var; // ms between data messages
+    double rate_in, rate_out; // bytes/ms, per-interval arrival and playback
+    double interval_ms;
+    int ngaps;
+    double margin; // grows on underruns, decays on clean intervals
+    volatile int underruns; // incremented (atomically) by the audio thread and mix workers
+    int underruns_seen;
+    int depth;
+};
+
+// worker threads that mix remote channels alongside the audio thread (config_mix_threads). the audio
+// thread lists the channels to mix and wakes the workers, then everybody takes channels off the list
+// until it's empty. the audio thread mixes straight into the output, each worker into its own buffer,
+// which the audio thread adds in once they're done. a worker that hasn't woken up by the time the
+// audio thread runs out of channels is called off rather than waited for. every channel has its own
+// DecodeState, so the only thing shared is the list.
+#define MIX_MAX_THREADS 8
+#define MIX_MAX_JOBS 1024
+#define MIX_MAX_FRAMES 8192 // bigger callbacks are mixed on the audio thread alone
+#define RESAMPLE_CHUNK 1024 // mixInChannel resamples this many frames at a time, scratch is sized for it
+
+class MixSignal // counting semaphore
+{
+  public:
+#ifdef _WIN32
+    MixSignal() { m_sem=CreateSemaphore(NULL,0,0x7fffffff,NULL); }
+    ~MixSignal() { CloseHandle(m_sem); }
+    void Post() { ReleaseSemaphore(m_sem,1,NULL); }
+    void Wait() { WaitForSingleObject(m_sem,INFINITE); }
+    void Wait(int ms) { WaitForSingleObject(m_sem,ms); }
+  private:
+    HANDLE m_sem;
+#elif defined(__APPLE__)
+    MixSignal() { m_sem=dispatch_semaphore_create(0); }
+    ~MixSignal() { dispatch_release(m_sem); }
+    void Post() { dispatch_semaphore_signal(m_sem); }
+    void Wait() { dispatch_semaphore_wait(m_sem,DISPATCH_TIME_FOREVER); }
+    void Wait(int ms) { dispatch_semaphore_wait(m_sem,dispatch_time(DISPATCH_TIME_NOW,ms*(int64_t)1000000)); }
+  private:
+    dispatch_semaphore_t m_sem;
+#else
+    MixSignal() { sem_init(&m_sem,0,0); }
+    ~MixSignal() { sem_destroy(&m_sem); }
+    void Post() { sem_post(&m_sem); }
+    void Wait() { while (sem_wait(&m_sem) && errno == EINTR); }
+    void Wait(int ms)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME,&ts);
+      ts.tv_nsec+=(ms%1000)*1000000;
+      ts.tv_sec+=ms/1000 + ts.tv_nsec/1000000000;
+      ts.tv_nsec%=1000000000;
+      while (sem_timedwait(&m_sem,&ts) && errno == EINTR);
+    }
+  private:
+    sem_t m_sem;
+#endif
+};
+
+class MixJob
+{
+  public:
+    DecodeState *ds;
+    volatile int *underruns;
+    bool muted;
+    float vol, pan;
+};
+
+class MixWorkers
+{
+  public:
+    MixWorkers(NJClient *parent) : m_parent(parent), m_nthreads(0), m_nactive(0), m_inmix(0),
+                                   m_njobs(0), m_next(0), m_prio_gen(0)
+    {
+#ifndef _WIN32
+      m_prio_pol=-1;
+      memset(&m_prio,0,sizeof(m_prio));
+#endif
+    }
+    ~MixWorkers() { SetThreads(0); }
+
+    // not from the audio thread
+    void SetThreads(int n)
+    {
+      if (n < 0) n=0;
+      else if (n > MIX_MAX_THREADS) n=MIX_MAX_THREADS;
+      if (n == m_nactive) return;
+
+      if (n < m_nactive)
+      {
+        m_nactive=n;
+        NJ_MEMBARRIER();
+        while (m_inmix)
+        {
+#ifdef _WIN32
+          Sleep(1);
+#else
+          struct timespec ts={0,1000*1000};
+          nanosleep(&ts,NULL);
+#endif
+        }
+      }
+      while (m_nthreads > n)
+      {
+        Worker *w=m_workers[--m_nthreads];
+        w->quit=1;
+        w->sig.Post();
+#ifdef _WIN32
+        WaitForSingleObject(w->thread,INFINITE);
+        CloseHandle(w->thread);
+#else
+        pthread_join(w->thread,NULL);
+#endif
+        delete w;
+      }
+      while (m_nthreads < n)
+      {
+        Worker *w=new Worker;
+        w->owner=this;
+        w->buf.Resize(MIX_MAX_FRAMES*2);
+        w->rstmp.Resize(RESAMPLE_CHUNK*2);
+#ifdef _WIN32
+        DWORD id;
+        w->thread=CreateThread(NULL,0,ThreadProc,w,0,&id);
+        if (!w->thread) { delete w; break; }
+        SetThreadPriority(w->thread,THREAD_PRIORITY_TIME_CRITICAL);
+#else
+        if (pthread_create(&w->thread,NULL,ThreadProc,w)) { delete w; break; }
+#endif
+        m_workers[m_nthreads++]=w;
+      }
+      NJ_MEMBARRIER();
+      m_nactive=m_nthreads;
+    }
+
+    // audio thread, under m_users_cs. channels that don't fit are mixed right away.
+    void Begin()
+    {
+      m_njobs=0;
+    }
+    void AddJob(bool muted, float vol, float pan, DecodeState *ds, volatile int *underruns,
+                float **outbuf, int len, int srate, int outnch, int offset, double decay)
+    {
+      if (m_njobs < MIX_MAX_JOBS)
+      {
+        MixJob *j=&m_jobs[m_njobs++];
+        j->ds=ds;
+        j->underruns=underruns;
+        j->muted=muted;
+        j->vol=vol;
+        j->pan=pan;
+      }
+      else if (m_parent->mixInChannel(muted,vol,pan,ds,outbuf,len,srate,outnch,offset,decay,&m_parent->m_resample_tmp))
+        NJ_ATOMIC_ADD(*underruns,1);
+    }
+    void Run(float **outbuf, int len, int srate, int outnch, int offset, double decay)
+    {
+      m_inmix=1;
+      NJ_MEMBARRIER();
+      int nw=m_nactive;
+      if (len > MIX_MAX_FRAMES || m_njobs < 2) nw=0;
+      else if (nw > m_njobs-1) nw=m_njobs-1;
+
+      m_len=len;
+      m_srate=srate;
+      m_outnch=outnch;
+      m_decay=decay;
+      m_next=0;
+
+#ifndef _WIN32
+      if (nw)
+      {
+        // workers run at our priority
+        int pol;
+        struct sched_param sp;
+        if (!pthread_getschedparam(pthread_self(),&pol,&sp) && (pol != m_prio_pol || sp.sched_priority != m_prio.sched_priority))
+        {
+          m_prio_pol=pol;
+          m_prio=sp;
+          m_prio_gen++;
+        }
+      }
+#endif
+
+      int x;
+      for (x = 0; x < nw; x ++)
+      {
+        m_workers[x]->used=0;
+        m_workers[x]->state=WORKER_POSTED;
+        m_workers[x]->sig.Post();
+      }
+
+      DoJobs(outbuf,offset,&m_parent->m_resample_tmp);
+
+      const WDL_PCMMix_Funcs *mix=WDL_PCMMix_Get();
+      for (x = 0; x < nw; x ++)
+      {
+        Worker *w=m_workers[x];
+        if (NJ_ATOMIC_CAS(w->state,WORKER_POSTED,WORKER_IDLE)) continue; // never got going
+        while (w->state == WORKER_RUNNING)
+        {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+          __asm__ __volatile__("pause");
+#endif
+        }
+        NJ_MEMBARRIER();
+        w->state=WORKER_IDLE;
+        if (!w->used) continue;
+        float *b=w->buf.Get();
+        mix->add(b,outbuf[0]+offset,len);
+        if (outnch > 1) mix->add(b+MIX_MAX_FRAMES,outbuf[1]+offset,len);
+      }
+      m_inmix=0;
+    }
+
+  private:
+    enum { WORKER_IDLE=0, WORKER_POSTED, WORKER_RUNNING, WORKER_DONE };
+    class Worker
+    {
+      public:
+        Worker() : owner(0), quit(0), state(WORKER_IDLE), used(0), prio_gen(0) { }
+        MixWorkers *owner;
+        MixSignal sig;
+        volatile int quit;
+        volatile int state;
+        int used;
+        int prio_gen;
+        WDL_TypedBuf<float> buf; // 2 channels of MIX_MAX_FRAMES
+        WDL_TypedBuf<float> rstmp;
+#ifdef _WIN32
+        HANDLE thread;
+#else
+        pthread_t thread;
+#endif
+    };
+
+    void DoJobs(float **outbuf, int offset, WDL_TypedBuf<float> *rstmp, Worker *w=NULL)
+    {
+      for (;;)
+      {
+        int i=NJ_ATOMIC_ADD(m_next,1);
+        if (i >= m_njobs) break;
+        if (w && !w->used)
+        {
+          w->used=1;
+          memset(w->buf.Get(),0,MIX_MAX_FRAMES*2*sizeof(float));
+        }
+        MixJob *j=&m_jobs[i];
+        if (m_parent->mixInChannel(j->muted,j->vol,j->pan,j->ds,outbuf,m_len,m_srate,m_outnch,offset,m_decay,rstmp))
+          NJ_ATOMIC_ADD(*j->underruns,1);
+      }
+    }
+
+#ifdef _WIN32
+    static DWORD WINAPI ThreadProc(LPVOID p)
+#else
+    static void *ThreadProc(void *p)
+#endif
+    {
+      Worker *w=(Worker *)p;
+      MixWorkers *_this=w->owner;
+      for (;;)
+      {
+        w->sig.Wait();
+        if (w->quit) break;
+        if (!NJ_ATOMIC_CAS(w->state,WORKER_POSTED,WORKER_RUNNING)) continue; // called off, or a stale wakeup
+#ifndef _WIN32
+        if (w->prio_gen != _this->m_prio_gen)
+        {
+          w->prio_gen=_this->m_prio_gen;
+          pthread_setschedparam(pthread_self(),_this->m_prio_pol,&_this->m_prio);
+        }
+#endif
+        float *b=w->buf.Get();
+        float *outbuf[2]={b,b+MIX_MAX_FRAMES};
+        RTCHECK_ENTER(); // the audio thread waits on this, it's held to the same rules
+        _this->DoJobs(outbuf,0,&w->rstmp,w);
+        RTCHECK_LEAVE();
+        NJ_MEMBARRIER();
+        w->state=WORKER_DONE;
+      }
+      return 0;
+    }
+
+    NJClient *m_parent;
+    Worker *m_workers[MIX_MAX_THREADS];
+    int m_nthreads; // only touched by SetThreads()
+    volatile int m_nactive; // how many the audio thread may use
+    volatile int m_inmix;
+
+    MixJob m_jobs[MIX_MAX_JOBS];
+    int m_njobs;
+    volatile int m_next;
+    int m_len, m_srate, m_outnch;
+    double m_decay;
+
+#ifndef _WIN32
+    volatile int m_prio_gen;
+    int m_prio_pol;
+    struct sched_param m_prio;
+#else
+    int m_prio_gen;
+#endif
+};
+
+
+// runs NJClient::encodeRun() on a thread of its own, so encoding and uploading the local channels
+// doesn't wait for the host to call Run(), or on whatever the host holds around it. the audio thread
+// wakes it after queueing blocks; it also wakes every 20ms by itself, which keeps the upload budget
+// draining when there's nothing new.
+class EncodeThread
+{
+  public:
+    EncodeThread(NJClient *parent) : m_parent(parent), m_quit(0), m_posted(0), m_running(0)
+    {
+#ifdef _WIN32
+      DWORD id;
+      m_thread=CreateThread(NULL,0,ThreadProc,this,0,&id);
+      m_running=!!m_thread;
+#else
+      m_running=!pthread_create(&m_thread,NULL,ThreadProc,this);
+#endif
+    }
+    ~EncodeThread()
+    {
+      m_quit=1;
+      m_sig.Post();
+      if (m_running)
+      {
+#ifdef _WIN32
+        WaitForSingleObject(m_thread,INFINITE);
+        CloseHandle(m_thread);
+#else
+        pthread_join(m_thread,NULL);
+#endif
+      }
+    }
+
+    void Wake() // audio thread, at most one post outstanding
+    {
+      if (NJ_ATOMIC_CAS(m_posted,0,1)) m_sig.Post();
+    }
+
+  private:
+#ifdef _WIN32
+    static DWORD WINAPI ThreadProc(LPVOID p)
+#else
+    static void *ThreadProc(void *p)
+#endif
+    {
+      EncodeThread *_this=(EncodeThread *)p;
+      NJClient *parent=_this->m_parent;
+      while (!_this->m_quit)
+      {
+        _this->m_sig.Wait(20);
+        _this->m_posted=0;
+        if (_this->m_quit) break;
+
+        int did;
+        do
+        {
+          parent->m_enc_cs.Enter(); // let go between passes, so adding or removing a channel doesn't wait long
+          did=parent->encodeRun();
+          parent->m_enc_cs.Leave();
+        }
+        while (did && !_this->m_quit);
+      }
+      return 0;
+    }
+
+    NJClient *m_parent;
+    MixSignal m_sig;
+    volatile int m_quit, m_posted;
+    int m_running;
+#ifdef _WIN32
+    HANDLE m_thread;
+#else
+    pthread_t m_thread;
+#endif
+};
+
+
+// runs the engine at config_engine_srate when the device is faster: input is converted down on the way in
+// and output back up on the way out. both converters work on planar buffers owned here, so after the first
+// block (and any change of format) there's no allocation.
+#define ENGINERATE_MINBLOCK 4096 // converters are sized for at least this, so hosts varying their block size don't cause rebuilds
+
+class EngineRate : public Retirable
+{
+  public:
+    // built by NJClient::updateEngineRate() off the audio thread (filter tables, allocation), the audio
+    // thread picks it up and retires the one it replaces
+    EngineRate(int devrate, int rate, int innch, int outnch, int len, int quality) : m_devrate(devrate), m_rate(rate),
+      m_innch(innch), m_outnch(outnch), m_maxlen(len), m_quality(quality), m_elen(0)
+    {
+
+      m_in_rs.Init(devrate,rate,innch>0?innch:1,quality);
+      m_out_rs.Init(rate,devrate,outnch>0?outnch:1,quality);
+
+      // most engine frames one block can need, the output side rounds up and looks ahead
+      m_elen=(int)ceil(len*(double)rate/devrate) + m_out_rs.GetLookahead()*2 + 8;
+
+      // the input side comes out behind by its lookahead, the output side asks for extra up front.
+      // start with enough silence queued that the engine never has to be fed a gap.
+      int prime=m_in_rs.GetLookahead() + m_out_rs.GetLookahead() + 2;
+      int fnch=innch>0?innch:1;
+      m_fifo.Init(fnch,m_elen*2+prime);
+      m_fifo.Clear();
+      m_buf.Resize(fnch*(m_elen > prime ? m_elen : prime));
+      memset(m_buf.Get(),0,m_buf.GetSize()*sizeof(float));
+      float **ptrs=m_inptrs.Resize(fnch);
+      int c;
+      for (c = 0; c < fnch; c ++) ptrs[c]=m_buf.Get();
+      m_fifo.Write(ptrs,prime);
+      for (c = 0; c < fnch; c ++) ptrs[c]=m_buf.Get()+c*m_elen;
+      m_outptrs.Resize(outnch>0?outnch:1);
+
+      m_in_rs.GetInputBuffer(0,len); // sizes for a whole block
+      m_out_rs.GetInputBuffer(0,m_elen);
+    }
+
+    // audio thread
+    bool Matches(int devrate, int rate, int innch, int outnch, int len, int quality) const
+    {
+      return devrate == m_devrate && rate == m_rate && innch == m_innch && outnch == m_outnch &&
+             len <= m_maxlen && quality == m_quality;
+    }
+
+    // converts a block of device input, returns how many engine frames to process. inbuf gets the engine's input.
+    int In(float **devin, int len, float ***inbuf)
+    {
+      int n=m_out_rs.GetInputNeeded(len);
+      if (n > m_elen) n=m_elen;
+      float **ptrs=m_inptrs.Get();
+      if (m_innch > 0)
+      {
+        int c;
+        for (c = 0; c < m_innch; c ++) memcpy(m_in_rs.GetInputBuffer(c,len),devin[c],len*sizeof(float));
+        m_in_rs.AddInput(len);
+        m_fifo.Write(ptrs,m_in_rs.Process(ptrs,m_elen));
+
+        int a=m_fifo.Available();
+        if (a > n) a=n;
+        for (c = 0; c < m_innch; c ++)
+        {
+          m_fifo.Read(c,ptrs[c],a);
+          if (a < n) memset(ptrs[c]+a,0,(n-a)*sizeof(float)); // shouldn't happen once primed
+        }
+        m_fifo.Advance(a);
+      }
+      *inbuf=ptrs;
+      return n;
+    }
+
+    // where the engine writes its n frames of output
+    float **OutBuffers(int n)
+    {
+      float **ptrs=m_outptrs.Get();
+      int c;
+      for (c = 0; c < m_out_rs.GetNumChannels(); c ++) ptrs[c]=m_out_rs.GetInputBuffer(c,n);
+      return ptrs;
+    }
+
+    // converts what the engine wrote back to the device rate
+    void Out(int n, float **devout, int len)
+    {
+      m_out_rs.AddInput(n);
+      int got=m_outnch > 0 ? m_out_rs.Process(devout,len) : 0;
+      int c;
+      if (got < len) for (c = 0; c < m_outnch; c ++) memset(devout[c]+got,0,(len-got)*sizeof(float));
+    }
+
+  private:
+    int m_devrate, m_rate, m_innch, m_outnch, m_maxlen, m_quality;
+    int m_elen;
+    WDL_Resampler m_in_rs, m_out_rs;
+    WDL_PlanarRingBuf m_fifo; // engine rate input, waiting for the engine
+    WDL_TypedBuf<float> m_buf;
+    WDL_TypedBuf<float *> m_inptrs, m_outptrs;
+};
+
+
+// round trip measurement, see NJClient::StartLatencyCalibration(). runs in place of the engine: a half second of
+// listening to the noise floor, then LATCAL_PINGS windows of half a second that each start with a one sample click
+// on every output. the loudest input sample in a window is the click coming back, and where the input first
+// reached half of that is the round trip (filters in the path ring a little before the peak, never by half).
+#define LATCAL_PINGS 8
+#define LATCAL_MAXWIN 192000 // half a second at 384kHz
+#define LATCAL_LEVEL 0.5f
+#define LATCAL_STALL_SEC 2.0 // GetLatencyCalibration() gives up if the audio thread hasn't run us for this long
+
+class LatencyCal
+{
+  public:
+    LatencyCal() : m_state(0), m_result(0.0), m_frames(0), m_seen(0), m_seen_t(0.0),
+                   m_srate(0), m_win(0), m_pos(0), m_ping(0), m_noise(0.0f), m_nres(0)
+    {
+      m_buf.Resize(LATCAL_MAXWIN,false);
+    }
+
+    volatile int m_state; // 0 idle, 1 measuring, 2 done (m_result set), -1 failed
+    double m_result; // seconds
+
+    // host thread
+    int Start()
+    {
+      if (m_state == 1) return -1;
+      m_srate=0;
+      m_frames=0;
+      m_seen_t=0.0;
+      m_state=1;
+      return 0;
+    }
+
+    // host thread: 1 if Process() hasn't advanced in LATCAL_STALL_SEC (no audio running, or it's wedged)
+    int Stalled(double now)
+    {
+      if (!m_seen_t || m_frames != m_seen)
+      {
+        m_seen=m_frames;
+        m_seen_t=now;
+        return 0;
+      }
+      return now-m_seen_t >= LATCAL_STALL_SEC;
+    }
+
+    // audio thread, outputs are already zeroed
+    void Process(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate)
+    {
+      m_frames+=len;
+      if (m_srate != srate)
+      {
+        if (m_srate) { m_state=-1; return; } // rate changed under us, start over
+        m_srate=srate;
+        m_win=srate/2 < LATCAL_MAXWIN ? srate/2 : LATCAL_MAXWIN;
+        m_pos=0;
+        m_ping=-1;
+        m_nres=0;
+      }
+
+      float *b=m_buf.Get();
+      int i, c;
+      for (i = 0; i < len; i ++)
+      {
+        if (!m_pos && m_ping >= 0)
+          for (c = 0; c < outnch; c ++) outbuf[c][i]=LATCAL_LEVEL;
+
+        float v=0.0f;
+        for (c = 0; c < innch; c ++)
+        {
+          float a=(float)fabs(inbuf[c][i]);
+          if (a > v) v=a;
+        }
+        b[m_pos++]=v;
+
+        if (m_pos >= m_win)
+        {
+          EndWindow();
+          if (m_state != 1) return;
+        }
+      }
+    }
+
+  private:
+    void EndWindow()
+    {
+      const float *b=m_buf.Get();
+      int x, peak=0;
+      for (x = 1; x < m_win; x ++) if (b[x] > b[peak]) peak=x;
+
+      if (m_ping < 0) m_noise=b[peak];
+      else if (b[peak] > m_noise*8.0f && b[peak] > 0.001f)
+      {
+        float th=b[peak]*0.5f;
+        for (x = 0; x < peak && b[x] < th; x ++);
+        m_res[m_nres++]=x;
+      }
+      m_pos=0;
+      if (++m_ping < LATCAL_PINGS) return;
+
+      // median, trusted if most of the clicks came back within a millisecond of it
+      int i, j;
+      for (i = 1; i < m_nres; i ++)
+        for (j = i; j > 0 && m_res[j-1] > m_res[j]; j --) { int t=m_res[j]; m_res[j]=m_res[j-1]; m_res[j-1]=t; }
+      int agree=0;
+      if (m_nres)
+      {
+        int med=m_res[m_nres/2], tol=m_srate/1000;
+        for (i = 0; i < m_nres; i ++) if (abs(m_res[i]-med) <= tol) agree++;
+        m_result=med/(double)m_srate;
+      }
+      m_state=agree > LATCAL_PINGS/2 ? 2 : -1;
+    }
+
+    volatile int m_frames; // written by the audio thread only
+    int m_seen; // host's view of m_frames, and when it last changed
+    double m_seen_t;
+
+    int m_srate, m_win, m_pos, m_ping;
+    float m_noise;
+    WDL_TypedBuf<float> m_buf;
+    int m_res[LATCAL_PINGS], m_nres;
+};
+
+
+// cheap timestamps for profiling the audio callback. on x86 these are TSC cycles,
+// elsewhere nanoseconds; AudioProfiler calibrates them against prof_seconds().
+static inline uint64_t prof_ticks()
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  unsigned int lo,hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi<<32) | lo;
+#elif defined(_WIN32)
+  LARGE_INTEGER c;
+  QueryPerformanceCounter(&c);
+  return (uint64_t)c.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double prof_seconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER c,f;
+  QueryPerformanceCounter(&c);
+  QueryPerformanceFrequency(&f);
+  return (double)c.QuadPart/(double)f.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*0.000000001;
+#endif
+}
+
+#define PROF_BUCKETS 256
+
+// log-spaced histogram bucket, 4 per octave
+static int prof_bucket(uint64_t t)
+{
+  if (t < 8) return (int)t;
+  int e=0;
+  while (t >= 8) { t>>=1; e++; }
+  return e*4 + (int)t;
+}
+
+static double prof_bucket_mid(int b)
+{
+  if (b < 8) return b + 0.5;
+  int e=b/4 - 1, m=b%4 + 4;
+  return (m + 0.5) * (double)((uint64_t)1<<e);
+}
+
+// per-stage time spent in AudioProc(). the audio thread is the only writer (it also
+// performs resets, on request), readers just look at the counters and may see them
+// mid-update, which is fine for display.
+class AudioProfiler
+{
+  public:
+    AudioProfiler()
+    {
+      Clear();
+      reset_req=0;
+      tps=0.0;
+      calib_ticks=prof_ticks();
+      calib_sec=prof_seconds();
+      budget_us=0.0;
+    }
+
+    void Clear()
+    {
+      memset(hist,0,sizeof(hist));
+      memset(count,0,sizeof(count));
+      memset(sum,0,sizeof(sum));
+      memset(maxt,0,sizeof(maxt));
+      misses=0;
+    }
+
+    // audio thread
+    void BeginBlock()
+    {
+      if (reset_req) { Clear(); reset_req=0; }
+      memset(acc,0,sizeof(acc));
+      ran=0;
+      block_start=prof_ticks();
+    }
+    void Add(int stage, uint64_t t) { acc[stage]+=t; ran|=1<<stage; }
+    void EndBlock(int len, int srate)
+    {
+      uint64_t now=prof_ticks();
+      Add(NJClient::NJC_PROF_TOTAL,now-block_start);
+
+      if (tps <= 0.0)
+      {
+        double el=prof_seconds()-calib_sec;
+        if (el > 0.5) tps=(now-calib_ticks)/el;
+      }
+      if (srate > 0)
+      {
+        budget_us=len*1000000.0/srate;
+        if (tps > 0.0 && acc[NJClient::NJC_PROF_TOTAL] > (uint64_t)(tps*len/srate)) misses++;
+      }
+
+      int x;
+      for (x = 0; x < NJClient::NJC_PROF_NUM; x ++) if (ran & (1<<x))
+      {
+        uint64_t t=acc[x];
+        hist[x][prof_bucket(t)]++;
+        count[x]++;
+        sum[x]+=t;
+        if (t > maxt[x]) maxt[x]=t;
+      }
+    }
+
+    // any thread
+    int GetStats(int stage, double *mean, double *p50, double *p99, double *max)
+    {
+      if (mean) *mean=0.0;
+      if (p50) *p50=0.0;
+      if (p99) *p99=0.0;
+      if (max) *max=0.0;
+      if (stage < 0 || stage >= NJClient::NJC_PROF_NUM || tps <= 0.0) return 0;
+
+      unsigned int h[PROF_BUCKETS];
+      memcpy(h,hist[stage],sizeof(h));
+      int n=0, x;
+      for (x = 0; x < PROF_BUCKETS; x ++) n+=h[x];
+      if (!n) return 0;
+
+      double us=1000000.0/tps;
+      int c=0, need50=(n+1)/2, need99=n-n/100;
+      for (x = 0; x < PROF_BUCKETS; x ++)
+      {
+        if (c < need50 && c+(int)h[x] >= need50 && p50) *p50=prof_bucket_mid(x)*us;
+        c+=h[x];
+        if (c >= need99) { if (p99) *p99=prof_bucket_mid(x)*us; break; }
+      }
+      if (mean && count[stage]) *mean=(double)sum[stage]/count[stage]*us;
+      if (max) *max=maxt[stage]*us;
+      return n;
+    }
+
+    volatile int reset_req;
+    volatile int misses;
+    double budget_us;
+
+  private:
+    unsigned int hist[NJClient::NJC_PROF_NUM][PROF_BUCKETS];
+    unsigned int count[NJClient::NJC_PROF_NUM];
+    uint64_t sum[NJClient::NJC_PROF_NUM], maxt[NJClient::NJC_PROF_NUM];
+
+    uint64_t acc[NJClient::NJC_PROF_NUM];
+    int ran;
+    uint64_t block_start;
+
+    double tps; // ticks per second, once calibrated
+    uint64_t calib_ticks;
+    double calib_sec;
+};
+
+
+// background writer for everything the client records: downloaded/saved intervals, .wav files,
+// the master ogg/wav and the session log. callers queue bytes and never wait on the disk; the
+// writer thread writes them out in batches. memory is bounded, data past the bound is dropped
+// and counted rather than stalling the caller. nothing plays from these files while they're
+// written: remote intervals play from memory, and an interval file only appears under its real
+// name once all of it made it to disk (see OpenWhole()).
+#define ASYNCWRITE_BATCH (1024*1024) // most bytes written per file per pass
+
+class AsyncWriteFile
+{
+  public:
+    AsyncWriteFile() : fp(0), wav(0), closing(0), dropped(0), pending_since(0.0) { }
+
+    FILE *fp;
+    WaveWriter *wav;
+    int closing;
+    int dropped; // lost data, so it never gets renamed to finalname
+    WDL_String tmpname, finalname; // OpenWhole() only
+
+    WDL_Queue pending;
+    double pending_since;
+
+    WDL_HeapBuf conv; // sample conversion, producer side
+};
+
+class AsyncWriter
+{
+  public:
+    AsyncWriter() : m_maxbytes(16*1024*1024), m_pending(0), m_dropped(0), m_quit(0), m_running(0)
+    {
+#ifdef _WIN32
+      DWORD id;
+      m_thread=CreateThread(NULL,0,ThreadProc,this,0,&id);
+      m_running=!!m_thread;
+#else
+      m_running=!pthread_create(&m_thread,NULL,ThreadProc,this);
+#endif
+    }
+    ~AsyncWriter()
+    {
+      m_quit=1;
+      if (m_running)
+      {
+#ifdef _WIN32
+        WaitForSingleObject(m_thread,INFINITE);
+        CloseHandle(m_thread);
+#else
+        pthread_join(m_thread,NULL);
+#endif
+      }
+      while (Pass()); // anything that's left, or everything if there was no thread
+    }
+
+    // these take ownership of fp/wav, which get closed on the writer thread. NULL in gives NULL out.
+    AsyncWriteFile *OpenFile(FILE *fp)
+    {
+      if (!fp) return NULL;
+      AsyncWriteFile *f=new AsyncWriteFile;
+      f->fp=fp;
+      m_cs.Enter();
+      m_files.Add(f);
+      m_cs.Leave();
+      return f;
+    }
+    // written as fn.part, renamed to fn when closed if nothing was dropped. a .part left behind
+    // is incomplete: kept for the archive, never picked up for playback
+    AsyncWriteFile *OpenWhole(const char *fn)
+    {
+      WDL_String tmp(fn);
+      tmp.Append(".part");
+      AsyncWriteFile *f=OpenFile(fopen(tmp.Get(),"wb"));
+      if (f)
+      {
+        f->tmpname.Set(tmp.Get());
+        f->finalname.Set(fn);
+      }
+      return f;
+    }
+    AsyncWriteFile *OpenWave(WaveWriter *wav)
+    {
+      if (!wav) return NULL;
+      if (!wav->Status()) { delete wav; return NULL; }
+      AsyncWriteFile *f=new AsyncWriteFile;
+      f->wav=wav;
+      m_cs.Enter();
+      m_files.Add(f);
+      m_cs.Leave();
+      return f;
+    }
+
+    int Write(AsyncWriteFile *f, const void *buf, int len) // returns 0 if the data was dropped
+    {
+      if (!f || len <= 0) return 1;
+      m_cs.Enter();
+      if (m_pending+len > m_maxbytes || f->closing)
+      {
+        m_dropped+=len;
+        f->dropped=1;
+        m_cs.Leave();
+        return 0;
+      }
+      if (!f->pending.Available()) f->pending_since=prof_seconds();
+      f->pending.Add(buf,len);
+      m_pending+=len;
+      m_cs.Leave();
+      return 1;
+    }
+
+    // wave files only: converts frames of per-channel floats to the file's format and queues them
+    int WriteFloats(AsyncWriteFile *f, float **bufs, int frames)
+    {
+      if (!f || !f->wav || frames <= 0) return 1;
+      int nch=f->wav->get_nch(), bps=f->wav->get_bps();
+      int len=frames*nch*(bps/8);
+      if (f->conv.GetSize() < len) f->conv.Resize(len);
+      int ch;
+      for (ch = 0; ch < nch; ch ++)
+        floatsToPcm(bufs[ch],1,frames,(char *)f->conv.Get()+ch*(bps/8),bps,nch);
+      return Write(f,f->conv.Get(),len);
+    }
+
+    void Close(AsyncWriteFile *f) // f is gone after this, the writer finishes and closes it
+    {
+      if (!f) return;
+      m_cs.Enter();
+      f->closing=1;
+      m_cs.Leave();
+    }
+
+    void SetMaxBytes(int bytes) { m_maxbytes=bytes > 65536 ? bytes : 65536; }
+    void GetStats(int *pending, double *lag, int *dropped)
+    {
+      m_cs.Enter();
+      double now=prof_seconds(), oldest=now;
+      int x;
+      for (x = 0; x < m_files.GetSize(); x ++)
+      {
+        AsyncWriteFile *f=m_files.Get(x);
+        if (f->pending.Available() && f->pending_since < oldest) oldest=f->pending_since;
+      }
+      if (pending) *pending=m_pending;
+      if (lag) *lag=now-oldest;
+      if (dropped) *dropped=m_dropped;
+      m_cs.Leave();
+    }
+
+  private:
+    int Pass() // returns nonzero if it did anything
+    {
+      int did=0, x;
+      m_cs.Enter();
+      for (x = 0; x < m_files.GetSize(); x ++)
+      {
+        AsyncWriteFile *f=m_files.Get(x);
+        int len=f->pending.Available();
+        if (len > ASYNCWRITE_BATCH) len=ASYNCWRITE_BATCH;
+        if (len > 0)
+        {
+          if (m_batch.GetSize() < len) m_batch.Resize(len);
+          memcpy(m_batch.Get(),f->pending.Get(),len);
+          f->pending.Advance(len);
+          f->pending.Compact();
+          f->pending_since=prof_seconds();
+          m_pending-=len;
+          m_cs.Leave();
+
+          // only this thread closes files, so f stays valid without the lock
+          if (f->wav) f->wav->WriteRaw(m_batch.Get(),len);
+          else fwrite(m_batch.Get(),1,len,f->fp);
+          did=1;
+
+          m_cs.Enter();
+        }
+        else if (f->closing)
+        {
+          m_files.Delete(x--);
+          m_cs.Leave();
 
-#define MAKE_NJ_FOURCC(A,B,C,D) ((A) | ((B)<<8) | ((C)<<16) | ((D)<<24))
+          if (f->fp) fclose(f->fp);
+          if (f->finalname.Get()[0] && !f->dropped)
+          {
+            remove(f->finalname.Get());
+            rename(f->tmpname.Get(),f->finalname.Get());
+          }
+          delete f->wav; // fills in the header
+          delete f;
+          did=1;
 
-class DecodeState
-{
-  public:
-    DecodeState() : decode_fp(0), decode_codec(0), dump_samples(0),
-                                           decode_samplesout(0), resample_state(0.0), decode_peak_vol(0.0)
-    { 
-      memset(guid,0,sizeof(guid));
+          m_cs.Enter();
+        }
+      }
+      m_cs.Leave();
+      return did;
     }
-    ~DecodeState()
-    {
-      delete decode_codec;
-      decode_codec=0;
-      if (decode_fp) fclose(decode_fp);
-      decode_fp=0;
 
-      if (delete_on_delete.Get()[0])
+#ifdef _WIN32
+    static DWORD WINAPI ThreadProc(LPVOID p)
+#else
+    static void *ThreadProc(void *p)
+#endif
+    {
+      AsyncWriter *_this=(AsyncWriter *)p;
+      while (!_this->m_quit)
       {
+        if (!_this->Pass())
+        {
 #ifdef _WIN32
-        DeleteFile(delete_on_delete.Get());
+          Sleep(10);
 #else
-        unlink(delete_on_delete.Get());
+          struct timespec ts={0,10*1000*1000};
+          nanosleep(&ts,NULL);
 #endif
+        }
       }
+      return 0;
     }
 
-    unsigned char guid[16];
-    double decode_peak_vol;
-
-    WDL_String delete_on_delete;
-
-    FILE *decode_fp;
-    I_NJDecoder *decode_codec;
-    int decode_samplesout;
-    int dump_samples;
-    double resample_state;
+    WDL_Mutex m_cs;
+    WDL_PtrList<AsyncWriteFile> m_files;
+    WDL_HeapBuf m_batch; // writer thread only
+    int m_maxbytes, m_pending, m_dropped;
 
+    volatile int m_quit;
+    int m_running;
+#ifdef _WIN32
+    HANDLE m_thread;
+#else
+    pthread_t m_thread;
+#endif
 };
 
 
@@ -93,6 +1867,8 @@ class RemoteUser_Channel
 
     WDL_String name;
 
+    JitterEstimator jitter;
+
     // decode/mixer state, used by mixer
     DecodeState *ds;
     DecodeState *next_ds[2]; // prepared by main thread, for audio thread
@@ -102,7 +1878,7 @@ class RemoteUser_Channel
 class RemoteUser
 {
 public:
-  RemoteUser() : muted(0), volume(1.0f), pan(0.0f), submask(0), mutedmask(0), solomask(0), chanpresentmask(0) { }
+  RemoteUser() : muted(0), volume(1.0f), pan(0.0f), submask(0), mutedmask(0), solomask(0), chanpresentmask(0), tier(0) { }
   ~RemoteUser() { }
 
   bool muted;
@@ -113,6 +1889,7 @@ public:
   int chanpresentmask;
   int mutedmask;
   int solomask;
+  int tier; // simulcast copy we ask for
   RemoteUser_Channel channels[MAX_USER_CHANNELS];
 };
 
@@ -124,7 +1901,7 @@ public:
   ~RemoteDownload();
 
   void Close();
-  void Open(NJClient *parent, unsigned int fourcc);
+  void Open(NJClient *parent, unsigned int fourcc, bool playback=true); // playback keeps the data in memory for the decoder
   void Write(void *buf, int len);
   void startPlaying(int force=0); // call this with 1 to make sure it gets played ASAP, or let RemoteDownload call it automatically
 
@@ -135,47 +1912,71 @@ public:
   WDL_String username;
   int playtime;
 
+  int jitter_chidx; // chidx is cleared once playing starts, this isn't
+  unsigned int start_ms;
+  unsigned int last_arrival; // gaps are measured per download, a channel can have two in flight
+  int total_bytes;
+  JitterEstimator *findJitter();
+
 private:
   unsigned int m_fourcc;
   NJClient *m_parent;
-  FILE *fp;
+  AsyncWriteFile *m_file;
+  StreamBuf *m_stream;
+  DecodeState *m_pending; // started, but held back until its decoder is past the stream setup
 };
 
 
 
+// blocks of audio from the audio thread to Run(). the audio thread takes its buffers from a
+// pool of spares that Run() keeps topped up (Refill()) and sized for the biggest block seen,
+// and the queue of pointers has its room reserved up front, so AddBlock() only allocates if
+// Run() falls behind or the block size grows.
+#define BQ_SPARE 16 // spare blocks Refill() keeps ready
+#define BQ_MAX_EMPTY 128 // most spares kept, past this returned blocks are freed
+
 class BufferQueue
 {
   public:
-    BufferQueue() { }
+    BufferQueue() : m_nempty(0), m_maxbytes(2*1024*sizeof(float))
+    {
+      m_samplequeue.Add(NULL,4096); // AddBlock() keeps it under 512 bytes, GetBlock() compacts
+      m_samplequeue.Clear();
+      Refill();
+    }
     ~BufferQueue() 
     { 
       Clear();
+      while (m_nempty > 0) delete m_empty[--m_nempty];
     }
 
-    void AddBlock(float *samples, int len, float *samples2=NULL);
-    int GetBlock(WDL_HeapBuf **b); // return 0 if got one, 1 if none avail
+    void AddBlock(float *samples, int len, float *samples2=NULL); // with samples2 the block is planar stereo
+    int GetBlock(WDL_HeapBuf **b, int *nch=NULL); // return 0 if got one, 1 if none avail
     void DisposeBlock(WDL_HeapBuf *b);
+    void Refill(); // not on the audio thread
 
-    void Clear()
+    void Clear() // queued blocks go back to the pool
     {
-      int x;
-      for (x = 0; x < m_emptybufs.GetSize(); x ++)
-        delete m_emptybufs.Get(x);
-      m_emptybufs.Empty();
+      m_cs.Enter();
       int l=m_samplequeue.Available()/sizeof(WDL_HeapBuf *);
       WDL_HeapBuf **bufs=(WDL_HeapBuf **)m_samplequeue.Get();
       if (bufs) while (l--)
       {
-        if ((uintptr_t)*bufs != 0 && (uintptr_t)*bufs != -1) delete *bufs;
-        bufs++;
+        uintptr_t v=(uintptr_t)*bufs++;
+        if (!v || v == (uintptr_t)-1) continue;
+        WDL_HeapBuf *b=(WDL_HeapBuf *)(v & ~(uintptr_t)1);
+        if (m_nempty < BQ_MAX_EMPTY) m_empty[m_nempty++]=b;
+        else delete b;
       }
-      m_samplequeue.Advance(m_samplequeue.Available());
-      m_samplequeue.Compact();
+      m_samplequeue.Clear(); // keeps the storage
+      m_cs.Leave();
     }
 
   private:
-    WDL_Queue m_samplequeue; // a list of pointers, with NULL to define spaces
-    WDL_PtrList<WDL_HeapBuf> m_emptybufs;
+    WDL_Queue m_samplequeue; // a list of pointers, with NULL to define spaces. stereo blocks have the low bit set
+    WDL_HeapBuf *m_empty[BQ_MAX_EMPTY];
+    int m_nempty;
+    volatile int m_maxbytes; // biggest block AddBlock() has seen, spares are sized for it
     WDL_Mutex m_cs;
 };
 
@@ -188,7 +1989,7 @@ public:
 
   int channel_idx;
 
-  int src_channel; // 0 or 1
+  int src_channel; // input index, |LOCAL_CHANNEL_STEREO for it and the next
   int bitrate;
 
   float volume;
@@ -204,6 +2005,7 @@ public:
 
   // internal state. should ONLY be used by the audio thread.
   bool bcast_active;
+  bool bcast_stereo; // latched with bcast_active, so an interval is all mono or all stereo
 
 
   void (*cbf)(float *, int ns, void *);
@@ -213,15 +2015,57 @@ public:
 
   double decode_peak_vol;
   bool m_need_header;
+  unsigned int codec; // 0 for default
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
   I_NJEncoder  *m_enc;
   int m_enc_bitrate_used;
+  unsigned int m_enc_fourcc;
+  int m_enc_nch;
   Net_Message *m_enc_header_needsend;
+
+  // silence detection: the start of each interval is held back (as a frame count) until something
+  // crosses config_silence_threshold. if nothing does, the interval is sent as a zero-GUID begin.
+  int m_silent_frames;
+  int m_silence_hang; // intervals left that get sent regardless
+  bool m_interval_loud;
+
+  bool m_unheard; // nobody subscribed at the start of this interval, so it's held back like silence
+  int m_subscribers; // as of the last interval, a rise means someone new needs the codec setup
+
+  // simulcast: lower bitrate copies, encoded from the same blocks and sent under their own guids
+  struct Tier
+  {
+    int bitrate; // kbps, 0=off
+    I_NJEncoder *enc;
+    int enc_bitrate_used;
+    unsigned int enc_fourcc;
+    int enc_nch;
+    unsigned char guid[16];
+    Net_Message *header_needsend; // goes just before m_enc_header_needsend
+  };
+  Tier m_tiers[MPB_MAX_TIERS-1];
+
+  void TiersEncode(float *buf, int frames, int spacing)
+  {
+    int t;
+    for (t = 0; t < MPB_MAX_TIERS-1; t ++) if (m_tiers[t].enc) m_tiers[t].enc->Encode(buf,frames,1,spacing);
+  }
+  void TiersClear()
+  {
+    int t;
+    for (t = 0; t < MPB_MAX_TIERS-1; t ++)
+    {
+      delete m_tiers[t].enc;
+      m_tiers[t].enc=0;
+      delete m_tiers[t].header_needsend;
+      m_tiers[t].header_needsend=0;
+    }
+  }
 #endif
   
   WDL_String name;
   RemoteDownload m_curwritefile;
-  WaveWriter *m_wavewritefile;
+  AsyncWriteFile *m_wavewritefile; // NJClient closes it before deleting us
 
   //DecodeState too, eventually
 };
@@ -233,6 +2077,8 @@ public:
 
 
 #define MIN_ENC_BLOCKSIZE 2048
+#define SILENCE_FILL_FRAMES 1024
+static float silence_fill[SILENCE_FILL_FRAMES]; // zeros, fed to the encoder for held back silence
 #define MAX_ENC_BLOCKSIZE (8192+1024)
 
 
@@ -327,6 +2173,30 @@ void NJClient::makeFilenameFromGuid(WDL_String *s, unsigned char *guid)
 NJClient::NJClient()
 {
   m_wavebq=new BufferQueue;
+  m_writer=new AsyncWriter;
+  m_prof=new AudioProfiler;
+  m_retireq=new RetireQueue;
+  m_decpool=new DecoderPool;
+  m_mixworkers=new MixWorkers(this);
+  m_enginerate=0;
+  m_enginerate_next=0;
+  m_er_devrate=m_er_rate=m_er_innch=m_er_outnch=m_er_len=m_er_quality=0;
+  m_er_gen=m_er_built=0;
+  m_latcal=new LatencyCal;
+  WDL_PCMMix_Get(); // probe the CPU here, not on the first audio callback
+  m_resample_tmp.Resize(RESAMPLE_CHUNK*2);
+  NJ_EnumCodecs(0); // set up the codec list before there are other threads around
+  m_netthread_quit=0;
+  m_netthread_running=0;
+  m_net_wakepipe[0]=m_net_wakepipe[1]=-1;
+#ifndef _WIN32
+  if (!pipe(m_net_wakepipe))
+  {
+    fcntl(m_net_wakepipe[0],F_SETFL,fcntl(m_net_wakepipe[0],F_GETFL)|O_NONBLOCK);
+    fcntl(m_net_wakepipe[1],F_SETFL,fcntl(m_net_wakepipe[1],F_GETFL)|O_NONBLOCK);
+  }
+  else m_net_wakepipe[0]=m_net_wakepipe[1]=-1;
+#endif
   m_userinfochange=0;
   m_loopcnt=0;
   m_srate=48000;
@@ -350,6 +2220,20 @@ NJClient::NJClient()
   config_masterpan=0.0f;
   config_mastermute=false;
   config_play_prebuffer=8192;
+  config_jitter_underrun_target=0.01;
+  config_resample_quality=2;
+  config_record_buffer=16*1024*1024;
+  config_silence_threshold=0.0001f;
+  config_silence_hangover=1;
+  config_mix_threads=0;
+  config_upload_mode=0;
+  config_upload_budget=0;
+  m_upload_tokens=m_upload_lasttime=0.0;
+  m_upload_qbytes=m_upload_win_bytes=0;
+  m_upload_rate=m_upload_win_start=0.0;
+  config_lazy_decode=1;
+  config_engine_srate=48000;
+  config_latency_compensation=0.0;
 
 
   LicenseAgreement_User32=0;
@@ -360,6 +2244,7 @@ NJClient::NJClient()
   ChannelMixer_User32=0;
 
   waveWrite=0;
+  m_waveWrite=0;
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
   m_oggWrite=0;
   m_oggComp=0;
@@ -372,6 +2257,8 @@ NJClient::NJClient()
   _reinit();
 
   m_session_pos_ms=m_session_pos_samples=0;
+
+  m_encthread=new EncodeThread(this);
 }
 
 void NJClient::_reinit()
@@ -395,6 +2282,7 @@ void NJClient::_reinit()
   m_active_bpi=32;
   m_interval_length=1000;
   m_interval_pos=-1;
+  m_rec_split=-1;
   m_metronome_pos=0.0;
   m_metronome_state=0;
   m_metronome_tmp=0;
@@ -402,6 +2290,14 @@ void NJClient::_reinit()
 
   m_issoloactive&=~1;
 
+  m_misc_cs.Enter();
+  m_codecs_common_num=0; // until the server tells us otherwise, only Vorbis
+  m_misc_cs.Leave();
+
+  int i;
+  for (i = 0; i < MPB_MAX_SUB_CHANNELS; i ++) m_chan_subscribers[i]=-1;
+  m_server_caps=0;
+
   int x;
   for (x = 0; x < m_locchannels.GetSize(); x ++)
     m_locchannels.Get(x)->decode_peak_vol=0.0f;
@@ -413,24 +2309,23 @@ void NJClient::writeLog(char *fmt, ...)
 {
   if (m_logFile)
   {
+    char buf[1024];
     va_list ap;
     va_start(ap,fmt);
+    int l=vsnprintf(buf,sizeof(buf),fmt,ap);
+    va_end(ap);
+    if (l >= (int)sizeof(buf)) l=sizeof(buf)-1;
 
     m_log_cs.Enter();
-    if (m_logFile) vfprintf(m_logFile,fmt,ap);
+    if (m_logFile && l > 0) m_writer->Write(m_logFile,buf,l);
     m_log_cs.Leave();
-
-    va_end(ap);
-
   }
-
-
 }
 
 void NJClient::SetLogFile(char *name)
 {
   m_log_cs.Enter();
-  if (m_logFile) fclose(m_logFile);
+  m_writer->Close(m_logFile);
   m_logFile=0;
   if (name && *name)
   {
@@ -438,10 +2333,10 @@ void NJClient::SetLogFile(char *name)
     {
       WDL_String s(m_workdir.Get());
       s.Append(name);
-      m_logFile=fopen(s.Get(),"a+t");
+      m_logFile=m_writer->OpenFile(fopen(s.Get(),"a+t"));
     }
     else
-      m_logFile=fopen(name,"a+t");
+      m_logFile=m_writer->OpenFile(fopen(name,"a+t"));
   }
   m_log_cs.Leave();
 }
@@ -449,28 +2344,54 @@ void NJClient::SetLogFile(char *name)
 
 NJClient::~NJClient()
 {
+  delete m_encthread; // stops encoding before the channels and connection go away
+  m_encthread=0;
+  StopNetThread();
   delete m_netcon;
   m_netcon=0;
+  int x;
+  for (x = 0; x < m_net_deferred.GetSize(); x ++) m_net_deferred.Get(x)->releaseRef();
+  m_net_deferred.Empty();
+#ifndef _WIN32
+  if (m_net_wakepipe[0] >= 0) close(m_net_wakepipe[0]);
+  if (m_net_wakepipe[1] >= 0) close(m_net_wakepipe[1]);
+#endif
 
   delete waveWrite;
+  SetWaveOutFile(NULL);
   SetOggOutFile(NULL,0,0);
 
   if (m_logFile)
   {
     writeLog("end\n");
-    fclose(m_logFile);
+    m_writer->Close(m_logFile);
     m_logFile=0;
   }
 
-  int x;
   for (x = 0; x < m_remoteusers.GetSize(); x ++) delete m_remoteusers.Get(x);
   m_remoteusers.Empty();
   for (x = 0; x < m_downloads.GetSize(); x ++) delete m_downloads.Get(x);
   m_downloads.Empty();
-  for (x = 0; x < m_locchannels.GetSize(); x ++) delete m_locchannels.Get(x);
+  for (x = 0; x < m_locchannels.GetSize(); x ++)
+  {
+    m_writer->Close(m_locchannels.Get(x)->m_wavewritefile);
+    delete m_locchannels.Get(x);
+  }
   m_locchannels.Empty();
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+  uploadClear();
+#endif
+
+  delete m_writer; // finishes writing and closes everything that was queued
 
   delete m_wavebq;
+  delete m_prof;
+  delete m_retireq;
+  delete m_mixworkers;
+  delete m_enginerate;
+  delete m_enginerate_next;
+  delete m_latcal;
+  delete m_decpool; // after anything that can hold a DecodeState
 }
 
 
@@ -499,12 +2420,68 @@ unsigned int NJClient::GetSessionPosition()// returns milliseconds
 }
 
 void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate)
+{
+  RTCHECK_ENTER();
+  m_prof->BeginBlock();
+
+  const int erate=GetEngineSampleRate(srate);
+  if (erate != srate)
+  {
+    const int q=config_resample_quality > 2 ? config_resample_quality : 2;
+    EngineRate *er=m_enginerate_next;
+    if (er && NJ_ATOMIC_CASPTR(m_enginerate_next,er,(EngineRate *)NULL))
+    {
+      m_retireq->Add(m_enginerate);
+      m_enginerate=er;
+    }
+
+    er=m_enginerate;
+    if (er && er->Matches(srate,erate,innch,outnch,len,q))
+    {
+      float **ein;
+      int n=er->In(inbuf,len,&ein);
+      float **eout=er->OutBuffers(n);
+      audioProcEngine(ein,innch,eout,outnch,n,erate);
+      er->Out(n,outbuf,len);
+    }
+    else
+    {
+      // the converters get built by Run(): ask for them, and stay quiet for the block or two until they're here
+      if (srate != m_er_devrate || erate != m_er_rate || innch != m_er_innch || outnch != m_er_outnch ||
+          len > m_er_len || q != m_er_quality)
+      {
+        m_er_devrate=srate;
+        m_er_rate=erate;
+        m_er_innch=innch;
+        m_er_outnch=outnch;
+        m_er_len=len > ENGINERATE_MINBLOCK ? len : ENGINERATE_MINBLOCK;
+        m_er_quality=q;
+        NJ_MEMBARRIER();
+        m_er_gen++;
+      }
+      int x;
+      for (x = 0; x < outnch; x ++) memset(outbuf[x],0,sizeof(float)*len);
+    }
+  }
+  else audioProcEngine(inbuf,innch,outbuf,outnch,len,srate);
+
+  m_prof->EndBlock(len,srate);
+  RTCHECK_LEAVE();
+}
+
+void NJClient::audioProcEngine(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate)
 {
   m_srate=srate;
   // zero output
   int x;
   for (x = 0; x < outnch; x ++) memset(outbuf[x],0,sizeof(float)*len);
 
+  if (m_latcal->m_state == 1)
+  {
+    m_latcal->Process(inbuf,innch,outbuf,outnch,len,srate);
+    return;
+  }
+
   if (!m_audio_enable)
   {
     process_samples(inbuf,innch,outbuf,outnch,len,srate,0,1);
@@ -562,10 +2539,29 @@ void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch, i
       m_misc_cs.Leave();
 
       // new buffer time
+      uint64_t t0=prof_ticks();
       on_new_interval();
+      m_prof->Add(NJC_PROF_INTERVAL,prof_ticks()-t0);
 
       m_interval_pos=0;
       x=m_interval_length;
+
+      // local channels' intervals start late by the round trip, when what was played along to arrives
+      m_rec_split=(int)(config_latency_compensation*srate+0.5);
+      if (m_rec_split >= m_interval_length) m_rec_split=m_interval_length-1;
+      if (m_rec_split < 0) m_rec_split=0;
+    }
+
+    if (m_rec_split >= 0)
+    {
+      if (m_interval_pos >= m_rec_split)
+      {
+        uint64_t t0=prof_ticks();
+        on_new_rec_interval();
+        m_prof->Add(NJC_PROF_INTERVAL,prof_ticks()-t0);
+        m_rec_split=-1;
+      }
+      else if (x > m_rec_split-m_interval_pos) x=m_rec_split-m_interval_pos;
     }
 
     if (x > len) x=len;
@@ -576,20 +2572,25 @@ void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch, i
     offs += x;
     len -= x;    
   }  
-
+  m_encthread->Wake(); // encode whatever the local channels just queued
 }
 
 
 void NJClient::Disconnect()
 {
+  m_enc_cs.Enter();
   m_errstr.Set("");
   m_host.Set("");
   m_user.Set("");
   m_pass.Set("");
+  StopNetThread();
   delete m_netcon;
   m_netcon=0;
 
   int x;
+  for (x = 0; x < m_net_deferred.GetSize(); x ++) m_net_deferred.Get(x)->releaseRef();
+  m_net_deferred.Empty();
+
   for (x=0;x<m_remoteusers.GetSize(); x++) delete m_remoteusers.Get(x);
   m_remoteusers.Empty();
   if (x) m_userinfochange=1; // if we removed users, notify parent
@@ -600,7 +2601,7 @@ void NJClient::Disconnect()
   for (x = 0; x < m_locchannels.GetSize(); x ++) 
   {
     Local_Channel *c=m_locchannels.Get(x);
-    delete c->m_wavewritefile;
+    m_writer->Close(c->m_wavewritefile);
     c->m_wavewritefile=0;
     c->m_curwritefile.Close();
 
@@ -609,15 +2610,20 @@ void NJClient::Disconnect()
     c->m_enc=0;
     delete c->m_enc_header_needsend;
     c->m_enc_header_needsend=0;
+    c->TiersClear();
 #endif
 
     c->m_bq.Clear();
   }
   m_downloads.Empty();
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+  uploadClear();
+#endif
 
   m_wavebq->Clear();
 
   _reinit();
+  m_enc_cs.Leave();
 }
 
 void NJClient::Connect(char *host, char *user, char *pass)
@@ -641,10 +2647,13 @@ void NJClient::Connect(char *host, char *user, char *pass)
   }
   JNL_Connection *c=new JNL_Connection(JNL_CONNECTION_AUTODNS,65536,65536);
   c->connect(tmp.Get(),port);
+  m_enc_cs.Enter();
   m_netcon = new Net_Connection;
   m_netcon->attach(c);
 
   m_status=0;
+  StartNetThread();
+  m_enc_cs.Leave();
 }
 
 int NJClient::GetStatus()
@@ -658,40 +2667,141 @@ int NJClient::GetStatus()
 }
 
 
-int NJClient::Run() // nonzero if sleep ok
+RemoteUser *NJClient::findRemoteUser(const char *name) // m_users_cs, or the Run() thread
 {
-  WDL_HeapBuf *p=0;
-  while (!m_wavebq->GetBlock(&p))
+  int x;
+  for (x = 0; x < m_remoteusers.GetSize(); x ++)
   {
-    if (p)
-    {
-      float *f=(float*)p->Get();
-      int hl=p->GetSize()/(2*sizeof(float));
-      float *outbuf[2]={f,f+hl};
-#ifndef NJCLIENT_NO_XMIT_SUPPORT
-      if (m_oggWrite&&m_oggComp)
-      {
-        m_oggComp->Encode(f,hl,1,hl);
-        if (m_oggComp->outqueue.Available())
-        {
-          fwrite((char *)m_oggComp->outqueue.Get(),1,m_oggComp->outqueue.Available(),m_oggWrite);
-          m_oggComp->outqueue.Advance(m_oggComp->outqueue.Available());
-          m_oggComp->outqueue.Compact();
-        }
-      }
+    RemoteUser *u=m_remoteusers.Get(x);
+    if (!strcmp(u->name.Get(),name)) return u;
+  }
+  return NULL;
+}
+
+void NJClient::NetSend(Net_Message *msg)
+{
+  m_net_cs.Enter();
+  if (m_netcon) m_netcon->Send(msg);
+  else if (msg) { msg->addRef(); msg->releaseRef(); }
+  m_net_cs.Leave();
+  WakeNetThread();
+}
+
+void NJClient::WakeNetThread()
+{
+#ifndef _WIN32
+  if (m_net_wakepipe[1] >= 0)
+  {
+    char c=0;
+    if (write(m_net_wakepipe[1],&c,1) < 0) { } // pipe full is fine, it's awake
+  }
 #endif
-      if (waveWrite)
+}
+
+#ifdef _WIN32
+DWORD WINAPI NJClient::NetThreadProcStub(LPVOID p)
+#else
+void *NJClient::NetThreadProcStub(void *p)
+#endif
+{
+  ((NJClient *)p)->NetThreadProc();
+  return 0;
+}
+
+void NJClient::StartNetThread()
+{
+  if (m_netthread_running) return;
+  m_netthread_quit=0;
+#ifdef _WIN32
+  DWORD id;
+  m_netthread=CreateThread(NULL,0,NetThreadProcStub,this,0,&id);
+  m_netthread_running=!!m_netthread;
+#else
+  m_netthread_running=!pthread_create(&m_netthread,NULL,NetThreadProcStub,this);
+#endif
+}
+
+void NJClient::StopNetThread()
+{
+  if (!m_netthread_running) return;
+  m_netthread_quit=1;
+  WakeNetThread();
+#ifdef _WIN32
+  WaitForSingleObject(m_netthread,INFINITE);
+  CloseHandle(m_netthread);
+#else
+  pthread_join(m_netthread,NULL);
+#endif
+  m_netthread_running=0;
+}
+
+void NJClient::NetThreadProc()
+{
+  while (!m_netthread_quit)
+  {
+    int sock=-1, wantwrite=0, timeout=500; // keepalives only need second resolution
+
+    m_net_cs.Enter();
+    int wantsleep=NetRun();
+    if (m_netcon && m_status < 1000)
+    {
+      JNL_Connection *c=m_netcon->GetConnection();
+      int st=c ? c->get_state() : JNL_Connection::STATE_ERROR;
+      if (st == JNL_Connection::STATE_CONNECTING || st == JNL_Connection::STATE_CONNECTED || st == JNL_Connection::STATE_CLOSING)
       {
-        waveWrite->WriteFloatsNI(outbuf,0,hl);
+        sock=c->get_socket();
+        wantwrite = st == JNL_Connection::STATE_CONNECTING || m_netcon->HasPendingSend();
       }
-      m_wavebq->DisposeBlock(p);
+      else if (st == JNL_Connection::STATE_RESOLVING) timeout=10; // nothing to wait on for async dns
+    }
+    m_net_cs.Leave();
+
+    if (!wantsleep) continue;
+
+#ifdef _WIN32
+    // no wake pipe here, so don't wait long: Send()s from other threads go out within 10ms
+    if (sock >= 0)
+    {
+      fd_set rfds, wfds;
+      FD_ZERO(&rfds);
+      FD_ZERO(&wfds);
+      FD_SET((SOCKET)sock,&rfds);
+      if (wantwrite) FD_SET((SOCKET)sock,&wfds);
+      struct timeval tv={0,10000};
+      select(sock+1,&rfds,&wfds,NULL,&tv);
+    }
+    else Sleep(10);
+#else
+    struct pollfd pfd[2];
+    int n=0;
+    pfd[n].fd=m_net_wakepipe[0];
+    pfd[n].events=POLLIN;
+    pfd[n++].revents=0;
+    if (sock >= 0)
+    {
+      pfd[n].fd=sock;
+      pfd[n].events=POLLIN | (wantwrite ? POLLOUT : 0);
+      pfd[n++].revents=0;
     }
+    poll(pfd,n,timeout);
+    if (pfd[0].revents & POLLIN)
+    {
+      char buf[256];
+      while (read(m_net_wakepipe[0],buf,sizeof(buf)) > 0);
+    }
+#endif
   }
-//    
-  int wantsleep=1;
+}
 
-  if (m_netcon)
+// one pass of the network thread, with m_net_cs held. returns nonzero if it can wait on the socket
+int NJClient::NetRun()
+{
+  if (!m_netcon || m_status >= 1000) return 1;
+
+  int cnt;
+  for (cnt = 0; cnt < 64; cnt ++) // let Send()s from other threads in now and then
   {
+    int wantsleep=1;
     Net_Message *msg=m_netcon->Run(&wantsleep);
     if (!msg)
     {
@@ -703,312 +2813,482 @@ int NJClient::Run() // nonzero if sleep ok
         if (m_status == 0) m_status=1000;
         return 1;
       }
+      return wantsleep;
     }
-    else
-    {
-      msg->addRef();
 
-      switch (msg->get_type())
-      {
-        case MESSAGE_SERVER_AUTH_CHALLENGE:
-          {
-            mpb_server_auth_challenge cha;
-            if (!cha.parse(msg))
-            {
-              if (cha.protocol_version < PROTO_VER_MIN || cha.protocol_version >= PROTO_VER_MAX)
-              {
-                m_errstr.Set("server is incorrect protocol version");
-                m_status = 1001;
-                m_netcon->Kill();
-                return 0;
-              }
+    msg->addRef();
+    netHandleMessage(msg);
+    msg->releaseRef();
+  }
+  return 0;
+}
 
-              mpb_client_auth_user repl;
-              repl.username=m_user.Get();
-              repl.client_version=PROTO_VER_CUR; // client version number
+// m_net_cs held
+void NJClient::sendAuthReply(mpb_server_auth_challenge *cha, int accept_license)
+{
+  mpb_client_auth_user repl;
+  repl.username=m_user.Get();
+  repl.client_version=PROTO_VER_CUR; // client version number
+  if (accept_license) repl.client_caps|=1;
+  if (cha->server_caps & MPB_SERVER_CAP_TIERS) repl.client_caps|=MPB_CLIENT_CAP_TIERS;
 
-              m_connection_keepalive=(cha.server_caps>>8)&0xff;
+  m_netcon->SetKeepAlive(m_connection_keepalive);
 
-//              printf("Got keepalive of %d\n",m_connection_keepalive);
+  WDL_SHA1 tmp;
+  tmp.add(m_user.Get(),strlen(m_user.Get()));
+  tmp.add(":",1);
+  tmp.add(m_pass.Get(),strlen(m_pass.Get()));
+  tmp.result(repl.passhash);
 
-              if (cha.license_agreement)
-              {
-                m_netcon->SetKeepAlive(45);
-                if (LicenseAgreementCallback && LicenseAgreementCallback(LicenseAgreement_User32,cha.license_agreement))
-                {
-                  repl.client_caps|=1;
-                }
-              }
-              m_netcon->SetKeepAlive(m_connection_keepalive);
+  tmp.reset(); // new auth method is SHA1(SHA1(user:pass)+challenge)
+  tmp.add(repl.passhash,sizeof(repl.passhash));
+  tmp.add(cha->challenge,sizeof(cha->challenge));
+  tmp.result(repl.passhash);               
+
+  m_netcon->Send(repl.build());
+
+  m_in_auth=1;
+}
 
-              WDL_SHA1 tmp;
-              tmp.add(m_user.Get(),strlen(m_user.Get()));
-              tmp.add(":",1);
-              tmp.add(m_pass.Get(),strlen(m_pass.Get()));
-              tmp.result(repl.passhash);
+// network thread, m_net_cs held
+void NJClient::netHandleMessage(Net_Message *msg)
+{
+  switch (msg->get_type())
+  {
+    case MESSAGE_SERVER_AUTH_CHALLENGE:
+      {
+        mpb_server_auth_challenge cha;
+        if (!cha.parse(msg))
+        {
+          if (cha.protocol_version < PROTO_VER_MIN || cha.protocol_version >= PROTO_VER_MAX)
+          {
+            m_errstr.Set("server is incorrect protocol version");
+            m_status = 1001;
+            m_netcon->Kill();
+            return;
+          }
 
-              tmp.reset(); // new auth method is SHA1(SHA1(user:pass)+challenge)
-              tmp.add(repl.passhash,sizeof(repl.passhash));
-              tmp.add(cha.challenge,sizeof(cha.challenge));
-              tmp.result(repl.passhash);               
+          m_connection_keepalive=(cha.server_caps>>8)&0xff;
+          m_server_caps=cha.server_caps;
 
-              m_netcon->Send(repl.build());
+//          printf("Got keepalive of %d\n",m_connection_keepalive);
 
-              m_in_auth=1;
-            }
+          if (cha.license_agreement && LicenseAgreementCallback)
+          {
+            // the user has to answer this, so Run() asks and replies
+            m_netcon->SetKeepAlive(45);
+            msg->addRef();
+            m_net_deferred.Add(msg);
           }
-        break;
-        case MESSAGE_SERVER_AUTH_REPLY:
+          else sendAuthReply(&cha,0);
+        }
+      }
+    break;
+    case MESSAGE_SERVER_AUTH_REPLY:
+      {
+        mpb_server_auth_reply ar;
+        if (!ar.parse(msg))
+        {
+          if (ar.flag) // send our channel information
           {
-            mpb_server_auth_reply ar;
-            if (!ar.parse(msg))
+            mpb_client_set_channel_info sci;
+            int x;
+            m_locchan_cs.Enter();
+            for (x = 0; x < m_locchannels.GetSize(); x ++)
             {
-              if (ar.flag) // send our channel information
-              {
-                mpb_client_set_channel_info sci;
-                int x;
-                for (x = 0; x < m_locchannels.GetSize(); x ++)
-                {
-                  Local_Channel *ch=m_locchannels.Get(x);
-                  sci.build_add_rec(ch->name.Get(),0,0,0);
-                }
-                m_netcon->Send(sci.build());
-                m_status=2;
-                m_in_auth=0;
-                m_max_localch=ar.maxchan;
-                if (ar.errmsg)
-                  m_user.Set(ar.errmsg); // server gave us an updated name
-              }
-              else 
-              {
-                if (ar.errmsg)
-                {
-                    m_errstr.Set(ar.errmsg);
-                }
-                m_status = 1001;
-                m_netcon->Kill();
-              }
+              Local_Channel *ch=m_locchannels.Get(x);
+              sci.build_add_rec(ch->name.Get(),0,0,0);
             }
+            m_locchan_cs.Leave();
+            m_netcon->Send(sci.build());
+            sendCodecCaps();
+            m_status=2;
+            m_in_auth=0;
+            m_max_localch=ar.maxchan;
+            if (ar.errmsg)
+              m_user.Set(ar.errmsg); // server gave us an updated name
           }
-        break;
-        case MESSAGE_SERVER_CONFIG_CHANGE_NOTIFY:
+          else 
           {
-            mpb_server_config_change_notify ccn;
-            if (!ccn.parse(msg))
+            if (ar.errmsg)
             {
-              updateBPMinfo(ccn.beats_minute,ccn.beats_interval);
-              m_audio_enable=1;
+                m_errstr.Set(ar.errmsg);
             }
+            m_status = 1001;
+            m_netcon->Kill();
           }
+        }
+      }
+    break;
+    case MESSAGE_SERVER_CONFIG_CHANGE_NOTIFY:
+      {
+        mpb_server_config_change_notify ccn;
+        if (!ccn.parse(msg))
+        {
+          updateBPMinfo(ccn.beats_minute,ccn.beats_interval);
+          m_audio_enable=1;
+        }
+      }
 
-        break;
-        case MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY:
+    break;
+    case MESSAGE_SERVER_CODEC_CAPS:
+      {
+        mpb_server_codec_caps cc;
+        if (!cc.parse(msg))
+        {
+          m_misc_cs.Enter();
+          memcpy(m_codecs_common,cc.fourcc,cc.num_fourcc*sizeof(cc.fourcc[0]));
+          m_codecs_common_num=cc.num_fourcc;
+          m_misc_cs.Leave();
+        }
+      }
+    break;
+    case MESSAGE_SERVER_CHANNEL_SUBSCRIBERS:
+      {
+        // ints, Run() just reads them at interval boundaries
+        mpb_server_channel_subscribers cs;
+        if (!cs.parse(msg)) memcpy(m_chan_subscribers,cs.subscribers,sizeof(m_chan_subscribers));
+      }
+    break;
+    case MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY:
+    case MESSAGE_CHAT_MESSAGE:
+      msg->addRef();
+      m_net_deferred.Add(msg);
+    break;
+    case MESSAGE_SERVER_DOWNLOAD_INTERVAL_BEGIN:
+      {
+        mpb_server_download_interval_begin dib;
+        if (!dib.parse(msg) && dib.username && dib.chidx >= 0 && dib.chidx < MAX_USER_CHANNELS)
+        {
+          // the user list belongs to the Run() thread, so only look at it with m_users_cs held
+          RemoteUser *theuser;
+          //printf("Getting interval for %s, channel %d\n",dib.username,dib.chidx);
+          if (!memcmp(dib.guid,zero_guid,sizeof(zero_guid)))
           {
-            mpb_server_userinfo_change_notify ucn;
-            if (!ucn.parse(msg))
+            DecodeState *tmp=NULL;
+            m_users_cs.Enter();
+            if ((theuser=findRemoteUser(dib.username)))
             {
-              int offs=0;
-              int a=0, cid=0, p=0,f=0;
-              short v=0;
-              char *un=0,*chn=0;
-              while ((offs=ucn.parse_get_rec(offs,&a,&cid,&v,&p,&f,&un,&chn))>0)
-              {
-                if (!un) un="";
-                if (!chn) chn="";
+              int useidx=!!theuser->channels[dib.chidx].next_ds[0];
+              tmp=theuser->channels[dib.chidx].next_ds[useidx];
+              theuser->channels[dib.chidx].next_ds[useidx]=0;
+            }
+            m_users_cs.Leave();
+            delete tmp;
+          }
+          else if (dib.fourcc) // download coming
+          {                
+            unsigned int now=GetSessionPosition();
+            int playtime=config_play_prebuffer;
 
-                m_userinfochange=1;
+            m_users_cs.Enter();
+            if ((theuser=findRemoteUser(dib.username)))
+            {
+              JitterEstimator *je=&theuser->channels[dib.chidx].jitter;
+              if (config_play_prebuffer > 0 && config_jitter_underrun_target > 0.0)
+                playtime=je->Update(config_jitter_underrun_target,config_play_prebuffer);
+            }
+            m_users_cs.Leave();
 
-                int x;
-                // todo: per-user autosubscribe option, or callback
-                // todo: have volume/pan settings here go into defaults for the channel. or not, kinda think it's pointless
-                if (cid >= 0 && cid < MAX_USER_CHANNELS)
-                {
-                  RemoteUser *theuser;
-                  for (x = 0; x < m_remoteusers.GetSize() && strcmp((theuser=m_remoteusers.Get(x))->name.Get(),un); x ++);
+            if (theuser)
+            {
+              if (config_debug_level>1) printf("RECV BLOCK %s\n",guidtostr_tmp(dib.guid));
+              RemoteDownload *ds=new RemoteDownload;
+              memcpy(ds->guid,dib.guid,sizeof(ds->guid));
+              ds->Open(this,dib.fourcc);
 
-                 // printf("user %s, channel %d \"%s\": %s v:%d.%ddB p:%d flag=%d\n",un,cid,chn,a?"active":"inactive",(int)v/10,abs((int)v)%10,p,f);
+              ds->playtime=playtime;
+              ds->chidx=ds->jitter_chidx=dib.chidx;
+              ds->username.Set(dib.username);
+              ds->start_ms=ds->last_arrival=now;
 
+              m_downloads.Add(ds);
+            }
+          }
+          else
+          {
+            DecodeState *tmp=start_decode(dib.guid,0,decoder_tag(dib.username,dib.chidx));
+            m_users_cs.Enter();
+            if ((theuser=findRemoteUser(dib.username)))
+            {
+              int useidx=!!theuser->channels[dib.chidx].next_ds[0];
+              DecodeState *t2=theuser->channels[dib.chidx].next_ds[useidx];
+              theuser->channels[dib.chidx].next_ds[useidx]=tmp;
+              tmp=t2;
+            }
+            m_users_cs.Leave();
+            delete tmp;
+          }
+        }
+      }
+    break;
+    case MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE:
+      {
+        mpb_server_download_interval_write diw;
+        if (!diw.parse(msg)) 
+        {
+          time_t now;
+          time(&now);
+          int x;
+          for (x = 0; x < m_downloads.GetSize(); x ++)
+          {
+            RemoteDownload *ds=m_downloads.Get(x);
+            if (ds)
+            {
+              if (!memcmp(ds->guid,diw.guid,sizeof(ds->guid)))
+              {
+                if (config_debug_level>1) printf("RECV BLOCK DATA %s%s %d bytes\n",guidtostr_tmp(diw.guid),diw.flags&1?":end":"",diw.audio_data_len);
 
+                ds->last_time=now;
+                unsigned int spos=GetSessionPosition();
+                if (diw.audio_data_len > 0 && diw.audio_data)
+                {
                   m_users_cs.Enter();
-                  if (a)
-                  {
-                    if (x == m_remoteusers.GetSize())
-                    {
-                      theuser=new RemoteUser;
-                      theuser->name.Set(un);
-                      m_remoteusers.Add(theuser);
-                    }
-
-                    theuser->channels[cid].name.Set(chn);
-                    theuser->chanpresentmask |= 1<<cid;
-
-
-                    if (config_autosubscribe)
-                    {
-                      theuser->submask |= 1<<cid;
-                      mpb_client_set_usermask su;
-                      su.build_add_rec(un,theuser->submask);
-                      m_netcon->Send(su.build());
-                    }
-                  }
-                  else
+                  JitterEstimator *je=ds->findJitter();
+                  if (je) je->OnData((int)(spos-ds->last_arrival));
+                  m_users_cs.Leave();
+                  ds->last_arrival=spos;
+                  ds->Write(diw.audio_data,diw.audio_data_len);
+                }
+                if (diw.flags & 1)
+                {
+                  if (m_srate > 0 && m_interval_length > 0) 
                   {
-                    if (x < m_remoteusers.GetSize())
-                    {
-                      theuser->channels[cid].name.Set("");
-                      theuser->chanpresentmask &= ~(1<<cid);
-                      theuser->submask &= ~(1<<cid);
-
-                      int chksolo=theuser->solomask == (1<<cid);
-                      theuser->solomask &= ~(1<<cid);
-
-                      delete theuser->channels[cid].ds;
-                      delete theuser->channels[cid].next_ds[0];
-                      delete theuser->channels[cid].next_ds[1];
-                      theuser->channels[cid].ds=0;
-                      theuser->channels[cid].next_ds[0]=0;
-                      theuser->channels[cid].next_ds[1]=0;
-
-                      if (!theuser->chanpresentmask) // user no longer exists, it seems
-                      {
-                        chksolo=1;
-                        delete theuser;
-                        m_remoteusers.Delete(x);
-                      }
-
-                      if (chksolo)
-                      {
-                        int i;
-                        for (i = 0; i < m_remoteusers.GetSize() && !m_remoteusers.Get(i)->solomask; i ++);
-
-                        if (i < m_remoteusers.GetSize()) m_issoloactive|=1;
-                        else m_issoloactive&=~1;
-                      }
-                    }
+                    m_users_cs.Enter();
+                    JitterEstimator *je=ds->findJitter();
+                    if (je) je->OnEnd(spos,ds->start_ms,ds->total_bytes,m_interval_length*1000.0/m_srate);
+                    m_users_cs.Leave();
                   }
-                  m_users_cs.Leave();
+                  delete ds;
+                  m_downloads.Delete(x);
                 }
+                break;
+              }
+
+              if (now - ds->last_time > DOWNLOAD_TIMEOUT)
+              {
+                ds->chidx=-1;
+                delete ds;
+                m_downloads.Delete(x--);
               }
             }
           }
-        break;
-        case MESSAGE_SERVER_DOWNLOAD_INTERVAL_BEGIN:
+        }
+      }
+    break;
+    default:
+      //printf("Got unknown message %02X\n",msg->get_type());
+    break;
+  }
+}
+
+// Run() thread, for messages the network thread passed along
+void NJClient::handleDeferredMessage(Net_Message *msg)
+{
+  switch (msg->get_type())
+  {
+    case MESSAGE_SERVER_AUTH_CHALLENGE:
+      {
+        mpb_server_auth_challenge cha;
+        if (!cha.parse(msg))
+        {
+          int accept=LicenseAgreementCallback && LicenseAgreementCallback(LicenseAgreement_User32,cha.license_agreement);
+          m_net_cs.Enter();
+          if (m_netcon) sendAuthReply(&cha,accept);
+          m_net_cs.Leave();
+          WakeNetThread();
+        }
+      }
+    break;
+    case MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY:
+      {
+        mpb_server_userinfo_change_notify ucn;
+        if (!ucn.parse(msg))
+        {
+          int offs=0;
+          int a=0, cid=0, p=0,f=0;
+          short v=0;
+          char *un=0,*chn=0;
+          while ((offs=ucn.parse_get_rec(offs,&a,&cid,&v,&p,&f,&un,&chn))>0)
           {
-            mpb_server_download_interval_begin dib;
-            if (!dib.parse(msg) && dib.username)
+            if (!un) un="";
+            if (!chn) chn="";
+
+            m_userinfochange=1;
+
+            int x;
+            // todo: per-user autosubscribe option, or callback
+            // todo: have volume/pan settings here go into defaults for the channel. or not, kinda think it's pointless
+            if (cid >= 0 && cid < MAX_USER_CHANNELS)
             {
-              int x;
               RemoteUser *theuser;
-              for (x = 0; x < m_remoteusers.GetSize() && strcmp((theuser=m_remoteusers.Get(x))->name.Get(),dib.username); x ++);
-              if (x < m_remoteusers.GetSize() && dib.chidx >= 0 && dib.chidx < MAX_USER_CHANNELS)
-              {              
-                //printf("Getting interval for %s, channel %d\n",dib.username,dib.chidx);
-                if (!memcmp(dib.guid,zero_guid,sizeof(zero_guid)))
+              for (x = 0; x < m_remoteusers.GetSize() && strcmp((theuser=m_remoteusers.Get(x))->name.Get(),un); x ++);
+
+             // printf("user %s, channel %d \"%s\": %s v:%d.%ddB p:%d flag=%d\n",un,cid,chn,a?"active":"inactive",(int)v/10,abs((int)v)%10,p,f);
+
+
+              int subscribe=-1, subtier=0;
+              m_users_cs.Enter();
+              if (a)
+              {
+                if (x == m_remoteusers.GetSize())
                 {
-                  m_users_cs.Enter();
-                  int useidx=!!theuser->channels[dib.chidx].next_ds[0];
-                  DecodeState *tmp=theuser->channels[dib.chidx].next_ds[useidx];
-                  theuser->channels[dib.chidx].next_ds[useidx]=0;
-                  m_users_cs.Leave();
-                  delete tmp;
+                  theuser=new RemoteUser;
+                  theuser->name.Set(un);
+                  m_remoteusers.Add(theuser);
                 }
-                else if (dib.fourcc) // download coming
-                {                
-                  if (config_debug_level>1) printf("RECV BLOCK %s\n",guidtostr_tmp(dib.guid));
-                  RemoteDownload *ds=new RemoteDownload;
-                  memcpy(ds->guid,dib.guid,sizeof(ds->guid));
-                  ds->Open(this,dib.fourcc);
-
-                  ds->playtime=config_play_prebuffer;
-                  ds->chidx=dib.chidx;
-                  ds->username.Set(dib.username);
-
-                  m_downloads.Add(ds);
-                }
-                else
+
+                theuser->channels[cid].name.Set(chn);
+                theuser->chanpresentmask |= 1<<cid;
+
+
+                if (config_autosubscribe)
                 {
-                  DecodeState *tmp=start_decode(dib.guid);
-                  m_users_cs.Enter();
-                  int useidx=!!theuser->channels[dib.chidx].next_ds[0];
-                  DecodeState *t2=theuser->channels[dib.chidx].next_ds[useidx];
-                  theuser->channels[dib.chidx].next_ds[useidx]=tmp;
-                  m_users_cs.Leave();
-                  delete t2;
+                  theuser->submask |= 1<<cid;
+                  subscribe=theuser->submask;
+                  subtier=theuser->tier;
                 }
-
               }
-            }
-          }
-        break;
-        case MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE:
-          {
-            mpb_server_download_interval_write diw;
-            if (!diw.parse(msg)) 
-            {
-              time_t now;
-              time(&now);
-              int x;
-              for (x = 0; x < m_downloads.GetSize(); x ++)
+              else
               {
-                RemoteDownload *ds=m_downloads.Get(x);
-                if (ds)
+                if (x < m_remoteusers.GetSize())
                 {
-                  if (!memcmp(ds->guid,diw.guid,sizeof(ds->guid)))
+                  theuser->channels[cid].name.Set("");
+                  theuser->chanpresentmask &= ~(1<<cid);
+                  theuser->submask &= ~(1<<cid);
+
+                  int chksolo=theuser->solomask == (1<<cid);
+                  theuser->solomask &= ~(1<<cid);
+
+                  delete theuser->channels[cid].ds;
+                  delete theuser->channels[cid].next_ds[0];
+                  delete theuser->channels[cid].next_ds[1];
+                  theuser->channels[cid].ds=0;
+                  theuser->channels[cid].next_ds[0]=0;
+                  theuser->channels[cid].next_ds[1]=0;
+
+                  if (!theuser->chanpresentmask) // user no longer exists, it seems
                   {
-                    if (config_debug_level>1) printf("RECV BLOCK DATA %s%s %d bytes\n",guidtostr_tmp(diw.guid),diw.flags&1?":end":"",diw.audio_data_len);
-
-                    ds->last_time=now;
-                    if (diw.audio_data_len > 0 && diw.audio_data)
-                    {
-                      ds->Write(diw.audio_data,diw.audio_data_len);
-                    }
-                    if (diw.flags & 1)
-                    {
-                      delete ds;
-                      m_downloads.Delete(x);
-                    }
-                    break;
+                    chksolo=1;
+                    delete theuser;
+                    m_remoteusers.Delete(x);
                   }
 
-                  if (now - ds->last_time > DOWNLOAD_TIMEOUT)
+                  if (chksolo)
                   {
-                    ds->chidx=-1;
-                    delete ds;
-                    m_downloads.Delete(x--);
+                    int i;
+                    for (i = 0; i < m_remoteusers.GetSize() && !m_remoteusers.Get(i)->solomask; i ++);
+
+                    if (i < m_remoteusers.GetSize()) m_issoloactive|=1;
+                    else m_issoloactive&=~1;
                   }
                 }
               }
+              m_users_cs.Leave();
+
+              if (subscribe >= 0) // outside of m_users_cs, the network thread takes that with m_net_cs held
+                sendUserMask(un,subscribe,subtier);
             }
           }
-        break;
-        case MESSAGE_CHAT_MESSAGE:
-          if (ChatMessage_Callback)
-          {
-            mpb_chat_message foo;
-            if (!foo.parse(msg))
-            {
-              ChatMessage_Callback(ChatMessage_User32,this,foo.parms,sizeof(foo.parms)/sizeof(foo.parms[0]));
-            }
-          }
-        break;
-        default:
-          //printf("Got unknown message %02X\n",msg->get_type());
-        break;
+        }
+      }
+    break;
+    case MESSAGE_CHAT_MESSAGE:
+      if (ChatMessage_Callback)
+      {
+        mpb_chat_message foo;
+        if (!foo.parse(msg))
+        {
+          ChatMessage_Callback(ChatMessage_User32,this,foo.parms,sizeof(foo.parms)/sizeof(foo.parms[0]));
+        }
+      }
+    break;
+    default:
+    break;
+  }
+}
+
+
+int NJClient::Run() // nonzero if sleep ok
+{
+  // free what the audio thread let go of
+  m_retireq->Drain();
+  updateEngineRate();
+
+  m_writer->SetMaxBytes(config_record_buffer);
+  m_mixworkers->SetThreads(config_mix_threads);
+
+  WDL_HeapBuf *p=0;
+  while (!m_wavebq->GetBlock(&p))
+  {
+    if (p)
+    {
+      float *f=(float*)p->Get();
+      int hl=p->GetSize()/(2*sizeof(float));
+      float *outbuf[2]={f,f+hl};
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+      if (m_oggWrite&&m_oggComp)
+      {
+        m_oggComp->Encode(f,hl,1,hl);
+        if (m_oggComp->GetOutQueue()->Available())
+        {
+          m_writer->Write(m_oggWrite,m_oggComp->GetOutQueue()->Get(),m_oggComp->GetOutQueue()->Available());
+          m_oggComp->GetOutQueue()->Advance(m_oggComp->GetOutQueue()->Available());
+          m_oggComp->GetOutQueue()->Compact();
+        }
+      }
+#endif
+      if (waveWrite)
+      {
+        waveWrite->WriteFloatsNI(outbuf,0,hl);
       }
+      if (m_waveWrite) m_writer->WriteFloats(m_waveWrite,outbuf,hl);
+      m_wavebq->DisposeBlock(p);
+    }
+  }
+  m_wavebq->Refill();
+//    
+  int wantsleep=1;
 
+  if (m_netcon)
+  {
+    // messages the network thread left for us: anything that calls back into
+    // the host, or changes the remote user list
+    for (;;)
+    {
+      m_net_cs.Enter();
+      Net_Message *msg=m_net_deferred.Get(0);
+      if (msg) m_net_deferred.Delete(0);
+      m_net_cs.Leave();
+      if (!msg) break;
+
+      wantsleep=0;
+      handleDeferredMessage(msg);
       msg->releaseRef();
     }
+
+    if (m_status >= 1000) return 1; // connection is gone
   }
 
+  return wantsleep;
+
+}
+
+int NJClient::encodeRun()
+{
+  int did=0;
+  if (m_netcon && m_status >= 1000) return 0; // connection is gone, leave the blocks for Disconnect()
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
   int u;
   for (u = 0; u < m_locchannels.GetSize(); u ++)
   {
     Local_Channel *lc=m_locchannels.Get(u);
     WDL_HeapBuf *p=0;
-    while (!lc->m_bq.GetBlock(&p))
+    int nch=1;
+    lc->m_bq.Refill();
+    while (!lc->m_bq.GetBlock(&p,&nch))
     {
-      wantsleep=0;
+      did=1;
       if (u >= m_max_localch)
       {
         if (p && (uintptr_t)p != -1)
@@ -1025,15 +3305,40 @@ int NJClient::Run() // nonzero if sleep ok
         memset(lc->m_curwritefile.guid,0,sizeof(lc->m_curwritefile.guid));
         cuib.fourcc=0;
         cuib.estsize=0;
-        m_netcon->Send(cuib.build());
+        uploadSend(cuib.build());
         p=0;
       }
       else if (p)
       {
+        int frames=p->GetSize()/sizeof(float)/nch;
+        bool hold=lc->m_need_header && lc->m_unheard;
+        if (!hold && !lc->m_interval_loud && config_silence_threshold > 0.0f) // once loud, stays loud until the interval ends
+        {
+          float pk=WDL_PCMMix_Get()->peak((float *)p->Get(),frames*nch,0.0f);
+          if (pk >= config_silence_threshold) lc->m_interval_loud=true;
+          else if (lc->m_need_header && lc->m_silence_hang <= 0) hold=true;
+        }
+        if (hold)
+        {
+          // nothing sent yet this interval, and still nothing worth sending (or nobody to send it to)
+          lc->m_silent_frames+=frames;
+          lc->m_bq.DisposeBlock(p);
+          p=0;
+          continue;
+        }
+
         // encode data
+        if (lc->m_enc && lc->m_need_header && nch != lc->m_enc_nch)
+        {
+          delete lc->m_enc; // switched between mono and stereo
+          lc->m_enc=0;
+        }
         if (!lc->m_enc)
         {
-          lc->m_enc = new I_NJEncoder(m_srate,1,lc->m_enc_bitrate_used = lc->bitrate,WDL_RNG_int32());
+          const NJ_CodecInfo *codec=NJ_GetCodec(encoderFourcc(lc));
+          lc->m_enc_fourcc=codec->fourcc;
+          lc->m_enc_nch=nch;
+          lc->m_enc = codec->CreateEncoder(m_srate,nch,lc->m_enc_bitrate_used = lc->bitrate,WDL_RNG_int32());
         }
 
         if (lc->m_need_header)
@@ -1046,8 +3351,8 @@ int NJClient::Run() // nonzero if sleep ok
             writeLog("local %s %d\n",guidstr,lc->channel_idx);
             if (config_savelocalaudio>0) 
             {
-              lc->m_curwritefile.Open(this,NJ_ENCODER_FMT_TYPE);
-              if (lc->m_wavewritefile) delete lc->m_wavewritefile;
+              lc->m_curwritefile.Open(this,lc->m_enc_fourcc,false);
+              m_writer->Close(lc->m_wavewritefile);
               lc->m_wavewritefile=0;
               if (config_savelocalaudio>1)
               {
@@ -1063,30 +3368,48 @@ int NJClient::Run() // nonzero if sleep ok
                 fn.Append(guidstr);
                 fn.Append(".wav");
 
-                lc->m_wavewritefile=new WaveWriter(fn.Get(),24,1,m_srate);
+                lc->m_wavewritefile=m_writer->OpenWave(new WaveWriter(fn.Get(),24,lc->m_enc_nch,m_srate));
               }
             }
 
             mpb_client_upload_interval_begin cuib;
             cuib.chidx=lc->channel_idx;
             memcpy(cuib.guid,lc->m_curwritefile.guid,sizeof(cuib.guid));
-            cuib.fourcc=NJ_ENCODER_FMT_TYPE;
+            cuib.fourcc=lc->m_enc_fourcc;
             cuib.estsize=0;
             delete lc->m_enc_header_needsend;
             lc->m_enc_header_needsend=cuib.build();
           }
+          tiersStart(lc,nch);
         }
 
         if (lc->m_enc)
         {
+          while (lc->m_silent_frames > 0)
+          {
+            int n=lc->m_silent_frames < SILENCE_FILL_FRAMES ? lc->m_silent_frames : SILENCE_FILL_FRAMES;
+            if (lc->m_wavewritefile)
+            {
+              float *bufs[2]={silence_fill,silence_fill};
+              m_writer->WriteFloats(lc->m_wavewritefile,bufs,n);
+            }
+            lc->m_enc->Encode(silence_fill,n,1,0);
+            lc->TiersEncode(silence_fill,n,0);
+            lc->m_silent_frames-=n;
+          }
+
+          float *buf=(float*)p->Get();
           if (lc->m_wavewritefile)
           {
-            lc->m_wavewritefile->WriteFloats((float*)p->Get(),p->GetSize()/sizeof(float));
+            float *bufs[2]={buf,buf+frames};
+            m_writer->WriteFloats(lc->m_wavewritefile,bufs,frames);
           }
-          lc->m_enc->Encode((float*)p->Get(),p->GetSize()/sizeof(float));
+          lc->m_enc->Encode(buf,frames,1,frames); // stereo blocks are planar
+          lc->TiersEncode(buf,frames,frames);
 
           int s;
-          while ((s=lc->m_enc->outqueue.Available())>(lc->m_enc_header_needsend?MIN_ENC_BLOCKSIZE*4:MIN_ENC_BLOCKSIZE))
+          int minsend=config_upload_mode ? 0 : lc->m_enc_header_needsend ? MIN_ENC_BLOCKSIZE*4 : MIN_ENC_BLOCKSIZE;
+          while ((s=lc->m_enc->GetOutQueue()->Available())>minsend)
           {
             if (s > MAX_ENC_BLOCKSIZE) s=MAX_ENC_BLOCKSIZE;
 
@@ -1094,7 +3417,7 @@ int NJClient::Run() // nonzero if sleep ok
               mpb_client_upload_interval_write wh;
               memcpy(wh.guid,lc->m_curwritefile.guid,sizeof(lc->m_curwritefile.guid));
               wh.flags=0;
-              wh.audio_data=lc->m_enc->outqueue.Get();
+              wh.audio_data=lc->m_enc->GetOutQueue()->Get();
               wh.audio_data_len=s;
               lc->m_curwritefile.Write(wh.audio_data,wh.audio_data_len);
 
@@ -1106,25 +3429,42 @@ int NJClient::Run() // nonzero if sleep ok
                   dib.parse(lc->m_enc_header_needsend);
                   printf("SEND BLOCK HEADER %s\n",guidtostr_tmp(dib.guid));
                 }
-                m_netcon->Send(lc->m_enc_header_needsend);
+                tiersSendBegins(lc);
+                uploadSend(lc->m_enc_header_needsend);
                 lc->m_enc_header_needsend=0;
               }
 
               if (config_debug_level>1) printf("SEND BLOCK %s%s %d bytes\n",guidtostr_tmp(wh.guid),wh.flags&1?"end":"",wh.audio_data_len);
 
-              m_netcon->Send(wh.build());
+              uploadSend(wh.build());
             }
 
-            lc->m_enc->outqueue.Advance(s);
+            lc->m_enc->GetOutQueue()->Advance(s);
           }
-          lc->m_enc->outqueue.Compact();
+          lc->m_enc->GetOutQueue()->Compact();
+          tiersSend(lc,false);
         }
         lc->m_bq.DisposeBlock(p);
         p=0;
       }
       else
       {
-        if (lc->m_enc)
+        if (lc->m_need_header)
+        {
+          // nothing got encoded, the whole interval was silent
+          if (lc->m_silent_frames)
+          {
+            mpb_client_upload_interval_begin cuib;
+            cuib.chidx=lc->channel_idx;
+            memset(cuib.guid,0,sizeof(cuib.guid));
+            memset(lc->m_curwritefile.guid,0,sizeof(lc->m_curwritefile.guid));
+            cuib.fourcc=0;
+            cuib.estsize=0;
+            uploadSend(cuib.build());
+          }
+          newSubscriberCheck(lc,true);
+        }
+        else if (lc->m_enc)
         {
           // finish any encoding
           lc->m_enc->Encode(NULL,0);
@@ -1134,17 +3474,17 @@ int NJClient::Run() // nonzero if sleep ok
           do
           {
             mpb_client_upload_interval_write wh;
-            int l=lc->m_enc->outqueue.Available();
+            int l=lc->m_enc->GetOutQueue()->Available();
             if (l>MAX_ENC_BLOCKSIZE) l=MAX_ENC_BLOCKSIZE;
 
             memcpy(wh.guid,lc->m_curwritefile.guid,sizeof(wh.guid));
-            wh.audio_data=lc->m_enc->outqueue.Get();
+            wh.audio_data=lc->m_enc->GetOutQueue()->Get();
             wh.audio_data_len=l;
 
             lc->m_curwritefile.Write(wh.audio_data,wh.audio_data_len);
 
-            lc->m_enc->outqueue.Advance(l);
-            wh.flags=lc->m_enc->outqueue.GetSize()>0 ? 0 : 1;
+            lc->m_enc->GetOutQueue()->Advance(l);
+            wh.flags=lc->m_enc->GetOutQueue()->GetSize()>0 ? 0 : 1;
 
             if (lc->m_enc_header_needsend)
             {
@@ -1154,40 +3494,216 @@ int NJClient::Run() // nonzero if sleep ok
                 dib.parse(lc->m_enc_header_needsend);
                 printf("SEND BLOCK HEADER %s\n",guidtostr_tmp(dib.guid));
               }
-              m_netcon->Send(lc->m_enc_header_needsend);
+              tiersSendBegins(lc);
+              uploadSend(lc->m_enc_header_needsend);
               lc->m_enc_header_needsend=0;
             }
 
             if (config_debug_level>1) printf("SEND BLOCK %s%s %d bytes\n",guidtostr_tmp(wh.guid),wh.flags&1?"end":"",wh.audio_data_len);
-            m_netcon->Send(wh.build());
+            uploadSend(wh.build());
           }
-          while (lc->m_enc->outqueue.Available()>0);
-          lc->m_enc->outqueue.Compact(); // free any memory left
+          while (lc->m_enc->GetOutQueue()->Available()>0);
+          lc->m_enc->GetOutQueue()->Compact(); // free any memory left
+          newSubscriberCheck(lc,false);
+          tiersSend(lc,true);
 
           //delete m_enc;
         //  m_enc=0;
           lc->m_enc->reinit();
         }
 
-        if (lc->m_enc && lc->bitrate != lc->m_enc_bitrate_used)
+        unsigned int want=encoderFourcc(lc);
+        if (lc->m_enc && (lc->bitrate != lc->m_enc_bitrate_used || want != lc->m_enc_fourcc))
         {
           delete lc->m_enc;
           lc->m_enc=0;
         }
         lc->m_need_header=true;
+        lc->m_silent_frames=0;
+        if (lc->m_interval_loud) lc->m_silence_hang=config_silence_hangover;
+        else if (lc->m_silence_hang > 0) lc->m_silence_hang--;
+        lc->m_interval_loud=false;
+        lc->m_unheard=config_savelocalaudio <= 0 && lc->channel_idx >= 0 && lc->channel_idx < MPB_MAX_SUB_CHANNELS &&
+                      !m_chan_subscribers[lc->channel_idx];
 
         // end the last encode
       }
     }
   }
+
+  uploadRun();
 #endif
 
-  return wantsleep;
+  return did;
+}
+
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+void NJClient::tiersStart(Local_Channel *lc, int nch)
+{
+  int t;
+  for (t = 0; t < MPB_MAX_TIERS-1; t ++)
+  {
+    Local_Channel::Tier *tr=&lc->m_tiers[t];
+    int want=(m_server_caps & MPB_SERVER_CAP_TIERS) ? tr->bitrate : 0;
+    if (tr->enc && (want != tr->enc_bitrate_used || tr->enc_fourcc != lc->m_enc_fourcc || tr->enc_nch != nch))
+    {
+      delete tr->enc;
+      tr->enc=0;
+    }
+    delete tr->header_needsend;
+    tr->header_needsend=0;
+    if (!want) continue;
+
+    if (!tr->enc)
+    {
+      const NJ_CodecInfo *codec=NJ_GetCodec(lc->m_enc_fourcc);
+      tr->enc_fourcc=lc->m_enc_fourcc;
+      tr->enc_nch=nch;
+      tr->enc=codec->CreateEncoder(m_srate,nch,tr->enc_bitrate_used=want,WDL_RNG_int32());
+    }
+
+    WDL_RNG_bytes(tr->guid,sizeof(tr->guid));
+    mpb_client_upload_tier_begin tb;
+    memcpy(tb.guid,tr->guid,sizeof(tb.guid));
+    memcpy(tb.link_guid,lc->m_curwritefile.guid,sizeof(tb.link_guid));
+    tb.fourcc=tr->enc_fourcc;
+    tb.chidx=lc->channel_idx;
+    tb.tier=t+1;
+    tr->header_needsend=tb.build();
+  }
+}
+
+// a channel that gained a subscriber sends its codec setup with the next interval rather than at the
+// encoder's next refresh. restart is for streams none of which has been sent, they start over now
+void NJClient::newSubscriberCheck(Local_Channel *lc, bool restart)
+{
+  int subs=GetLocalChannelSubscribers(lc->channel_idx);
+  bool rise=subs > lc->m_subscribers && lc->m_subscribers >= 0;
+  lc->m_subscribers=subs;
+  if (!rise) return;
+
+  I_NJEncoder *enc[MPB_MAX_TIERS];
+  int n=0, t;
+  if (lc->m_enc) enc[n++]=lc->m_enc;
+  for (t = 0; t < MPB_MAX_TIERS-1; t ++) if (lc->m_tiers[t].enc) enc[n++]=lc->m_tiers[t].enc;
+  for (t = 0; t < n; t ++)
+  {
+    enc[t]->SendHeadersNext();
+    if (restart) enc[t]->reinit();
+  }
+}
+
+// the server needs these before the interval's own begin
+void NJClient::tiersSendBegins(Local_Channel *lc)
+{
+  int t;
+  for (t = 0; t < MPB_MAX_TIERS-1; t ++)
+  {
+    if (lc->m_tiers[t].header_needsend) uploadSend(lc->m_tiers[t].header_needsend);
+    lc->m_tiers[t].header_needsend=0;
+  }
+}
+
+void NJClient::tiersSend(Local_Channel *lc, bool flush)
+{
+  if (lc->m_enc_header_needsend) return; // not until the interval itself has begun
+
+  int t;
+  for (t = 0; t < MPB_MAX_TIERS-1; t ++)
+  {
+    Local_Channel::Tier *tr=&lc->m_tiers[t];
+    if (!tr->enc) continue;
+    if (flush) tr->enc->Encode(NULL,0);
+
+    WDL_Queue *q=tr->enc->GetOutQueue();
+    int s, minsend=flush ? -1 : config_upload_mode ? 0 : MIN_ENC_BLOCKSIZE;
+    while ((s=q->Available()) > minsend)
+    {
+      if (s > MAX_ENC_BLOCKSIZE) s=MAX_ENC_BLOCKSIZE;
+      mpb_client_upload_interval_write wh;
+      memcpy(wh.guid,tr->guid,sizeof(wh.guid));
+      wh.audio_data=q->Get();
+      wh.audio_data_len=s;
+      wh.flags=flush && s == q->Available() ? 1 : 0;
+      uploadSend(wh.build());
+      q->Advance(s);
+      if (wh.flags) break;
+    }
+    q->Compact();
+    if (flush) tr->enc->reinit();
+  }
+}
+
+#define UPLOAD_MAX_QUEUE_SEC 2.0 // most the upload queue holds, in seconds of budget
+
+void NJClient::uploadSend(Net_Message *msg)
+{
+  if (!msg) return;
+  if (!config_upload_mode || config_upload_budget <= 0)
+  {
+    uploadRun(); // anything left from before goes first
+    if (!m_upload_q.GetSize())
+    {
+      NetSend(msg);
+      return;
+    }
+  }
+  m_upload_q.Add(msg);
+  m_upload_qbytes+=msg->get_size()+5;
+  m_upload_win_bytes+=msg->get_size()+5;
+  uploadRun();
+}
+
+void NJClient::uploadRun()
+{
+  double now=prof_seconds();
+  double budget=config_upload_mode && config_upload_budget > 0 ? config_upload_budget : 0.0;
+  if (budget > 0.0)
+  {
+    // the budget only smooths, it never holds back more than gets produced: each second the rate
+    // everything was queued at is measured, and if that's over the budget the budget follows it
+    if (m_upload_win_start <= 0.0) m_upload_win_start=now;
+    else if (now-m_upload_win_start >= 1.0)
+    {
+      m_upload_rate=m_upload_win_bytes/(now-m_upload_win_start);
+      m_upload_win_bytes=0;
+      m_upload_win_start=now;
+    }
+    if (budget < m_upload_rate*1.25) budget=m_upload_rate*1.25;
+
+    // a tenth of a second of allowance can build up, or one big block
+    double maxtok=budget*0.1;
+    if (maxtok < MAX_ENC_BLOCKSIZE+64) maxtok=MAX_ENC_BLOCKSIZE+64;
+    if (m_upload_lasttime > 0.0) m_upload_tokens+=(now-m_upload_lasttime)*budget;
+    if (m_upload_tokens > maxtok) m_upload_tokens=maxtok;
+  }
+  m_upload_lasttime=now;
+
+  // and until the measurement catches up, a burst never waits more than UPLOAD_MAX_QUEUE_SEC
+  while (m_upload_q.GetSize() && (budget <= 0.0 || m_upload_tokens > 0.0 || m_upload_qbytes > budget*UPLOAD_MAX_QUEUE_SEC))
+  {
+    Net_Message *msg=m_upload_q.Get(0);
+    m_upload_q.Delete(0);
+    m_upload_qbytes-=msg->get_size()+5; // and the message header
+    if (budget > 0.0) m_upload_tokens-=msg->get_size()+5;
+    NetSend(msg);
+  }
+}
 
+void NJClient::uploadClear()
+{
+  int x;
+  for (x = 0; x < m_upload_q.GetSize(); x ++) delete m_upload_q.Get(x);
+  m_upload_q.Empty();
+  m_upload_tokens=0.0;
+  m_upload_lasttime=0.0;
+  m_upload_qbytes=m_upload_win_bytes=0;
+  m_upload_rate=m_upload_win_start=0.0;
 }
+#endif
 
 
-DecodeState *NJClient::start_decode(unsigned char *guid, unsigned int fourcc)
+DecodeState *NJClient::start_decode(unsigned char *guid, unsigned int fourcc, unsigned int tag, StreamBuf *src)
 {
   DecodeState *newstate=new DecodeState;
   memcpy(newstate->guid,guid,sizeof(newstate->guid));
@@ -1196,43 +3712,98 @@ DecodeState *NJClient::start_decode(unsigned char *guid, unsigned int fourcc)
 
   makeFilenameFromGuid(&s,guid);
 
-  // todo: make plug-in system to allow encoders to add types allowed
-  // todo: with a preference for 'fourcc' if specified
-  unsigned int types[]={MAKE_NJ_FOURCC('O','G','G','v')}; // only types we understand
-
+  const NJ_CodecInfo *codec=NULL;
   int oldl=strlen(s.Get())+1;
   s.Append(".XXXXXXXXX");
-  unsigned int x;
-  for (x = 0; !newstate->decode_fp && x < sizeof(types)/sizeof(types[0]); x ++)
+  if (src)
   {
-    type_to_string(types[x],s.Get()+oldl);
-    newstate->decode_fp=fopen(s.Get(),"rb");
+    // still downloading, decode straight from memory
+    codec=NJ_GetCodec(fourcc);
+    if (codec && codec->CreateDecoder)
+    {
+      type_to_string(codec->fourcc,s.Get()+oldl);
+      src->AddRef();
+      newstate->decode_src=src;
+    }
   }
-
-  if (newstate->decode_fp)
+  else
   {
-    if (config_savelocalaudio<0)
+    // look for the file under each type we can decode, trying 'fourcc' first if specified,
+    // and read all of it in here so the audio thread never has to
+    FILE *fp=NULL;
+    int x;
+    for (x = -1; !fp; x ++)
     {
-      newstate->delete_on_delete.Set(s.Get());
-    }
-    newstate->decode_codec= new I_NJDecoder;
-    // run some decoding
+      if (x < 0) codec=fourcc ? NJ_GetCodec(fourcc) : NULL;
+      else if (!(codec=NJ_EnumCodecs(x))) break;
+      else if (fourcc && codec->fourcc == fourcc) continue;
 
-    while (newstate->decode_codec->m_samples_used <= 0)
+      if (!codec || !codec->CreateDecoder) continue;
+      type_to_string(codec->fourcc,s.Get()+oldl);
+      fp=fopen(s.Get(),"rb");
+    }
+    if (fp)
     {
-      int l=fread(newstate->decode_codec->DecodeGetSrcBuffer(128),1,128,newstate->decode_fp);          
-      if (l) newstate->decode_codec->DecodeWrote(l);
-      if (!l) 
-      {
-        clearerr(newstate->decode_fp);
-        break;
-      }
+      newstate->decode_src=new StreamBuf;
+      char buf[8192];
+      int l;
+      while ((l=fread(buf,1,sizeof(buf),fp)) > 0) newstate->decode_src->Write(buf,l);
+      fclose(fp);
     }
   }
 
+  if (newstate->decode_src)
+  {
+    newstate->decode_codec=m_decpool->Get(codec->fourcc,tag);
+    if (!newstate->decode_codec) newstate->decode_codec=codec->CreateDecoder();
+    newstate->pool=m_decpool;
+    newstate->pool_fourcc=codec->fourcc;
+    newstate->pool_tag=tag;
+    prime_decode(newstate);
+  }
+
   return newstate;
 }
 
+// builds the device<->engine rate converters the audio thread asked for, see AudioProc()
+void NJClient::updateEngineRate()
+{
+  const int gen=m_er_gen;
+  if (gen == m_er_built) return;
+  m_er_built=gen;
+  NJ_MEMBARRIER();
+  EngineRate *er=new EngineRate(m_er_devrate,m_er_rate,m_er_innch,m_er_outnch,m_er_len,m_er_quality);
+
+  // one that was never picked up has been asked past, the audio thread may take it meanwhile though
+  EngineRate *old=m_enginerate_next;
+  if (old && NJ_ATOMIC_CASPTR(m_enginerate_next,old,(EngineRate *)NULL)) delete old;
+  NJ_MEMBARRIER();
+  m_enginerate_next=er;
+}
+
+// decodes until there's output, so stream setup (codec headers, the OGHv header cache) happens on the
+// calling thread rather than the audio thread, then sets up the resampler once the samplerate is known.
+// returns 0 if the data ran out first: call again when there's more.
+int NJClient::prime_decode(DecodeState *ds)
+{
+  if (!ds->decode_codec || !ds->decode_src) return 0;
+  while (ds->decode_codec->GetRing()->Available() <= 0)
+  {
+    int l=ds->decode_src->Read(ds->decode_codec->DecodeGetSrcBuffer(128),128);
+    if (!l) return 0;
+    ds->decode_codec->DecodeWrote(l);
+  }
+
+  int sr=ds->decode_codec->GetSampleRate();
+  if (!ds->resampler && sr > 0 && m_srate > 0 && sr != m_srate)
+  {
+    ds->resampler=new WDL_Resampler;
+    ds->resampler->Init(sr,m_srate,ds->decode_codec->GetNumChannels()>1?2:1,config_resample_quality);
+    ds->resampler->Prepare(RESAMPLE_CHUNK);
+  }
+  return 1;
+}
+
 float NJClient::GetOutputPeak()
 {
   return (float)output_peaklevel;
@@ -1248,7 +3819,7 @@ void NJClient::ChatMessage_Send(char *parm1, char *parm2, char *parm3, char *par
     m.parms[2]=parm3;
     m.parms[3]=parm4;
     m.parms[4]=parm5;
-    m_netcon->Send(m.build());
+    NetSend(m.build());
   }
 }
 
@@ -1258,39 +3829,53 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
   double decay=pow(.25*0.25*0.25,len/(double)srate);
   // encode my audio and send to server, if enabled
   int u;
+  const WDL_PCMMix_Funcs *mix=WDL_PCMMix_Get();
+  uint64_t t0=prof_ticks(), tbq=0, t1;
   m_locchan_cs.Enter();
   for (u = 0; u < m_locchannels.GetSize() && u < m_max_localch; u ++)
   {
     Local_Channel *lc=m_locchannels.Get(u);
-    int sc=lc->src_channel;
-    float *src=NULL;
+    int sc=lc->src_channel&~LOCAL_CHANNEL_STEREO;
+    bool stereo=!!(lc->src_channel&LOCAL_CHANNEL_STEREO);
+    float *src=NULL, *src2=NULL;
     if (sc >= 0 && sc < innch) src=inbuf[sc]+offset;
+    if (stereo && sc+1 >= 0 && sc+1 < innch) src2=inbuf[sc+1]+offset;
 
-    if (lc->cbf || !src || ChannelMixer)
+    if (lc->cbf || !src || (stereo && !src2) || ChannelMixer)
     {
       int bytelen=len*(int)sizeof(float);
-      if (tmpblock.GetSize() < bytelen) tmpblock.Resize(bytelen);
+      if (tmpblock.GetSize() < bytelen*2) tmpblock.Resize(bytelen*2);
+      float *tmp=(float*)tmpblock.Get();
 
-      if (ChannelMixer && ChannelMixer(ChannelMixer_User32,inbuf,offset,innch,sc,(float*)tmpblock.Get(),len))
+      int ch;
+      for (ch = 0; ch < (stereo ? 2 : 1); ch ++)
       {
-        // channelmixer succeeded
-      }
-      else if (src) memcpy(tmpblock.Get(),src,bytelen);
-      else memset(tmpblock.Get(),0,bytelen);
-
-      src=(float* )tmpblock.Get();
+        float *in=ch ? src2 : src;
+        float *buf=tmp+ch*len;
+        if (ChannelMixer && ChannelMixer(ChannelMixer_User32,inbuf,offset,innch,sc+ch,buf,len))
+        {
+          // channelmixer succeeded
+        }
+        else if (in) memcpy(buf,in,bytelen);
+        else memset(buf,0,bytelen);
 
-      // processor
-      if (lc->cbf)
-      {
-        lc->cbf(src,len,lc->cbf_inst);
+        // processor
+        if (lc->cbf)
+        {
+          lc->cbf(buf,len,lc->cbf_inst);
+        }
       }
+      src=tmp;
+      if (stereo) src2=tmp+len;
     }
 
     if (!justmonitor && lc->bcast_active) 
     {
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
-      lc->m_bq.AddBlock(src,len);
+      t1=prof_ticks();
+      if (!lc->bcast_stereo) lc->m_bq.AddBlock(src,len);
+      else lc->m_bq.AddBlock(src,len,src2 ? src2 : src);
+      tbq+=prof_ticks()-t1;
 #endif
     }
 
@@ -1309,49 +3894,20 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
         else if (lc->pan < 0.0f) vol2 *= 1.0f+lc->pan;
 
         float maxf=(float) (lc->decode_peak_vol*decay);
-
-        int x=len;
-        while (x--) 
-        {
-          float f=src[0] * vol1;
-
-          if (f > maxf) maxf=f;
-          else if (f < -maxf) maxf=-f;
-
-          if (f > 1.0) f=1.0;
-          else if (f < -1.0) f=-1.0;
-
-          *out1++ += f;
-
-          f=src[0]*vol2;
-
-          if (f > maxf) maxf=f;
-          else if (f < -maxf) maxf=-f;
-
-          if (f > 1.0) f=1.0;
-          else if (f < -1.0) f=-1.0;
-
-          *out2++ += f;
-          src++;
-        }
+        maxf=mix->mix_peak(src,out1,len,vol1,maxf);
+        maxf=mix->mix_peak(src2 ? src2 : src,out2,len,vol2,maxf);
         lc->decode_peak_vol=maxf;
       }
       else
       {
         float maxf=(float) (lc->decode_peak_vol*decay);
-        int x=len;
-        while (x--) 
+        if (src2)
         {
-          float f=*src++ * vol1;
-          if (f > maxf) maxf=f;
-          else if (f < -maxf) maxf=-f;
-
-          if (f > 1.0) f=1.0;
-          else if (f < -1.0) f=-1.0;
-
-          *out1++ += f;
+          maxf=mix->mix_peak(src,out1,len,vol1*0.5f,maxf);
+          maxf=mix->mix_peak(src2,out1,len,vol1*0.5f,maxf);
+          lc->decode_peak_vol=maxf;
         }
-        lc->decode_peak_vol=maxf;
+        else lc->decode_peak_vol=mix->mix_peak(src,out1,len,vol1,maxf);
       }
     }
     else lc->decode_peak_vol=0.0;
@@ -1359,11 +3915,16 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
 
   m_locchan_cs.Leave();
 
+  t1=prof_ticks();
+  m_prof->Add(NJC_PROF_LOCAL,t1-t0-tbq);
+  if (tbq) m_prof->Add(NJC_PROF_BUFQUEUE,tbq);
+  t0=t1;
 
   if (!justmonitor)
   {
     // mix in all active (subscribed) channels
     m_users_cs.Enter();
+    m_mixworkers->Begin();
     for (u = 0; u < m_remoteusers.GetSize(); u ++)
     {
       RemoteUser *user=m_remoteusers.Get(u);
@@ -1381,29 +3942,32 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
         else muteflag=(user->mutedmask & (1<<ch)) || user->muted;
 
         if (user->channels[ch].ds)
-          mixInChannel(muteflag,
-            user->volume*user->channels[ch].volume,lpan,
-              user->channels[ch].ds,outbuf,len,srate,outnch,offset,decay);
+          m_mixworkers->AddJob(muteflag,user->volume*user->channels[ch].volume,lpan,
+                               user->channels[ch].ds,&user->channels[ch].jitter.underruns,outbuf,len,srate,outnch,offset,decay);
       }
     }
+    m_mixworkers->Run(outbuf,len,srate,outnch,offset,decay);
     m_users_cs.Leave();
 
+    t1=prof_ticks();
+    m_prof->Add(NJC_PROF_REMOTE,t1-t0);
 
     // write out wave if necessary
 
-    if (waveWrite
+    if (waveWrite || m_waveWrite
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
       ||(m_oggWrite&&m_oggComp)
 #endif
       )
     {
       m_wavebq->AddBlock(outbuf[0]+offset,len,outbuf[outnch>1]+offset);
+      m_prof->Add(NJC_PROF_BUFQUEUE,prof_ticks()-t1);
     }
+    t0=prof_ticks();
   }
 
   // apply master volume, then
   {
-    int x=len;
     float *ptr1=outbuf[0]+offset;
     float maxf=(float)(output_peaklevel*decay);
 
@@ -1415,30 +3979,20 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
       if (config_masterpan > 0.0f) vol1 *= 1.0f-config_masterpan;
       else if (config_masterpan< 0.0f) vol2 *= 1.0f+config_masterpan;
 
-      while (x--)
-      {
-        float f = *ptr1++ *= vol1;
-        if (f > maxf) maxf=f;
-        else if (f < -maxf) maxf=-f;
-
-        f = *ptr2++ *= vol2;
-        if (f > maxf) maxf=f;
-        else if (f < -maxf) maxf=-f;
-      }
+      maxf=mix->scale_peak(ptr1,len,vol1,maxf);
+      maxf=mix->scale_peak(ptr2,len,vol2,maxf);
     }
     else
     {
       float vol1=config_mastermute?0.0f:config_mastervolume;
-      while (x--)
-      {
-        float f = *ptr1++ *= vol1;
-        if (f > maxf) maxf=f;
-        else if (f < -maxf) maxf=-f;
-      }
+      maxf=mix->scale_peak(ptr1,len,vol1,maxf);
     }
     output_peaklevel=maxf;
   }
 
+  t1=prof_ticks();
+  m_prof->Add(NJC_PROF_MASTER,t1-t0);
+
   // mix in (super shitty) metronome (fucko!!!!)
   if (!justmonitor)
   {
@@ -1473,67 +4027,210 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
           if (!m_metronome_tmp) val = sin((double)m_metronome_state*sc*2.0) * 0.25;
           else val = sin((double)m_metronome_state*sc);
 
-          ptr1[x]+=(float)(val*vol1);
-          if (ptr2) ptr2[x]+=(float)(val*vol2);
+          ptr1[x]+=(float)(val*vol1);
+          if (ptr2) ptr2[x]+=(float)(val*vol2);
+        }
+        if (++m_metronome_state >= metrolen) m_metronome_state=0;
+
+      }
+    }   
+    m_prof->Add(NJC_PROF_METRONOME,prof_ticks()-t1);
+  }
+
+}
+
+int NJClient::mixInChannel(bool muted, float vol, float pan, DecodeState *chan, float **outbuf, int len, int srate, int outnch, int offs, double vudecay, WDL_TypedBuf<float> *rstmp)
+{
+  if (!chan->decode_codec || !chan->decode_src) return 0;
+
+  WDL_PlanarRingBuf *ring=chan->decode_codec->GetRing();
+  int nch=chan->decode_codec->GetNumChannels();
+  int srcrate=chan->decode_codec->GetSampleRate();
+  if (!srcrate) srcrate=srate;
+
+  WDL_Resampler *rs=NULL;
+  bool badrate=false;
+  if (srcrate != srate)
+  {
+    rs=chan->resampler;
+    if (!rs || (int)rs->GetDstRate() != srate || (int)rs->GetSrcRate() != srcrate)
+    {
+      // samplerate changed since start_decode. setting up a resampler here would allocate, so let
+      // the rest of this interval go by in silence, the next start_decode builds one that fits
+      rs=NULL;
+      badrate=true;
+    }
+  }
+
+  // everything here is in frames
+  int needed=rs ? rs->GetInputNeeded(len) : len;
+
+  I_NJDecoder *dec=chan->decode_codec;
+  bool skip=badrate || (config_lazy_decode && (muted || vol < 0.0000001));
+  dec->SetSkip(skip);
+  if (skip || dec->GetSkipped() > 0)
+  {
+    // nobody's listening (or was, and decoding hasn't caught up yet), move along in silence
+    int want=needed+chan->dump_samples;
+    while (ring->Available()+dec->GetSkipped() <= want)
+    {
+      int l=chan->decode_src->Read(dec->DecodeGetSrcBuffer(128),128);
+      if (!l) break;
+      dec->DecodeWrote(l);
+    }
+
+    // if decoding just caught up, carry on as normal
+    int s=dec->GetSkipped();
+    if (skip || s > 0)
+    {
+      if (ring->Available()+s >= want)
+      {
+        if (s > want) s=want;
+        dec->ConsumeSkipped(s);
+        ring->Advance(want-s);
+        if (rs)
+        {
+          // keep the resampler's position, the history is silence as far as anyone can hear
+          int c, rsnch=rs->GetNumChannels(), done=0;
+          while (done < len)
+          {
+            int k=len-done > RESAMPLE_CHUNK ? RESAMPLE_CHUNK : len-done;
+            int in=rs->GetInputNeeded(k);
+            for (c = 0; c < rsnch; c ++) memset(rs->GetInputBuffer(c,in),0,in*sizeof(float));
+            rs->AddInput(in);
+            rs->Skip(k);
+            done+=k;
+          }
         }
-        if (++m_metronome_state >= metrolen) m_metronome_state=0;
-
+        chan->decode_samplesout += needed;
+        chan->dump_samples=0;
+        chan->decode_peak_vol=0.0;
+        return 0;
       }
-    }   
-  }
 
-}
+      chan->decode_samplesout += ring->Available()+s;
+      dec->ConsumeSkipped(s);
+      ring->Clear();
+      int isnew=!chan->dump_samples;
+      chan->dump_samples+=needed;
+      return isnew;
+    }
+  }
 
-void NJClient::mixInChannel(bool muted, float vol, float pan, DecodeState *chan, float **outbuf, int len, int srate, int outnch, int offs, double vudecay)
-{
-  if (!chan->decode_codec || !chan->decode_fp) return;
+  while (ring->Available() <= needed+chan->dump_samples)
+  {
+    int l=chan->decode_src->Read(dec->DecodeGetSrcBuffer(128),128);
+    if (!l) break;
+    dec->DecodeWrote(l);
+  }
 
-  int needed;
-  while (chan->decode_codec->m_samples_used <= 
-        (needed=resampleLengthNeeded(chan->decode_codec->GetSampleRate(),srate,len,&chan->resample_state)*chan->decode_codec->GetNumChannels()))
+  int padframes=0;
+  if (rs)
   {
-    int l=fread(chan->decode_codec->DecodeGetSrcBuffer(128),1,128,chan->decode_fp);          
-    chan->decode_codec->DecodeWrote(l);
-    if (!l) 
+    // the end of an interval only lacks the filter's lookahead, pad that with silence rather than dropping the block
+    int short_by=needed+chan->dump_samples-ring->Available();
+    if (short_by > 0 && short_by <= rs->GetLookahead())
     {
-      clearerr(chan->decode_fp);
-      break;
+      padframes=short_by;
+      needed-=padframes;
     }
   }
 
-  if (chan->decode_codec->m_samples_used >= needed+chan->dump_samples)
+  if (ring->Available() >= needed+chan->dump_samples)
   {
-    float *sptr=(float *)chan->decode_codec->m_samples.Get();
+    const WDL_PCMMix_Funcs *mix=WDL_PCMMix_Get();
+    int c;
+
+    bool audible=!muted && vol > 0.0000001;
+    float vol1=0.0f, vol2=0.0f;
+    float *dest1=outbuf[0]+offs, *dest2=outnch > 1 ? (outbuf[1]+offs) : 0;
 
     // process VU meter, yay for powerful CPUs
-    if (!muted && vol > 0.0000001) 
+    if (audible)
     {
-      float *p=sptr;
-      int l=(needed+chan->dump_samples)*chan->decode_codec->GetNumChannels();
+      int l=needed+chan->dump_samples;
       float maxf=(float) (chan->decode_peak_vol*vudecay/vol);
-      while (l--)
+      for (c = 0; c < nch; c ++)
       {
-        float f=*p++;
-        if (f > maxf) maxf=f;
-        else if (f < -maxf) maxf=-f;
+        int done=0,seg;
+        while (done < l)
+        {
+          float *p=ring->Peek(c,done,&seg);
+          if (seg > l-done) seg=l-done;
+          if (seg < 1) break;
+          maxf=mix->peak(p,seg,maxf);
+          done+=seg;
+        }
       }
       chan->decode_peak_vol=maxf*vol;
 
-      float *tmpbuf[2]={outbuf[0]+offs,outnch > 1 ? (outbuf[1]+offs) : 0};
-      mixFloatsNIOutput(sptr+chan->dump_samples,
-              chan->decode_codec->GetSampleRate(),
-              chan->decode_codec->GetNumChannels(),
-              tmpbuf,
-              srate,outnch>1?2:1,len,
-              vol,pan,&chan->resample_state);
+      vol1=vol2=vol > 4.0f ? 4.0f : vol;
+      if (dest2)
+      {
+        if (pan < -1.0f) pan=-1.0f;
+        else if (pan > 1.0f) pan=1.0f;
+        if (pan < 0.0f) vol2 *= 1.0f+pan;
+        else if (pan > 0.0f) vol1 *= 1.0f-pan;
+      }
     }
     else 
       chan->decode_peak_vol=0.0;
 
+    if (rs)
+    {
+      // the resampler keeps history, so it gets fed even when muted. a chunk at a time,
+      // so neither its input buffer nor the scratch (both sized at setup) has to grow here
+      int rsnch=rs->GetNumChannels(), done=0, used=0;
+      float *tmpbuf[2]={rstmp->Get(),rstmp->Get()+(rsnch>1?RESAMPLE_CHUNK:0)};
+      while (done < len)
+      {
+        int k=len-done > RESAMPLE_CHUNK ? RESAMPLE_CHUNK : len-done;
+        int in=rs->GetInputNeeded(k);
+        if (in > needed+padframes-used) in=needed+padframes-used;
+        int rd=needed-used < in ? needed-used : in; // the rest is padding
+        if (rd < 0) rd=0;
+        for (c = 0; c < rsnch; c ++)
+        {
+          float *p=rs->GetInputBuffer(c,in);
+          ring->Read(c,p,rd,chan->dump_samples+used);
+          memset(p+rd,0,(in-rd)*sizeof(float));
+        }
+        rs->AddInput(in);
+        used+=in;
+
+        int got=rs->Process(tmpbuf,k);
+        if (got < k) for (c = 0; c < rsnch; c ++) memset(tmpbuf[c]+got,0,(k-got)*sizeof(float));
+        if (audible)
+        {
+          if (dest2) mix->mix_peak(tmpbuf[1],dest2+done,k,vol2,0.0f);
+          mix->mix_peak(tmpbuf[0],dest1+done,k,vol1,0.0f);
+        }
+        done+=k;
+      }
+      if (used < needed)
+      {
+        // the per-chunk estimates can round a frame short, keep the resampler in step with the ring
+        for (c = 0; c < rsnch; c ++) ring->Read(c,rs->GetInputBuffer(c,needed-used),needed-used,chan->dump_samples+used);
+        rs->AddInput(needed-used);
+      }
+    }
+    else if (audible)
+    {
+      // mix straight out of the decoder's ring
+      int done=0,seg,seg2;
+      while (done < len)
+      {
+        float *p=ring->Peek(0,chan->dump_samples+done,&seg);
+        if (seg > len-done) seg=len-done;
+        if (dest2) mix->mix_peak(ring->Peek(nch>1,chan->dump_samples+done,&seg2),dest2+done,seg,vol2,0.0f);
+        mix->mix_peak(p,dest1+done,seg,vol1,0.0f);
+        done+=seg;
+      }
+    }
+
     // advance the queue
-    chan->decode_samplesout += needed/chan->decode_codec->GetNumChannels();
-    chan->decode_codec->m_samples_used -= needed+chan->dump_samples;
-    memmove(sptr,sptr+needed+chan->dump_samples,chan->decode_codec->m_samples_used*sizeof(float));
+    chan->decode_samplesout += needed;
+    ring->Advance(needed+chan->dump_samples);
     chan->dump_samples=0;
   }
   else
@@ -1547,17 +4244,19 @@ void NJClient::mixInChannel(bool muted, float vol, float pan, DecodeState *chan,
     guidtostr(chan->guid,s);
 
     char buf[512];
-    sprintf(buf,"underrun %d at %d on %s, %d/%d samples\n",cnt++,ftell(chan->decode_fp),s,chan->decode_codec->m_samples_used,needed);
+    sprintf(buf,"underrun %d at %d on %s, %d/%d frames\n",cnt++,chan->decode_src->GetReadPos(),s,ring->Available(),needed);
 #ifdef _WIN32
     OutputDebugString(buf);
 #endif
     }
 
-    chan->decode_samplesout += chan->decode_codec->m_samples_used/chan->decode_codec->GetNumChannels();
-    chan->decode_codec->m_samples_used=0;
+    chan->decode_samplesout += ring->Available();
+    ring->Clear();
+    int isnew=!chan->dump_samples;
     chan->dump_samples+=needed;
-
+    return isnew;
   }
+  return 0;
 }
 
 void NJClient::on_new_interval()
@@ -1568,29 +4267,6 @@ void NJClient::on_new_interval()
   m_metronome_pos=0.0;
 
   int u;
-  m_locchan_cs.Enter();
-  for (u = 0; u < m_locchannels.GetSize() && u < m_max_localch; u ++)
-  {
-    Local_Channel *lc=m_locchannels.Get(u);
-
-
-    if (lc->bcast_active) 
-    {
-      lc->m_bq.AddBlock(NULL,0);
-    }
-
-    int wasact=lc->bcast_active;
-
-    lc->bcast_active = lc->broadcasting;
-
-    if (wasact && !lc->bcast_active)
-    {
-      lc->m_bq.AddBlock(NULL,-1);
-    }
-
-  }
-  m_locchan_cs.Leave();
-
   m_users_cs.Enter();
   for (u = 0; u < m_remoteusers.GetSize(); u ++)
   {
@@ -1600,10 +4276,10 @@ void NJClient::on_new_interval()
     for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
     {
       RemoteUser_Channel *chan=&user->channels[ch];
-      delete chan->ds;
+      m_retireq->Add(chan->ds);
       chan->ds=0;
       if ((user->submask & user->chanpresentmask) & (1<<ch)) chan->ds = chan->next_ds[0];
-      else delete chan->next_ds[0];
+      else m_retireq->Add(chan->next_ds[0]);
       chan->next_ds[0]=chan->next_ds[1]; // advance queue
       chan->next_ds[1]=0;
       ;
@@ -1622,6 +4298,34 @@ void NJClient::on_new_interval()
 
 }
 
+void NJClient::on_new_rec_interval()
+{
+  int u;
+  m_locchan_cs.Enter();
+  for (u = 0; u < m_locchannels.GetSize() && u < m_max_localch; u ++)
+  {
+    Local_Channel *lc=m_locchannels.Get(u);
+
+
+    if (lc->bcast_active) 
+    {
+      lc->m_bq.AddBlock(NULL,0);
+    }
+
+    int wasact=lc->bcast_active;
+
+    lc->bcast_active = lc->broadcasting;
+    lc->bcast_stereo = !!(lc->src_channel & LOCAL_CHANNEL_STEREO);
+
+    if (wasact && !lc->bcast_active)
+    {
+      lc->m_bq.AddBlock(NULL,-1);
+    }
+
+  }
+  m_locchan_cs.Leave();
+}
+
 
 char *NJClient::GetUserState(int idx, float *vol, float *pan, bool *mute)
 {
@@ -1642,6 +4346,31 @@ void NJClient::SetUserState(int idx, bool setvol, float vol, bool setpan, float
   if (setmute) p->muted=mute;
 }
 
+void NJClient::SetUserTier(int idx, int tier)
+{
+  if (idx<0 || idx>=m_remoteusers.GetSize()) return;
+  RemoteUser *p=m_remoteusers.Get(idx);
+  if (tier < 0) tier=0;
+  else if (tier >= MPB_MAX_TIERS) tier=MPB_MAX_TIERS-1;
+  if (p->tier == tier) return;
+  p->tier=tier;
+  if (p->submask) sendUserMask(p->name.Get(),p->submask,tier);
+}
+
+int NJClient::GetUserTier(int idx)
+{
+  if (idx<0 || idx>=m_remoteusers.GetSize()) return 0;
+  return m_remoteusers.Get(idx)->tier;
+}
+
+void NJClient::sendUserMask(const char *username, int submask, int tier)
+{
+  mpb_client_set_usermask su;
+  su.tiered=!!(m_server_caps & MPB_SERVER_CAP_TIERS);
+  su.build_add_rec((char *)username,submask,tier);
+  NetSend(su.build());
+}
+
 int NJClient::EnumUserChannels(int useridx, int i)
 {
   if (useridx<0 || useridx>=m_remoteusers.GetSize()||i<0||i>=MAX_USER_CHANNELS) return -1;
@@ -1685,9 +4414,7 @@ void NJClient::SetUserChannelState(int useridx, int channelidx,
     // toggle subscription
     if (!sub)
     {     
-      mpb_client_set_usermask su;
-      su.build_add_rec(user->name.Get(),(user->submask&=~(1<<channelidx)));
-      m_netcon->Send(su.build());
+      sendUserMask(user->name.Get(),(user->submask&=~(1<<channelidx)),user->tier);
 
       DecodeState *tmp,*tmp2,*tmp3;
       m_users_cs.Enter();
@@ -1702,9 +4429,7 @@ void NJClient::SetUserChannelState(int useridx, int channelidx,
     }
     else
     {
-      mpb_client_set_usermask su;
-      su.build_add_rec(user->name.Get(),(user->submask|=(1<<channelidx)));
-      m_netcon->Send(su.build());
+      sendUserMask(user->name.Get(),(user->submask|=(1<<channelidx)),user->tier);
     }
 
   }
@@ -1748,6 +4473,80 @@ float NJClient::GetUserChannelPeak(int useridx, int channelidx)
   return (float)p->ds->decode_peak_vol;
 }
 
+int NJClient::GetUserChannelPrebuffer(int useridx, int channelidx, int *ms)
+{
+  if (ms) *ms=0;
+  if (useridx<0 || useridx>=m_remoteusers.GetSize()||channelidx<0||channelidx>=MAX_USER_CHANNELS) return 0;
+  RemoteUser *user=m_remoteusers.Get(useridx);
+  if (!(user->chanpresentmask & (1<<channelidx))) return 0;
+  JitterEstimator *je=&user->channels[channelidx].jitter;
+  if (ms && je->rate_out > 0.0) *ms=(int)(je->depth/je->rate_out);
+  return je->depth;
+}
+
+int NJClient::StartLatencyCalibration()
+{
+  return m_latcal->Start();
+}
+
+void NJClient::StopLatencyCalibration()
+{
+  NJ_ATOMIC_CAS(m_latcal->m_state,1,0);
+}
+
+int NJClient::GetLatencyCalibration(double *seconds)
+{
+  updateEngineRate(); // clients wait on this before they start calling Run()
+  int st=m_latcal->m_state;
+  if (st == 1)
+  {
+    // nothing is calling AudioProc(): call it off, or it'd silence the engine whenever audio does start.
+    // if the audio thread finishes first, the CAS fails and we pick up its result next time
+    if (m_latcal->Stalled(prof_seconds()) && NJ_ATOMIC_CAS(m_latcal->m_state,1,0)) return -1;
+    return 1;
+  }
+  m_latcal->m_state=0;
+  if (st != 2) return -1;
+  config_latency_compensation=m_latcal->m_result;
+  if (seconds) *seconds=m_latcal->m_result;
+  return 0;
+}
+
+const char *NJClient::GetAudioStageName(int stage)
+{
+  static const char *names[NJC_PROF_NUM]={"total","local","bufqueue","remote","master","metronome","interval"};
+  if (stage < 0 || stage >= NJC_PROF_NUM) return NULL;
+  return names[stage];
+}
+
+int NJClient::GetAudioStageStats(int stage, double *mean, double *p50, double *p99, double *max)
+{
+  return m_prof->GetStats(stage,mean,p50,p99,max);
+}
+
+double NJClient::GetAudioCallbackBudget()
+{
+  return m_prof->budget_us;
+}
+
+int NJClient::GetAudioDeadlineMisses()
+{
+  return m_prof->misses;
+}
+
+void NJClient::ResetAudioStats()
+{
+  m_prof->reset_req=1;
+}
+
+int NJClient::GetUserChannelUnderruns(int useridx, int channelidx)
+{
+  if (useridx<0 || useridx>=m_remoteusers.GetSize()||channelidx<0||channelidx>=MAX_USER_CHANNELS) return 0;
+  RemoteUser *user=m_remoteusers.Get(useridx);
+  if (!(user->chanpresentmask & (1<<channelidx))) return 0;
+  return user->channels[channelidx].jitter.underruns;
+}
+
 float NJClient::GetLocalChannelPeak(int ch)
 {
   int x;
@@ -1759,15 +4558,18 @@ float NJClient::GetLocalChannelPeak(int ch)
 
 void NJClient::DeleteLocalChannel(int ch)
 {
+  m_enc_cs.Enter(); // the encoder thread may be in the middle of this channel
   m_locchan_cs.Enter();
   int x;
   for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
   if (x < m_locchannels.GetSize())
   {
+    m_writer->Close(m_locchannels.Get(x)->m_wavewritefile);
     delete m_locchannels.Get(x);
     m_locchannels.Delete(x);
   }
   m_locchan_cs.Leave();
+  m_enc_cs.Leave();
 }
 
 void NJClient::SetLocalChannelProcessor(int ch, void (*cbf)(float *, int ns, void *), void *inst)
@@ -1803,6 +4605,7 @@ void NJClient::GetLocalChannelProcessor(int ch, void **func, void **inst)
 void NJClient::SetLocalChannelInfo(int ch, char *name, bool setsrcch, int srcch,
                                    bool setbitrate, int bitrate, bool setbcast, bool broadcast)
 {  
+  m_enc_cs.Enter(); // adding may move the list under the encoder thread
   m_locchan_cs.Enter();
   int x;
   for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
@@ -1818,6 +4621,7 @@ void NJClient::SetLocalChannelInfo(int ch, char *name, bool setsrcch, int srcch,
   if (setbitrate) c->bitrate=bitrate;
   if (setbcast) c->broadcasting=broadcast;
   m_locchan_cs.Leave();
+  m_enc_cs.Leave();
 }
 
 char *NJClient::GetLocalChannelInfo(int ch, int *srcch, int *bitrate, bool *broadcast)
@@ -1833,6 +4637,93 @@ char *NJClient::GetLocalChannelInfo(int ch, int *srcch, int *bitrate, bool *broa
   return c->name.Get();
 }
 
+void NJClient::SetLocalChannelCodec(int ch, unsigned int fourcc)
+{
+  m_locchan_cs.Enter();
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x < m_locchannels.GetSize()) m_locchannels.Get(x)->codec=fourcc;
+  m_locchan_cs.Leave();
+}
+
+void NJClient::SetLocalChannelTiers(int ch, int bitrate1, int bitrate2)
+{
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+  m_locchan_cs.Enter();
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x < m_locchannels.GetSize())
+  {
+    Local_Channel *c=m_locchannels.Get(x);
+    c->m_tiers[0].bitrate=bitrate1 > 0 ? bitrate1 : 0;
+    c->m_tiers[1].bitrate=bitrate2 > 0 ? bitrate2 : 0;
+  }
+  m_locchan_cs.Leave();
+#endif
+}
+
+void NJClient::GetLocalChannelTiers(int ch, int *bitrate1, int *bitrate2)
+{
+  if (bitrate1) *bitrate1=0;
+  if (bitrate2) *bitrate2=0;
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x == m_locchannels.GetSize()) return;
+  Local_Channel *c=m_locchannels.Get(x);
+  if (bitrate1) *bitrate1=c->m_tiers[0].bitrate;
+  if (bitrate2) *bitrate2=c->m_tiers[1].bitrate;
+#endif
+}
+
+unsigned int NJClient::GetLocalChannelCodec(int ch, unsigned int *inuse)
+{
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x == m_locchannels.GetSize()) return 0;
+  Local_Channel *c=m_locchannels.Get(x);
+  if (inuse)
+  {
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+    *inuse=c->m_enc ? c->m_enc_fourcc : 0;
+#else
+    *inuse=0;
+#endif
+  }
+  return c->codec;
+}
+
+int NJClient::IsCodecUsable(unsigned int fourcc)
+{
+  if (fourcc == NJ_ENCODER_FMT_TYPE) return 1;
+  if (!NJ_GetCodec(fourcc)) return 0;
+  int x, rv=0;
+  m_misc_cs.Enter();
+  for (x = 0; x < m_codecs_common_num && !rv; x ++) rv = m_codecs_common[x] == fourcc;
+  m_misc_cs.Leave();
+  return rv;
+}
+
+// what a local channel encodes with this interval
+unsigned int NJClient::encoderFourcc(Local_Channel *lc)
+{
+  const NJ_CodecInfo *codec=NJ_GetCodec(lc->codec);
+  if (codec && codec->CreateEncoder && IsCodecUsable(codec->fourcc)) return codec->fourcc;
+  if (!lc->codec && IsCodecUsable(NJ_CODEC_VORBIS_HDRLESS)) return NJ_CODEC_VORBIS_HDRLESS;
+  return NJ_ENCODER_FMT_TYPE;
+}
+
+// m_net_cs held
+void NJClient::sendCodecCaps()
+{
+  mpb_client_set_codec_caps cc;
+  int x;
+  const NJ_CodecInfo *codec;
+  for (x = 0; (codec=NJ_EnumCodecs(x)) && cc.num_fourcc < MPB_MAX_CODECS; x ++)
+    if (codec->CreateDecoder) cc.fourcc[cc.num_fourcc++]=codec->fourcc;
+  m_netcon->Send(cc.build());
+}
+
 int NJClient::EnumLocalChannels(int i)
 {
   if (i<0||i>=m_locchannels.GetSize()) return -1;
@@ -1899,7 +4790,7 @@ void NJClient::NotifyServerOfChannelChange()
       Local_Channel *ch=m_locchannels.Get(x);
       sci.build_add_rec(ch->name.Get(),0,0,0);
     }
-    m_netcon->Send(sci.build());
+    NetSend(sci.build());
   }
 }
 
@@ -1949,7 +4840,76 @@ RemoteUser_Channel::~RemoteUser_Channel()
 }
 
 
-RemoteDownload::RemoteDownload() : chidx(-1), playtime(0), m_parent(0), fp(0)
+void JitterEstimator::OnData(int gap)
+{
+  if (gap < 0) return;
+
+  if (!ngaps++) gap_mean=gap;
+  else
+  {
+    double d=gap-gap_mean;
+    gap_mean += d*(1.0/16.0);
+    gap_var += (d*d-gap_var)*(1.0/16.0);
+  }
+}
+
+void JitterEstimator::OnEnd(unsigned int now, unsigned int start, int bytes, double intms)
+{
+  if (bytes <= 0 || intms <= 0.0) return;
+  double dur=(double)(int)(now-start);
+  if (dur < 1.0) dur=1.0;
+
+  double ri=bytes/dur, ro=bytes/intms;
+  if (rate_out <= 0.0) { rate_in=ri; rate_out=ro; }
+  else
+  {
+    rate_in += (ri-rate_in)*0.25;
+    rate_out += (ro-rate_out)*0.25;
+  }
+  interval_ms=intms;
+
+  // a clean interval lets the safety margin relax
+  if (underruns == underruns_seen) margin = 1.0 + (margin-1.0)*0.9;
+}
+
+// inverse of the upper normal tail (Abramowitz & Stegun 26.2.23)
+static double normal_quantile_upper(double p)
+{
+  if (p > 0.5) p=0.5;
+  if (p < 1e-9) p=1e-9;
+  double t=sqrt(-2.0*log(p));
+  return t - (2.515517+0.802853*t+0.010328*t*t)/(1.0+1.432788*t+0.189269*t*t+0.001308*t*t*t);
+}
+
+int JitterEstimator::Update(double target, int fallback)
+{
+  int u=underruns;
+  if (u != underruns_seen)
+  {
+    int n=u-underruns_seen;
+    while (n-- > 0 && margin < 8.0) margin *= 1.5;
+    underruns_seen=u;
+  }
+
+  if (rate_out <= 0.0 || interval_ms <= 0.0) return depth=fallback; // nothing measured yet
+
+  double size=rate_out*interval_ms;
+
+  // bytes needed up front so that a link slower than playback doesn't run dry before the end,
+  // plus enough to ride out a late message at the target probability
+  double deficit=rate_in < rate_out ? size*(1.0-rate_in/rate_out) : 0.0;
+  double cover=normal_quantile_upper(target)*sqrt(gap_var)*rate_out;
+  double d=(deficit+cover)*margin;
+
+  double lo=size*0.25, hi=size*0.9;
+  if (lo > 2048.0) lo=2048.0;
+  if (d < lo) d=lo;
+  if (d > hi) d=hi;
+  return depth=(int)d;
+}
+
+
+RemoteDownload::RemoteDownload() : chidx(-1), playtime(0), jitter_chidx(-1), start_ms(0), last_arrival(0), total_bytes(0), m_parent(0), m_file(0), m_stream(0), m_pending(0)
 {
   memset(&guid,0,sizeof(guid));
   time(&last_time);
@@ -1962,12 +4922,14 @@ RemoteDownload::~RemoteDownload()
 
 void RemoteDownload::Close()
 {
-  if (fp) fclose(fp);
-  fp=0;
+  if (m_file) m_parent->m_writer->Close(m_file);
+  m_file=0;
   startPlaying(1);
+  if (m_stream) m_stream->Release();
+  m_stream=0;
 }
 
-void RemoteDownload::Open(NJClient *parent, unsigned int fourcc)
+void RemoteDownload::Open(NJClient *parent, unsigned int fourcc, bool playback)
 {    
   m_parent=parent;
   Close();
@@ -1982,69 +4944,97 @@ void RemoteDownload::Open(NJClient *parent, unsigned int fourcc)
   s.Append(buf);
 
   m_fourcc=fourcc;
-  fp=fopen(s.Get(),"wb");
+  // playback decodes from m_stream, the file is only the archive copy (none at all with
+  // config_savelocalaudio<0), so it can go through the writer and lose data under load
+  if (!playback || parent->config_savelocalaudio >= 0) m_file=parent->m_writer->OpenWhole(s.Get());
+  if (playback) m_stream=new StreamBuf;
 }
 
 void RemoteDownload::startPlaying(int force)
 {
-  if (m_parent && chidx >= 0 && (force || (playtime && fp && ftell(fp)>playtime))) 
+  if (m_parent && chidx >= 0 && m_stream && (force || m_pending || (playtime && m_stream->GetSize()>playtime))) 
     // wait until we have config_play_prebuffer of data to start playing, or if config_play_prebuffer is 0, we are forced to play (download finished)
   {
-    int x;
-    RemoteUser *theuser;
-    for (x = 0; x < m_parent->m_remoteusers.GetSize() && strcmp((theuser=m_parent->m_remoteusers.Get(x))->name.Get(),username.Get()); x ++);
-    if (x < m_parent->m_remoteusers.GetSize() && chidx >= 0 && chidx < MAX_USER_CHANNELS)
+    if (chidx >= 0 && chidx < MAX_USER_CHANNELS)
     {
-       DecodeState *tmp=m_parent->start_decode(guid,m_fourcc);
+      // decoder setup can be slow, keep it out of m_users_cs
+      DecodeState *tmp=m_pending;
+      if (!tmp) tmp=m_parent->start_decode(guid,m_fourcc,decoder_tag(username.Get(),chidx),m_stream);
+      else m_parent->prime_decode(tmp);
+      m_pending=NULL;
+      if (!force && tmp->decode_codec && tmp->decode_codec->GetRing()->Available() <= 0)
+      {
+        m_pending=tmp; // not past the headers yet, keep feeding it from Write()
+        return;
+      }
 
-       DecodeState *tmp2;
-       m_parent->m_users_cs.Enter();
-       int useidx=!!theuser->channels[chidx].next_ds[0];
-       tmp2=theuser->channels[chidx].next_ds[useidx];
-       theuser->channels[chidx].next_ds[useidx]=tmp;
-       m_parent->m_users_cs.Leave();
-       delete tmp2;
+      m_parent->m_users_cs.Enter();
+      RemoteUser *theuser=m_parent->findRemoteUser(username.Get());
+      if (theuser)
+      {
+        int useidx=!!theuser->channels[chidx].next_ds[0];
+        DecodeState *tmp2=theuser->channels[chidx].next_ds[useidx];
+        theuser->channels[chidx].next_ds[useidx]=tmp;
+        tmp=tmp2;
+      }
+      m_parent->m_users_cs.Leave();
+      delete tmp;
     }
     chidx=-1;
   }
 }
 
+JitterEstimator *RemoteDownload::findJitter() // m_users_cs held
+{
+  if (!m_parent || jitter_chidx < 0 || jitter_chidx >= MAX_USER_CHANNELS) return NULL;
+  RemoteUser *u=m_parent->findRemoteUser(username.Get());
+  return u ? &u->channels[jitter_chidx].jitter : NULL;
+}
+
 void RemoteDownload::Write(void *buf, int len)
 {
-  int pos=len;
-  if (fp)
-  {
-    fwrite(buf,1,len,fp);
-    fflush(fp);
-    pos = ftell(fp);
-  }
+  total_bytes+=len;
+  if (m_file) m_parent->m_writer->Write(m_file,buf,len);
+  if (m_stream) m_stream->Write(buf,len);
 
   startPlaying();  
 }
 
 
-Local_Channel::Local_Channel() : channel_idx(0), src_channel(0), volume(1.0f), pan(0.0f), 
-                muted(false), solo(false), broadcasting(false), 
+Local_Channel::Local_Channel() : channel_idx(0), src_channel(0), bitrate(64), volume(1.0f), pan(0.0f), 
+                muted(false), solo(false), broadcasting(false),
+                bcast_active(false), bcast_stereo(false), cbf(NULL), cbf_inst(NULL), 
+                decode_peak_vol(0.0), m_need_header(true), codec(0),
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
                 m_enc(NULL), 
                 m_enc_bitrate_used(0), 
+                m_enc_fourcc(0),
+                m_enc_nch(1),
                 m_enc_header_needsend(NULL),
+                m_silent_frames(0), m_silence_hang(0), m_interval_loud(false), m_unheard(false), m_subscribers(-1),
 #endif
-                bcast_active(false), cbf(NULL), cbf_inst(NULL), 
-                bitrate(64), m_need_header(true), m_wavewritefile(NULL),
-                decode_peak_vol(0.0)
+                m_wavewritefile(NULL)
 {
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+  memset(m_tiers,0,sizeof(m_tiers));
+#endif
 }
 
 
-int BufferQueue::GetBlock(WDL_HeapBuf **b) // return 0 if got one, 1 if none avail
+int BufferQueue::GetBlock(WDL_HeapBuf **b, int *nch) // return 0 if got one, 1 if none avail
 {
   m_cs.Enter();
   if (m_samplequeue.Available())
   {
     *b=*(WDL_HeapBuf **)m_samplequeue.Get();
+    if (nch) *nch=1;
+    if ((uintptr_t)*b != -1 && ((uintptr_t)*b & 1))
+    {
+      *b=(WDL_HeapBuf *)((uintptr_t)*b & ~(uintptr_t)1);
+      if (nch) *nch=2;
+    }
     m_samplequeue.Advance(sizeof(WDL_HeapBuf *));
-    if (m_samplequeue.Available()<256) m_samplequeue.Compact();
+    m_samplequeue.Compact(); // every time, so it never outgrows what the constructor reserved
     m_cs.Leave();
     return 0;
   }
@@ -2054,9 +5044,37 @@ int BufferQueue::GetBlock(WDL_HeapBuf **b) // return 0 if got one, 1 if none ava
 
 void BufferQueue::DisposeBlock(WDL_HeapBuf *b)
 {
+  if (!b || (uintptr_t)b == (uintptr_t)-1) return;
+  b->Resize(m_maxbytes,false); // so AddBlock() can fill it without growing it
+  m_cs.Enter();
+  if (m_nempty < BQ_MAX_EMPTY)
+  {
+    m_empty[m_nempty++]=b;
+    b=0;
+  }
+  m_cs.Leave();
+  delete b;
+}
+
+void BufferQueue::Refill()
+{
+  // spares that are too small for the current block size get resized, and the pool topped up
+  WDL_HeapBuf *small[BQ_MAX_EMPTY];
+  int nsmall=0, x;
   m_cs.Enter();
-  if (b && (uintptr_t)b != -1) m_emptybufs.Add(b);
+  for (x = 0; x < m_nempty; x ++)
+  {
+    if (m_empty[x]->GetSize() < m_maxbytes)
+    {
+      small[nsmall++]=m_empty[x];
+      m_empty[x--]=m_empty[--m_nempty];
+    }
+  }
+  int need=BQ_SPARE-m_nempty-nsmall;
   m_cs.Leave();
+
+  for (x = 0; x < nsmall; x ++) DisposeBlock(small[x]);
+  while (need-- > 0) DisposeBlock(new WDL_HeapBuf);
 }
 
 
@@ -2072,26 +5090,25 @@ void BufferQueue::AddBlock(float *samples, int len, float *samples2)
       m_cs.Leave();
       return;
     }
-    int tmp;
-    if ((tmp=m_emptybufs.GetSize()))
-    {
-      mybuf=m_emptybufs.Get(tmp-1);
-      if (mybuf) m_emptybufs.Delete(tmp-1);
-    }
+    if (m_nempty > 0) mybuf=m_empty[--m_nempty];
     m_cs.Leave();
-    if (!mybuf) mybuf=new WDL_HeapBuf;
+    if (!mybuf) mybuf=new WDL_HeapBuf; // Run() isn't keeping up
 
     int uselen=len*sizeof(float);
     if (samples2)
     {
       uselen+=uselen;
     }
+    if (uselen > m_maxbytes) m_maxbytes=uselen; // Refill() sizes the spares to match
 
-    mybuf->Resize(uselen);
+    mybuf->Resize(uselen,false);
 
     memcpy(mybuf->Get(),samples,len*sizeof(float));
     if (samples2)
+    {
       memcpy((float*)mybuf->Get()+len,samples2,len*sizeof(float));
+      mybuf=(WDL_HeapBuf *)((uintptr_t)mybuf | 1);
+    }
   }
   else if (len == -1) mybuf=(WDL_HeapBuf *)-1;
 
@@ -2107,11 +5124,9 @@ Local_Channel::~Local_Channel()
   m_enc=0;
   delete m_enc_header_needsend;
   m_enc_header_needsend=0;
+  TiersClear();
 #endif
 
-  delete m_wavewritefile;
-  m_wavewritefile=0;
-
 }
 
 void NJClient::SetOggOutFile(FILE *fp, int srate, int nch, int bitrate)
@@ -2122,10 +5137,10 @@ void NJClient::SetOggOutFile(FILE *fp, int srate, int nch, int bitrate)
     if (m_oggComp)
     {
       m_oggComp->Encode(NULL,0);
-      if (m_oggComp->outqueue.Available())
-        fwrite((char *)m_oggComp->outqueue.Get(),1,m_oggComp->outqueue.Available(),m_oggWrite);
+      if (m_oggComp->GetOutQueue()->Available())
+        m_writer->Write(m_oggWrite,m_oggComp->GetOutQueue()->Get(),m_oggComp->GetOutQueue()->Available());
     }
-    fclose(m_oggWrite);
+    m_writer->Close(m_oggWrite);
     m_oggWrite=0;
   }
   delete m_oggComp;
@@ -2134,9 +5149,20 @@ void NJClient::SetOggOutFile(FILE *fp, int srate, int nch, int bitrate)
   if (fp)
   {
     //fucko
-    m_oggComp=new I_NJEncoder(srate,nch,bitrate,WDL_RNG_int32());
-    m_oggWrite=fp;
+    m_oggComp=NJVorbisEncoder::Create(srate,nch,bitrate,WDL_RNG_int32());
+    m_oggWrite=m_writer->OpenFile(fp);
   }
 #endif
 }
 
+void NJClient::SetWaveOutFile(WaveWriter *wav)
+{
+  m_writer->Close(m_waveWrite);
+  m_waveWrite=m_writer->OpenWave(wav);
+}
+
+void NJClient::GetRecordingStats(int *pending, double *lag, int *dropped)
+{
+  m_writer->GetStats(pending,lag,dropped);
+}
+
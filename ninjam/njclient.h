@@ -38,6 +38,12 @@
   writes to local channel state, in that mutex lock as well. This is a bit of 
   a pain, but not really that bad.
 
+  Network I/O runs on a thread of NJClient's own, started by Connect(), which
+  handles incoming audio as soon as it arrives. Anything that calls back into
+  the UI (chat, license agreement, user info changes) is left for Run().
+  Encoding the local channels has a thread of its own too, woken by the audio
+  thread whenever it queues a block.
+
   Additionally, NJClient::AudioProc() needs to be called from the audio thread.
   It is not necessary to do any sort of mutex protection around these calls, 
   though, as they are done internally.
@@ -45,10 +51,9 @@
 
   Some other notes:
 
-    + Currently only OGG Vorbis is supported. There's hooks in there to add support
-      for more formats, but the requirements for the formats are a little high, so
-      currently OGG Vorbis is the only thing we've seen that would work well. And it
-      really rocks for this application.
+    + OGG Vorbis is the default format, and really rocks for this application. Other
+      formats can be added through the codec registry in njcodec.h, which also has a
+      16 bit PCM codec for when CPU is scarcer than bandwidth (LANs, slow boxes).
 
     + OK maybe that's it for now? :)
 
@@ -75,6 +80,7 @@
 #include "../WDL/wavwrite.h"
 
 #include "netmsg.h"
+#include "mpb.h"
 
 
 class I_NJEncoder;
@@ -82,7 +88,17 @@ class RemoteDownload;
 class RemoteUser;
 class Local_Channel;
 class DecodeState;
+class StreamBuf;
 class BufferQueue;
+class AudioProfiler;
+class RetireQueue;
+class DecoderPool;
+class MixWorkers;
+class EncodeThread;
+class EngineRate;
+class LatencyCal;
+class AsyncWriter;
+class AsyncWriteFile;
 
 // #define NJCLIENT_NO_XMIT_SUPPORT // might want to do this for njcast :)
 //  it also removes mixed ogg writing support
@@ -90,6 +106,8 @@ class BufferQueue;
 class NJClient
 {
   friend class RemoteDownload;
+  friend class MixWorkers;
+  friend class EncodeThread;
 public:
   NJClient();
   ~NJClient();
@@ -110,7 +128,7 @@ public:
   // basic configuration
   int   config_autosubscribe;
   int   config_savelocalaudio; // set 1 to save compressed files, set to 2 to save .wav files as well. 
-                                // -1 makes it try to delete the remote .oggs as soon as possible
+                                // -1 plays remote intervals from memory only, without writing them to disk
 
   float config_metronome,config_metronome_pan; // volume of metronome
   bool  config_metronome_mute;
@@ -119,6 +137,30 @@ public:
   int   config_debug_level; 
   int   config_play_prebuffer; // -1 means play instantly, 0 means play when full file is there, otherwise refers to how many
                                // bytes of compressed source to have before play. the default value is 4096.
+  double config_jitter_underrun_target; // if config_play_prebuffer>0, adapt the prebuffer per channel to aim for this
+                                        // probability of underrun. 0 uses config_play_prebuffer as-is. default 0.01.
+  int   config_resample_quality; // 0=linear interpolation, 1-3=windowed sinc of increasing length (default 2), used
+                                 // when a remote stream's samplerate differs from ours. applies to intervals decoded afterwards.
+  float config_silence_threshold; // peak level (1.0=full scale) a broadcast interval has to reach to get encoded and
+                                 // uploaded, quieter ones are sent as silence. 0 disables. default 0.0001 (-80dB).
+  int   config_silence_hangover; // intervals after a loud one that get sent regardless of level. default 1.
+  int   config_mix_threads; // threads that mix remote channels alongside the audio callback, for big rooms and small
+                            // buffers where one core can't keep up. 0 (default) mixes everything in the callback. max 8.
+  int   config_lazy_decode; // 1 (default) skips decoding remote channels that are muted (or at zero volume), then
+                            // picks up again shortly after they're unmuted, in silence until then.
+  int   config_upload_mode; // 0 (default) uploads encoded audio in 2KB+ blocks, the first once 8KB have built up. 1 sends
+                          // it as soon as it's encoded, so listeners get each interval sooner, paced by config_upload_budget.
+  int   config_upload_budget; // with config_upload_mode 1, bytes per second uploads are spread out to stay under (so the end
+                              // of an interval doesn't go out in one burst). should be above the total bitrate: if the encoders
+                              // produce more, the budget rises to the measured rate, and nothing waits more than 2 seconds'
+                              // worth, so audio is late rather than lost or piled up. 0 (default)=no limit.
+  int   config_engine_srate; // when the device runs faster than this, encoding, decoding and mixing happen at this rate
+                             // instead, converted at AudioProc()'s edges (adds a millisecond or two of latency). 0=always the device rate. default 48000.
+  double config_latency_compensation; // seconds between audio leaving AudioProc() and coming back in (the device's round trip).
+                                      // local channels start their intervals this much late, so what's sent lines up with
+                                      // what was being heard. see StartLatencyCalibration(). default 0.
+  int   config_record_buffer; // bytes of recorded audio/logs allowed to wait for the disk, past that data is dropped
+                              // (and counted, see GetRecordingStats()) rather than holding anything up. default 16MB.
 
   float GetOutputPeak();
 
@@ -141,8 +183,14 @@ public:
   int GetNumUsers() { return m_remoteusers.GetSize(); }
   char *GetUserState(int idx, float *vol=0, float *pan=0, bool *mute=0);
   void SetUserState(int idx, bool setvol, float vol, bool setpan, float pan, bool setmute, bool mute);
+  // which of a user's simulcast copies to get (see SetLocalChannelTiers()): 0 (default) is what they normally send,
+  // 1 and 2 are lower bitrates, or the nearest better one they do send. takes effect at their next interval.
+  void SetUserTier(int idx, int tier);
+  int GetUserTier(int idx);
 
   float GetUserChannelPeak(int useridx, int channelidx);
+  int GetUserChannelPrebuffer(int useridx, int channelidx, int *ms=NULL); // current prebuffer depth in compressed bytes (and ms of playback)
+  int GetUserChannelUnderruns(int useridx, int channelidx); // times playback of this channel has run dry
   char *GetUserChannelState(int useridx, int channelidx, bool *sub=0, float *vol=0, float *pan=0, bool *mute=0, bool *solo=0);
   void SetUserChannelState(int useridx, int channelidx, bool setsub, bool sub, bool setvol, float vol, bool setpan, float pan, bool setmute, bool mute, bool setsolo, bool solo);
   int EnumUserChannels(int useridx, int i); // returns <0 if out of channels. start with i=0, and go upwards
@@ -153,18 +201,58 @@ public:
   float GetLocalChannelPeak(int ch);
   void SetLocalChannelProcessor(int ch, void (*cbf)(float *, int ns, void *), void *inst);
   void GetLocalChannelProcessor(int ch, void **func, void **inst);
+  // srcch is the input index, or with LOCAL_CHANNEL_STEREO for that input and the next, sent as one stereo stream.
+  // pan acts as balance for stereo channels, and a channel processor gets called for each side in turn.
   void SetLocalChannelInfo(int ch, char *name, bool setsrcch, int srcch, bool setbitrate, int bitrate, bool setbcast, bool broadcast);
   char *GetLocalChannelInfo(int ch, int *srcch, int *bitrate, bool *broadcast);
   void SetLocalChannelMonitoring(int ch, bool setvol, float vol, bool setpan, float pan, bool setmute, bool mute, bool setsolo, bool solo);
   int GetLocalChannelMonitoring(int ch, float *vol, float *pan, bool *mute, bool *solo); // 0 on success
+  // codec fourcc (see njcodec.h) for a local channel, 0 for the default ('OGHv' if everybody has it, else Vorbis).
+  // only used if everybody in the session can decode it, otherwise the channel falls back to Vorbis. takes
+  // effect at the next interval.
+  void SetLocalChannelCodec(int ch, unsigned int fourcc);
+  unsigned int GetLocalChannelCodec(int ch, unsigned int *inuse=NULL); // inuse gets what's actually being sent
+  // simulcast: also send a channel at up to two lower bitrates (kbps, 0=off), for listeners on slow links that ask
+  // for them. only with servers that support it, takes effect at the next interval. costs an encoder each.
+  void SetLocalChannelTiers(int ch, int bitrate1, int bitrate2);
+  void GetLocalChannelTiers(int ch, int *bitrate1, int *bitrate2);
+  int IsCodecUsable(unsigned int fourcc); // nonzero if every user in the session can decode fourcc
+  // other users subscribed to a local channel, -1 if the server doesn't say. a broadcasting channel nobody
+  // subscribes to isn't encoded or sent (unless it's being saved locally), from the next interval on.
+  int GetLocalChannelSubscribers(int ch) { return ch >= 0 && ch < MPB_MAX_SUB_CHANNELS ? m_chan_subscribers[ch] : -1; }
   void NotifyServerOfChannelChange(); // call after any SetLocalChannel* that occur after initial connect
 
   int IsASoloActive() { return m_issoloactive; }
 
+  // round trip calibration: plays clicks on every output and listens for them on every input, so loop an output
+  // back to an input (cable, or the interface's loopback) first. everything else is silenced while it runs, so
+  // do it before Connect(). takes about 5 seconds.
+  int StartLatencyCalibration(); // returns 0 if started
+  int GetLatencyCalibration(double *seconds); // 1 while measuring. 0 when finished: *seconds is the round trip, and
+                                              // config_latency_compensation has been set to it. -1 if no clicks were
+                                              // heard, they were too inconsistent to trust, or the audio callback
+                                              // stopped (or never started) running.
+  void StopLatencyCalibration(); // gives up on a measurement, the engine goes back to normal
+
+  // audio callback profiling. each AudioProc() call is split into stages, times are in microseconds.
+  // stats can be read from any thread, the first ones show up about half a second after audio starts.
+  enum { NJC_PROF_TOTAL=0, NJC_PROF_LOCAL, NJC_PROF_BUFQUEUE, NJC_PROF_REMOTE, NJC_PROF_MASTER, NJC_PROF_METRONOME, NJC_PROF_INTERVAL, NJC_PROF_NUM };
+  const char *GetAudioStageName(int stage);
+  int GetAudioStageStats(int stage, double *mean, double *p50=NULL, double *p99=NULL, double *max=NULL); // returns callbacks counted
+  double GetAudioCallbackBudget(); // microseconds of audio in the last callback
+  int GetAudioDeadlineMisses(); // callbacks that took longer than their budget
+  void ResetAudioStats();
+
   void SetLogFile(char *name=NULL);
 
+  // recording. everything (these, saved intervals, .wav files and the log) is written by a background
+  // thread, so a slow disk never holds up Run() or the audio. the files passed in are owned by NJClient.
+  // the master mix comes at the engine rate, create these with GetEngineSampleRate(device rate)
   void SetOggOutFile(FILE *fp, int srate, int nch, int bitrate=128);
-  WaveWriter *waveWrite;
+  void SetWaveOutFile(WaveWriter *wav); // NULL to stop
+  int GetEngineSampleRate(int devrate) { return config_engine_srate > 0 && devrate > config_engine_srate ? config_engine_srate : devrate; }
+  void GetRecordingStats(int *pending, double *lag, int *dropped); // bytes queued, seconds the oldest has waited, bytes dropped
+  WaveWriter *waveWrite; // deprecated: written synchronously from Run(), use SetWaveOutFile()
 
 
   int LicenseAgreement_User32;
@@ -201,8 +289,10 @@ protected:
   void makeFilenameFromGuid(WDL_String *s, unsigned char *guid);
 
   void updateBPMinfo(int bpm, int bpi);
+  void audioProcEngine(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate); // AudioProc() at the engine rate
   void process_samples(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate, int offset, int justmonitor=0);
   void on_new_interval();
+  void on_new_rec_interval(); // local channels' side of on_new_interval(), config_latency_compensation later
 
   void writeLog(char *fmt, ...);
 
@@ -212,9 +302,11 @@ protected:
   int m_status;
   int m_max_localch;
   int m_connection_keepalive;
-  FILE *m_logFile;
+  AsyncWriter *m_writer;
+  AsyncWriteFile *m_logFile;
+  AsyncWriteFile *m_waveWrite;
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
-  FILE *m_oggWrite;
+  AsyncWriteFile *m_oggWrite;
   I_NJEncoder *m_oggComp;
 #endif
 
@@ -233,28 +325,104 @@ protected:
   int m_loopcnt;
   int m_active_bpm, m_active_bpi;
   int m_interval_length;
+  int m_rec_split; // m_interval_pos on_new_rec_interval() is due at, -1 once done
   int m_interval_pos, m_metronome_state, m_metronome_tmp,m_metronome_interval;
   double m_metronome_pos;
 
-  DecodeState *start_decode(unsigned char *guid, unsigned int fourcc=0);
+  // tag picks a pooled decoder, see decoder_tag(). src is an interval still downloading, otherwise it's read from disk
+  DecodeState *start_decode(unsigned char *guid, unsigned int fourcc=0, unsigned int tag=0, StreamBuf *src=NULL);
+  int prime_decode(DecodeState *ds);
+  void updateEngineRate();
 
   BufferQueue *m_wavebq;
+  AudioProfiler *m_prof;
+  RetireQueue *m_retireq;
+  DecoderPool *m_decpool;
+  MixWorkers *m_mixworkers;
+  EngineRate *m_enginerate; // audio thread's
+  EngineRate * volatile m_enginerate_next; // built by updateEngineRate(), taken by the audio thread
+  // what the audio thread last asked updateEngineRate() for, m_er_gen is bumped after the rest is set
+  volatile int m_er_devrate, m_er_rate, m_er_innch, m_er_outnch, m_er_len, m_er_quality, m_er_gen;
+  int m_er_built; // m_er_gen updateEngineRate() last built for
+  LatencyCal *m_latcal;
 
   WDL_PtrList<Local_Channel> m_locchannels;
 
-  void mixInChannel(bool muted, float vol, float pan, DecodeState *chan, float **outbuf, int len, int srate, int outnch, int offs, double vudecay);
+  int mixInChannel(bool muted, float vol, float pan, DecodeState *chan, float **outbuf, int len, int srate, int outnch, int offs, double vudecay,
+                   WDL_TypedBuf<float> *rstmp); // rstmp is resampler scratch, one per thread
 
   WDL_Mutex m_users_cs, m_locchan_cs, m_log_cs, m_misc_cs;
+  // held by the encoder thread while it works, and by anything that adds or removes local channels,
+  // their encoders or the connection. taken before m_net_cs and m_locchan_cs, never by the audio thread
+  WDL_Mutex m_enc_cs;
   Net_Connection *m_netcon;
+
+  // network thread. m_net_cs guards m_netcon and m_downloads, and is taken before m_users_cs/m_locchan_cs
+  WDL_Mutex m_net_cs;
+  WDL_PtrList<Net_Message> m_net_deferred; // for Run() to handle
+#ifdef _WIN32
+  HANDLE m_netthread;
+  static DWORD WINAPI NetThreadProcStub(LPVOID p);
+#else
+  pthread_t m_netthread;
+  static void *NetThreadProcStub(void *p);
+#endif
+  volatile int m_netthread_quit;
+  int m_netthread_running;
+  int m_net_wakepipe[2];
+
+  void StartNetThread();
+  void StopNetThread();
+  void WakeNetThread();
+  void NetThreadProc();
+  int NetRun();
+  void NetSend(Net_Message *msg); // from any thread but the network thread
+  void netHandleMessage(Net_Message *msg);
+  void handleDeferredMessage(Net_Message *msg);
+  void sendAuthReply(mpb_server_auth_challenge *cha, int accept_license);
+  RemoteUser *findRemoteUser(const char *name);
+
+  // fourccs every user in the session can decode, from the server. m_misc_cs
+  unsigned int m_codecs_common[MPB_MAX_CODECS];
+  int m_codecs_common_num;
+  void sendCodecCaps(); // m_net_cs held
+  unsigned int encoderFourcc(Local_Channel *lc);
+
+  EncodeThread *m_encthread;
+  int encodeRun(); // encoder thread, m_enc_cs held. returns nonzero if it did anything
+
+  // config_upload_mode 1: encoded audio waits here for its share of config_upload_budget. encoder thread only
+  WDL_PtrList<Net_Message> m_upload_q;
+  double m_upload_tokens, m_upload_lasttime;
+  int m_upload_qbytes, m_upload_win_bytes; // queued now, queued since m_upload_win_start
+  double m_upload_rate, m_upload_win_start; // bytes/sec queued over the last second
+  void uploadSend(Net_Message *msg);
+  void uploadRun();
+  void uploadClear();
+
+  int m_server_caps; // MPB_SERVER_CAP_*, from the auth challenge
+  void sendUserMask(const char *username, int submask, int tier);
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+  // simulcast copies of a local channel, alongside its encoder
+  void tiersStart(Local_Channel *lc, int nch);
+  void tiersSendBegins(Local_Channel *lc);
+  void newSubscriberCheck(Local_Channel *lc, bool restart);
+  void tiersSend(Local_Channel *lc, bool flush);
+#endif
+
+  // other users subscribed to each of our channels, -1 until the server says (older servers never do)
+  int m_chan_subscribers[MPB_MAX_SUB_CHANNELS];
   WDL_PtrList<RemoteUser> m_remoteusers;
   WDL_PtrList<RemoteDownload> m_downloads;
 
   WDL_HeapBuf tmpblock;
+  WDL_TypedBuf<float> m_resample_tmp;
 };
 
 
 
 #define MAX_USER_CHANNELS 32
+#define LOCAL_CHANNEL_STEREO 1024 // flag for SetLocalChannelInfo()'s srcch
 #define MAX_LOCAL_CHANNELS 32 // probably want to use NJClient::GetMaxLocalChannels() if determining when it's OK to add a channel,etc
 #define DOWNLOAD_TIMEOUT 8
 
@@ -0,0 +1,106 @@
+/*
+    Copyright (C) 2005 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  This file defines the interfaces NJClient uses for audio codecs, and the
+  registry they're looked up in by fourcc.
+
+  Built in are 'OGGv' (Vorbis, the fallback and the only thing older clients
+  understand), 'OGHv' (Vorbis that leaves out the setup headers most of the
+  time, used by default when the whole session has it) and 'PCMs' (16 bit PCM,
+  no compression: costs almost no CPU, but ~768kbps per 48kHz mono channel, so
+  it's for LANs).
+
+  To add a codec, fill in an NJ_CodecInfo and pass it to NJ_RegisterCodec()
+  before connecting. The client tells the server which fourccs it can decode,
+  the server tells everybody which ones the whole session can decode, and a
+  local channel only uses its codec (see NJClient::SetLocalChannelCodec()) if
+  it's in that set, otherwise it falls back to 'OGGv'.
+
+*/
+
+#ifndef _NJCODEC_H_
+#define _NJCODEC_H_
+
+#include "../WDL/queue.h"
+#include "../WDL/ringbuf.h"
+
+#ifndef MAKE_NJ_FOURCC
+#define MAKE_NJ_FOURCC(A,B,C,D) ((A) | ((B)<<8) | ((C)<<16) | ((D)<<24))
+#endif
+
+#define NJ_CODEC_VORBIS MAKE_NJ_FOURCC('O','G','G','v')
+#define NJ_CODEC_VORBIS_HDRLESS MAKE_NJ_FOURCC('O','G','H','v')
+#define NJ_CODEC_PCM16 MAKE_NJ_FOURCC('P','C','M','s')
+
+
+class I_NJEncoder
+{
+  public:
+    virtual ~I_NJEncoder() { }
+
+    // length in sample frames, read from in[0], in[advance], ...; the second channel
+    // (if any) is spacing samples after the first. inlen=0 flushes the end of the stream.
+    virtual void Encode(float *in, int inlen, int advance=1, int spacing=1)=0;
+    virtual int isError()=0;
+    virtual void reinit()=0; // start a new stream (next interval)
+    virtual void SendHeadersNext() { } // someone new is listening: codecs that leave their setup out of
+                                       // most intervals put it in the next one
+
+    virtual WDL_Queue *GetOutQueue()=0; // encoded bytes, caller Advance()s what it sent
+};
+
+class I_NJDecoder
+{
+  public:
+    virtual ~I_NJDecoder() { }
+
+    virtual int GetSampleRate()=0; // 0 until known
+    virtual int GetNumChannels()=0;
+
+    virtual void *DecodeGetSrcBuffer(int srclen)=0;
+    virtual void DecodeWrote(int srclen)=0;
+    virtual void Reset()=0; // ready for a new stream. decoders get reused, keep any setup the next one might share
+
+    virtual WDL_PlanarRingBuf *GetRing()=0; // decoded output
+
+    // optional, for channels nobody's listening to: with skip on the decoder may just count the frames it's
+    // given instead of decoding them. those come before anything in the ring, and are used up with
+    // ConsumeSkipped(). turning skip off again resumes proper decoding as soon as it can.
+    virtual void SetSkip(bool skip) { }
+    virtual int GetSkipped() { return 0; }
+    virtual void ConsumeSkipped(int frames) { }
+};
+
+
+struct NJ_CodecInfo
+{
+  unsigned int fourcc;
+  const char *name; // short, lowercase, used by UIs
+
+  I_NJEncoder *(*CreateEncoder)(int srate, int nch, int bitrate, int serno); // bitrate in kbps, may be ignored
+  I_NJDecoder *(*CreateDecoder)();
+};
+
+void NJ_RegisterCodec(const NJ_CodecInfo *codec); // not copied, keep it around. replaces an existing fourcc
+const NJ_CodecInfo *NJ_GetCodec(unsigned int fourcc); // NULL if not registered
+const NJ_CodecInfo *NJ_EnumCodecs(int idx); // NULL past the end
+const NJ_CodecInfo *NJ_FindCodecByName(const char *name);
+
+#endif//_NJCODEC_H_
@@ -36,6 +36,7 @@ void ClientRunThread::run()
   int lastBpm = -1;
   int lastBpi = -1;
   int lastBeat = -1;
+  int statsCountdown = 0;
 
   running = true;
   while (running) {
@@ -78,6 +79,11 @@ void ClientRunThread::run()
       }
     }
 
+    if (--statsCountdown <= 0) {
+      emit audioStatsChanged();
+      statsCountdown = 50; /* about once a second */
+    }
+
     cond.wait(mutex, 20 /* milliseconds */);
   }
   mutex->unlock();
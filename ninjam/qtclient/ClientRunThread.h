@@ -49,6 +49,7 @@ signals:
   void beatsPerMinuteChanged(int bpi);
   void beatsPerIntervalChanged(int bpi);
   void currentBeatChanged(int currentBeat);
+  void audioStatsChanged();
 
 private:
   bool running;
@@ -187,6 +187,10 @@ MainWindow::MainWindow(QWidget *parent)
   connect(runThread, SIGNAL(currentBeatChanged(int)),
           metronomeBar, SLOT(setCurrentBeat(int)));
 
+  /* Periodic audio callback load */
+  connect(runThread, SIGNAL(audioStatsChanged()),
+          this, SLOT(AudioStatsChanged()));
+
   runThread->start();
 }
 
@@ -224,6 +228,10 @@ void MainWindow::setupStatusBar()
   bpiLabel = new QLabel(this);
   bpiLabel->setFrameStyle(QFrame::Panel | QFrame::Sunken);
   statusBar()->addPermanentWidget(bpiLabel);
+
+  dspLabel = new QLabel(tr("DSP: N/A"), this);
+  dspLabel->setFrameStyle(QFrame::Panel | QFrame::Sunken);
+  statusBar()->addPermanentWidget(dspLabel);
 }
 
 void MainWindow::Connect(const QString &host, const QString &user, const QString &pass)
@@ -478,6 +486,39 @@ void MainWindow::BeatsPerIntervalChanged(int bpi)
   }
 }
 
+/* Audio stats are lock-free so the client mutex is not needed here */
+void MainWindow::AudioStatsChanged()
+{
+  double budget = client.GetAudioCallbackBudget();
+  double p99;
+  if (budget <= 0 ||
+      !client.GetAudioStageStats(NJClient::NJC_PROF_TOTAL, NULL, NULL, &p99)) {
+    dspLabel->setText(tr("DSP: N/A"));
+    dspLabel->setToolTip(QString());
+    return;
+  }
+
+  dspLabel->setText(tr("DSP: %1%").arg((int)(p99 * 100 / budget)));
+
+  QString tip = tr("<b>Audio callback</b> (budget %1 us, %2 deadline misses)"
+                   "<table><tr><th></th><th>mean</th><th>p50</th>"
+                   "<th>p99</th><th>max</th></tr>")
+                .arg(budget, 0, 'f', 0)
+                .arg(client.GetAudioDeadlineMisses());
+  for (int i = 0; i < NJClient::NJC_PROF_NUM; i++) {
+    double mean, p50, max;
+    if (!client.GetAudioStageStats(i, &mean, &p50, &p99, &max)) {
+      continue;
+    }
+    tip += QString("<tr><td>%1</td><td>%2</td><td>%3</td><td>%4</td><td>%5</td></tr>")
+           .arg(client.GetAudioStageName(i))
+           .arg(mean, 0, 'f', 1).arg(p50, 0, 'f', 1)
+           .arg(p99, 0, 'f', 1).arg(max, 0, 'f', 1);
+  }
+  tip += "</table>";
+  dspLabel->setToolTip(tip);
+}
+
 /* Append line with bold formatted prefix to the chat widget */
 void MainWindow::chatAddLine(const QString &prefix, const QString &content)
 {
@@ -62,6 +62,7 @@ private slots:
   void ClientStatusChanged(int newStatus);
   void BeatsPerIntervalChanged(int bpm);
   void BeatsPerMinuteChanged(int bpi);
+  void AudioStatsChanged();
   void MetronomeMuteChanged(bool mute);
   void MetronomeBoostChanged(bool boost);
   void LocalChannelMuteChanged(int ch, bool mute);
@@ -85,6 +86,7 @@ private:
   QAction *audioConfigAction;
   QLabel *bpmLabel;
   QLabel *bpiLabel;
+  QLabel *dspLabel;
   MetronomeBar *metronomeBar;
 
   void setupChannelTree();
@@ -0,0 +1,305 @@
+/*
+    Copyright (C) 2005 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Real-time safety checker, see rtcheck.h.
+
+  The hooks are plain definitions of the libc functions, which the dynamic
+  linker prefers over libc's own. malloc and friends forward to glibc's
+  __libc_* entry points, everything else to the next definition found with
+  dlsym(RTLD_NEXT). Calls made by libc internally don't go through these.
+
+*/
+
+#ifndef NJCLIENT_RTCHECK
+#define NJCLIENT_RTCHECK
+#endif
+
+#undef _FORTIFY_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+#include "rtcheck.h"
+
+
+static __thread int rt_depth; // >0 while in the audio callback
+static __thread int rt_inhook; // set while reporting, so we don't report ourselves
+
+static volatile int rt_violations;
+static volatile int rt_nsites;
+static int rt_mode; // 0=report, 1=quiet, 2=abort
+
+#define RT_SITES 1024
+static volatile unsigned int rt_sites[RT_SITES]; // hashes of reported backtraces
+
+static pthread_mutex_t rt_report_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static int (*real_mutex_lock)(pthread_mutex_t *);
+static FILE *(*real_fopen)(const char *, const char *);
+static size_t (*real_fread)(void *, size_t, size_t, FILE *);
+static size_t (*real_fwrite)(const void *, size_t, size_t, FILE *);
+static int (*real_fclose)(FILE *);
+static int (*real_open)(const char *, int, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static int (*real_close)(int);
+static int (*real_unlink)(const char *);
+static int (*real_nanosleep)(const struct timespec *, struct timespec *);
+static int (*real_usleep)(useconds_t);
+
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+extern "C" void __libc_free(void *);
+
+#define RT_RESOLVE(var,name) if (!var) *(void **)&var=dlsym(RTLD_NEXT,name)
+
+// also called from the hooks, in case one runs before our constructor does
+static void rt_resolve()
+{
+  RT_RESOLVE(real_mutex_lock,"pthread_mutex_lock");
+  RT_RESOLVE(real_fopen,"fopen");
+  RT_RESOLVE(real_fread,"fread");
+  RT_RESOLVE(real_fwrite,"fwrite");
+  RT_RESOLVE(real_fclose,"fclose");
+  RT_RESOLVE(real_open,"open");
+  RT_RESOLVE(real_read,"read");
+  RT_RESOLVE(real_write,"write");
+  RT_RESOLVE(real_close,"close");
+  RT_RESOLVE(real_unlink,"unlink");
+  RT_RESOLVE(real_nanosleep,"nanosleep");
+  RT_RESOLVE(real_usleep,"usleep");
+}
+
+static void rt_init() __attribute__((constructor));
+static void rt_init()
+{
+  rt_inhook++;
+  rt_resolve();
+
+  const char *m=getenv("NJ_RTCHECK");
+  if (m && !strcmp(m,"quiet")) rt_mode=1;
+  else if (m && !strcmp(m,"abort")) rt_mode=2;
+
+  // backtrace() allocates the first time it's used (it loads libgcc), get that out of the way
+  void *tmp[4];
+  backtrace(tmp,4);
+  rt_inhook--;
+}
+
+static void rt_puts(const char *s)
+{
+  real_write(2,s,strlen(s));
+}
+
+static void rt_violation(const char *what)
+{
+  rt_inhook++;
+  __sync_fetch_and_add(&rt_violations,1);
+
+  if (rt_mode != 1)
+  {
+    void *frames[32];
+    int n=backtrace(frames,32);
+
+    // skip rt_violation and the hook itself when identifying the site
+    unsigned int h=2166136261u;
+    int x;
+    for (x = 2; x < n; x ++) h=(h ^ (unsigned int)(size_t)frames[x])*16777619u;
+    if (!h) h=1;
+
+    int isnew=0;
+    for (x = 0; x < RT_SITES; x ++)
+    {
+      unsigned int *slot=(unsigned int *)&rt_sites[(h+x)&(RT_SITES-1)];
+      if (*slot == h) break;
+      if (!*slot && __sync_bool_compare_and_swap(slot,0,h))
+      {
+        isnew=1;
+        __sync_fetch_and_add(&rt_nsites,1);
+        break;
+      }
+    }
+
+    if (isnew)
+    {
+      real_mutex_lock(&rt_report_mutex);
+      char buf[256];
+      snprintf(buf,sizeof(buf),"rtcheck: %s on the audio thread\n",what);
+      rt_puts(buf);
+      backtrace_symbols_fd(frames+2,n-2,2);
+      rt_puts("\n");
+      pthread_mutex_unlock(&rt_report_mutex);
+    }
+  }
+
+  if (rt_mode == 2)
+  {
+    rt_puts("rtcheck: aborting\n");
+    abort();
+  }
+  rt_inhook--;
+}
+
+#define RT_CHECK(what) do { if (rt_depth && !rt_inhook) rt_violation(what); } while (0)
+
+
+void rtcheck_enter() { rt_depth++; }
+void rtcheck_leave() { if (rt_depth > 0) rt_depth--; }
+int rtcheck_get_violations() { return rt_violations; }
+int rtcheck_get_sites() { return rt_nsites; }
+
+
+// hooks. the exception specs have to match glibc's declarations, hence __THROW where it has one.
+extern "C" {
+
+void *malloc(size_t n) __THROW
+{
+  RT_CHECK("malloc");
+  return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t sz) __THROW
+{
+  RT_CHECK("calloc");
+  return __libc_calloc(n,sz);
+}
+
+void *realloc(void *p, size_t n) __THROW
+{
+  RT_CHECK("realloc");
+  return __libc_realloc(p,n);
+}
+
+void free(void *p) __THROW
+{
+  if (p) RT_CHECK("free");
+  __libc_free(p);
+}
+
+int pthread_mutex_lock(pthread_mutex_t *m) __THROWNL
+{
+  if (rt_depth && !rt_inhook)
+  {
+    // only complain if we'd actually have to wait
+    if (!pthread_mutex_trylock(m)) return 0;
+    rt_violation("mutex wait");
+  }
+  if (!real_mutex_lock) rt_resolve();
+  return real_mutex_lock(m);
+}
+
+FILE *fopen(const char *fn, const char *mode)
+{
+  RT_CHECK("fopen");
+  if (!real_fopen) rt_resolve();
+  return real_fopen(fn,mode);
+}
+
+size_t fread(void *buf, size_t sz, size_t n, FILE *fp)
+{
+  RT_CHECK("fread");
+  if (!real_fread) rt_resolve();
+  return real_fread(buf,sz,n,fp);
+}
+
+size_t fwrite(const void *buf, size_t sz, size_t n, FILE *fp)
+{
+  RT_CHECK("fwrite");
+  if (!real_fwrite) rt_resolve();
+  return real_fwrite(buf,sz,n,fp);
+}
+
+int fclose(FILE *fp)
+{
+  RT_CHECK("fclose");
+  if (!real_fclose) rt_resolve();
+  return real_fclose(fp);
+}
+
+int open(const char *fn, int flags, ...)
+{
+  int mode=0;
+  if (flags & O_CREAT)
+  {
+    va_list ap;
+    va_start(ap,flags);
+    mode=va_arg(ap,int);
+    va_end(ap);
+  }
+  RT_CHECK("open");
+  if (!real_open) rt_resolve();
+  return real_open(fn,flags,mode);
+}
+
+ssize_t read(int fd, void *buf, size_t n)
+{
+  RT_CHECK("read");
+  if (!real_read) rt_resolve();
+  return real_read(fd,buf,n);
+}
+
+ssize_t write(int fd, const void *buf, size_t n)
+{
+  RT_CHECK("write");
+  if (!real_write) rt_resolve();
+  return real_write(fd,buf,n);
+}
+
+int close(int fd)
+{
+  RT_CHECK("close");
+  if (!real_close) rt_resolve();
+  return real_close(fd);
+}
+
+int unlink(const char *fn) __THROW
+{
+  RT_CHECK("unlink");
+  if (!real_unlink) rt_resolve();
+  return real_unlink(fn);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+  RT_CHECK("nanosleep");
+  if (!real_nanosleep) rt_resolve();
+  return real_nanosleep(req,rem);
+}
+
+int usleep(useconds_t us)
+{
+  RT_CHECK("usleep");
+  if (!real_usleep) rt_resolve();
+  return real_usleep(us);
+}
+
+};
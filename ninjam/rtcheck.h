@@ -0,0 +1,56 @@
+/*
+    Copyright (C) 2005 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Real-time safety checker, for debug/test builds.
+
+  Build with NJCLIENT_RTCHECK defined and link in rtcheck.o (Linux/glibc only,
+  needs -ldl). NJClient::AudioProc() marks its thread as real-time for the
+  duration of the call, and any malloc/free, contended mutex lock, sleep or
+  file syscall made from it is reported on stderr with a backtrace, once per
+  call site.
+
+  Set NJ_RTCHECK=abort in the environment to abort() on the first violation,
+  or NJ_RTCHECK=quiet to only count them.
+
+  Without NJCLIENT_RTCHECK the macros compile to nothing.
+
+*/
+
+#ifndef _NJ_RTCHECK_H_
+#define _NJ_RTCHECK_H_
+
+#ifdef NJCLIENT_RTCHECK
+
+void rtcheck_enter(); // calls nest
+void rtcheck_leave();
+int rtcheck_get_violations(); // total count, all threads
+int rtcheck_get_sites(); // distinct call sites reported
+
+#define RTCHECK_ENTER() rtcheck_enter()
+#define RTCHECK_LEAVE() rtcheck_leave()
+
+#else
+
+#define RTCHECK_ENTER()
+#define RTCHECK_LEAVE()
+
+#endif
+
+#endif
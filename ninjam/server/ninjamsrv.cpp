@@ -127,6 +127,13 @@ time_t next_session_update_time;
 
 WDL_String g_config_license;
 
+#ifdef NJ_SERVER_TRANSCODE
+// Transcode as the running transcoder was built (threads, cpu%, kbps per tier). users hold jobs on it,
+// so a reload can't swap it out, just say the new settings wait for a restart
+int g_config_transcode[2+MPB_MAX_TIERS];
+int g_config_transcode_seen;
+#endif
+
 class localUserInfoLookup : public IUserInfoLookup
 {
 public:
@@ -479,6 +486,30 @@ static int ConfigOnToken(LineParser *lp)
     }
     g_config_allow_anonchat=!!x;
   }  
+  else if (!stricmp(t,"Transcode"))
+  {
+    if (lp->getnumtokens() < 4 || lp->getnumtokens() > 2+MPB_MAX_TIERS) return -1;
+    if (lp->gettoken_int(1) < 1 || lp->gettoken_int(2) < 1) return -2;
+
+#ifdef NJ_SERVER_TRANSCODE
+    int cfg[2+MPB_MAX_TIERS]={lp->gettoken_int(1),lp->gettoken_int(2),}; // then kbps, tier 0 is the source
+    int x;
+    for (x = 3; x < lp->getnumtokens(); x ++) cfg[x]=lp->gettoken_int(x);
+    g_config_transcode_seen=1;
+    if (!m_group->m_transcoder)
+    {
+      memcpy(g_config_transcode,cfg,sizeof(cfg));
+      m_group->m_transcoder=new Transcoder(cfg[0],cfg[1],cfg+2);
+    }
+    else if (memcmp(cfg,g_config_transcode,sizeof(cfg)))
+    {
+      if (g_logfp) logText("[config] Transcode changed, the new settings take effect when the server restarts\n");
+      printf("[config] Transcode changed, the new settings take effect when the server restarts\n");
+    }
+#else
+    if (g_logfp) logText("[config] Transcode ignored, this server was built without it (make TRANSCODE=1)\n");
+#endif
+  }
   else return -3;
   return 0;
 
@@ -511,6 +542,9 @@ static int ReadConfig(char *configfile)
   g_default_bpm=120;
 
   g_config_log_sessionlen=10; // ten minute default, tho the user will need to specify the path anyway
+#ifdef NJ_SERVER_TRANSCODE
+  g_config_transcode_seen=0;
+#endif
 
   m_group->m_max_users=0; // unlimited users
   g_acllist.Resize(0);
@@ -587,6 +621,13 @@ static int ReadConfig(char *configfile)
     }
   }
 
+#ifdef NJ_SERVER_TRANSCODE
+  if (m_group->m_transcoder && !g_config_transcode_seen)
+  {
+    if (g_logfp) logText("[config] Transcode removed, still transcoding until the server restarts\n");
+    printf("[config] Transcode removed, still transcoding until the server restarts\n");
+  }
+#endif
   if (g_logfp) logText("[config] reload complete\n");
 
   if (fp != stdin) fclose(fp);
@@ -0,0 +1,412 @@
+/*
+    Copyright (C) 2005-2007 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Server side transcoding pool, see transcode.h.
+
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+#include "transcode.h"
+#include "../njcodec.h"
+
+#include "../../WDL/rng.h"
+#include "../../WDL/heapbuf.h"
+#include "../../WDL/vorbisencdec.h"
+
+#define TRANSCODE_CHUNK 16384 // source bytes a worker takes at a time, rounded to whole ogg pages
+#define TRANSCODE_MAX_LAG 1.0 // seconds input may wait before we call ourselves behind
+#define TRANSCODE_MAX_BUDGET 0.25 // CPU seconds saved up while idle
+
+// length of the ogg page at p, 0 if it isn't all there yet, -1 if p isn't the start of one
+static int ogg_page_len(const unsigned char *p, int avail)
+{
+  if (avail < 4) return 0;
+  if (memcmp(p,"OggS",4)) return -1;
+  if (avail < 27 || avail < 27+p[26]) return 0;
+  int i, len=27+p[26];
+  for (i = 27; i < 27+p[26]; i ++) len+=p[i];
+  return len <= avail ? len : 0;
+}
+
+// how much of p to take: whole pages, up to max unless the first one is bigger. junk between
+// pages goes along with them, ogg_sync skips it
+static int ogg_whole_pages(const unsigned char *p, int avail, int max)
+{
+  int len=0;
+  while (len < avail && len < max)
+  {
+    int l=ogg_page_len(p+len,avail-len);
+    if (l < 0) l=1;
+    else if (!l || (len && len+l > max)) break;
+    len+=l;
+  }
+  return len;
+}
+
+
+class TranscodeJob
+{
+  public:
+    TranscodeJob(int kbps) : m_kbps(kbps), m_serno(WDL_RNG_int32()), m_enc(0), m_hdr_done(0), m_pt_started(0),
+                             m_in_end(0), m_in_taken(0), m_done(0), m_busy(0), m_released(0), m_passthrough(0),
+                             m_waiting_since(0.0)
+    {
+      m_dec.SetPlanarOutput(true);
+    }
+    ~TranscodeJob() { delete m_enc; }
+
+    int m_kbps;
+    int m_serno;
+
+    // only touched by the worker that has m_busy set
+    VorbisDecoder m_dec;
+    VorbisEncoder *m_enc;
+    WDL_TypedBuf<float> m_tmp;
+    WDL_Queue m_src_hdr; // the source's setup header pages, for falling back to it
+    int m_hdr_done;
+    WDL_Queue m_pt; // passthrough output, goes after whatever the encoder flushed
+    int m_pt_started;
+
+    // Transcoder::m_mutex
+    WDL_Queue m_in, m_out;
+    int m_in_end, m_in_taken; // all source bytes written, and handed to a worker
+    int m_done, m_busy, m_released;
+    int m_passthrough; // fell behind, the rest of the interval is the source as it is
+    double m_waiting_since; // when the oldest input not yet taken arrived, 0 if none
+};
+
+
+Transcoder::Transcoder(int nthreads, int cpu_percent, const int *tier_kbps)
+{
+  m_cpu_percent=cpu_percent > 0 ? cpu_percent : 1;
+  memset(m_tier_kbps,0,sizeof(m_tier_kbps));
+  int x;
+  for (x = 1; x < MPB_MAX_TIERS; x ++) m_tier_kbps[x]=tier_kbps[x];
+  m_budget=0.0;
+  m_budget_time=now();
+  m_next=0;
+  m_quit=0;
+
+  if (nthreads < 1) nthreads=1;
+  else if (nthreads > TRANSCODE_MAX_THREADS) nthreads=TRANSCODE_MAX_THREADS;
+  m_nthreads=0;
+  while (m_nthreads < nthreads)
+  {
+#ifdef _WIN32
+    DWORD id;
+    m_threads[m_nthreads]=CreateThread(NULL,0,ThreadProc,this,0,&id);
+    if (!m_threads[m_nthreads]) break;
+    SetThreadPriority(m_threads[m_nthreads],THREAD_PRIORITY_BELOW_NORMAL); // the routing thread comes first
+#else
+    if (pthread_create(&m_threads[m_nthreads],NULL,ThreadProc,this)) break;
+#endif
+    m_nthreads++;
+  }
+}
+
+Transcoder::~Transcoder()
+{
+  m_quit=1;
+  int x;
+  for (x = 0; x < m_nthreads; x ++)
+  {
+#ifdef _WIN32
+    WaitForSingleObject(m_threads[x],INFINITE);
+    CloseHandle(m_threads[x]);
+#else
+    pthread_join(m_threads[x],NULL);
+#endif
+  }
+  for (x = 0; x < m_jobs.GetSize(); x ++) delete m_jobs.Get(x);
+  m_jobs.Empty();
+}
+
+double Transcoder::thread_cpu()
+{
+#ifdef _WIN32
+  FILETIME c,e,k,u;
+  if (!GetThreadTimes(GetCurrentThread(),&c,&e,&k,&u)) return now();
+  return ((((unsigned __int64)k.dwHighDateTime<<32)|k.dwLowDateTime) +
+          (((unsigned __int64)u.dwHighDateTime<<32)|u.dwLowDateTime)) / 10000000.0;
+#else
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts)) return now();
+  return ts.tv_sec + ts.tv_nsec/1000000000.0;
+#endif
+}
+
+double Transcoder::now()
+{
+#ifdef _WIN32
+  return GetTickCount()/1000.0;
+#else
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec + tv.tv_usec/1000000.0;
+#endif
+}
+
+TranscodeJob *Transcoder::Start(unsigned int fourcc, int tier)
+{
+  if (fourcc != NJ_CODEC_VORBIS || tier < 1 || tier >= MPB_MAX_TIERS || !m_tier_kbps[tier] || !m_nthreads) return NULL;
+  if (IsLagging()) return NULL;
+
+  TranscodeJob *job=new TranscodeJob(m_tier_kbps[tier]);
+  m_mutex.Enter();
+  m_jobs.Add(job);
+  m_mutex.Leave();
+  return job;
+}
+
+void Transcoder::Write(TranscodeJob *job, const void *buf, int len, int end)
+{
+  m_mutex.Enter();
+  if (len > 0)
+  {
+    if (!job->m_in.Available()) job->m_waiting_since=now();
+    job->m_in.Add(buf,len);
+  }
+  if (end) job->m_in_end=1;
+  m_mutex.Leave();
+}
+
+int Transcoder::Read(TranscodeJob *job, WDL_Queue *out)
+{
+  m_mutex.Enter();
+  int a=job->m_out.Available();
+  if (a)
+  {
+    out->Add(job->m_out.Get(),a);
+    job->m_out.Advance(a);
+    job->m_out.Compact();
+  }
+  int done=job->m_done;
+  m_mutex.Leave();
+  return done;
+}
+
+void Transcoder::Release(TranscodeJob *job)
+{
+  m_mutex.Enter();
+  if (job->m_busy) job->m_released=1; // the worker deletes it when it's through
+  else
+  {
+    m_jobs.Delete(m_jobs.Find(job));
+    delete job;
+  }
+  m_mutex.Leave();
+}
+
+int Transcoder::IsLagging()
+{
+  int lag=0;
+  m_mutex.Enter();
+  double t=now();
+  int x;
+  for (x = 0; x < m_jobs.GetSize() && !lag; x ++)
+  {
+    TranscodeJob *job=m_jobs.Get(x);
+    if (!job->m_passthrough && job->m_in.Available() && t-job->m_waiting_since > TRANSCODE_MAX_LAG) lag=1;
+  }
+  m_mutex.Leave();
+  return lag;
+}
+
+void Transcoder::CheckLag()
+{
+  double t=now();
+  int x;
+  for (x = 0; x < m_jobs.GetSize(); x ++)
+  {
+    TranscodeJob *job=m_jobs.Get(x);
+    if (!job->m_passthrough && !job->m_done && job->m_in.Available() && t-job->m_waiting_since > TRANSCODE_MAX_LAG)
+      job->m_passthrough=1;
+  }
+}
+
+void Transcoder::Refill()
+{
+  double t=now();
+  if (t > m_budget_time)
+  {
+    m_budget += (t-m_budget_time)*m_cpu_percent/100.0;
+    if (m_budget > TRANSCODE_MAX_BUDGET) m_budget=TRANSCODE_MAX_BUDGET;
+  }
+  m_budget_time=t;
+}
+
+TranscodeJob *Transcoder::NextJob(int budget)
+{
+  int n=m_jobs.GetSize();
+  int x;
+  for (x = 0; x < n; x ++) // round robin, so one long interval doesn't hold up the rest
+  {
+    if (m_next >= n) m_next=0;
+    TranscodeJob *job=m_jobs.Get(m_next++);
+    if (job->m_busy || job->m_done || job->m_released) continue;
+    if (!budget && !job->m_passthrough) continue; // passing through costs next to nothing
+    if (job->m_in_end ? !job->m_in_taken :
+        ogg_whole_pages((const unsigned char *)job->m_in.Get(),job->m_in.Available(),TRANSCODE_CHUNK) > 0) return job;
+  }
+  return NULL;
+}
+
+void Transcoder::Process(TranscodeJob *job, const char *buf, int len, int end)
+{
+  if (job->m_passthrough)
+  {
+    if (!job->m_pt_started)
+    {
+      // end the re-encoded stream where it got to, and chain the source onto it from here. it
+      // needs its setup headers again, the decoder starts over on the new serial
+      job->m_pt_started=1;
+      if (job->m_enc) job->m_enc->Encode(NULL,0);
+      job->m_pt.Add(job->m_src_hdr.Get(),job->m_src_hdr.Available());
+    }
+    job->m_pt.Add(buf,len);
+    return;
+  }
+
+  // remember the header pages (granule position 0) at the start of the source
+  int pos=0, l;
+  while (!job->m_hdr_done && pos < len && (l=ogg_page_len((const unsigned char *)buf+pos,len-pos)) > 0)
+  {
+    static const char zero[8]={0,};
+    if (memcmp(buf+pos+6,zero,8)) job->m_hdr_done=1;
+    else job->m_src_hdr.Add(buf+pos,l);
+    pos+=l;
+  }
+
+  if (len > 0)
+  {
+    void *b=job->m_dec.DecodeGetSrcBuffer(len);
+    if (b)
+    {
+      memcpy(b,buf,len);
+      job->m_dec.DecodeWrote(len);
+    }
+  }
+
+  WDL_PlanarRingBuf *ring=&job->m_dec.m_ring;
+  int n=ring->Available();
+  if (n > 0 && !job->m_enc && job->m_dec.GetSampleRate() > 0)
+  {
+    job->m_enc=new VorbisEncoder(job->m_dec.GetSampleRate(),ring->GetNumChannels() > 1 ? 2 : 1,job->m_kbps,job->m_serno);
+    if (job->m_enc->isError())
+    {
+      delete job->m_enc;
+      job->m_enc=0;
+    }
+  }
+  if (n > 0)
+  {
+    if (job->m_enc)
+    {
+      int nch=ring->GetNumChannels() > 1 ? 2 : 1;
+      float *tmp=job->m_tmp.Resize(n*nch,false);
+      int c;
+      for (c = 0; c < nch; c ++) ring->Read(c,tmp+c*n,n);
+      job->m_enc->Encode(tmp,n,1,n);
+    }
+    ring->Advance(n);
+  }
+  if (end && job->m_enc) job->m_enc->Encode(NULL,0);
+}
+
+#ifdef _WIN32
+DWORD WINAPI Transcoder::ThreadProc(LPVOID p)
+#else
+void *Transcoder::ThreadProc(void *p)
+#endif
+{
+  Transcoder *_this=(Transcoder *)p;
+  WDL_HeapBuf buf;
+  while (!_this->m_quit)
+  {
+    _this->m_mutex.Enter();
+    _this->Refill();
+    _this->CheckLag();
+    TranscodeJob *job=_this->NextJob(_this->m_budget > 0.0);
+    int len=0, end=0;
+    if (job)
+    {
+      len=ogg_whole_pages((const unsigned char *)job->m_in.Get(),job->m_in.Available(),TRANSCODE_CHUNK);
+      if (!len && job->m_in_end) len=job->m_in.Available(); // a truncated last page, the decoder can have it
+      memcpy(buf.Resize(len),job->m_in.Get(),len);
+      job->m_in.Advance(len);
+      job->m_in.Compact();
+      job->m_waiting_since=job->m_in.Available() ? now() : 0.0; // what's left may be the start of a page still arriving
+      if (job->m_in_end && !job->m_in.Available()) end=job->m_in_taken=1;
+      job->m_busy=1;
+    }
+    _this->m_mutex.Leave();
+
+    if (!job)
+    {
+#ifdef _WIN32
+      Sleep(5);
+#else
+      usleep(5000);
+#endif
+      continue;
+    }
+
+    // CPU time rather than wall clock: a worker that gets preempted hasn't used the budget
+    double t0=thread_cpu();
+    _this->Process(job,(const char *)buf.Get(),len,end);
+    double t1=thread_cpu();
+
+    _this->m_mutex.Enter();
+    _this->m_budget -= t1-t0;
+    job->m_busy=0;
+    if (job->m_released)
+    {
+      _this->m_jobs.Delete(_this->m_jobs.Find(job));
+      delete job;
+    }
+    else
+    {
+      WDL_Queue *q=job->m_enc ? &job->m_enc->outqueue : NULL;
+      if (q && q->Available())
+      {
+        job->m_out.Add(q->Get(),q->Available());
+        q->Advance(q->Available());
+        q->Compact();
+      }
+      if (job->m_pt.Available())
+      {
+        job->m_out.Add(job->m_pt.Get(),job->m_pt.Available());
+        job->m_pt.Clear();
+      }
+      if (end) job->m_done=1;
+    }
+    _this->m_mutex.Leave();
+  }
+  return 0;
+}
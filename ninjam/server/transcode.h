@@ -0,0 +1,98 @@
+/*
+    Copyright (C) 2005-2007 Cockos Incorporated
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Server side transcoding, for listeners who ask for a lower tier (see
+  User_SubscribeMask::tier) than the sender uploads. Only built with
+  NJ_SERVER_TRANSCODE defined (make TRANSCODE=1), it needs libvorbis.
+
+  An interval is fed in as it arrives, decoded once and re-encoded at the
+  tier's bitrate on a pool of worker threads. The workers together get a
+  share of one CPU (cpu_percent, counted in thread CPU time), and when they
+  can't keep up Start() refuses new jobs, so the caller sends the original
+  stream instead. A job that falls behind part way through an interval ends
+  its re-encoded stream there and carries on with the original, chained on as
+  a second Ogg stream, so listeners get the rest at the sender's bitrate
+  rather than late.
+
+  Output is always 'OGGv', which every client can decode.
+
+*/
+
+#ifndef _TRANSCODE_H_
+#define _TRANSCODE_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "../../WDL/queue.h"
+#include "../../WDL/ptrlist.h"
+#include "../../WDL/mutex.h"
+#include "../mpb.h"
+
+#define TRANSCODE_MAX_THREADS 16
+
+class TranscodeJob;
+
+class Transcoder
+{
+  public:
+    // tier_kbps[1..MPB_MAX_TIERS-1] is the bitrate each tier is encoded at, 0 if we don't offer it
+    Transcoder(int nthreads, int cpu_percent, const int *tier_kbps);
+    ~Transcoder();
+
+    TranscodeJob *Start(unsigned int fourcc, int tier); // NULL if we can't, or are behind
+    void Write(TranscodeJob *job, const void *buf, int len, int end); // source bytes, end set with the last
+    int Read(TranscodeJob *job, WDL_Queue *out); // appends what's been encoded so far, returns 1 once that's everything
+    void Release(TranscodeJob *job); // finished or not
+
+    int IsLagging();
+
+  private:
+    static double now();
+    static double thread_cpu(); // seconds of CPU the calling thread has used
+    void Refill(); // m_mutex held
+    void CheckLag(); // m_mutex held, switches jobs that fell behind to passthrough
+    TranscodeJob *NextJob(int budget); // m_mutex held, without budget only passthrough jobs
+    void Process(TranscodeJob *job, const char *buf, int len, int end);
+
+    int m_cpu_percent;
+    int m_tier_kbps[MPB_MAX_TIERS];
+
+    WDL_Mutex m_mutex;
+    WDL_PtrList<TranscodeJob> m_jobs;
+    double m_budget; // CPU seconds the workers may still use
+    double m_budget_time;
+    int m_next;
+    volatile int m_quit;
+
+    int m_nthreads;
+#ifdef _WIN32
+    HANDLE m_threads[TRANSCODE_MAX_THREADS];
+    static DWORD WINAPI ThreadProc(LPVOID p);
+#else
+    pthread_t m_threads[TRANSCODE_MAX_THREADS];
+    static void *ThreadProc(void *p);
+#endif
+};
+
+#endif//_TRANSCODE_H_
@@ -35,6 +35,7 @@
 
 #include "usercon.h"
 #include "../mpb.h"
+#include "../njcodec.h"
 
 #include "../../WDL/rng.h"
 #include "../../WDL/sha.h"
@@ -100,6 +101,11 @@ User_Connection::User_Connection(JNL_Connection *con, User_Group *grp) : m_auth_
 {
   m_netcon.attach(con);
 
+  m_codecs[0]=MAKE_NJ_FOURCC('O','G','G','v');
+  m_num_codecs=1;
+  int x;
+  for (x = 0; x < MAX_USER_CHANNELS; x ++) m_subs_sent[x]=-1;
+
   WDL_RNG_bytes(m_challenge,sizeof(m_challenge));
 
   mpb_server_auth_challenge ch;
@@ -111,7 +117,7 @@ User_Connection::User_Connection(JNL_Connection *con, User_Group *grp) : m_auth_
 
   if (ka < 0)ka=0;
   else if (ka > 255) ka=255;
-  ch.server_caps=ka<<8;
+  ch.server_caps=(ka<<8) | MPB_SERVER_CAP_TIERS;
 
   if (grp->m_licensetext.Get()[0])
   {
@@ -148,6 +154,14 @@ User_Connection::~User_Connection()
   for (x = 0; x < m_sendfiles.GetSize(); x ++)
     delete m_sendfiles.Get(x);
   m_sendfiles.Empty();
+  for (x = 0; x < m_pendingtiers.GetSize(); x ++)
+    delete m_pendingtiers.Get(x);
+  m_pendingtiers.Empty();
+#ifdef NJ_SERVER_TRANSCODE
+  for (x = 0; x < m_transcodes.GetSize(); x ++)
+    delete m_transcodes.Get(x);
+  m_transcodes.Empty();
+#endif
 
   delete m_lookup;
   m_lookup=0;
@@ -324,6 +338,8 @@ int User_Connection::OnRunAuth(User_Group *group)
   m_auth_state=1;
 
   SendConfigChangeNotify(group->m_last_bpm,group->m_last_bpi);
+  group->UpdateCodecCaps(this);
+  group->UpdateSubscribers();
 
 
   SendUserList(group);
@@ -563,13 +579,16 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
       case MESSAGE_CLIENT_SET_USERMASK:
         {
           mpb_client_set_usermask umi;
+          umi.tiered=!!(m_clientcaps & MPB_CLIENT_CAP_TIERS);
           if (!umi.parse(msg))
           {
             int offs=0;
             char *unp=0;
             unsigned int fla=0;
-            while ((offs=umi.parse_get_rec(offs,&unp,&fla))>0)
+            int tier=0;
+            while ((offs=umi.parse_get_rec(offs,&unp,&fla,&tier))>0)
             {
+              if (tier < 0 || tier >= MPB_MAX_TIERS) tier=0;
               if (unp)
               {
                 int x;
@@ -581,6 +600,7 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
                     User_SubscribeMask *n=new User_SubscribeMask;
                     n->username.Set(unp);
                     n->channelmask = fla;
+                    n->tier = tier;
                     m_sublist.Add(n);
                   }
                 }
@@ -589,6 +609,7 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
                   if (fla) // update flag
                   {
                     m_sublist.Get(x)->channelmask=fla;
+                    m_sublist.Get(x)->tier=tier;
                   }
                   else // remove
                   {
@@ -598,6 +619,7 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
                 }
               }
             }
+            group->UpdateSubscribers();
           }
         }
       break;
@@ -656,6 +678,22 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
             }
 
 
+            // simulcast copies of this interval, announced just before it
+            User_PendingTier *tiers[MPB_MAX_TIERS]={0,};
+            Net_Message *tiermsg[MPB_MAX_TIERS]={newmsg,0,};
+            int x;
+            for (x = 0; x < m_pendingtiers.GetSize(); x ++)
+            {
+              User_PendingTier *pt=m_pendingtiers.Get(x);
+              if (!memcmp(pt->link_guid,mp.guid,sizeof(mp.guid)) && pt->tier > 0 && pt->tier < MPB_MAX_TIERS) tiers[pt->tier]=pt;
+            }
+#ifdef NJ_SERVER_TRANSCODE
+            // tiers the sender doesn't upload, which we make ourselves as long as we keep up
+            User_Transcode *xcode[MPB_MAX_TIERS]={0,};
+            Net_Message *xcodemsg[MPB_MAX_TIERS]={0,};
+            int xcode_tried[MPB_MAX_TIERS]={0,};
+#endif
+
             int user;
             for (user=0;user<group->m_users.GetSize(); user++)
             {
@@ -670,28 +708,111 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
                   {
                     if (sm->channelmask & (1<<mp.chidx))
                     {
+                      // the tier they asked for, or the nearest better one we have
+                      int want=sm->tier < MPB_MAX_TIERS ? sm->tier : MPB_MAX_TIERS-1;
+                      int t=want;
+                      while (t > 0 && !tiers[t]) t--;
+
+                      const unsigned char *sguid=t ? tiers[t]->guid : mp.guid;
+                      int sest=t ? tiers[t]->estsize : mp.estsize;
+                      unsigned int sfourcc=t ? tiers[t]->fourcc : mp.fourcc;
+                      Net_Message *smsg=NULL;
+
+#ifdef NJ_SERVER_TRANSCODE
+                      if (t < want && group->m_transcoder && mp.fourcc && memcmp(mp.guid,zero_guid,sizeof(zero_guid)))
+                      {
+                        if (!xcode_tried[want] && m_transcodes.GetSize() < MAX_USER_CHANNELS*MPB_MAX_TIERS)
+                        {
+                          xcode_tried[want]=1;
+                          TranscodeJob *job=group->m_transcoder->Start(mp.fourcc,want); // NULL if it's behind, they get what there is
+                          if (job)
+                          {
+                            User_Transcode *tc=new User_Transcode(group->m_transcoder,job);
+                            memcpy(tc->src_guid,mp.guid,sizeof(tc->src_guid));
+                            WDL_RNG_bytes(tc->guid,sizeof(tc->guid));
+                            m_transcodes.Add(tc);
+                            xcode[want]=tc;
+
+                            nmb.fourcc=MAKE_NJ_FOURCC('O','G','G','v');
+                            nmb.estsize=0;
+                            memcpy(nmb.guid,tc->guid,sizeof(nmb.guid));
+                            xcodemsg[want]=nmb.build();
+                            xcodemsg[want]->addRef();
+                          }
+                        }
+                        if (xcode[want])
+                        {
+                          sguid=xcode[want]->guid;
+                          sest=0;
+                          sfourcc=MAKE_NJ_FOURCC('O','G','G','v');
+                          smsg=xcodemsg[want];
+                        }
+                      }
+#endif
+                      if (!smsg)
+                      {
+                        if (t > 0 && !tiermsg[t])
+                        {
+                          nmb.fourcc=tiers[t]->fourcc;
+                          nmb.estsize=tiers[t]->estsize;
+                          memcpy(nmb.guid,tiers[t]->guid,sizeof(nmb.guid));
+                          tiermsg[t]=nmb.build();
+                          tiermsg[t]->addRef();
+                        }
+                        smsg=tiermsg[t];
+                      }
+
                       if (memcmp(mp.guid,zero_guid,sizeof(zero_guid))) // zero = silence, so simply rebroadcast
                       {
                         // add entry in send list
                         User_TransferState *nt=new User_TransferState;
-                        memcpy(nt->guid,mp.guid,sizeof(nt->guid));
-                        nt->bytes_estimated = mp.estsize;
-                        nt->fourcc = mp.fourcc;
+                        memcpy(nt->guid,sguid,sizeof(nt->guid));
+                        nt->bytes_estimated = sest;
+                        nt->fourcc = sfourcc;
                         u->m_sendfiles.Add(nt);
                       }
 
-                      u->Send(newmsg);
+                      u->Send(smsg);
                     }
                     break;
                   }
                 }
               }
             }
-            newmsg->releaseRef();
+            for (x = 0; x < MPB_MAX_TIERS; x ++) if (tiermsg[x]) tiermsg[x]->releaseRef();
+#ifdef NJ_SERVER_TRANSCODE
+            for (x = 0; x < MPB_MAX_TIERS; x ++) if (xcodemsg[x]) xcodemsg[x]->releaseRef();
+#endif
+            for (x = 0; x < MPB_MAX_TIERS; x ++) if (tiers[x])
+            {
+              m_pendingtiers.Delete(m_pendingtiers.Find(tiers[x]));
+              delete tiers[x];
+            }
           }
         }
         //m_recvfiles
       break;
+      case MESSAGE_CLIENT_UPLOAD_TIER_BEGIN:
+        {
+          mpb_client_upload_tier_begin mp;
+          if (!mp.parse(msg) && mp.chidx < m_max_channels && mp.tier > 0 && mp.tier < MPB_MAX_TIERS)
+          {
+            // kept until the interval it's a copy of begins, the few that never get that far are dropped eventually
+            while (m_pendingtiers.GetSize() >= MAX_USER_CHANNELS*MPB_MAX_TIERS)
+            {
+              delete m_pendingtiers.Get(0);
+              m_pendingtiers.Delete(0);
+            }
+            User_PendingTier *pt=new User_PendingTier;
+            memcpy(pt->guid,mp.guid,sizeof(pt->guid));
+            memcpy(pt->link_guid,mp.link_guid,sizeof(pt->link_guid));
+            pt->estsize=mp.estsize;
+            pt->fourcc=mp.fourcc;
+            pt->tier=mp.tier;
+            m_pendingtiers.Add(pt);
+          }
+        }
+      break;
       case MESSAGE_CLIENT_UPLOAD_INTERVAL_WRITE:
         {
           mpb_client_upload_interval_write mp;
@@ -702,7 +823,7 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
             msg->set_type(MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE); // we rely on the fact that the upload/download write messages are identical
                                                                    // though we may need to update this at a later date if we change things.
 
-            int user,x;
+            int x;
 
 
             for (x = 0; x < m_recvfiles.GetSize(); x ++)
@@ -730,36 +851,32 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
             }
 
 
-            for (user=0;user<group->m_users.GetSize(); user++)
+            group->SendToDownloaders(msg,mp.guid,mp.audio_data_len,mp.flags & 1,this);
+
+#ifdef NJ_SERVER_TRANSCODE
+            for (x = 0; x < m_transcodes.GetSize(); x ++)
             {
-              User_Connection *u=group->m_users.Get(user);
-              if (u && u != this)
+              User_Transcode *tc=m_transcodes.Get(x);
+              if (!tc->src_done && !memcmp(tc->src_guid,mp.guid,sizeof(mp.guid)))
               {
-                int i;
-                for (i=0; i < u->m_sendfiles.GetSize(); i ++)
-                {
-                  User_TransferState *t=u->m_sendfiles.Get(i);
-                  if (t && !memcmp(t->guid,mp.guid,sizeof(t->guid)))
-                  {
-                    t->last_acttime=now;
-                    t->bytes_sofar += mp.audio_data_len;
-                    u->Send(msg);
-                    if (mp.flags & 1)
-                    {
-                      delete t;
-                      u->m_sendfiles.Delete(i);
-                      // remove from transfer list
-                    }
-                    break;
-                  }
-                  if (now-t->last_acttime > TRANSFER_TIMEOUT)
-                  {
-                    delete t;
-                    u->m_sendfiles.Delete(i--);
-                  }
-                }
+                group->m_transcoder->Write(tc->job,mp.audio_data,mp.audio_data_len,mp.flags & 1);
+                tc->src_done=mp.flags & 1;
+                tc->last_acttime=now;
               }
             }
+#endif
+          }
+        }
+      break;
+
+      case MESSAGE_CLIENT_SET_CODEC_CAPS:
+        {
+          mpb_client_set_codec_caps cc;
+          if (!cc.parse(msg))
+          {
+            memcpy(m_codecs,cc.fourcc,cc.num_fourcc*sizeof(cc.fourcc[0]));
+            m_num_codecs=cc.num_fourcc;
+            group->UpdateCodecCaps();
           }
         }
       break;
@@ -784,12 +901,14 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
 }
 
 
-User_Group::User_Group() : m_max_users(0), m_last_bpm(120), m_last_bpi(32), m_keepalive(0), 
-  m_voting_threshold(110), m_voting_timeout(120),
-  m_loopcnt(0), m_run_robin(0), m_allow_hidden_users(0), m_logfp(0)
+User_Group::User_Group() : m_codecs_common_num(0), m_max_users(0), m_last_bpm(120), m_last_bpi(32), m_keepalive(0), 
+  m_voting_threshold(110), m_voting_timeout(120), m_loopcnt(0), m_run_robin(0), m_allow_hidden_users(0), m_logfp(0)
 {
   CreateUserLookup=0;
   memset(&m_next_loop_time,0,sizeof(m_next_loop_time));
+#ifdef NJ_SERVER_TRANSCODE
+  m_transcoder=0;
+#endif
 }
 
 User_Group::~User_Group()
@@ -800,10 +919,101 @@ User_Group::~User_Group()
     delete m_users.Get(x);
   }
   m_users.Empty();
+#ifdef NJ_SERVER_TRANSCODE
+  delete m_transcoder; // after the users, they release their jobs
+  m_transcoder=0;
+#endif
   if (m_logfp) fclose(m_logfp);
   m_logfp=0;
 }
 
+void User_Group::SendToDownloaders(Net_Message *msg, const unsigned char *guid, int len, int end, User_Connection *nosend)
+{
+  time_t now;
+  time(&now);
+  int user;
+  for (user=0;user<m_users.GetSize(); user++)
+  {
+    User_Connection *u=m_users.Get(user);
+    if (u && u != nosend)
+    {
+      int i;
+      for (i=0; i < u->m_sendfiles.GetSize(); i ++)
+      {
+        User_TransferState *t=u->m_sendfiles.Get(i);
+        if (t && !memcmp(t->guid,guid,sizeof(t->guid)))
+        {
+          t->last_acttime=now;
+          t->bytes_sofar += len;
+          u->Send(msg);
+          if (end)
+          {
+            delete t;
+            u->m_sendfiles.Delete(i);
+            // remove from transfer list
+          }
+          break;
+        }
+        if (now-t->last_acttime > TRANSFER_TIMEOUT)
+        {
+          delete t;
+          u->m_sendfiles.Delete(i--);
+        }
+      }
+    }
+  }
+}
+
+#ifdef NJ_SERVER_TRANSCODE
+void User_Group::RunTranscodes()
+{
+  if (!m_transcoder) return;
+  time_t now;
+  time(&now);
+  WDL_Queue q;
+  int x;
+  for (x = 0; x < m_users.GetSize(); x ++)
+  {
+    User_Connection *src=m_users.Get(x);
+    int i;
+    for (i = 0; i < src->m_transcodes.GetSize(); i ++)
+    {
+      User_Transcode *tc=src->m_transcodes.Get(i);
+      int done=m_transcoder->Read(tc->job,&q);
+      if (q.Available()) tc->last_acttime=now;
+      else if (!done && now-tc->last_acttime > TRANSFER_TIMEOUT) done=1; // the upload stalled, or we did. end what they've got
+
+      while (q.Available() || done)
+      {
+        int l=q.Available();
+        if (l > 16384) l=16384;
+        int end=done && l == q.Available();
+
+        mpb_server_download_interval_write wr;
+        memcpy(wr.guid,tc->guid,sizeof(wr.guid));
+        wr.flags=end;
+        wr.audio_data=q.Get();
+        wr.audio_data_len=l;
+        Net_Message *msg=wr.build();
+        msg->addRef();
+        SendToDownloaders(msg,tc->guid,l,end,src);
+        msg->releaseRef();
+
+        q.Advance(l);
+        if (end) break;
+      }
+      q.Clear();
+
+      if (done)
+      {
+        delete tc;
+        src->m_transcodes.Delete(i--);
+      }
+    }
+  }
+}
+#endif
+
 
 void User_Group::SetLogDir(char *path) // NULL to not log
 {
@@ -813,6 +1023,8 @@ void User_Group::SetLogDir(char *path) // NULL to not log
     if (m_logfp) fclose(m_logfp);
     m_logfp=0;
     m_logdir.Set("");
+    UpdateSubscribers();
+    UpdateCodecCaps();
     return;
   }
 
@@ -842,6 +1054,8 @@ void User_Group::SetLogDir(char *path) // NULL to not log
     mkdir(tmp.Get(),0755);
 #endif
   }
+  UpdateSubscribers();
+  UpdateCodecCaps();
 }
 
 void User_Group::Broadcast(Net_Message *msg, User_Connection *nosend)
@@ -949,17 +1163,115 @@ int User_Group::Run()
           JNL::addr_to_ipstr(p->m_netcon.GetConnection()->get_remote(),addrbuf,sizeof(addrbuf));
           logText("%s: disconnected (username:'%s', code=%d)\n",addrbuf,p->m_auth_state>0?p->m_username.Get():"",ret);
 
+          int wasauth=p->m_auth_state>0;
           delete p;
           m_users.Delete(thispos);
           x--;
+          if (wasauth) 
+          {
+            UpdateCodecCaps();
+            UpdateSubscribers();
+          }
         }
       }
     }
     m_run_robin++;
 
+#ifdef NJ_SERVER_TRANSCODE
+    RunTranscodes();
+#endif
+
     return wantsleep;
 }
 
+void User_Group::UpdateCodecCaps(User_Connection *newuser)
+{
+  mpb_server_codec_caps cc;
+  int x, first=1;
+  for (x = 0; x < m_users.GetSize(); x ++)
+  {
+    User_Connection *p=m_users.Get(x);
+    if (!p || p->m_auth_state <= 0) continue;
+    if (first)
+    {
+      memcpy(cc.fourcc,p->m_codecs,p->m_num_codecs*sizeof(cc.fourcc[0]));
+      cc.num_fourcc=p->m_num_codecs;
+      first=0;
+      continue;
+    }
+    int i;
+    for (i = 0; i < cc.num_fourcc; i ++)
+    {
+      int j;
+      for (j = 0; j < p->m_num_codecs && p->m_codecs[j] != cc.fourcc[i]; j ++);
+      if (j == p->m_num_codecs) cc.fourcc[i--]=cc.fourcc[--cc.num_fourcc];
+    }
+  }
+
+  // the session archive writes uploads as they are, and 'OGHv' intervals without their Vorbis setup
+  // headers can't be decoded on their own, so don't let clients pick it while archiving
+  if (m_logdir.Get()[0])
+    for (x = 0; x < cc.num_fourcc; x ++)
+      if (cc.fourcc[x] == NJ_CODEC_VORBIS_HDRLESS) cc.fourcc[x--]=cc.fourcc[--cc.num_fourcc];
+
+  int changed=cc.num_fourcc != m_codecs_common_num;
+  for (x = 0; x < cc.num_fourcc && !changed; x ++)
+  {
+    int j;
+    for (j = 0; j < m_codecs_common_num && m_codecs_common[j] != cc.fourcc[x]; j ++);
+    changed = j == m_codecs_common_num;
+  }
+
+  if (changed)
+  {
+    memcpy(m_codecs_common,cc.fourcc,cc.num_fourcc*sizeof(cc.fourcc[0]));
+    m_codecs_common_num=cc.num_fourcc;
+    Broadcast(cc.build());
+  }
+  else if (newuser) newuser->Send(cc.build());
+}
+
+void User_Group::UpdateSubscribers()
+{
+  int x;
+  for (x = 0; x < m_users.GetSize(); x ++)
+  {
+    User_Connection *p=m_users.Get(x);
+    if (!p || p->m_auth_state <= 0) continue;
+
+    mpb_server_channel_subscribers cs;
+    int y;
+    if (m_logdir.Get()[0]) // the session archive wants every channel, so nothing counts as unheard
+      for (y = 0; y < MAX_USER_CHANNELS && y < MPB_MAX_SUB_CHANNELS; y ++) cs.subscribers[y]=1;
+    for (y = 0; y < m_users.GetSize(); y ++)
+    {
+      User_Connection *u=m_users.Get(y);
+      if (!u || u == p || u->m_auth_state <= 0) continue;
+      int i;
+      for (i = 0; i < u->m_sublist.GetSize(); i ++)
+      {
+        User_SubscribeMask *sm=u->m_sublist.Get(i);
+        if (!strcasecmp(sm->username.Get(),p->m_username.Get()))
+        {
+          int ch;
+          for (ch = 0; ch < MAX_USER_CHANNELS && ch < MPB_MAX_SUB_CHANNELS; ch ++)
+            if (sm->channelmask & (1<<ch)) cs.subscribers[ch]++;
+          break;
+        }
+      }
+    }
+
+    int changed=0;
+    for (y = 0; y < MAX_USER_CHANNELS && y < MPB_MAX_SUB_CHANNELS; y ++)
+    {
+      if (cs.subscribers[y]) cs.num_channels=y+1;
+      if (p->m_subs_sent[y] != cs.subscribers[y]) changed=1;
+      p->m_subs_sent[y]=cs.subscribers[y];
+    }
+    if (changed) p->Send(cs.build());
+  }
+}
+
 void User_Group::SetConfig(int bpi, int bpm)
 {
   m_last_bpi=bpi;
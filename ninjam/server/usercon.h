@@ -38,6 +38,10 @@
 #include "../../WDL/ptrlist.h"
 #include "../mpb.h"
 
+#ifdef NJ_SERVER_TRANSCODE
+#include "transcode.h"
+#endif
+
 #define MAX_USER_CHANNELS 32
 #define MAX_USERS 64
 #define MAX_UPLOADS 32
@@ -104,6 +108,22 @@ class User_Group
     IUserInfoLookup *(*CreateUserLookup)(char *username);
 
     void onChatMessage(User_Connection *con, mpb_chat_message *msg);
+
+    // recompute which codecs everybody can decode, tell everybody if that changed (or just newuser if not)
+    void UpdateCodecCaps(User_Connection *newuser=0);
+    unsigned int m_codecs_common[MPB_MAX_CODECS];
+    int m_codecs_common_num;
+
+    // recount who subscribes to whose channels, tell the owners whose counts changed
+    void UpdateSubscribers();
+
+    // passes an interval write on to whoever's downloading guid (and drops downloads that have gone stale)
+    void SendToDownloaders(Net_Message *msg, const unsigned char *guid, int len, int end, User_Connection *nosend=0);
+
+#ifdef NJ_SERVER_TRANSCODE
+    void RunTranscodes(); // forwards what the transcoder has produced
+    Transcoder *m_transcoder; // NULL unless configured
+#endif
     
 
     WDL_PtrList<User_Connection> m_users;
@@ -140,12 +160,45 @@ class User_Group
 class User_SubscribeMask
 {
 public:
-  User_SubscribeMask()  {} 
+  User_SubscribeMask() : tier(0) {} 
   ~User_SubscribeMask() {}
   WDL_String username;
   unsigned int channelmask;
+  int tier; // simulcast copy wanted, 0=the normal one
+};
+
+class User_PendingTier // a simulcast copy of an interval, until the begin of the interval itself arrives
+{
+public:
+  User_PendingTier() : estsize(0), fourcc(0), tier(0) { memset(guid,0,sizeof(guid)); memset(link_guid,0,sizeof(link_guid)); }
+  ~User_PendingTier() { }
+  unsigned char guid[16];
+  unsigned char link_guid[16];
+  int estsize;
+  unsigned int fourcc;
+  int tier;
 };
 
+#ifdef NJ_SERVER_TRANSCODE
+class User_Transcode // one of our intervals, re-encoded here for a tier the sender doesn't upload
+{
+public:
+  User_Transcode(Transcoder *o, TranscodeJob *j) : owner(o), job(j), src_done(0)
+  {
+    time(&last_acttime);
+    memset(src_guid,0,sizeof(src_guid));
+    memset(guid,0,sizeof(guid));
+  }
+  ~User_Transcode() { owner->Release(job); }
+  Transcoder *owner;
+  TranscodeJob *job;
+  unsigned char src_guid[16]; // what we upload
+  unsigned char guid[16]; // what the listeners get
+  int src_done;
+  time_t last_acttime;
+};
+#endif
+
 class User_Channel
 {
 public:
@@ -207,7 +260,10 @@ class User_Connection
     int m_auth_state;      // 1 if authorized, 0 if not yet, -1 if auth pending
     unsigned char m_challenge[8];
     int m_clientcaps;
-
+    unsigned int m_codecs[MPB_MAX_CODECS]; // what the client can decode, 'OGGv' if it never said
+    int m_num_codecs;
+    int m_subs_sent[MAX_USER_CHANNELS]; // subscriber counts last sent, -1 before the first
+    
     int m_auth_privs;
 
     int m_reserved;
@@ -225,6 +281,10 @@ class User_Connection
 
     WDL_PtrList<User_TransferState> m_recvfiles;
     WDL_PtrList<User_TransferState> m_sendfiles;
+    WDL_PtrList<User_PendingTier> m_pendingtiers;
+#ifdef NJ_SERVER_TRANSCODE
+    WDL_PtrList<User_Transcode> m_transcodes;
+#endif
 
     IUserInfoLookup *m_lookup;
 };
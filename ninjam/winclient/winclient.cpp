@@ -316,8 +316,7 @@ static void do_disconnect()
   WDL_String sessiondir(g_client->GetWorkDir()); // save a copy of the work dir before we blow it away
   
   g_client->Disconnect();
-  delete g_client->waveWrite;
-  g_client->waveWrite=0;
+  g_client->SetWaveOutFile(NULL);
   g_client->SetWorkDir(NULL);
   g_client->SetOggOutFile(NULL,0,0,0);
   g_client->SetLogFile(NULL);
@@ -470,7 +469,7 @@ static void do_connect()
     WDL_String wf;
     wf.Set(g_client->GetWorkDir());
     wf.Append("output.wav");
-    g_client->waveWrite = new WaveWriter(wf.Get(),24,g_audio->m_outnch>1?2:1,g_audio->m_srate);
+    g_client->SetWaveOutFile(new WaveWriter(wf.Get(),24,g_audio->m_outnch>1?2:1,g_client->GetEngineSampleRate(g_audio->m_srate)));
   }
   
   if (GetPrivateProfileInt(CONFSEC,"saveogg",0,g_ini_file.Get()))
@@ -479,7 +478,7 @@ static void do_connect()
     wf.Set(g_client->GetWorkDir());
     wf.Append("output.ogg");
     int br=GetPrivateProfileInt(CONFSEC,"saveoggbr",128,g_ini_file.Get());
-    g_client->SetOggOutFile(fopen(wf.Get(),"ab"),g_audio->m_srate,g_audio->m_outnch>1?2:1,br);
+    g_client->SetOggOutFile(fopen(wf.Get(),"ab"),g_client->GetEngineSampleRate(g_audio->m_srate),g_audio->m_outnch>1?2:1,br);
   }
   
   if (g_client->config_savelocalaudio)
@@ -257,6 +257,10 @@ SOURCE=..\netmsg.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\njcodec.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\njclient.cpp
 # End Source File
 # Begin Source File